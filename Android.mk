@@ -77,6 +77,7 @@ LOCAL_STATIC_LIBRARIES := \
     libfusesideload \
     libpartition \
     libminui \
+    libotatrace \
     libpng \
     libfs_mgr \
     libcrypto_static \
@@ -157,6 +158,7 @@ include \
     $(LOCAL_PATH)/minadbd/Android.mk \
     $(LOCAL_PATH)/mtdutils/Android.mk \
     $(LOCAL_PATH)/otafault/Android.mk \
+    $(LOCAL_PATH)/otatrace/Android.mk \
     $(LOCAL_PATH)/tests/Android.mk \
     $(LOCAL_PATH)/tools/Android.mk \
     $(LOCAL_PATH)/uncrypt/Android.mk \
@@ -23,7 +23,7 @@ include $(CLEAR_VARS)
 MEDIATEK_RECOVERY_PATH := vendor/mediatek/proprietary/bootable/recovery
 
 LOCAL_CLANG := true
-LOCAL_SRC_FILES := applypatch.cpp bspatch.cpp freecache.cpp imgpatch.cpp utils.cpp
+LOCAL_SRC_FILES := applypatch.cpp bspatch.cpp freecache.cpp imgpatch.cpp partition_writer.cpp utils.cpp
 LOCAL_SRC_FILES += mt_applypatch.cpp
 LOCAL_MODULE := libapplypatch
 LOCAL_MULTILIB := both
@@ -40,6 +40,7 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 #include "ota_io.h"
+#include "partition_writer.h"
 #include "print_sha1.h"
 #include "mt_applypatch.h"
 #include "mt_partition.h"
@@ -397,121 +398,35 @@ int WriteToPartition(const unsigned char* data, size_t len, const char* target)
         }
 
         case EMMC: {
+            // PartitionWriter takes the image in pieces, but every caller
+            // still has all of it in memory: a patched image may only
+            // reach the partition once its SHA-1 has been checked, and the
+            // source of the patch is often this same partition.
+            //
+            // A region that doesn't read back right is written again,
+            // along with everything after it, from the same buffer.
             size_t start = 0;
             bool success = false;
-            int fd = ota_open(partition, O_RDWR | O_SYNC);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                free(dev_path);
-                return -1;
-            }
-
             for (size_t attempt = 0; attempt < 2; ++attempt) {
-                if (TEMP_FAILURE_RETRY(lseek(fd, start, SEEK_SET)) == -1) {
-                    printf("failed seek on %s: %s\n", partition, strerror(errno));
-                    ota_close(fd);
+                PartitionWriter writer(partition);
+                size_t verified;
+                if (!writer.Start(start) || !writer.Write(data + start, len - start) ||
+                        !writer.Finish(&verified)) {
                     free(dev_path);
                     return -1;
                 }
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 1<<20) to_write = 1<<20;
-
-                    ssize_t written = TEMP_FAILURE_RETRY(ota_write(fd, data+start, to_write));
-                    if (written == -1) {
-                        printf("failed write writing to %s: %s\n", partition, strerror(errno));
-                        close(fd);
-                        free(dev_path);
-                        return -1;
-                    }
-                    start += written;
-                }
-                if (ota_fsync(fd) != 0) {
-                   printf("failed to sync to %s (%s)\n", partition, strerror(errno));
-                    ota_close(fd);
-                   free(dev_path);
-                   return -1;
-                }
-                if (ota_close(fd) != 0) {
-                   printf("failed to close %s (%s)\n", partition, strerror(errno));
-                   return -1;
-                }
-                fd = ota_open(partition, O_RDONLY);
-                if (fd < 0) {
-                   printf("failed to reopen %s for verify (%s)\n", partition, strerror(errno));
-                   free(dev_path);
-                   return -1;
-                }
 
-                // Drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = ota_open("/proc/sys/vm/drop_caches", O_WRONLY);
-                if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
-                    printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
-                } else {
-                    printf("  caches dropped\n");
-                }
-                ota_close(dc);
-                sleep(1);
-
-                // verify
-                if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
-                    printf("failed to seek back to beginning of %s: %s\n",
-                           partition, strerror(errno));
-                    close(fd);
-                    free(dev_path);
-                    return -1;
-                }
-                unsigned char buffer[4096];
-                start = len;
-                for (size_t p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) {
-                        to_read = sizeof(buffer);
-                    }
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count =
-                                TEMP_FAILURE_RETRY(ota_read(fd, buffer+so_far, to_read-so_far));
-                        if (read_count == -1) {
-                            printf("verify read error %s at %zu: %s\n",
-                                   partition, p, strerror(errno));
-                            close(fd);
-                            free(dev_path);
-                            return -1;
-                        }
-                        if (static_cast<size_t>(read_count) < to_read) {
-                            printf("short verify read %s at %zu: %zd %zu %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read) != 0) {
-                        printf("verification failed starting at %zu\n", p);
-                        start = p;
-                        break;
-                    }
-                }
-
-                if (start == len) {
+                if (verified == len) {
                     printf("verification read succeeded (attempt %zu)\n", attempt+1);
                     success = true;
                     break;
                 }
+                printf("verification failed starting at %zu\n", verified);
+                start = verified;
             }
 
             if (!success) {
                 printf("failed to verify after all attempts\n");
-                close(fd);
-                free(dev_path);
-                return -1;
-            }
-
-            if (ota_close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
                 free(dev_path);
                 return -1;
             }
@@ -640,8 +555,8 @@ size_t FreeSpaceForFile(const char* filename) {
     return sf.f_bsize * sf.f_bavail;
 }
 
-int CacheSizeCheck(size_t bytes) {
-    if (MakeFreeSpaceOnCache(bytes) < 0) {
+int CacheSizeCheck(size_t bytes, bool dry_run) {
+    if (MakeFreeSpaceOnCache(bytes, dry_run) < 0) {
         printf("unable to make %ld bytes available on /cache\n", (long)bytes);
         return 1;
     } else {
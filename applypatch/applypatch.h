@@ -24,6 +24,7 @@
 
 #include <sys/stat.h>
 
+#include <string>
 #include <vector>
 
 #include "openssl/sha.h"
@@ -47,7 +48,7 @@ typedef ssize_t (*SinkFn)(const unsigned char*, ssize_t, void*);
 // applypatch.c
 int ShowLicenses();
 size_t FreeSpaceForFile(const char* filename);
-int CacheSizeCheck(size_t bytes);
+int CacheSizeCheck(size_t bytes, bool dry_run = false);
 int ParseSha1(const char* str, uint8_t* digest);
 
 int applypatch_flash(const char* source_filename, const char* target_filename,
@@ -85,8 +86,39 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     SinkFn sink, void* token, SHA_CTX* ctx,
                     const Value* bonus_data);
 
+// Deflate implementation used to recompress CHUNK_DEFLATE chunks.  A
+// replacement (e.g. a SIMD-optimized zlib) must produce output that is
+// bit-identical to stock zlib for the same parameters, since the result is
+// checked against the expected SHA-1.  Passing nullptr restores zlib.
+// The table is read by the patch threads without locking, so set it at
+// startup, before any patch is applied.
+struct z_stream_s;
+struct ImagePatchDeflater {
+    const char* name;
+    int (*init)(struct z_stream_s* strm, int level, int method, int windowBits,
+                int memLevel, int strategy);
+    int (*deflate)(struct z_stream_s* strm, int flush);
+    int (*end)(struct z_stream_s* strm);
+};
+void SetImagePatchDeflater(const ImagePatchDeflater* deflater);
+
 // freecache.cpp
-int MakeFreeSpaceOnCache(size_t bytes_needed);
+struct CacheFile {
+    std::string path;
+    size_t size;                // Bytes freed by deleting it.
+};
+
+// Picks the fewest files whose sizes add up to at least bytes_to_free,
+// with as little excess as that allows.  Returns false if all of them
+// together are not enough.
+bool PlanCacheEviction(std::vector<CacheFile> files, size_t bytes_to_free,
+                       std::vector<CacheFile>* plan);
+
+// Deletes unopened files on /cache as planned by PlanCacheEviction()
+// until bytes_needed bytes are free.  With dry_run nothing is deleted;
+// the plan is only printed, and the return value tells whether it would
+// free enough.
+int MakeFreeSpaceOnCache(size_t bytes_needed, bool dry_run = false);
 
 // mt_applypatch.cpp
 int WriteToPartition(const unsigned char* data, size_t len, const char* target);
@@ -98,26 +98,10 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    std::vector<unsigned char> new_data;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset, &new_data) != 0) {
-        return -1;
-    }
-
-    if (sink(new_data.data(), new_data.size(), token) < static_cast<ssize_t>(new_data.size())) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
-    }
-    if (ctx) SHA1_Update(ctx, new_data.data(), new_data.size());
-    return 0;
-}
-
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        std::vector<unsigned char>* new_data) {
+// Reads the patch header and sets up the three bzip2 streams. Returns
+// 0 on success; on failure any stream that was set up has been ended.
+static int OpenBSDiffPatch(const Value* patch, ssize_t patch_offset, ssize_t* new_size,
+                           bz_stream* cstream, bz_stream* dstream, bz_stream* estream) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -136,103 +120,211 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         return 1;
     }
 
-    ssize_t ctrl_len, data_len, new_size;
+    ssize_t ctrl_len, data_len;
     ctrl_len = offtin(header+8);
     data_len = offtin(header+16);
-    new_size = offtin(header+24);
+    *new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || new_size < 0) {
+    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
 
     int bzerr;
 
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
+    cstream->next_in = patch->data + patch_offset + 32;
+    cstream->avail_in = ctrl_len;
+    cstream->bzalloc = NULL;
+    cstream->bzfree = NULL;
+    cstream->opaque = NULL;
+    if ((bzerr = BZ2_bzDecompressInit(cstream, 0, 0)) != BZ_OK) {
         printf("failed to bzinit control stream (%d)\n", bzerr);
     }
 
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
+    dstream->next_in = patch->data + patch_offset + 32 + ctrl_len;
+    dstream->avail_in = data_len;
+    dstream->bzalloc = NULL;
+    dstream->bzfree = NULL;
+    dstream->opaque = NULL;
+    if ((bzerr = BZ2_bzDecompressInit(dstream, 0, 0)) != BZ_OK) {
         printf("failed to bzinit diff stream (%d)\n", bzerr);
     }
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
+    estream->next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
+    estream->avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
+    estream->bzalloc = NULL;
+    estream->bzfree = NULL;
+    estream->opaque = NULL;
+    if ((bzerr = BZ2_bzDecompressInit(estream, 0, 0)) != BZ_OK) {
         printf("failed to bzinit extra stream (%d)\n", bzerr);
     }
 
-    new_data->resize(new_size);
+    return 0;
+}
+
+static void CloseBSDiffPatch(bz_stream* cstream, bz_stream* dstream, bz_stream* estream) {
+    BZ2_bzDecompressEnd(cstream);
+    BZ2_bzDecompressEnd(dstream);
+    BZ2_bzDecompressEnd(estream);
+}
+
+// Reads the next control triple and checks it against the output size.
+static int ReadControl(bz_stream* cstream, off_t newpos, ssize_t new_size, off_t ctrl[3]) {
+    unsigned char buf[24];
+    if (FillBuffer(buf, 24, cstream) != 0) {
+        printf("error while reading control stream\n");
+        return 1;
+    }
+    ctrl[0] = offtin(buf);
+    ctrl[1] = offtin(buf+8);
+    ctrl[2] = offtin(buf+16);
+
+    if (ctrl[0] < 0 || ctrl[1] < 0) {
+        printf("corrupt patch (negative byte counts)\n");
+        return 1;
+    }
+
+    // Sanity check
+    if (newpos + ctrl[0] + ctrl[1] > new_size) {
+        printf("corrupt patch (new file overrun)\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Adds the old data at oldpos to the len diff bytes in buf, treating old
+// data outside [0, old_size) as zeroes.
+static void AddOldData(unsigned char* buf, off_t len, const unsigned char* old_data,
+                       ssize_t old_size, off_t oldpos) {
+    off_t begin = oldpos < 0 ? -oldpos : 0;
+    off_t end = old_size - oldpos < len ? old_size - oldpos : len;
+    for (off_t i = begin; i < end; ++i) {
+        buf[i] += old_data[oldpos+i];
+    }
+}
+
+// Output is produced and handed to the sink in windows of at most this
+// many bytes, so the new data is never held in memory as a whole.
+#define BSPATCH_WINDOW_SIZE (1024 * 1024)
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t new_size;
+    bz_stream cstream, dstream, estream;
+    if (OpenBSDiffPatch(patch, patch_offset, &new_size, &cstream, &dstream, &estream) != 0) {
+        return -1;
+    }
+
+    std::vector<unsigned char> window(new_size < BSPATCH_WINDOW_SIZE ?
+                                      new_size : BSPATCH_WINDOW_SIZE);
+    size_t filled = 0;
+    int result = 0;
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
-    unsigned char buf[24];
     while (newpos < new_size) {
-        // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
-            printf("error while reading control stream\n");
-            return 1;
+        if (ReadControl(&cstream, newpos, new_size, ctrl) != 0) {
+            result = -1;
+            break;
         }
-        ctrl[0] = offtin(buf);
-        ctrl[1] = offtin(buf+8);
-        ctrl[2] = offtin(buf+16);
 
-        if (ctrl[0] < 0 || ctrl[1] < 0) {
-            printf("corrupt patch (negative byte counts)\n");
-            return 1;
+        // Diff string plus old data, then the extra string, both cut
+        // into pieces that fit the remaining window.
+        for (int part = 0; part < 2 && result == 0; ++part) {
+            off_t remain = ctrl[part];
+            while (remain > 0) {
+                size_t len = window.size() - filled;
+                if (static_cast<off_t>(len) > remain) {
+                    len = remain;
+                }
+
+                unsigned char* out = window.data() + filled;
+                if (FillBuffer(out, len, part == 0 ? &dstream : &estream) != 0) {
+                    printf("error while reading %s stream\n", part == 0 ? "diff" : "extra");
+                    result = -1;
+                    break;
+                }
+                if (part == 0) {
+                    AddOldData(out, len, old_data, old_size, oldpos);
+                    oldpos += len;
+                }
+
+                filled += len;
+                newpos += len;
+                remain -= len;
+
+                if (filled == window.size()) {
+                    if (sink(window.data(), filled, token) < static_cast<ssize_t>(filled)) {
+                        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+                        result = 1;
+                        break;
+                    }
+                    if (ctx) SHA1_Update(ctx, window.data(), filled);
+                    filled = 0;
+                }
+            }
         }
+        if (result != 0) {
+            break;
+        }
+
+        // Adjust pointers
+        oldpos += ctrl[2];
+    }
 
-        // Sanity check
-        if (newpos + ctrl[0] > new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
+    if (result == 0 && filled > 0) {
+        if (sink(window.data(), filled, token) < static_cast<ssize_t>(filled)) {
+            printf("short write of output: %d (%s)\n", errno, strerror(errno));
+            result = 1;
+        } else if (ctx) {
+            SHA1_Update(ctx, window.data(), filled);
+        }
+    }
+
+    CloseBSDiffPatch(&cstream, &dstream, &estream);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        std::vector<unsigned char>* new_data) {
+    ssize_t new_size;
+    bz_stream cstream, dstream, estream;
+    if (OpenBSDiffPatch(patch, patch_offset, &new_size, &cstream, &dstream, &estream) != 0) {
+        return 1;
+    }
+
+    new_data->resize(new_size);
+
+    int result = 0;
+    off_t oldpos = 0, newpos = 0;
+    off_t ctrl[3];
+    while (newpos < new_size) {
+        if (ReadControl(&cstream, newpos, new_size, ctrl) != 0) {
+            result = 1;
+            break;
         }
 
         // Read diff string
         if (FillBuffer(new_data->data() + newpos, ctrl[0], &dstream) != 0) {
             printf("error while reading diff stream\n");
-            return 1;
+            result = 1;
+            break;
         }
 
         // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
-            }
-        }
+        AddOldData(new_data->data() + newpos, ctrl[0], old_data, old_size, oldpos);
 
         // Adjust pointers
         newpos += ctrl[0];
         oldpos += ctrl[0];
 
-        // Sanity check
-        if (newpos + ctrl[1] > new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
-
         // Read extra string
         if (FillBuffer(new_data->data() + newpos, ctrl[1], &estream) != 0) {
             printf("error while reading extra stream\n");
-            return 1;
+            result = 1;
+            break;
         }
 
         // Adjust pointers
@@ -240,8 +332,6 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
-    return 0;
+    CloseBSDiffPatch(&cstream, &dstream, &estream);
+    return result;
 }
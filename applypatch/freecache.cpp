@@ -21,20 +21,26 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/types.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <ctype.h>
 
+#include <algorithm>
+#include <map>
 #include <memory>
-#include <set>
 #include <string>
+#include <vector>
 
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(std::set<std::string>* files) {
+// Collects the inodes on the /cache filesystem that any process has
+// open, in one pass over /proc/*/fd.  The fd links are stat()ed rather
+// than read, so nothing is compared by name.
+static int FindOpenFiles(dev_t dev, std::map<ino_t, std::string>* open_files) {
   std::unique_ptr<DIR, decltype(&closedir)> d(opendir("/proc"), closedir);
   if (!d) {
     printf("error opening /proc: %s\n", strerror(errno));
@@ -46,7 +52,7 @@ static int EliminateOpenFiles(std::set<std::string>* files) {
     if (!android::base::ParseUint(de->d_name, &pid)) {
         continue;
     }
-    std::string path = android::base::StringPrintf("/proc/%s/fd/", de->d_name);
+    std::string path = android::base::StringPrintf("/proc/%s/fd", de->d_name);
 
     struct dirent* fdde;
     std::unique_ptr<DIR, decltype(&closedir)> fdd(opendir(path.c_str()), closedir);
@@ -55,25 +61,27 @@ static int EliminateOpenFiles(std::set<std::string>* files) {
       continue;
     }
     while ((fdde = readdir(fdd.get())) != 0) {
-      std::string fd_path = path + fdde->d_name;
-      char link[FILENAME_MAX];
-
-      int count = readlink(fd_path.c_str(), link, sizeof(link)-1);
-      if (count >= 0) {
-        link[count] = '\0';
-        if (strncmp(link, "/cache/", 7) == 0) {
-          if (files->erase(link) > 0) {
-            printf("%s is open by %s\n", link, de->d_name);
-          }
-        }
+      struct stat st;
+      if (fdde->d_name[0] != '.' && fstatat(dirfd(fdd.get()), fdde->d_name, &st, 0) == 0 &&
+          st.st_dev == dev && S_ISREG(st.st_mode)) {
+        (*open_files)[st.st_ino] = de->d_name;
       }
     }
   }
   return 0;
 }
 
-static std::set<std::string> FindExpendableFiles() {
-  std::set<std::string> files;
+static int FindExpendableFiles(std::vector<CacheFile>* files) {
+  struct stat cache_st;
+  if (stat("/cache", &cache_st) != 0) {
+    printf("failed to stat /cache: %s\n", strerror(errno));
+    return -1;
+  }
+  std::map<ino_t, std::string> open_files;
+  if (FindOpenFiles(cache_st.st_dev, &open_files) < 0) {
+    return -1;
+  }
+
   // We're allowed to delete unopened regular files in any of these
   // directories.
   const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
@@ -98,46 +106,93 @@ static std::set<std::string> FindExpendableFiles() {
       }
 
       struct stat st;
-      if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
-        files.insert(path);
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      auto it = open_files.find(st.st_ino);
+      if (it != open_files.end()) {
+        printf("%s is open by %s\n", path.c_str(), it->second.c_str());
+        continue;
+      }
+      // Deleting one of several links frees nothing.
+      if (st.st_nlink == 1) {
+        files->push_back(CacheFile { path, static_cast<size_t>(st.st_blocks) * 512 });
       }
     }
   }
 
-  printf("%zu regular files in deletable directories\n", files.size());
-  if (EliminateOpenFiles(&files) < 0) {
-    return std::set<std::string>();
+  printf("%zu deletable files in deletable directories\n", files->size());
+  return 0;
+}
+
+bool PlanCacheEviction(std::vector<CacheFile> files, size_t bytes_to_free,
+                       std::vector<CacheFile>* plan) {
+  // Taking the largest files first needs the fewest of them.  The last
+  // one is then swapped for the smallest file that still covers what
+  // is left, so no more is deleted than it takes.
+  std::sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) {
+    return a.size > b.size;
+  });
+
+  plan->clear();
+  size_t planned = 0;
+  for (size_t i = 0; i < files.size() && planned < bytes_to_free; ++i) {
+    size_t last = i;
+    while (last + 1 < files.size() && planned + files[last + 1].size >= bytes_to_free) {
+      ++last;
+    }
+    if (planned + files[last].size >= bytes_to_free) {
+      i = last;
+    }
+    plan->push_back(files[i]);
+    planned += files[i].size;
   }
-  return files;
+  return planned >= bytes_to_free;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
+int MakeFreeSpaceOnCache(size_t bytes_needed, bool dry_run) {
   size_t free_now = FreeSpaceForFile("/cache");
   printf("%zu bytes free on /cache (%zu needed)\n", free_now, bytes_needed);
 
   if (free_now >= bytes_needed) {
     return 0;
   }
-  std::set<std::string> files = FindExpendableFiles();
-  if (files.empty()) {
+  std::vector<CacheFile> files;
+  if (FindExpendableFiles(&files) < 0 || files.empty()) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
-  for (const auto& file : files) {
-    unlink(file.c_str());
-    free_now = FreeSpaceForFile("/cache");
-    printf("deleted %s; now %zu bytes free\n", file.c_str(), free_now);
-    if (free_now < bytes_needed) {
-        break;
+  std::vector<CacheFile> plan;
+  size_t bytes_to_free = bytes_needed - free_now;
+  if (!PlanCacheEviction(files, bytes_to_free, &plan)) {
+    // Deleting what can be deleted still leaves less for whatever needs
+    // the space, so leave it all in place.
+    printf("deleting all %zu files on /cache would not free %zu bytes\n", files.size(),
+           bytes_to_free);
+    return -1;
+  }
+
+  size_t reclaimed = 0;
+  for (const auto& file : plan) {
+    if (dry_run) {
+      printf("would delete %s (%zu bytes)\n", file.path.c_str(), file.size);
+    } else if (unlink(file.path.c_str()) == 0) {
+      printf("deleted %s (%zu bytes)\n", file.path.c_str(), file.size);
+    } else {
+      printf("failed to delete %s: %s\n", file.path.c_str(), strerror(errno));
+      continue;
     }
+    reclaimed += file.size;
+  }
+
+  if (dry_run) {
+    printf("would reclaim %zu bytes in %zu files\n", reclaimed, plan.size());
+    return 0;
   }
+  free_now = FreeSpaceForFile("/cache");
+  printf("reclaimed %zu bytes in %zu files; now %zu bytes free\n", reclaimed, plan.size(),
+         free_now);
   return (free_now >= bytes_needed) ? 0 : -1;
 }
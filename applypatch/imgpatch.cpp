@@ -21,9 +21,11 @@
 #include <sys/cdefs.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "zlib.h"
@@ -41,44 +43,77 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
       old_data, old_size, &patch, sink, token, nullptr, nullptr);
 }
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
-    ssize_t pos = 12;
-    char* header = patch->data;
-    if (patch->size < 12) {
-        printf("patch too short to contain header\n");
-        return -1;
-    }
+// Upper bound on the threads used to rebuild deflate chunks, across all
+// patches being applied in the process at the same time.
+#define IMGPATCH_MAX_THREADS 4
 
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
-    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
-        printf("corrupt patch file header (magic number)\n");
-        return -1;
-    }
+// Rough limit on the memory held by deflate chunks that are being rebuilt
+// or waiting to be written out in order, again for the whole process.  A
+// single chunk larger than this is still processed, just not alongside
+// any other.
+#define IMGPATCH_MAX_INFLIGHT_BYTES (64 * 1024 * 1024)
+
+static int zlib_deflate_init(z_stream* strm, int level, int method, int windowBits,
+                             int memLevel, int strategy) {
+    return deflateInit2(strm, level, method, windowBits, memLevel, strategy);
+}
+
+static const ImagePatchDeflater zlib_deflater = {
+    "zlib", zlib_deflate_init, deflate, deflateEnd,
+};
+
+static const ImagePatchDeflater* deflater = &zlib_deflater;
+
+void SetImagePatchDeflater(const ImagePatchDeflater* d) {
+    deflater = (d != nullptr) ? d : &zlib_deflater;
+    printf("imgpatch: recompressing with %s\n", deflater->name);
+}
 
-    int num_chunks = Read4(header+8);
+struct ImageChunk {
+    int type;
 
-    int i;
-    for (i = 0; i < num_chunks; ++i) {
+    // CHUNK_NORMAL and CHUNK_DEFLATE
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE
+    size_t expanded_len;
+    size_t bonus_size;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+
+    // CHUNK_RAW
+    const unsigned char* raw_data;
+    ssize_t raw_len;
+
+    // Compressed output of a CHUNK_DEFLATE rebuilt by a worker thread.
+    std::vector<unsigned char> output;
+    bool done;
+    bool failed;
+};
+
+// Decodes all the chunk headers up front, so that deflate chunks can be
+// handed out to worker threads.
+static int ReadChunks(ssize_t old_size, const Value* patch, const Value* bonus_data,
+                      std::vector<ImageChunk>* chunks) {
+    ssize_t pos = 12;
+    int num_chunks = Read4(patch->data+8);
+
+    for (int i = 0; i < num_chunks; ++i) {
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
             return -1;
         }
-        int type = Read4(patch->data + pos);
+        ImageChunk chunk = {};
+        chunk.type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (chunk.type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
@@ -86,17 +121,10 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 return -1;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            if (src_start + src_len > static_cast<size_t>(old_size)) {
-                printf("source data too short\n");
-                return -1;
-            }
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            chunk.src_start = Read8(normal_header);
+            chunk.src_len = Read8(normal_header+8);
+            chunk.patch_offset = Read8(normal_header+16);
+        } else if (chunk.type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
@@ -104,20 +132,15 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 return -1;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            chunk.raw_len = Read4(raw_header);
 
-            if (pos + data_len > patch->size) {
+            if (pos + chunk.raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
                 return -1;
             }
-            if (ctx) SHA1_Update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            chunk.raw_data = reinterpret_cast<unsigned char*>(patch->data + pos);
+            pos += chunk.raw_len;
+        } else if (chunk.type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
@@ -126,124 +149,353 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 return -1;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            if (src_start + src_len > static_cast<size_t>(old_size)) {
-                printf("source data too short\n");
-                return -1;
-            }
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
+            chunk.src_start = Read8(deflate_header);
+            chunk.src_len = Read8(deflate_header+8);
+            chunk.patch_offset = Read8(deflate_header+16);
+            chunk.expanded_len = Read8(deflate_header+24);
+            chunk.level = Read4(deflate_header+40);
+            chunk.method = Read4(deflate_header+44);
+            chunk.windowBits = Read4(deflate_header+48);
+            chunk.memLevel = Read4(deflate_header+52);
+            chunk.strategy = Read4(deflate_header+56);
 
             // Note: expanded_len will include the bonus data size if
             // the patch was constructed with bonus data.  The
             // deflation will come up 'bonus_size' bytes short; these
             // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            std::vector<unsigned char> expanded_source(expanded_len);
-
-            // inflate() doesn't like strm.next_out being a nullptr even with
-            // avail_out being zero (Z_STREAM_ERROR).
-            if (expanded_len != 0) {
-                z_stream strm;
-                strm.zalloc = Z_NULL;
-                strm.zfree = Z_NULL;
-                strm.opaque = Z_NULL;
-                strm.avail_in = src_len;
-                strm.next_in = (unsigned char*)(old_data + src_start);
-                strm.avail_out = expanded_len;
-                strm.next_out = expanded_source.data();
-
-                int ret;
-                ret = inflateInit2(&strm, -15);
-                if (ret != Z_OK) {
-                    printf("failed to init source inflation: %d\n", ret);
-                    return -1;
-                }
-
-                // Because we've provided enough room to accommodate the output
-                // data, we expect one call to inflate() to suffice.
-                ret = inflate(&strm, Z_SYNC_FLUSH);
-                if (ret != Z_STREAM_END) {
-                    printf("source inflation returned %d\n", ret);
-                    return -1;
-                }
-                // We should have filled the output buffer exactly, except
-                // for the bonus_size.
-                if (strm.avail_out != bonus_size) {
-                    printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
-                    return -1;
-                }
-                inflateEnd(&strm);
-
-                if (bonus_size) {
-                    memcpy(expanded_source.data() + (expanded_len - bonus_size),
-                           bonus_data->data, bonus_size);
-                }
-            }
-
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            std::vector<unsigned char> uncompressed_target_data;
-            if (ApplyBSDiffPatchMem(expanded_source.data(), expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data) != 0) {
+            chunk.bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+            if (chunk.bonus_size > chunk.expanded_len) {
+                printf("chunk %d bonus data larger than expanded source\n", i);
                 return -1;
             }
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, chunk.type);
+            return -1;
+        }
 
-            // Now compress the target data and append it to the output.
+        if (chunk.type != CHUNK_RAW &&
+            chunk.src_start + chunk.src_len > static_cast<size_t>(old_size)) {
+            printf("source data too short\n");
+            return -1;
+        }
+        chunks->push_back(std::move(chunk));
+    }
 
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            if (expanded_source.size() < 32768U) {
-                expanded_source.resize(32768U);
-            }
+    return 0;
+}
 
-            {
-                std::vector<unsigned char>& temp_data = expanded_source;
-
-                // now the deflate stream
-                z_stream strm;
-                strm.zalloc = Z_NULL;
-                strm.zfree = Z_NULL;
-                strm.opaque = Z_NULL;
-                strm.avail_in = uncompressed_target_data.size();
-                strm.next_in = uncompressed_target_data.data();
-                int ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-                if (ret != Z_OK) {
-                    printf("failed to init uncompressed data deflation: %d\n", ret);
-                    return -1;
-                }
-                do {
-                    strm.avail_out = temp_data.size();
-                    strm.next_out = temp_data.data();
-                    ret = deflate(&strm, Z_FINISH);
-                    ssize_t have = temp_data.size() - strm.avail_out;
-
-                    if (sink(temp_data.data(), have, token) != have) {
-                        printf("failed to write %ld compressed bytes to output\n",
-                               (long)have);
-                        return -1;
-                    }
-                    if (ctx) SHA1_Update(ctx, temp_data.data(), have);
-                } while (ret != Z_STREAM_END);
-                deflateEnd(&strm);
-            }
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
+// Rebuilds one CHUNK_DEFLATE: inflates the source, applies the bsdiff
+// patch to it in memory and deflates the result with the parameters
+// recorded in the chunk header, passing the output to 'sink'.
+static int ApplyDeflateChunk(const unsigned char* old_data, const Value* patch,
+                             const Value* bonus_data, const ImageChunk& chunk,
+                             SinkFn sink, void* token, SHA_CTX* ctx) {
+    size_t expanded_len = chunk.expanded_len;
+    size_t bonus_size = chunk.bonus_size;
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+    std::vector<unsigned char> expanded_source(expanded_len);
+
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (expanded_len != 0) {
+        z_stream strm;
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = chunk.src_len;
+        strm.next_in = (unsigned char*)(old_data + chunk.src_start);
+        strm.avail_out = expanded_len;
+        strm.next_out = expanded_source.data();
+
+        int ret;
+        ret = inflateInit2(&strm, -15);
+        if (ret != Z_OK) {
+            printf("failed to init source inflation: %d\n", ret);
+            return -1;
+        }
+
+        // Because we've provided enough room to accommodate the output
+        // data, we expect one call to inflate() to suffice.
+        ret = inflate(&strm, Z_SYNC_FLUSH);
+        if (ret != Z_STREAM_END) {
+            printf("source inflation returned %d\n", ret);
+            inflateEnd(&strm);
             return -1;
         }
+        // We should have filled the output buffer exactly, except
+        // for the bonus_size.
+        if (strm.avail_out != bonus_size) {
+            printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
+            inflateEnd(&strm);
+            return -1;
+        }
+        inflateEnd(&strm);
+
+        if (bonus_size) {
+            memcpy(expanded_source.data() + (expanded_len - bonus_size),
+                   bonus_data->data, bonus_size);
+        }
     }
 
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    std::vector<unsigned char> uncompressed_target_data;
+    if (ApplyBSDiffPatchMem(expanded_source.data(), expanded_len,
+                            patch, chunk.patch_offset,
+                            &uncompressed_target_data) != 0) {
+        return -1;
+    }
+
+    // Now compress the target data and append it to the output.
+
+    // we're done with the expanded_source data buffer, so we'll
+    // reuse that memory to receive the output of deflate.
+    if (expanded_source.size() < 32768U) {
+        expanded_source.resize(32768U);
+    }
+    std::vector<unsigned char>& temp_data = expanded_source;
+
+    // now the deflate stream
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = uncompressed_target_data.size();
+    strm.next_in = uncompressed_target_data.data();
+    int ret = deflater->init(&strm, chunk.level, chunk.method, chunk.windowBits,
+                             chunk.memLevel, chunk.strategy);
+    if (ret != Z_OK) {
+        printf("failed to init uncompressed data deflation: %d\n", ret);
+        return -1;
+    }
+    do {
+        strm.avail_out = temp_data.size();
+        strm.next_out = temp_data.data();
+        ret = deflater->deflate(&strm, Z_FINISH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            printf("deflate of uncompressed data returned %d\n", ret);
+            deflater->end(&strm);
+            return -1;
+        }
+        ssize_t have = temp_data.size() - strm.avail_out;
+
+        if (sink(temp_data.data(), have, token) != have) {
+            printf("failed to write %ld compressed bytes to output\n",
+                   (long)have);
+            deflater->end(&strm);
+            return -1;
+        }
+        if (ctx) SHA1_Update(ctx, temp_data.data(), have);
+    } while (ret != Z_STREAM_END);
+    deflater->end(&strm);
+
     return 0;
 }
+
+static ssize_t AppendToVector(const unsigned char* data, ssize_t len, void* token) {
+    std::vector<unsigned char>* out = reinterpret_cast<std::vector<unsigned char>*>(token);
+    out->insert(out->end(), data, data + len);
+    return len;
+}
+
+// Rebuilds the deflate chunks of one patch on a small pool of threads.
+// Chunks are claimed in patch order and their compressed output is kept
+// until ApplyImagePatch gets to them, so the sink still sees the chunks in
+// order; IMGPATCH_MAX_INFLIGHT_BYTES bounds how far the workers may run
+// ahead of the writer.
+struct DeflatePool {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+    std::vector<ImageChunk>* chunks;
+
+    size_t next;
+    size_t inflight;                    // This pool's part of deflate_inflight.
+    bool abort;
+};
+
+// The block image updater applies several patches at once, so the thread
+// and memory limits are shared by all pools.  deflate_mu guards these
+// and the state of every pool.
+static pthread_mutex_t deflate_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deflate_cv = PTHREAD_COND_INITIALIZER;
+static size_t deflate_threads = 0;      // Workers of all pools.
+static size_t deflate_inflight = 0;     // Bytes held by chunks of all pools.
+
+static size_t ChunkCost(const ImageChunk& chunk) {
+    // The expanded source, the patched data and the compressed output
+    // are all alive at once.
+    return 2 * chunk.expanded_len + chunk.src_len;
+}
+
+static void* DeflateWorker(void* cookie) {
+    DeflatePool* pool = reinterpret_cast<DeflatePool*>(cookie);
+    std::vector<ImageChunk>& chunks = *pool->chunks;
+
+    pthread_mutex_lock(&deflate_mu);
+    while (!pool->abort) {
+        while (pool->next < chunks.size() && chunks[pool->next].type != CHUNK_DEFLATE) {
+            ++pool->next;
+        }
+        if (pool->next >= chunks.size()) {
+            break;
+        }
+        ImageChunk& chunk = chunks[pool->next];
+        size_t cost = ChunkCost(chunk);
+        if (deflate_inflight > 0 && deflate_inflight + cost > IMGPATCH_MAX_INFLIGHT_BYTES) {
+            pthread_cond_wait(&deflate_cv, &deflate_mu);
+            continue;
+        }
+        ++pool->next;
+        deflate_inflight += cost;
+        pool->inflight += cost;
+        pthread_mutex_unlock(&deflate_mu);
+
+        bool failed = ApplyDeflateChunk(pool->old_data, pool->patch, pool->bonus_data,
+                                        chunk, AppendToVector, &chunk.output, nullptr) != 0;
+
+        pthread_mutex_lock(&deflate_mu);
+        chunk.failed = failed;
+        chunk.done = true;
+        pthread_cond_broadcast(&deflate_cv);
+    }
+    pthread_mutex_unlock(&deflate_mu);
+    return nullptr;
+}
+
+static size_t DeflateThreads(const std::vector<ImageChunk>& chunks) {
+    size_t deflate_chunks = std::count_if(chunks.begin(), chunks.end(),
+            [](const ImageChunk& chunk) { return chunk.type == CHUNK_DEFLATE; });
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = std::min(static_cast<size_t>(IMGPATCH_MAX_THREADS), deflate_chunks);
+    if (cpus > 0) {
+        threads = std::min(threads, static_cast<size_t>(cpus));
+    }
+
+    // Take what other patches leave of the process-wide limit.  A single
+    // worker would only make the writer wait for it, so that is done
+    // serially instead.
+    pthread_mutex_lock(&deflate_mu);
+    threads = std::min(threads, IMGPATCH_MAX_THREADS - deflate_threads);
+    if (threads < 2) {
+        threads = 0;
+    }
+    deflate_threads += threads;
+    pthread_mutex_unlock(&deflate_mu);
+    return threads;
+}
+
+static void ReleaseDeflateThreads(size_t threads) {
+    pthread_mutex_lock(&deflate_mu);
+    deflate_threads -= threads;
+    pthread_mutex_unlock(&deflate_mu);
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    char* header = patch->data;
+    if (patch->size < 12) {
+        printf("patch too short to contain header\n");
+        return -1;
+    }
+
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
+    // CHUNK_GZIP.)
+    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+        printf("corrupt patch file header (magic number)\n");
+        return -1;
+    }
+
+    std::vector<ImageChunk> chunks;
+    if (ReadChunks(old_size, patch, bonus_data, &chunks) != 0) {
+        return -1;
+    }
+
+    // With more than one deflate chunk, rebuild them in parallel; the
+    // loop below only writes out their results.
+    DeflatePool pool = {old_data, patch, bonus_data, &chunks, 0, 0, false};
+    std::vector<pthread_t> threads;
+    size_t num_threads = DeflateThreads(chunks);
+    for (size_t t = 0; t < num_threads; ++t) {
+        pthread_t thread;
+        int error = pthread_create(&thread, nullptr, DeflateWorker, &pool);
+        if (error != 0) {
+            printf("failed to create deflate thread: %s\n", strerror(error));
+            break;
+        }
+        threads.push_back(thread);
+    }
+    ReleaseDeflateThreads(num_threads - threads.size());
+    bool parallel = !threads.empty();
+
+    int result = 0;
+    for (size_t i = 0; i < chunks.size() && result == 0; ++i) {
+        ImageChunk& chunk = chunks[i];
+
+        if (chunk.type == CHUNK_NORMAL) {
+            ApplyBSDiffPatch(old_data + chunk.src_start, chunk.src_len,
+                             patch, chunk.patch_offset, sink, token, ctx);
+        } else if (chunk.type == CHUNK_RAW) {
+            if (ctx) SHA1_Update(ctx, chunk.raw_data, chunk.raw_len);
+            if (sink(chunk.raw_data, chunk.raw_len, token) != chunk.raw_len) {
+                printf("failed to write chunk %zu raw data\n", i);
+                result = -1;
+            }
+        } else if (!parallel) {
+            result = ApplyDeflateChunk(old_data, patch, bonus_data, chunk, sink, token, ctx);
+        } else {
+            pthread_mutex_lock(&deflate_mu);
+            while (!chunk.done) {
+                pthread_cond_wait(&deflate_cv, &deflate_mu);
+            }
+            pthread_mutex_unlock(&deflate_mu);
+
+            ssize_t have = chunk.output.size();
+            if (chunk.failed) {
+                result = -1;
+            } else if (sink(chunk.output.data(), have, token) != have) {
+                printf("failed to write %ld compressed bytes to output\n", (long)have);
+                result = -1;
+            } else if (ctx) {
+                SHA1_Update(ctx, chunk.output.data(), have);
+            }
+            std::vector<unsigned char>().swap(chunk.output);
+
+            pthread_mutex_lock(&deflate_mu);
+            deflate_inflight -= ChunkCost(chunk);
+            pool.inflight -= ChunkCost(chunk);
+            pthread_cond_broadcast(&deflate_cv);
+            pthread_mutex_unlock(&deflate_mu);
+        }
+    }
+
+    if (parallel) {
+        pthread_mutex_lock(&deflate_mu);
+        pool.abort = true;
+        pthread_cond_broadcast(&deflate_cv);
+        pthread_mutex_unlock(&deflate_mu);
+        for (pthread_t thread : threads) {
+            pthread_join(thread, nullptr);
+        }
+        ReleaseDeflateThreads(threads.size());
+
+        // Chunks left unwritten after an error give their share back.
+        pthread_mutex_lock(&deflate_mu);
+        deflate_inflight -= pool.inflight;
+        pthread_cond_broadcast(&deflate_cv);
+        pthread_mutex_unlock(&deflate_mu);
+    }
+
+    return result;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "ota_io.h"
+#include "partition_writer.h"
+
+// O_DIRECT transfers have to be aligned to the logical block size of
+// the device; no EMMC part uses more than this.
+#define DIRECT_ALIGN 4096
+
+PartitionWriter::PartitionWriter(const char* path) :
+        path_(path), fd_(-1), verify_fd_(-1), direct_(false), offset_(0), region_start_(0),
+        running_(false), done_(false), bad_(SIZE_MAX), read_error_(false) {
+    pthread_mutex_init(&mu_, nullptr);
+    pthread_cond_init(&cv_, nullptr);
+}
+
+PartitionWriter::~PartitionWriter() {
+    Stop();
+    if (verify_fd_ != -1) {
+        ota_close(verify_fd_);
+    }
+    if (fd_ != -1) {
+        ota_close(fd_);
+    }
+    pthread_cond_destroy(&cv_);
+    pthread_mutex_destroy(&mu_);
+}
+
+bool PartitionWriter::Start(size_t offset) {
+    fd_ = ota_open(path_.c_str(), O_RDWR | O_SYNC);
+    if (fd_ < 0) {
+        printf("failed to open %s: %s\n", path_.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Reading back with O_DIRECT goes to the device without evicting
+    // anything else from the page cache.  Where it isn't supported, the
+    // range is dropped from the cache before it is read instead.
+    verify_fd_ = ota_open(path_.c_str(), O_RDONLY | O_DIRECT);
+    direct_ = verify_fd_ != -1;
+    if (!direct_) {
+        verify_fd_ = ota_open(path_.c_str(), O_RDONLY);
+        if (verify_fd_ < 0) {
+            printf("failed to open %s for verify: %s\n", path_.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (TEMP_FAILURE_RETRY(lseek(fd_, offset, SEEK_SET)) == -1) {
+        printf("failed seek on %s: %s\n", path_.c_str(), strerror(errno));
+        return false;
+    }
+    offset_ = offset;
+    region_start_ = offset;
+    SHA1_Init(&ctx_);
+
+    int error = pthread_create(&thread_, nullptr, VerifyThread, this);
+    if (error != 0) {
+        printf("failed to start verify thread: %s\n", strerror(error));
+        return false;
+    }
+    running_ = true;
+    return true;
+}
+
+bool PartitionWriter::Write(const unsigned char* data, size_t len) {
+    while (len > 0) {
+        size_t to_write = std::min(len, region_start_ + PARTITION_WRITER_REGION - offset_);
+        ssize_t written = TEMP_FAILURE_RETRY(ota_write(fd_, data, to_write));
+        if (written == -1) {
+            printf("failed write writing to %s: %s\n", path_.c_str(), strerror(errno));
+            return false;
+        }
+        SHA1_Update(&ctx_, data, written);
+        data += written;
+        len -= written;
+        offset_ += written;
+
+        if (offset_ == region_start_ + PARTITION_WRITER_REGION) {
+            EndRegion();
+        }
+    }
+    return true;
+}
+
+// Hands the region just written to the verify thread.  O_SYNC has
+// already made it durable.
+void PartitionWriter::EndRegion() {
+    Region region;
+    region.offset = region_start_;
+    region.len = offset_ - region_start_;
+    SHA1_Final(region.sha1, &ctx_);
+
+    pthread_mutex_lock(&mu_);
+    queue_.push_back(region);
+    pthread_cond_signal(&cv_);
+    pthread_mutex_unlock(&mu_);
+
+    region_start_ = offset_;
+    SHA1_Init(&ctx_);
+}
+
+bool PartitionWriter::Finish(size_t* verified) {
+    if (offset_ > region_start_) {
+        EndRegion();
+    }
+
+    bool success = true;
+    if (ota_fsync(fd_) != 0) {
+        printf("failed to sync to %s (%s)\n", path_.c_str(), strerror(errno));
+        success = false;
+    }
+
+    Stop();
+    if (read_error_) {
+        success = false;
+    }
+    *verified = std::min(bad_, offset_);
+    return success;
+}
+
+void PartitionWriter::Stop() {
+    if (!running_) {
+        return;
+    }
+    pthread_mutex_lock(&mu_);
+    done_ = true;
+    pthread_cond_signal(&cv_);
+    pthread_mutex_unlock(&mu_);
+    pthread_join(thread_, nullptr);
+    running_ = false;
+}
+
+void* PartitionWriter::VerifyThread(void* cookie) {
+    reinterpret_cast<PartitionWriter*>(cookie)->Verify();
+    return nullptr;
+}
+
+void PartitionWriter::Verify() {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, DIRECT_ALIGN, PARTITION_WRITER_REGION) != 0) {
+        printf("failed to allocate verify buffer\n");
+        read_error_ = true;
+        buffer = nullptr;
+    }
+    std::unique_ptr<void, decltype(&free)> buffer_holder(buffer, free);
+
+    pthread_mutex_lock(&mu_);
+    while (true) {
+        while (queue_.empty() && !done_) {
+            pthread_cond_wait(&cv_, &mu_);
+        }
+        if (queue_.empty()) {
+            break;
+        }
+        Region region = queue_.front();
+        queue_.pop_front();
+
+        // Everything from the first bad region on gets written again, so
+        // there is no point in reading it.
+        if (buffer == nullptr || read_error_ || region.offset > bad_) {
+            continue;
+        }
+        pthread_mutex_unlock(&mu_);
+
+        uint8_t* data = reinterpret_cast<uint8_t*>(buffer);
+        bool read = ReadRegion(region, data);
+        uint8_t sha1[SHA_DIGEST_LENGTH];
+        if (read) {
+            SHA1(data, region.len, sha1);
+        }
+
+        pthread_mutex_lock(&mu_);
+        if (!read) {
+            read_error_ = true;
+        } else if (memcmp(sha1, region.sha1, SHA_DIGEST_LENGTH) != 0) {
+            printf("verification failed in region at %zu\n", region.offset);
+            bad_ = std::min(bad_, region.offset);
+        }
+    }
+    pthread_mutex_unlock(&mu_);
+}
+
+bool PartitionWriter::ReadRegion(const Region& region, uint8_t* buffer) {
+    // O_DIRECT reads whole blocks; the device always extends past the
+    // end of the image to the next block.
+    size_t to_read = direct_ ? (region.len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1) : region.len;
+    if (!direct_) {
+        posix_fadvise(verify_fd_, region.offset, region.len, POSIX_FADV_DONTNEED);
+    }
+
+    size_t so_far = 0;
+    while (so_far < region.len) {
+        ssize_t read_count = TEMP_FAILURE_RETRY(ota_pread(verify_fd_, buffer + so_far,
+                                                          to_read - so_far,
+                                                          region.offset + so_far));
+        if (read_count == -1) {
+            printf("verify read error %s at %zu: %s\n", path_.c_str(), region.offset + so_far,
+                   strerror(errno));
+            return false;
+        }
+        if (read_count == 0) {
+            printf("short verify read %s at %zu\n", path_.c_str(), region.offset + so_far);
+            return false;
+        }
+        size_t end = so_far + read_count;
+        if (direct_ && end < region.len) {
+            // The next O_DIRECT read has to start on a block boundary
+            // again, so a partial block is read once more.
+            end &= ~(DIRECT_ALIGN - 1);
+            if (end == so_far) {
+                printf("short verify read %s at %zu\n", path_.c_str(), region.offset + so_far);
+                return false;
+            }
+        }
+        so_far = end;
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_PARTITION_WRITER_H
+#define _APPLYPATCH_PARTITION_WRITER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+
+#include "openssl/sha.h"
+
+// Writes an image to an EMMC block device in pieces of any size, so the
+// caller never needs all of it in memory, and verifies it on the way:
+// each region is read back with O_DIRECT on a second thread and checked
+// against the SHA-1 of what was written while the next region is being
+// written.  Nothing is dropped from the page cache system-wide.
+#define PARTITION_WRITER_REGION (1 << 20)
+
+class PartitionWriter {
+  public:
+    explicit PartitionWriter(const char* path);
+    virtual ~PartitionWriter();
+
+    // Opens the device and starts writing at offset, which has to be a
+    // multiple of PARTITION_WRITER_REGION.
+    bool Start(size_t offset);
+
+    // Appends the next len bytes of the image.
+    bool Write(const unsigned char* data, size_t len);
+
+    // Syncs the device and waits for the verification.  *verified is set
+    // to the start of the first region that read back wrong, or to the
+    // end of the data if all of it matched.  Returns false on I/O errors.
+    bool Finish(size_t* verified);
+
+  protected:
+    struct Region {
+        size_t offset;
+        size_t len;
+        uint8_t sha1[SHA_DIGEST_LENGTH];
+    };
+
+    // Reads a region back from the device on the verify thread.  Tests
+    // override it to see what happens when the data doesn't match; those
+    // have to call Finish() before the writer is destroyed.
+    virtual bool ReadRegion(const Region& region, uint8_t* buffer);
+
+  private:
+    static void* VerifyThread(void* cookie);
+    void Verify();
+    void EndRegion();
+    void Stop();
+
+    std::string path_;
+    int fd_;
+    int verify_fd_;
+    bool direct_;               // verify_fd_ is opened with O_DIRECT.
+    size_t offset_;             // End of the data written so far.
+    size_t region_start_;
+    SHA_CTX ctx_;               // Covers [region_start_, offset_).
+
+    pthread_t thread_;
+    bool running_;
+    pthread_mutex_t mu_;
+    pthread_cond_t cv_;
+    std::deque<Region> queue_;
+    bool done_;
+    size_t bad_;                // First region that failed, or SIZE_MAX.
+    bool read_error_;
+};
+
+#endif  // _APPLYPATCH_PARTITION_WRITER_H
@@ -10,7 +10,8 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.ll \
 	parser.yy \
-	expr.cpp
+	expr.cpp \
+	compile.cpp
 
 #
 # Build the host-side command line tool
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expr.h"
+
+// CompileExpr() works in two passes.  The first copies the parsed tree
+// into Nodes, folding the builtin operators as it goes; the second lays
+// the Nodes out in one block as Exprs, in evaluation order, with the
+// argument arrays and a pool of the strings they name after them.
+
+namespace {
+
+struct Node {
+    Function fn;
+    std::string name;
+    int start, end;
+    std::vector<std::unique_ptr<Node>> args;
+
+    bool literal() const { return fn == Literal; }
+};
+
+std::unique_ptr<Node> LiteralNode(const std::string& value, int start, int end) {
+    std::unique_ptr<Node> n(new Node);
+    n->fn = Literal;
+    n->name = value;
+    n->start = start;
+    n->end = end;
+    return n;
+}
+
+// Stands in for expression e, which has to keep e's source range:
+// AssertFn() quotes the script by it.
+std::unique_ptr<Node> Replace(std::unique_ptr<Node> with, const Expr* e) {
+    with->start = e->start;
+    with->end = e->end;
+    return with;
+}
+
+bool IsTrue(const Node* n) {
+    return !n->name.empty();
+}
+
+// The builtins that only combine their arguments' values, so they give
+// the same result every time the arguments are the same literals.
+bool IsPure(Function fn) {
+    return fn == ConcatFn || fn == EqualityFn || fn == InequalityFn ||
+           fn == LogicalNotFn || fn == SubstringFn;
+}
+
+// Evaluates fn over literal arguments now.  Returns false, leaving the
+// call to run (and fail) at run time, if it doesn't produce a string.
+bool EvaluatePure(const Expr* e, const std::vector<std::unique_ptr<Node>>& args,
+                  std::string* result) {
+    std::vector<Expr> literals(args.size());
+    std::vector<Expr*> argv(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        literals[i].fn = Literal;
+        literals[i].name = args[i]->name.c_str();
+        literals[i].argc = 0;
+        literals[i].argv = NULL;
+        literals[i].start = args[i]->start;
+        literals[i].end = args[i]->end;
+        argv[i] = &literals[i];
+    }
+
+    State state;
+    state.cookie = NULL;
+    state.script = NULL;
+    state.errmsg = NULL;
+    Value* v = e->fn(e->name, &state, e->argc, argv.data());
+    free(state.errmsg);
+    if (v == NULL) {
+        return false;
+    }
+    bool ok = v->type == VAL_STRING;
+    if (ok) {
+        result->assign(v->data, v->size);
+    }
+    FreeValue(v);
+    return ok;
+}
+
+std::unique_ptr<Node> Fold(const Expr* e, int* folded) {
+    if (e->fn == Literal) {
+        return LiteralNode(e->name, e->start, e->end);
+    }
+
+    std::unique_ptr<Node> n(new Node);
+    n->fn = e->fn;
+    n->name = e->name != NULL ? e->name : "";
+    n->start = e->start;
+    n->end = e->end;
+    bool all_literal = true;
+    for (int i = 0; i < e->argc; ++i) {
+        n->args.push_back(Fold(e->argv[i], folded));
+        all_literal = all_literal && n->args.back()->literal();
+    }
+
+    // The operators that evaluate their first argument to pick what to
+    // evaluate next: a literal there decides it now.
+    if (e->argc > 0 && n->args[0]->literal()) {
+        std::unique_ptr<Node>& first = n->args[0];
+        if (e->fn == SequenceFn && e->argc == 2) {
+            ++*folded;
+            return Replace(std::move(n->args[1]), e);
+        }
+        if ((e->fn == LogicalAndFn || e->fn == LogicalOrFn) && e->argc == 2) {
+            ++*folded;
+            bool take_second = IsTrue(first.get()) == (e->fn == LogicalAndFn);
+            return Replace(std::move(n->args[take_second ? 1 : 0]), e);
+        }
+        if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3)) {
+            ++*folded;
+            if (IsTrue(first.get())) {
+                return Replace(std::move(n->args[1]), e);
+            }
+            return Replace(std::move(n->args[e->argc == 3 ? 2 : 0]), e);
+        }
+    }
+
+    std::string value;
+    if (all_literal && IsPure(e->fn) && EvaluatePure(e, n->args, &value)) {
+        ++*folded;
+        return LiteralNode(value, e->start, e->end);
+    }
+    return n;
+}
+
+class Emitter {
+  public:
+    explicit Emitter(const Node* root) : nodes_(0), args_(0), pool_size_(0) {
+        Count(root);
+    }
+
+    Expr* Emit(const Node* root) {
+        size_t size = nodes_ * sizeof(Expr) + args_ * sizeof(Expr*) + pool_size_;
+        char* block = reinterpret_cast<char*>(malloc(size));
+        if (block == NULL) {
+            return NULL;
+        }
+        next_node_ = reinterpret_cast<Expr*>(block);
+        next_arg_ = reinterpret_cast<Expr**>(block + nodes_ * sizeof(Expr));
+        pool_ = block + nodes_ * sizeof(Expr) + args_ * sizeof(Expr*);
+        for (const auto& s : offsets_) {
+            memcpy(pool_ + s.second, s.first.c_str(), s.first.size() + 1);
+        }
+        Expr* result = next_node_;
+        Place(root, next_node_++);
+        return result;
+    }
+
+  private:
+    void Count(const Node* n) {
+        ++nodes_;
+        args_ += n->args.size();
+        if (offsets_.find(n->name) == offsets_.end()) {
+            offsets_[n->name] = pool_size_;
+            pool_size_ += n->name.size() + 1;
+        }
+        for (const auto& arg : n->args) {
+            Count(arg.get());
+        }
+    }
+
+    void Place(const Node* n, Expr* e) {
+        e->fn = n->fn;
+        e->name = pool_ + offsets_[n->name];
+        e->argc = n->args.size();
+        e->argv = n->args.empty() ? NULL : next_arg_;
+        e->start = n->start;
+        e->end = n->end;
+
+        // The node's arguments sit next to each other, and each one is
+        // followed by its own subtree.
+        next_arg_ += n->args.size();
+        for (size_t i = 0; i < n->args.size(); ++i) {
+            e->argv[i] = next_node_++;
+        }
+        for (size_t i = 0; i < n->args.size(); ++i) {
+            Place(n->args[i].get(), e->argv[i]);
+        }
+    }
+
+    size_t nodes_;
+    size_t args_;
+    size_t pool_size_;
+    std::unordered_map<std::string, size_t> offsets_;
+
+    Expr* next_node_;
+    Expr** next_arg_;
+    char* pool_;
+};
+
+}  // namespace
+
+Expr* CompileExpr(Expr* root, int* folded) {
+    int count = 0;
+    std::unique_ptr<Node> tree = Fold(root, &count);
+    Emitter emitter(tree.get());
+    Expr* result = emitter.Emit(tree.get());
+    if (folded != NULL) {
+        *folded = count;
+    }
+    return result;
+}
+
+void FreeCompiledExpr(Expr* compiled) {
+    free(compiled);
+}
@@ -407,26 +407,28 @@ void RegisterBuiltins() {
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
+//
+// The results go straight to the caller's pointers; on failure a second
+// pass over the same arguments frees what was stored.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = reinterpret_cast<char**>(malloc(count * sizeof(char*)));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char* arg = Evaluate(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                free(*(va_arg(v, char**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
+        *(va_arg(v, char**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -434,25 +436,24 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = reinterpret_cast<Value**>(malloc(count * sizeof(Value*)));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value* arg = EvaluateValue(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                FreeValue(*(va_arg(v, Value**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
+        *(va_arg(v, Value**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
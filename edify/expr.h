@@ -180,4 +180,15 @@ void FreeValue(Value* v);
 
 int parse_string(const char* str, Expr** root, int* error_count);
 
+// Compile the tree parse_string() produced into a copy that evaluates
+// to the same results with less work: all the nodes, argument arrays and
+// strings share one allocation, in evaluation order, and builtin
+// operators on literals ("a" + "b", "" || x, ifelse(t, ...)) are worked
+// out once here.  If folded is not NULL it gets the number of operators
+// removed.  Returns NULL if out of memory; the tree is left unchanged.
+Expr* CompileExpr(Expr* root, int* folded);
+
+// Free the result of CompileExpr().
+void FreeCompiledExpr(Expr* compiled);
+
 #endif  // _EXPRESSION_H
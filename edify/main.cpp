@@ -30,6 +30,21 @@
 
 extern int yyparse(Expr** root, int* error_count);
 
+// Evaluates e, returning the result and the error message if there is
+// one.
+static char* evaluate(Expr* e, const char* expr_str, std::string* errmsg) {
+    State state;
+    state.cookie = NULL;
+    state.script = strdup(expr_str);
+    state.errmsg = NULL;
+
+    char* result = Evaluate(&state, e);
+    errmsg->assign(state.errmsg != NULL ? state.errmsg : "");
+    free(state.errmsg);
+    free(state.script);
+    return result;
+}
+
 int expect(const char* expr_str, const char* expected, int* errors) {
     Expr* e;
     char* result;
@@ -44,14 +59,24 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         return 0;
     }
 
-    State state;
-    state.cookie = NULL;
-    state.script = strdup(expr_str);
-    state.errmsg = NULL;
+    std::string errmsg;
+    result = evaluate(e, expr_str, &errmsg);
+
+    // The compiled form must behave exactly like the tree.
+    Expr* compiled = CompileExpr(e, NULL);
+    std::string compiled_errmsg;
+    char* compiled_result = evaluate(compiled, expr_str, &compiled_errmsg);
+    FreeCompiledExpr(compiled);
+    bool same = (result == NULL) ? (compiled_result == NULL)
+            : (compiled_result != NULL && strcmp(result, compiled_result) == 0);
+    if (!same || errmsg != compiled_errmsg) {
+        fprintf(stderr, "evaluating \"%s\": compiled gave \"%s\" (%s), tree gave \"%s\" (%s)\n",
+                expr_str, compiled_result ? compiled_result : "(NULL)", compiled_errmsg.c_str(),
+                result ? result : "(NULL)", errmsg.c_str());
+        ++*errors;
+    }
+    free(compiled_result);
 
-    result = Evaluate(&state, e);
-    free(state.errmsg);
-    free(state.script);
     if (result == NULL && expected != NULL) {
         fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
         ++*errors;
@@ -158,6 +183,18 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // constant folding
+    expect("\"a\" + \"b\" == ab && yes", "yes", &errors);
+    expect("if a + b == ab then yes else abort() endif", "yes", &errors);
+    expect("ifelse(\"\", abort(), no)", "no", &errors);
+    expect("ifelse(!t, abort())", "", &errors);
+    expect("a; b; concat(c, d + e)", "cde", &errors);
+    expect("\"\" || a + b", "ab", &errors);
+    expect("t && \"\" == \"\"", "t", &errors);
+    expect("assert(t, \"\" + \"\")", NULL, &errors);
+    expect("assert(t && (\"\" || \"\"))", NULL, &errors);
+    expect("is_substring(b, a + b + c) + less_than_int(1, 2)", "tt", &errors);
+
     // big string
     expect(std::string(8192, 's').c_str(), std::string(8192, 's').c_str(), &errors);
 
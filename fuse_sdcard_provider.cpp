@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -32,28 +33,62 @@ struct file_data {
     uint32_t block_size;
 };
 
-static int read_block_file(void* cookie, uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+// Most blocks read with one preadv() call.
+#define MAX_IOV 8
+
+// Reads count consecutive blocks straight into the caller's buffers,
+// with as few preadv() calls as the kernel allows.  Short reads just
+// move the iovecs along; hitting EOF early is an error.
+static int read_blocks_file(void* cookie, uint32_t block, uint32_t count, uint8_t** buffers,
+                            const uint32_t* fetch_sizes) {
     file_data* fd = reinterpret_cast<file_data*>(cookie);
 
     off64_t offset = ((off64_t) block) * fd->block_size;
-    if (TEMP_FAILURE_RETRY(lseek64(fd->fd, offset, SEEK_SET)) == -1) {
-        fprintf(stderr, "seek on sdcard failed: %s\n", strerror(errno));
-        return -EIO;
-    }
+    while (count > 0) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        size_t want = 0;
+        for (; iovcnt < MAX_IOV && static_cast<uint32_t>(iovcnt) < count; ++iovcnt) {
+            iov[iovcnt].iov_base = buffers[iovcnt];
+            iov[iovcnt].iov_len = fetch_sizes[iovcnt];
+            want += fetch_sizes[iovcnt];
+        }
 
-    while (fetch_size > 0) {
-        ssize_t r = TEMP_FAILURE_RETRY(read(fd->fd, buffer, fetch_size));
-        if (r == -1) {
-            fprintf(stderr, "read on sdcard failed: %s\n", strerror(errno));
-            return -EIO;
+        struct iovec* v = iov;
+        while (want > 0) {
+            ssize_t r = TEMP_FAILURE_RETRY(preadv64(fd->fd, v, iovcnt - (v - iov), offset));
+            if (r == -1) {
+                fprintf(stderr, "read on sdcard failed: %s\n", strerror(errno));
+                return -EIO;
+            }
+            if (r == 0) {
+                fprintf(stderr, "unexpected EOF on sdcard\n");
+                return -EIO;
+            }
+            offset += r;
+            want -= r;
+            while (r > 0 && static_cast<size_t>(r) >= v->iov_len) {
+                r -= v->iov_len;
+                ++v;
+            }
+            if (r > 0) {
+                v->iov_base = reinterpret_cast<uint8_t*>(v->iov_base) + r;
+                v->iov_len -= r;
+            }
         }
-        fetch_size -= r;
-        buffer += r;
+
+        buffers += iovcnt;
+        fetch_sizes += iovcnt;
+        count -= iovcnt;
     }
 
     return 0;
 }
 
+static int read_block_file(void* cookie, uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    return read_blocks_file(cookie, block, 1, &buffer, &fetch_size);
+}
+
 static void close_file(void* cookie) {
     file_data* fd = reinterpret_cast<file_data*>(cookie);
     close(fd->fd);
@@ -74,9 +109,11 @@ bool start_sdcard_fuse(const char* path) {
     }
     fd.file_size = sb.st_size;
     fd.block_size = 65536;
+    posix_fadvise(fd.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
     provider_vtab vtab;
     vtab.read_block = read_block_file;
+    vtab.read_blocks = read_blocks_file;
     vtab.close = close_file;
 
     // The installation process expects to find the sdcard unmounted.
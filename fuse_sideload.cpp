@@ -71,6 +71,41 @@
 #define NO_STATUS         1
 #define NO_STATUS_EXIT    2
 
+// Blocks fetched from the host are kept in a small LRU cache.  When the
+// reader is going through the file sequentially, a prefetch thread keeps
+// fetching the blocks ahead of it so the host round trip for block N+1
+// overlaps with the reader consuming block N.  The cache is bounded in
+// bytes, so large block sizes get fewer slots.
+#define CACHE_MAX_BYTES   (8 << 20)
+#define CACHE_MIN_SLOTS   4
+#define CACHE_MAX_SLOTS   64
+
+// Consecutive sequential block reads needed before prefetching starts.
+#define SEQUENTIAL_THRESHOLD 2
+
+// Most blocks the prefetch thread requests at once from a provider that
+// implements read_blocks.
+#define PREFETCH_MAX_BATCH 8
+
+// Largest read the kernel is asked to send us.  A read is answered with
+// one writev() straight from the cache slots of every block it touches,
+// so the limit is also kept below the number of slots.
+#define FUSE_MAX_READ     (128 << 10)
+
+enum slot_state {
+    SLOT_EMPTY,
+    SLOT_LOADING,
+    SLOT_VALID,
+};
+
+struct cache_slot {
+    uint32_t block;
+    uint8_t* data;
+    slot_state state;
+    int pins;               // readers currently replying from this slot
+    uint64_t last_used;
+};
+
 struct fuse_data {
     int ffd;   // file descriptor for the fuse socket
 
@@ -81,18 +116,39 @@ struct fuse_data {
 
     uint32_t block_size;    // block size that the adb host is using to send the file to us
     uint32_t file_blocks;   // file size in block_size blocks
+    uint32_t max_read;      // negotiated with the kernel at mount time
+
+    // Scratch space for handle_read: one entry per block a read of
+    // max_read bytes can touch.
+    uint32_t reply_blocks;
+    struct iovec* reply_vec;
+    struct cache_slot** reply_slots;
 
     uid_t uid;
     gid_t gid;
 
-    uint32_t curr_block;    // cache the block most recently read from the host
-    uint8_t* block_data;
-
-    uint8_t* extra_block;   // another block of storage for reads that
-                            // span two blocks
+    uint8_t* zero_block;    // returned for reads past the end of the file
 
     uint8_t* hashes;        // SHA-256 hash of each block (all zeros
                             // if block hasn't been read yet)
+
+    struct cache_slot* slots;
+    uint32_t slot_count;
+    uint8_t* slot_data;
+    uint64_t use_clock;
+
+    uint32_t last_block;    // sequential access detection
+    uint32_t sequential;
+    uint32_t prefetch_next; // next block for the prefetch thread
+    uint32_t prefetch_end;  // first block past the prefetch window
+    uint32_t prefetch_window;
+    bool stop_prefetch;
+
+    pthread_mutex_t cache_mu;   // protects the cache and prefetch state
+    pthread_cond_t cache_cv;
+    pthread_mutex_t io_mu;      // serializes calls into the provider
+    pthread_t prefetch_thread;
+    bool prefetch_running;
 };
 
 static void fuse_reply(struct fuse_data* fd, __u64 unique, const void *data, size_t len)
@@ -234,33 +290,24 @@ static int handle_release(void* data, struct fuse_data* fd, const struct fuse_in
     return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(struct fuse_data* fd, uint32_t block) {
-    if (block == fd->curr_block) {
-        return 0;
-    }
-
-    if (block >= fd->file_blocks) {
-        memset(fd->block_data, 0, fd->block_size);
-        fd->curr_block = block;
-        return 0;
-    }
-
-    size_t fetch_size = fd->block_size;
+// Returns how many bytes of the given block the host will send, and
+// zero-pads the rest of buffer when the block is the short last one.
+static uint32_t block_fetch_size(struct fuse_data* fd, uint32_t block, uint8_t* buffer) {
+    uint32_t fetch_size = fd->block_size;
     if (block * fd->block_size + fetch_size > fd->file_size) {
         // If we're reading the last (partial) block of the file,
         // expect a shorter response from the host, and pad the rest
         // of the block with zeroes.
         fetch_size = fd->file_size - (block * fd->block_size);
-        memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+        memset(buffer + fetch_size, 0, fd->block_size - fetch_size);
     }
+    return fetch_size;
+}
 
-    int result = fd->vtab->read_block(fd->cookie, block, fd->block_data, fetch_size);
-    if (result < 0) return result;
-
-    fd->curr_block = block;
-
+// Checks a block just received from the host against the hash recorded
+// the first time the block was read.  Only one thread loads any given
+// block at a time, so the hash entry needs no locking.
+static int verify_block(struct fuse_data* fd, uint32_t block, const uint8_t* buffer) {
     // Verify the hash of the block we just got from the host.
     //
     // - If the hash of the just-received data matches the stored hash
@@ -271,7 +318,7 @@ static int fetch_block(struct fuse_data* fd, uint32_t block) {
     // - Otherwise, return -EINVAL for the read.
 
     uint8_t hash[SHA256_DIGEST_LENGTH];
-    SHA256(fd->block_data, fd->block_size, hash);
+    SHA256(buffer, fd->block_size, hash);
     uint8_t* blockhash = fd->hashes + block * SHA256_DIGEST_LENGTH;
     if (memcmp(hash, blockhash, SHA256_DIGEST_LENGTH) == 0) {
         return 0;
@@ -280,7 +327,6 @@ static int fetch_block(struct fuse_data* fd, uint32_t block) {
     int i;
     for (i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
         if (blockhash[i] != 0) {
-            fd->curr_block = -1;
             return -EIO;
         }
     }
@@ -289,17 +335,232 @@ static int fetch_block(struct fuse_data* fd, uint32_t block) {
     return 0;
 }
 
+// Reads a block from the host into buffer and verifies it.  Returns 0
+// on success, negative otherwise.
+static int load_block(struct fuse_data* fd, uint32_t block, uint8_t* buffer) {
+    uint32_t fetch_size = block_fetch_size(fd, block, buffer);
+
+    pthread_mutex_lock(&fd->io_mu);
+    int result = fd->vtab->read_block(fd->cookie, block, buffer, fetch_size);
+    pthread_mutex_unlock(&fd->io_mu);
+    if (result < 0) return result;
+
+    return verify_block(fd, block, buffer);
+}
+
+// Reads count consecutive blocks with a single provider call, for
+// providers that can keep several requests in flight.  results[i]
+// receives the outcome for block + i.
+static void load_blocks(struct fuse_data* fd, uint32_t block, uint32_t count,
+                        uint8_t** buffers, int* results) {
+    uint32_t fetch_sizes[PREFETCH_MAX_BATCH];
+    for (uint32_t i = 0; i < count; ++i) {
+        fetch_sizes[i] = block_fetch_size(fd, block + i, buffers[i]);
+    }
+
+    pthread_mutex_lock(&fd->io_mu);
+    int result = fd->vtab->read_blocks(fd->cookie, block, count, buffers, fetch_sizes);
+    pthread_mutex_unlock(&fd->io_mu);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        results[i] = (result < 0) ? result : verify_block(fd, block + i, buffers[i]);
+    }
+}
+
+// The following helpers must be called with fd->cache_mu held.
+
+static struct cache_slot* find_slot(struct fuse_data* fd, uint32_t block) {
+    for (uint32_t i = 0; i < fd->slot_count; ++i) {
+        if (fd->slots[i].state != SLOT_EMPTY && fd->slots[i].block == block) {
+            return &fd->slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the least recently used slot that is not being loaded or
+// replied from, or NULL if every slot is busy.
+static struct cache_slot* victim_slot(struct fuse_data* fd) {
+    struct cache_slot* victim = NULL;
+    for (uint32_t i = 0; i < fd->slot_count; ++i) {
+        struct cache_slot* slot = &fd->slots[i];
+        if (slot->state == SLOT_EMPTY) {
+            return slot;
+        }
+        if (slot->state == SLOT_VALID && slot->pins == 0 &&
+            (victim == NULL || slot->last_used < victim->last_used)) {
+            victim = slot;
+        }
+    }
+    return victim;
+}
+
+// Updates the sequential access detector after a read of the given
+// block, and moves the prefetch window along with the reader.
+static void note_access(struct fuse_data* fd, uint32_t block) {
+    if (block == fd->last_block + 1) {
+        ++fd->sequential;
+    } else if (block != fd->last_block) {
+        fd->sequential = 0;
+        fd->prefetch_next = fd->prefetch_end = 0;
+    }
+    fd->last_block = block;
+
+    if (fd->sequential >= SEQUENTIAL_THRESHOLD && fd->prefetch_running) {
+        uint32_t end = MIN(block + 1 + fd->prefetch_window, fd->file_blocks);
+        if (fd->prefetch_next <= block) {
+            fd->prefetch_next = block + 1;
+        }
+        if (end > fd->prefetch_end) {
+            fd->prefetch_end = end;
+            pthread_cond_broadcast(&fd->cache_cv);
+        }
+    }
+}
+
+static void* prefetch_thread(void* cookie) {
+    struct fuse_data* fd = reinterpret_cast<struct fuse_data*>(cookie);
+    uint32_t max_batch = (fd->vtab->read_blocks != NULL) ? PREFETCH_MAX_BATCH : 1;
+
+    pthread_mutex_lock(&fd->cache_mu);
+    while (!fd->stop_prefetch) {
+        if (fd->prefetch_next >= fd->prefetch_end) {
+            pthread_cond_wait(&fd->cache_cv, &fd->cache_mu);
+            continue;
+        }
+
+        if (find_slot(fd, fd->prefetch_next) != NULL) {
+            ++fd->prefetch_next;
+            continue;
+        }
+
+        // Claim slots for a run of consecutive blocks that are not
+        // cached yet.
+        struct cache_slot* batch[PREFETCH_MAX_BATCH];
+        uint32_t first = fd->prefetch_next;
+        uint32_t count = 0;
+        while (count < max_batch && fd->prefetch_next < fd->prefetch_end &&
+               find_slot(fd, fd->prefetch_next) == NULL) {
+            struct cache_slot* slot = victim_slot(fd);
+            if (slot == NULL) {
+                break;
+            }
+            slot->block = fd->prefetch_next++;
+            slot->state = SLOT_LOADING;
+            batch[count++] = slot;
+        }
+
+        if (count == 0) {
+            pthread_cond_wait(&fd->cache_cv, &fd->cache_mu);
+            continue;
+        }
+        pthread_mutex_unlock(&fd->cache_mu);
+
+        int results[PREFETCH_MAX_BATCH];
+        if (count == 1) {
+            results[0] = load_block(fd, first, batch[0]->data);
+        } else {
+            uint8_t* buffers[PREFETCH_MAX_BATCH];
+            for (uint32_t i = 0; i < count; ++i) {
+                buffers[i] = batch[i]->data;
+            }
+            load_blocks(fd, first, count, buffers, results);
+        }
+
+        pthread_mutex_lock(&fd->cache_mu);
+        for (uint32_t i = 0; i < count; ++i) {
+            // On failure the slot is dropped; the reader then fetches
+            // the block itself and gets to see the error.
+            batch[i]->state = (results[i] == 0) ? SLOT_VALID : SLOT_EMPTY;
+            batch[i]->last_used = ++fd->use_clock;
+        }
+        pthread_cond_broadcast(&fd->cache_cv);
+    }
+    pthread_mutex_unlock(&fd->cache_mu);
+
+    return NULL;
+}
+
+// Fetch a block from the host, or from the cache.  On success *data
+// points to the block contents and *slot to the cache slot, which stays
+// pinned until the caller passes it to release_block().  Returns 0 on
+// successful fetch, negative otherwise.
+static int fetch_block(struct fuse_data* fd, uint32_t block, uint8_t** data,
+                       struct cache_slot** slot) {
+    *slot = NULL;
+    if (block >= fd->file_blocks) {
+        *data = fd->zero_block;
+        return 0;
+    }
+
+    pthread_mutex_lock(&fd->cache_mu);
+    note_access(fd, block);
+
+    for (;;) {
+        struct cache_slot* found = find_slot(fd, block);
+        if (found != NULL && found->state == SLOT_VALID) {
+            found->pins++;
+            found->last_used = ++fd->use_clock;
+            pthread_mutex_unlock(&fd->cache_mu);
+            *data = found->data;
+            *slot = found;
+            return 0;
+        }
+        if (found != NULL) {
+            // The prefetch thread is loading this block right now.
+            pthread_cond_wait(&fd->cache_cv, &fd->cache_mu);
+            continue;
+        }
+
+        found = victim_slot(fd);
+        if (found == NULL) {
+            pthread_cond_wait(&fd->cache_cv, &fd->cache_mu);
+            continue;
+        }
+
+        found->block = block;
+        found->state = SLOT_LOADING;
+        pthread_mutex_unlock(&fd->cache_mu);
+
+        int result = load_block(fd, block, found->data);
+
+        pthread_mutex_lock(&fd->cache_mu);
+        if (result == 0) {
+            found->state = SLOT_VALID;
+            found->pins++;
+            found->last_used = ++fd->use_clock;
+        } else {
+            found->state = SLOT_EMPTY;
+        }
+        pthread_cond_broadcast(&fd->cache_cv);
+        pthread_mutex_unlock(&fd->cache_mu);
+
+        if (result != 0) return result;
+        *data = found->data;
+        *slot = found;
+        return 0;
+    }
+}
+
+static void release_block(struct fuse_data* fd, struct cache_slot* slot) {
+    if (slot == NULL) return;
+
+    pthread_mutex_lock(&fd->cache_mu);
+    slot->pins--;
+    pthread_cond_broadcast(&fd->cache_cv);
+    pthread_mutex_unlock(&fd->cache_mu);
+}
+
 static int handle_read(void* data, struct fuse_data* fd, const struct fuse_in_header* hdr) {
     const struct fuse_read_in* req = reinterpret_cast<const struct fuse_read_in*>(data);
     struct fuse_out_header outhdr;
-    struct iovec vec[3];
-    int vec_used;
-    int result;
+    int result = 0;
 
     if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
     uint64_t offset = req->offset;
     uint32_t size = req->size;
+    if (size > fd->max_read) return -EINVAL;
 
     // The docs on the fuse kernel interface are vague about what to
     // do when a read request extends past the end of the file.  We
@@ -315,51 +576,39 @@ static int handle_read(void* data, struct fuse_data* fd, const struct fuse_in_he
     outhdr.len = sizeof(outhdr) + size;
     outhdr.error = 0;
     outhdr.unique = hdr->unique;
+    struct iovec* vec = fd->reply_vec;
     vec[0].iov_base = &outhdr;
     vec[0].iov_len = sizeof(outhdr);
 
-    uint32_t block = offset / fd->block_size;
-    result = fetch_block(fd, block);
-    if (result != 0) return result;
+    // Every block the read touches is fetched (or found in the cache)
+    // and stays pinned until the reply has been written, so the reply
+    // goes out with a single writev() straight from the cache slots.
+    // Since we mount with max_read no larger than reply_blocks - 1
+    // blocks, a read never touches more than reply_blocks blocks.
 
-    // Two cases:
-    //
-    //   - the read request is entirely within this block.  In this
-    //     case we can reply immediately.
-    //
-    //   - the read request goes over into the next block.  Note that
-    //     since we mount the filesystem with max_read=block_size, a
-    //     read can never span more than two blocks.  In this case we
-    //     copy the block to extra_block and issue a fetch for the
-    //     following block.
-
-    uint32_t block_offset = offset - (block * fd->block_size);
-
-    if (size + block_offset <= fd->block_size) {
-        // First case: the read fits entirely in the first block.
-
-        vec[1].iov_base = fd->block_data + block_offset;
-        vec[1].iov_len = size;
-        vec_used = 2;
-    } else {
-        // Second case: the read spills over into the next block.
-
-        memcpy(fd->extra_block, fd->block_data + block_offset,
-               fd->block_size - block_offset);
-        vec[1].iov_base = fd->extra_block;
-        vec[1].iov_len = fd->block_size - block_offset;
-
-        result = fetch_block(fd, block+1);
-        if (result != 0) return result;
-        vec[2].iov_base = fd->block_data;
-        vec[2].iov_len = size - vec[1].iov_len;
-        vec_used = 3;
+    uint32_t block = offset / fd->block_size;
+    uint32_t block_offset = offset - ((uint64_t) block * fd->block_size);
+    uint32_t used = 0;
+    while (size > 0) {
+        uint8_t* block_data;
+        result = fetch_block(fd, block + used, &block_data, &fd->reply_slots[used]);
+        if (result != 0) break;
+
+        uint32_t len = MIN(size, fd->block_size - block_offset);
+        ++used;
+        vec[used].iov_base = block_data + block_offset;
+        vec[used].iov_len = len;
+        size -= len;
+        block_offset = 0;
     }
 
-    if (writev(fd->ffd, vec, vec_used) < 0) {
+    if (result == 0 && writev(fd->ffd, vec, used + 1) < 0) {
         printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
     }
-    return NO_STATUS;
+    for (uint32_t i = 0; i < used; ++i) {
+        release_block(fd, fd->reply_slots[i]);
+    }
+    return (result == 0) ? NO_STATUS : result;
 }
 
 int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
@@ -405,20 +654,57 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
     fd.uid = getuid();
     fd.gid = getgid();
 
-    fd.curr_block = -1;
-    fd.block_data = (uint8_t*)malloc(block_size);
-    if (fd.block_data == NULL) {
-        fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
+    // Blocks are handed to the provider and to writev() in place, so
+    // keep them page aligned.
+    if (posix_memalign((void**)&fd.zero_block, getpagesize(), block_size) != 0) {
+        fd.zero_block = NULL;
+    }
+    if (fd.zero_block == NULL) {
+        fprintf(stderr, "failed to allocate %d bites for zero_block\n", block_size);
+        result = -1;
+        goto done;
+    }
+    memset(fd.zero_block, 0, block_size);
+
+    fd.slot_count = MAX(CACHE_MIN_SLOTS, MIN(CACHE_MAX_SLOTS, CACHE_MAX_BYTES / block_size));
+    fd.prefetch_window = fd.slot_count / 2;
+    fd.slots = (struct cache_slot*)calloc(fd.slot_count, sizeof(struct cache_slot));
+    if (posix_memalign((void**)&fd.slot_data, getpagesize(),
+                       (size_t)fd.slot_count * block_size) != 0) {
+        fd.slot_data = NULL;
+    }
+    if (fd.slots == NULL || fd.slot_data == NULL) {
+        fprintf(stderr, "failed to allocate %u cache blocks\n", fd.slot_count);
         result = -1;
         goto done;
     }
-    fd.extra_block = (uint8_t*)malloc(block_size);
-    if (fd.extra_block == NULL) {
-        fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
+    for (uint32_t i = 0; i < fd.slot_count; ++i) {
+        fd.slots[i].data = fd.slot_data + (size_t)i * block_size;
+        fd.slots[i].state = SLOT_EMPTY;
+    }
+    fd.last_block = -1;
+
+    // A read of max_read bytes at an arbitrary offset touches up to
+    // max_read / block_size + 1 blocks, all pinned at once.
+    fd.max_read = block_size * MAX(1, MIN(FUSE_MAX_READ / block_size, fd.slot_count - 1));
+    fd.reply_blocks = fd.max_read / block_size + 1;
+    fd.reply_vec = (struct iovec*)calloc(fd.reply_blocks + 1, sizeof(struct iovec));
+    fd.reply_slots = (struct cache_slot**)calloc(fd.reply_blocks, sizeof(struct cache_slot*));
+    if (fd.reply_vec == NULL || fd.reply_slots == NULL) {
+        fprintf(stderr, "failed to allocate reply vectors\n");
         result = -1;
         goto done;
     }
 
+    pthread_mutex_init(&fd.cache_mu, NULL);
+    pthread_cond_init(&fd.cache_cv, NULL);
+    pthread_mutex_init(&fd.io_mu, NULL);
+    if (pthread_create(&fd.prefetch_thread, NULL, prefetch_thread, &fd) == 0) {
+        fd.prefetch_running = true;
+    } else {
+        fprintf(stderr, "failed to start prefetch thread; reading on demand only\n");
+    }
+
     fd.ffd = open("/dev/fuse", O_RDWR);
     if (fd.ffd < 0) {
         perror("open /dev/fuse");
@@ -430,7 +716,7 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
     snprintf(opts, sizeof(opts),
              ("fd=%d,user_id=%d,group_id=%d,max_read=%u,"
               "allow_other,rootmode=040000"),
-             fd.ffd, fd.uid, fd.gid, block_size);
+             fd.ffd, fd.uid, fd.gid, fd.max_read);
 
     result = mount("/dev/fuse", FUSE_SIDELOAD_HOST_MOUNTPOINT,
                    "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC, opts);
@@ -509,6 +795,14 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
     }
 
   done:
+    if (fd.prefetch_running) {
+        pthread_mutex_lock(&fd.cache_mu);
+        fd.stop_prefetch = true;
+        pthread_cond_broadcast(&fd.cache_cv);
+        pthread_mutex_unlock(&fd.cache_mu);
+        pthread_join(fd.prefetch_thread, NULL);
+    }
+
     fd.vtab->close(fd.cookie);
 
     result = umount2(FUSE_SIDELOAD_HOST_MOUNTPOINT, MNT_DETACH);
@@ -518,8 +812,11 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
 
     if (fd.ffd) close(fd.ffd);
     free(fd.hashes);
-    free(fd.block_data);
-    free(fd.extra_block);
+    free(fd.zero_block);
+    free(fd.slots);
+    free(fd.slot_data);
+    free(fd.reply_vec);
+    free(fd.reply_slots);
 
     return result;
 }
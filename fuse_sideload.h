@@ -28,6 +28,11 @@ struct provider_vtab {
     // read a block
     int (*read_block)(void* cookie, uint32_t block, uint8_t* buffer, uint32_t fetch_size);
 
+    // read count consecutive blocks, block i into buffers[i]; optional,
+    // for providers that can have several requests in flight at once
+    int (*read_blocks)(void* cookie, uint32_t block, uint32_t count, uint8_t** buffers,
+                       const uint32_t* fetch_sizes);
+
     // close down
     void (*close)(void* cookie);
 };
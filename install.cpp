@@ -49,6 +49,7 @@
 #include "minzip/Zip.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "otatrace/trace.h"
 #include "roots.h"
 #include "ui.h"
 #include "verifier.h"
@@ -488,10 +489,14 @@ really_install_package(const char *path, bool* wipe_cache, bool needs_mount,
     }
 
     MemMapping map;
-    if (sysMapFile(path, &map) != 0) {
-        LOGE("failed to map file\n");
-        mt_clear_bootloader_message();
-        return INSTALL_CORRUPT;
+    {
+        TraceScope trace(TRACE_PACKAGE_MAP);
+        if (sysMapFile(path, &map) != 0) {
+            LOGE("failed to map file\n");
+            mt_clear_bootloader_message();
+            return INSTALL_CORRUPT;
+        }
+        trace.Add(map.length);
     }
 
     // Verify package.
@@ -525,7 +530,11 @@ really_install_package(const char *path, bool* wipe_cache, bool needs_mount,
         ui->Print("Retry attempt: %d\n", retry_count);
     }
     ui->SetEnableReboot(false);
-    int result = try_update_binary(path, &zip, wipe_cache, log_buffer, retry_count);
+    int result;
+    {
+        TraceScope trace(TRACE_UPDATE_BINARY);
+        result = try_update_binary(path, &zip, wipe_cache, log_buffer, retry_count);
+    }
     ui->SetEnableReboot(true);
     ui->Print("\n");
 
@@ -598,7 +607,12 @@ bool verify_package(const unsigned char* package_data, size_t package_size) {
     // Verify package.
     ui->Print("Verifying update package...\n");
     auto t0 = std::chrono::system_clock::now();
-    int err = verify_file(const_cast<unsigned char*>(package_data), package_size, loadedKeys);
+    int err;
+    {
+        TraceScope trace(TRACE_VERIFY);
+        err = verify_file(const_cast<unsigned char*>(package_data), package_size, loadedKeys);
+        trace.Add(package_size);
+    }
     std::chrono::duration<double> duration = std::chrono::system_clock::now() - t0;
     ui->Print("Update package verification took %.1f s (result %d).\n", duration.count(), err);
     if (err != VERIFY_SUCCESS) {
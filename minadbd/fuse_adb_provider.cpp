@@ -42,19 +42,53 @@ int read_block_adb(void* data, uint32_t block, uint8_t* buffer, uint32_t fetch_s
     return 0;
 }
 
+// Pipelined variant of read_block_adb.  Block requests use the same
+// "%08u" format, but up to max_outstanding of them are written before
+// the first reply is read, so the host can start sending the next block
+// while the current one is still in transit.  Replies come back in
+// request order.
+int read_blocks_adb(void* data, uint32_t block, uint32_t count, uint8_t** buffers,
+                    const uint32_t* fetch_sizes) {
+    adb_data* ad = reinterpret_cast<adb_data*>(data);
+    uint32_t window = ad->max_outstanding > 0 ? ad->max_outstanding : 1;
+
+    uint32_t sent = 0;
+    for (uint32_t received = 0; received < count; ++received) {
+        while (sent < count && sent - received < window) {
+            if (!WriteFdFmt(ad->sfd, "%08u", block + sent)) {
+                fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+                return -EIO;
+            }
+            ++sent;
+        }
+
+        if (!ReadFdExactly(ad->sfd, buffers[received], fetch_sizes[received])) {
+            fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
 static void close_adb(void* data) {
     adb_data* ad = reinterpret_cast<adb_data*>(data);
     WriteFdExactly(ad->sfd, "DONEDONE");
 }
 
-int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size) {
+int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size, uint32_t max_outstanding) {
     adb_data ad;
     ad.sfd = sfd;
     ad.file_size = file_size;
     ad.block_size = block_size;
+    ad.max_outstanding = max_outstanding;
+    if (ad.max_outstanding > ADB_FUSE_MAX_OUTSTANDING) {
+        ad.max_outstanding = ADB_FUSE_MAX_OUTSTANDING;
+    }
 
     provider_vtab vtab;
     vtab.read_block = read_block_adb;
+    vtab.read_blocks = (ad.max_outstanding > 1) ? read_blocks_adb : nullptr;
     vtab.close = close_adb;
 
     return run_fuse_sideload(&vtab, &ad, file_size, block_size);
@@ -24,9 +24,19 @@ struct adb_data {
 
     uint64_t file_size;
     uint32_t block_size;
+
+    // Number of block requests the host accepts before it has answered
+    // the first one.  Hosts that don't announce a value get 1, which is
+    // the original one-request-at-a-time protocol.
+    uint32_t max_outstanding;
 };
 
+// Upper bound for the outstanding request count a host may announce.
+#define ADB_FUSE_MAX_OUTSTANDING 32
+
 int read_block_adb(void* cookie, uint32_t block, uint8_t* buffer, uint32_t fetch_size);
-int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size);
+int read_blocks_adb(void* cookie, uint32_t block, uint32_t count, uint8_t** buffers,
+                    const uint32_t* fetch_sizes);
+int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size, uint32_t max_outstanding);
 
 #endif
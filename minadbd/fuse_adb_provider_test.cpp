@@ -22,7 +22,10 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 
+#include <algorithm>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "adb_io.h"
 
@@ -86,3 +89,67 @@ TEST(fuse_adb_provider, read_block_adb_fail_write) {
 
   close(sockets[0]);
 }
+
+// Local stand-in for the adb host side of sideload-host: answers each
+// "%08u" block request from the given file contents, in request order,
+// until it reads "DONEDONE" or the socket closes.
+static void fake_sideload_host(int sfd, const std::string& file, uint32_t block_size,
+                               std::vector<uint32_t>* requests) {
+  char buf[9] = {};
+  while (ReadFdExactly(sfd, buf, 8)) {
+    if (strcmp(buf, "DONEDONE") == 0) {
+      break;
+    }
+    uint32_t block = strtoul(buf, nullptr, 10);
+    requests->push_back(block);
+    size_t offset = static_cast<size_t>(block) * block_size;
+    size_t len = std::min(static_cast<size_t>(block_size), file.size() - offset);
+    if (!WriteFdExactly(sfd, file.data() + offset, len)) {
+      break;
+    }
+  }
+}
+
+TEST(fuse_adb_provider, read_blocks_adb_pipelined) {
+  const uint32_t block_size = 16;
+  std::string file;
+  for (size_t i = 0; i < 6 * block_size - 5; ++i) {
+    file += static_cast<char>('a' + i % 26);
+  }
+
+  int sockets[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+
+  adb_data data = {};
+  data.sfd = sockets[0];
+  data.file_size = file.size();
+  data.block_size = block_size;
+  data.max_outstanding = 4;
+
+  std::vector<uint32_t> requests;
+  std::thread host(fake_sideload_host, sockets[1], std::cref(file), block_size, &requests);
+
+  // Read blocks 1..5, the last of which is short.
+  const uint32_t count = 5;
+  std::vector<std::vector<uint8_t>> blocks(count, std::vector<uint8_t>(block_size));
+  uint8_t* buffers[count];
+  uint32_t fetch_sizes[count];
+  for (uint32_t i = 0; i < count; ++i) {
+    buffers[i] = blocks[i].data();
+    fetch_sizes[i] = std::min(static_cast<size_t>(block_size),
+                              file.size() - (i + 1) * block_size);
+  }
+  ASSERT_EQ(0, read_blocks_adb(&data, 1, count, buffers, fetch_sizes));
+
+  ASSERT_TRUE(WriteFdExactly(sockets[0], "DONEDONE"));
+  host.join();
+
+  ASSERT_EQ(std::vector<uint32_t>({1, 2, 3, 4, 5}), requests);
+  for (uint32_t i = 0; i < count; ++i) {
+    ASSERT_EQ(file.substr((i + 1) * block_size, fetch_sizes[i]),
+              std::string(blocks[i].begin(), blocks[i].begin() + fetch_sizes[i]));
+  }
+
+  close(sockets[0]);
+  close(sockets[1]);
+}
@@ -41,19 +41,29 @@ void service_bootstrap_func(void* x) {
     free(sti);
 }
 
+// The host asks for "sideload-host:<file size>:<block size>".  Hosts
+// that can answer several block requests in order append
+// ":<max outstanding requests>"; without it we fall back to one request
+// at a time.
 static void sideload_host_service(int sfd, void* data) {
     char* args = reinterpret_cast<char*>(data);
     int file_size;
     int block_size;
-    if (sscanf(args, "%d:%d", &file_size, &block_size) != 2) {
+    int max_outstanding = 1;
+    int fields = sscanf(args, "%d:%d:%d", &file_size, &block_size, &max_outstanding);
+    if (fields < 2) {
         printf("bad sideload-host arguments: %s\n", args);
         exit(1);
     }
     free(args);
+    if (max_outstanding < 1) {
+        max_outstanding = 1;
+    }
 
-    printf("sideload-host file size %d block size %d\n", file_size, block_size);
+    printf("sideload-host file size %d block size %d max outstanding %d\n",
+           file_size, block_size, max_outstanding);
 
-    int result = run_adb_fuse(sfd, file_size, block_size);
+    int result = run_adb_fuse(sfd, file_size, block_size, max_outstanding);
 
     printf("sideload_host finished\n");
     sleep(1);
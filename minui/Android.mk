@@ -11,6 +11,7 @@ LOCAL_SRC_FILES := \
     graphics_adf.cpp \
     graphics_drm.cpp \
     graphics_fbdev.cpp \
+    pixel_ops.cpp \
     resources.cpp \
 
 LOCAL_SRC_FILES += mt_graphic_rotate.cpp
@@ -52,3 +53,12 @@ LOCAL_MODULE := libminui
 LOCAL_WHOLE_STATIC_LIBRARIES += libminui
 LOCAL_SHARED_LIBRARIES := libpng
 include $(BUILD_SHARED_LIBRARY)
+
+# Host tool that converts images to the frame cache format (frame_cache.h).
+# Not run by the build; devices that want the caches ship its output.
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_MODULE := mkframecache
+LOCAL_SRC_FILES := mkframecache.cpp
+LOCAL_STATIC_LIBRARIES := libpng libz
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FRAME_CACHE_H_
+#define _FRAME_CACHE_H_
+
+#include <stdint.h>
+
+// Pre-decoded images, written by mkframecache so that
+// res_create_display_surface() can skip libpng.  An image NAME is looked
+// for as /res/images/NAME.rle before NAME.png.
+//
+// They are opt-in.  The build copies only the PNGs into the recovery
+// ramdisk, so a device that wants the faster load runs mkframecache on
+// its images (the loopNNNNN frames matter most) and ships the .rle files
+// next to them, e.g. in $(TARGET_DEVICE_DIR)/recovery/res/images.
+// Without them the PNGs are decoded as before.
+//
+// The file is a frame_cache_header followed by width * height RGB
+// pixels, top row first, coded as packets.  Each packet starts with a
+// little-endian uint16 n.  If FRAME_CACHE_RUN is set in n, one RGB
+// triple follows and is repeated (n & FRAME_CACHE_COUNT) + 1 times;
+// otherwise n + 1 RGB triples follow as they are.  Packets may cross
+// rows.  All header fields are little-endian.
+
+#define FRAME_CACHE_MAGIC "RLE1"
+#define FRAME_CACHE_RUN 0x8000
+#define FRAME_CACHE_COUNT 0x7fff
+
+struct frame_cache_header {
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+};
+
+#endif
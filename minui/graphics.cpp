@@ -39,6 +39,7 @@
 #include "font_10x18.h"
 #include "minui.h"
 #include "graphics.h"
+#include "pixel_ops.h"
 
 struct GRFont {
     GRSurface* texture;
@@ -60,11 +61,38 @@ static unsigned char gr_current_a = 255;
 
 static GRSurface* gr_draw = NULL;
 
+// Everything drawn since the last flip.
+static GRRect gr_damage = { 0, 0, 0, 0 };
+
 static bool outside(int x, int y)
 {
     return x < 0 || x >= gr_draw->width || y < 0 || y >= gr_draw->height;
 }
 
+bool gr_rect_empty(const GRRect& r)
+{
+    return r.left >= r.right || r.top >= r.bottom;
+}
+
+void gr_rect_union(GRRect* r, const GRRect& other)
+{
+    if (gr_rect_empty(other)) return;
+    if (gr_rect_empty(*r)) {
+        *r = other;
+        return;
+    }
+    if (other.left < r->left) r->left = other.left;
+    if (other.top < r->top) r->top = other.top;
+    if (other.right > r->right) r->right = other.right;
+    if (other.bottom > r->bottom) r->bottom = other.bottom;
+}
+
+static void add_damage(int x1, int y1, int x2, int y2)
+{
+    GRRect r = { x1, y1, x2, y2 };
+    gr_rect_union(&gr_damage, r);
+}
+
 int gr_measure(const char *s)
 {
     return gr_font->cwidth * strlen(s);
@@ -81,28 +109,8 @@ static void text_blend(unsigned char* src_p, int src_row_bytes,
                        int width, int height)
 {
     for (int j = 0; j < height; ++j) {
-        unsigned char* sx = src_p;
-        unsigned char* px = dst_p;
-        for (int i = 0; i < width; ++i) {
-            unsigned char a = *sx++;
-            if (gr_current_a < 255) a = ((int)a * gr_current_a) / 255;
-            if (a == 255) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            } else if (a > 0) {
-                *px = (*px * (255-a) + gr_current_r * a) / 255;
-                ++px;
-                *px = (*px * (255-a) + gr_current_g * a) / 255;
-                ++px;
-                *px = (*px * (255-a) + gr_current_b * a) / 255;
-                ++px;
-                ++px;
-            } else {
-                px += 4;
-            }
-        }
+        pixel_blend_alpha(src_p, dst_p, width,
+                          gr_current_r, gr_current_g, gr_current_b, gr_current_a);
         src_p += src_row_bytes;
         dst_p += dst_row_bytes;
     }
@@ -118,6 +126,7 @@ void gr_text(int x, int y, const char *s, bool bold)
 
     x += overscan_offset_x;
     y += overscan_offset_y;
+    int x_start = x;
 
     unsigned char ch;
     while ((ch = *s++)) {
@@ -137,6 +146,7 @@ void gr_text(int x, int y, const char *s, bool bold)
 
         x += font->cwidth;
     }
+    add_damage(x_start, y, x, y + font->cheight);
 }
 
 void gr_texticon(int x, int y, GRSurface* icon) {
@@ -158,6 +168,7 @@ void gr_texticon(int x, int y, GRSurface* icon) {
     text_blend(src_p, icon->row_bytes,
                dst_p, gr_draw->row_bytes,
                icon->width, icon->height);
+    add_damage(x, y, x + icon->width, y + icon->height);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -177,18 +188,14 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 
 void gr_clear()
 {
+    add_damage(0, 0, gr_draw->width, gr_draw->height);
     if (gr_current_r == gr_current_g && gr_current_r == gr_current_b) {
         memset(gr_draw->data, gr_current_r, gr_draw->height * gr_draw->row_bytes);
     } else {
         unsigned char* px = gr_draw->data;
         for (int y = 0; y < gr_draw->height; ++y) {
-            for (int x = 0; x < gr_draw->width; ++x) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            }
-            px += gr_draw->row_bytes - (gr_draw->width * gr_draw->pixel_bytes);
+            pixel_fill(px, gr_draw->width, gr_current_r, gr_current_g, gr_current_b);
+            px += gr_draw->row_bytes;
         }
     }
 }
@@ -203,32 +210,17 @@ void gr_fill(int x1, int y1, int x2, int y2)
 
     if (outside(x1, y1) || outside(x2-1, y2-1)) return;
 
+    if (gr_current_a > 0) add_damage(x1, y1, x2, y2);
+
     unsigned char* p = gr_draw->data + y1 * gr_draw->row_bytes + x1 * gr_draw->pixel_bytes;
     if (gr_current_a == 255) {
-        int x, y;
-        for (y = y1; y < y2; ++y) {
-            unsigned char* px = p;
-            for (x = x1; x < x2; ++x) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            }
+        for (int y = y1; y < y2; ++y) {
+            pixel_fill(p, x2 - x1, gr_current_r, gr_current_g, gr_current_b);
             p += gr_draw->row_bytes;
         }
     } else if (gr_current_a > 0) {
-        int x, y;
-        for (y = y1; y < y2; ++y) {
-            unsigned char* px = p;
-            for (x = x1; x < x2; ++x) {
-                *px = (*px * (255-gr_current_a) + gr_current_r * gr_current_a) / 255;
-                ++px;
-                *px = (*px * (255-gr_current_a) + gr_current_g * gr_current_a) / 255;
-                ++px;
-                *px = (*px * (255-gr_current_a) + gr_current_b * gr_current_a) / 255;
-                ++px;
-                ++px;
-            }
+        for (int y = y1; y < y2; ++y) {
+            pixel_blend(p, x2 - x1, gr_current_r, gr_current_g, gr_current_b, gr_current_a);
             p += gr_draw->row_bytes;
         }
     }
@@ -247,12 +239,23 @@ void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
 
     if (outside(dx, dy) || outside(dx+w-1, dy+h-1)) return;
 
+    add_damage(dx, dy, dx + w, dy + h);
+
     unsigned char* src_p = source->data + sy*source->row_bytes + sx*source->pixel_bytes;
     unsigned char* dst_p = gr_draw->data + dy*gr_draw->row_bytes + dx*gr_draw->pixel_bytes;
 
+    // Full-width blits between surfaces without row padding (e.g. a
+    // background image) are a single copy.
+    size_t row = w * source->pixel_bytes;
+    if (row == static_cast<size_t>(source->row_bytes) &&
+        row == static_cast<size_t>(gr_draw->row_bytes)) {
+        memcpy(dst_p, src_p, row * h);
+        return;
+    }
+
     int i;
     for (i = 0; i < h; ++i) {
-        memcpy(dst_p, src_p, w * source->pixel_bytes);
+        memcpy(dst_p, src_p, row);
         src_p += source->row_bytes;
         dst_p += gr_draw->row_bytes;
     }
@@ -345,7 +348,7 @@ static void gr_test() {
         gr_color(0, 0, 255, 128);
         gr_fill(gr_draw->width - 200 - x, 300, gr_draw->width - x, 500);
 
-        gr_draw = gr_backend->flip(gr_backend);
+        gr_flip();
     }
     printf("getting end time\n");
     time_t end = time(NULL);
@@ -358,7 +361,8 @@ static void gr_test() {
 #endif
 
 void gr_flip() {
-    gr_draw = gr_backend->flip(gr_backend);
+    gr_draw = gr_backend->flip(gr_backend, &gr_damage);
+    gr_damage = { 0, 0, 0, 0 };
 }
 
 int gr_init(void)
@@ -389,7 +393,10 @@ int gr_init(void)
     overscan_offset_x = gr_draw->width * overscan_percent / 100;
     overscan_offset_y = gr_draw->height * overscan_percent / 100;
 
+    // Push the whole (blank) surface out to every buffer.
+    add_damage(0, 0, gr_draw->width, gr_draw->height);
     gr_flip();
+    add_damage(0, 0, gr_draw->width, gr_draw->height);
     gr_flip();
 
     return 0;
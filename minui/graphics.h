@@ -26,8 +26,10 @@ struct minui_backend {
 
     // Causes the current drawing surface (returned by the most recent
     // call to flip() or init()) to be displayed, and returns a new
-    // drawing surface.
-    GRSurface* (*flip)(minui_backend*);
+    // drawing surface.  'damage' bounds everything drawn since the
+    // previous flip; backends only need to copy that part to the display.
+    // The returned surface must still hold the frame just displayed.
+    GRSurface* (*flip)(minui_backend*, const GRRect* damage);
 
     // Blank (or unblank) the screen.
     void (*blank)(minui_backend*, bool);
@@ -36,6 +38,10 @@ struct minui_backend {
     void (*exit)(minui_backend*);
 };
 
+// Grows 'r' to also cover 'other'.  Empty rectangles are ignored.
+void gr_rect_union(GRRect* r, const GRRect& other);
+bool gr_rect_empty(const GRRect& r);
+
 minui_backend* open_fbdev();
 minui_backend* open_adf();
 minui_backend* open_drm();
@@ -33,6 +33,7 @@
 #include <adf/adf.h>
 
 #include "graphics.h"
+#include "mt_graphic_rotate.h"
 
 struct adf_surface_pdata {
     GRSurface base;
@@ -50,9 +51,12 @@ struct adf_pdata {
     unsigned int current_surface;
     unsigned int n_surfaces;
     adf_surface_pdata surfaces[2];
+
+    // Damage of the previous frame, which the other surface hasn't seen.
+    GRRect prev_damage;
 };
 
-static GRSurface* adf_flip(minui_backend *backend);
+static GRSurface* adf_flip(minui_backend *backend, const GRRect *damage);
 static void adf_blank(minui_backend *backend, bool blank);
 
 static int adf_surface_init(adf_pdata *pdata, drm_mode_modeinfo *mode, adf_surface_pdata *surf) {
@@ -192,7 +196,12 @@ static GRSurface* adf_init(minui_backend *backend)
     if (pdata->intf_fd < 0)
         return NULL;
 
-    ret = adf_flip(backend);
+    GRRect none = { 0, 0, 0, 0 };
+    ret = adf_flip(backend, &none);
+    if (ret == NULL) {
+        // No canvas to draw on; gr_init() tries the next backend.
+        return NULL;
+    }
 
     adf_blank(backend, true);
     adf_blank(backend, false);
@@ -200,11 +209,23 @@ static GRSurface* adf_init(minui_backend *backend)
     return ret;
 }
 
-static GRSurface* adf_flip(minui_backend *backend)
+static GRSurface* adf_flip(minui_backend *backend, const GRRect *damage)
 {
     adf_pdata *pdata = (adf_pdata *)backend;
     adf_surface_pdata *surf = &pdata->surfaces[pdata->current_surface];
 
+    // Drawing goes to a canvas in ordinary memory (the surfaces are mapped
+    // write-only); copy what changed since this surface was last shown.
+    GRRect update = *damage;
+    if (pdata->n_surfaces > 1) {
+        gr_rect_union(&update, pdata->prev_damage);
+        pdata->prev_damage = *damage;
+    }
+    GRSurface* canvas = rotate_canvas_get(&surf->base);
+    if (canvas != NULL) {
+        rotate_surface_rect(&surf->base, canvas, &update, NULL);
+    }
+
     int fence_fd = adf_interface_simple_post(pdata->intf_fd, pdata->eng_id,
             surf->base.width, surf->base.height, pdata->format, surf->fd,
             surf->offset, surf->pitch, -1);
@@ -212,7 +233,7 @@ static GRSurface* adf_flip(minui_backend *backend)
         close(fence_fd);
 
     pdata->current_surface = (pdata->current_surface + 1) % pdata->n_surfaces;
-    return &pdata->surfaces[pdata->current_surface].base;
+    return rotate_canvas_get(&pdata->surfaces[pdata->current_surface].base);
 }
 
 static void adf_blank(minui_backend *backend, bool blank)
@@ -233,6 +254,7 @@ static void adf_exit(minui_backend *backend)
     adf_pdata *pdata = (adf_pdata *)backend;
     unsigned int i;
 
+    rotate_canvas_exit();
     for (i = 0; i < pdata->n_surfaces; i++)
         adf_surface_destroy(&pdata->surfaces[i]);
     if (pdata->intf_fd >= 0)
@@ -30,6 +30,7 @@
 
 #include "minui.h"
 #include "graphics.h"
+#include "mt_graphic_rotate.h"
 
 #define ARRAY_SIZE(A) (sizeof(A)/sizeof(*(A)))
 
@@ -42,6 +43,10 @@ struct drm_surface {
 static drm_surface *drm_surfaces[2];
 static int current_buffer;
 
+// Damage of the previous frame, which drm_surfaces[current_buffer]
+// hasn't seen yet.
+static GRRect prev_damage;
+
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
 
@@ -436,14 +441,39 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
 
     current_buffer = 0;
 
+    // Draw into a canvas in ordinary memory and copy the changed parts to
+    // the scanout buffers on flip.  This also applies the panel rotation.
+    GRSurface* canvas = rotate_canvas_get(&(drm_surfaces[0]->base));
+    if (canvas == NULL) {
+        drm_destroy_surface(drm_surfaces[0]);
+        drm_destroy_surface(drm_surfaces[1]);
+        drm_surfaces[0] = drm_surfaces[1] = NULL;
+        drmModeFreeCrtc(main_monitor_crtc);
+        drmModeFreeConnector(main_monitor_connector);
+        main_monitor_crtc = NULL;
+        main_monitor_connector = NULL;
+        close(drm_fd);
+        drm_fd = -1;
+        return NULL;
+    }
+
     drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
 
-    return &(drm_surfaces[0]->base);
+    return canvas;
 }
 
-static GRSurface* drm_flip(minui_backend* backend __unused) {
+static GRSurface* drm_flip(minui_backend* backend __unused, const GRRect* damage) {
     int ret;
 
+    GRRect update = *damage;
+    gr_rect_union(&update, prev_damage);
+    prev_damage = *damage;
+    GRSurface* draw = &(drm_surfaces[current_buffer]->base);
+    GRSurface* canvas = rotate_canvas_get(draw);
+    if (canvas != NULL) {
+        rotate_surface_rect(draw, canvas, &update, NULL);
+    }
+
     ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
                           drm_surfaces[current_buffer]->fb_id, 0, NULL);
     if (ret < 0) {
@@ -451,11 +481,12 @@ static GRSurface* drm_flip(minui_backend* backend __unused) {
         return NULL;
     }
     current_buffer = 1 - current_buffer;
-    return &(drm_surfaces[current_buffer]->base);
+    return rotate_canvas_get(&(drm_surfaces[current_buffer]->base));
 }
 
 static void drm_exit(minui_backend* backend __unused) {
     drm_disable_crtc(drm_fd, main_monitor_crtc);
+    rotate_canvas_exit();
     drm_destroy_surface(drm_surfaces[0]);
     drm_destroy_surface(drm_surfaces[1]);
     drmModeFreeCrtc(main_monitor_crtc);
@@ -35,7 +35,7 @@
 #include "mt_graphic_rotate.h"
 
 static GRSurface* fbdev_init(minui_backend*);
-static GRSurface* fbdev_flip(minui_backend*);
+static GRSurface* fbdev_flip(minui_backend*, const GRRect*);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
@@ -44,6 +44,11 @@ static bool double_buffered;
 static GRSurface* gr_draw = NULL;
 static int displayed_buffer;
 
+// Damage of the frame before the one being drawn now.  With double
+// buffering, gr_draw last received that frame's predecessor, so it is
+// also missing these pixels.
+static GRRect prev_damage;
+
 static fb_var_screeninfo vi;
 static int fb_fd = -1;
 
@@ -181,8 +186,18 @@ static GRSurface* fbdev_init(minui_backend* backend) {
     return rotate_canvas_get(gr_draw);
 }
 
-static GRSurface* fbdev_flip(minui_backend* backend __unused) {
-    rotate_surface(gr_draw, rotate_canvas_get(gr_draw));
+static GRSurface* fbdev_flip(minui_backend* backend __unused, const GRRect* damage) {
+    GRRect update = *damage;
+    if (double_buffered) {
+        gr_rect_union(&update, prev_damage);
+        prev_damage = *damage;
+    }
+
+    GRRect rows = { 0, 0, 0, 0 };
+    GRSurface* canvas = rotate_canvas_get(gr_draw);
+    if (canvas != NULL) {
+        rotate_surface_rect(gr_draw, canvas, &update, &rows);
+    }
     if (double_buffered) {
         // Change gr_draw to point to the buffer currently displayed,
         // then flip the driver so we're displaying the other buffer
@@ -190,9 +205,13 @@ static GRSurface* fbdev_flip(minui_backend* backend __unused) {
         gr_draw = gr_framebuffer + displayed_buffer;
         set_displayed_framebuffer(1-displayed_buffer);
     } else {
-        // Copy from the in-memory surface to the framebuffer.
-        memcpy(gr_framebuffer[0].data, gr_draw->data,
-               gr_draw->height * gr_draw->row_bytes);
+        // Copy the changed rows from the in-memory surface to the
+        // framebuffer.
+        if (!gr_rect_empty(rows)) {
+            memcpy(gr_framebuffer[0].data + rows.top * gr_draw->row_bytes,
+                   gr_draw->data + rows.top * gr_draw->row_bytes,
+                   (rows.bottom - rows.top) * gr_draw->row_bytes);
+        }
     }
     return rotate_canvas_get(gr_draw);
 }
@@ -33,6 +33,14 @@ struct GRSurface {
     unsigned char* data;
 };
 
+// The pixels [left, right) x [top, bottom) of a surface.
+struct GRRect {
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
 int gr_init();
 void gr_exit();
 
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: convert a recovery image PNG into the frame cache format
+// read by res_create_display_surface() (see frame_cache.h).
+//
+//   mkframecache loop00000.png loop00000.rle
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <png.h>
+
+#include "frame_cache.h"
+
+// Smallest run worth a packet of its own.
+static const size_t kMinRun = 3;
+
+// Decode 'path' into 8-bit RGB, accepting the same PNG types minui does.
+static bool read_png(const char* path, uint32_t* width, uint32_t* height,
+                     std::vector<unsigned char>* rgb) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "can't open %s\n", path);
+        return false;
+    }
+
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+    if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "failed to decode %s\n", path);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        fclose(fp);
+        return false;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_read_info(png_ptr, info_ptr);
+    int bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    bool gray = false;
+    if (bit_depth == 8 && color_type == PNG_COLOR_TYPE_RGB) {
+        // Nothing to do.
+    } else if (bit_depth <= 8 && color_type == PNG_COLOR_TYPE_GRAY) {
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+        gray = true;
+    } else if (bit_depth <= 8 && color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(png_ptr);
+    } else {
+        fprintf(stderr, "%s: unsupported PNG depth %d color_type %d\n",
+                path, bit_depth, color_type);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        fclose(fp);
+        return false;
+    }
+
+    *width = png_get_image_width(png_ptr, info_ptr);
+    *height = png_get_image_height(png_ptr, info_ptr);
+    rgb->resize(static_cast<size_t>(*width) * *height * 3);
+    std::vector<unsigned char> row(*width * 3);
+    for (uint32_t y = 0; y < *height; ++y) {
+        png_read_row(png_ptr, row.data(), NULL);
+        unsigned char* out = rgb->data() + static_cast<size_t>(y) * *width * 3;
+        if (gray) {
+            for (uint32_t x = 0; x < *width; ++x) {
+                out[x * 3] = out[x * 3 + 1] = out[x * 3 + 2] = row[x];
+            }
+        } else {
+            memcpy(out, row.data(), *width * 3);
+        }
+    }
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    return true;
+}
+
+static void put_le16(std::vector<unsigned char>* out, uint32_t v) {
+    out->push_back(v & 0xff);
+    out->push_back((v >> 8) & 0xff);
+}
+
+static void put_le32(std::vector<unsigned char>* out, uint32_t v) {
+    put_le16(out, v & 0xffff);
+    put_le16(out, v >> 16);
+}
+
+static size_t run_length(const unsigned char* p, size_t left) {
+    size_t n = 1;
+    while (n < left && n <= FRAME_CACHE_COUNT && memcmp(p, p + n * 3, 3) == 0) ++n;
+    return n;
+}
+
+static void encode(const std::vector<unsigned char>& rgb, std::vector<unsigned char>* out) {
+    const unsigned char* p = rgb.data();
+    size_t left = rgb.size() / 3;
+    while (left > 0) {
+        size_t run = run_length(p, left);
+        if (run >= kMinRun) {
+            put_le16(out, FRAME_CACHE_RUN | (run - 1));
+            out->insert(out->end(), p, p + 3);
+        } else {
+            // Take literals up to the next run worth coding.
+            run = 0;
+            while (run < left && run <= FRAME_CACHE_COUNT &&
+                   run_length(p + run * 3, left - run) < kMinRun) {
+                ++run;
+            }
+            put_le16(out, run - 1);
+            out->insert(out->end(), p, p + run * 3);
+        }
+        p += run * 3;
+        left -= run;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s input.png output.rle\n", argv[0]);
+        return 2;
+    }
+
+    uint32_t width, height;
+    std::vector<unsigned char> rgb;
+    if (!read_png(argv[1], &width, &height, &rgb)) return 1;
+
+    std::vector<unsigned char> out(FRAME_CACHE_MAGIC, FRAME_CACHE_MAGIC + 4);
+    put_le32(&out, width);
+    put_le32(&out, height);
+    encode(rgb, &out);
+
+    FILE* fp = fopen(argv[2], "wb");
+    if (fp == NULL || fwrite(out.data(), 1, out.size(), fp) != out.size() || fclose(fp) != 0) {
+        fprintf(stderr, "failed to write %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -21,6 +21,8 @@
 #include <linux/fb.h>
 #include <linux/kd.h>
 
+#include <algorithm>
+
 #include "minui.h"
 #include "graphics.h"
 
@@ -83,10 +85,11 @@ void rotate_canvas_init(GRSurface *gr_draw)
 // Cleanup the canvas
 void rotate_canvas_exit(void)
 {
+    // gr_canvas points at the static __gr_canvas; only its pixels are
+    // allocated.
     if (gr_canvas) {
         if (gr_canvas->data)
             free(gr_canvas->data);
-        free(gr_canvas);
     }
     gr_canvas=NULL;
 }
@@ -101,57 +104,87 @@ GRSurface *rotate_canvas_get(GRSurface *gr_draw)
 }
 
 // Surface Rotate Routines
-static void rotate_surface_0(GRSurface *dst, GRSurface *src)
+//
+// Each routine fills the rectangle 'r' (in dst coordinates) of dst from
+// the matching pixels of src.
+
+static void rotate_surface_0(GRSurface *dst, GRSurface *src, const GRRect &r)
 {
-    memcpy(dst->data, src->data, src->height*src->row_bytes);
+    int h;
+    int left = r.left*src->pixel_bytes;
+    int len = (r.right-r.left)*src->pixel_bytes;
+
+    if (len == src->row_bytes && src->row_bytes == dst->row_bytes) {
+        memcpy(dst->data + dst->row_bytes*r.top, src->data + src->row_bytes*r.top,
+               (r.bottom-r.top)*src->row_bytes);
+        return;
+    }
+    for (h=r.top; h<r.bottom; h++) {
+        memcpy(dst->data + dst->row_bytes*h + left, src->data + src->row_bytes*h + left, len);
+    }
 }
 
-static void rotate_surface_270(GRSurface *dst, GRSurface *src)
-{
-    int v, w, h;
-    unsigned int *src_pixel;
-    unsigned int *dst_pixel;
+// The 90" and 270" rotations read the source down a column, touching a
+// new cache line for every pixel.  Walk the surfaces in square tiles
+// instead, so that the source lines of one tile are reused across all of
+// its destination rows.
+#define ROTATE_TILE 32
 
-    for (h=0, v=src->width-1; h<dst->height; h++, v--) {
-        for (w=0; w<dst->width; w++) {
-            dst_pixel = (unsigned int *)(dst->data + dst->row_bytes*h);
-            src_pixel = (unsigned int *)(src->data + src->row_bytes*w);
-            *(dst_pixel+w)=*(src_pixel+v);
+static void rotate_surface_270(GRSurface *dst, GRSurface *src, const GRRect &r)
+{
+    int h0, w0, h, w;
+
+    for (h0=r.top; h0<r.bottom; h0+=ROTATE_TILE) {
+        int h1 = std::min(h0+ROTATE_TILE, r.bottom);
+        for (w0=r.left; w0<r.right; w0+=ROTATE_TILE) {
+            int w1 = std::min(w0+ROTATE_TILE, r.right);
+            for (h=h0; h<h1; h++) {
+                unsigned int *dst_pixel = (unsigned int *)(dst->data + dst->row_bytes*h);
+                const unsigned char *src_col = src->data + 4*(src->width-1-h);
+                for (w=w0; w<w1; w++) {
+                    dst_pixel[w] = *(const unsigned int *)(src_col + src->row_bytes*w);
+                }
+            }
         }
     }
 }
 
-static void rotate_surface_180(GRSurface *dst, GRSurface *src)
+static void rotate_surface_180(GRSurface *dst, GRSurface *src, const GRRect &r)
 {
     int v, w, k, h;
     unsigned int *src_pixel;
     unsigned int *dst_pixel;
 
-    for (h=0, k=src->height-1; h<dst->height && k>=0 ; h++, k--) {
+    for (h=r.top, k=src->height-1-r.top; h<r.bottom; h++, k--) {
         dst_pixel = (unsigned int *)(dst->data + dst->row_bytes*h);
         src_pixel = (unsigned int *)(src->data + src->row_bytes*k);
-        for (w=0, v=src->width-1; w<dst->width && v>=0; w++, v--) {
+        for (w=r.left, v=src->width-1-r.left; w<r.right; w++, v--) {
             *(dst_pixel+w)=*(src_pixel+v);
         }
     }
 }
 
-static void rotate_surface_90(GRSurface *dst, GRSurface *src)
+static void rotate_surface_90(GRSurface *dst, GRSurface *src, const GRRect &r)
 {
-    int w, k, h;
-    unsigned int *src_pixel;
-    unsigned int *dst_pixel;
-
-    for (h=0; h<dst->height; h++) {
-        for (w=0, k=src->height-1; w<dst->width; w++, k--) {
-            dst_pixel = (unsigned int *)(dst->data + dst->row_bytes*h);
-            src_pixel = (unsigned int *)(src->data + src->row_bytes*k);
-            *(dst_pixel+w)=*(src_pixel+h);
+    int h0, w0, h, w;
+
+    for (h0=r.top; h0<r.bottom; h0+=ROTATE_TILE) {
+        int h1 = std::min(h0+ROTATE_TILE, r.bottom);
+        for (w0=r.left; w0<r.right; w0+=ROTATE_TILE) {
+            int w1 = std::min(w0+ROTATE_TILE, r.right);
+            for (h=h0; h<h1; h++) {
+                unsigned int *dst_pixel = (unsigned int *)(dst->data + dst->row_bytes*h);
+                const unsigned char *src_col = src->data + 4*h;
+                for (w=w0; w<w1; w++) {
+                    dst_pixel[w] = *(const unsigned int *)
+                            (src_col + src->row_bytes*(src->height-1-w));
+                }
+            }
         }
     }
 }
 
-typedef void (*rotate_surface_t) (GRSurface *, GRSurface *);
+typedef void (*rotate_surface_t) (GRSurface *, GRSurface *, const GRRect &);
 
 rotate_surface_t rotate_func[4]=
 {
@@ -161,12 +194,56 @@ rotate_surface_t rotate_func[4]=
     rotate_surface_270
 };
 
+// Map a rectangle of the (unrotated) src surface to dst coordinates
+static GRRect rotate_rect(GRSurface *src, const GRRect &r, int index)
+{
+    int W = src->width, H = src->height;
+
+    switch (index) {
+        case 1: return { H-r.bottom, r.left, H-r.top, r.right };
+        case 2: return { W-r.right, H-r.bottom, W-r.left, H-r.top };
+        case 3: return { r.top, W-r.right, r.bottom, W-r.left };
+        default: return r;
+    }
+}
+
+static void rotate_surface_index(GRSurface *dst, GRSurface *src, const GRRect *rect,
+                                 GRRect *dst_rect, int index)
+{
+    GRRect r = { 0, 0, src->width, src->height };
+
+    if (rect) {
+        // clip to the surface
+        r.left = rect->left > 0 ? rect->left : 0;
+        r.top = rect->top > 0 ? rect->top : 0;
+        r.right = std::min(rect->right, src->width);
+        r.bottom = std::min(rect->bottom, src->height);
+    }
+    if (r.left >= r.right || r.top >= r.bottom) {
+        r = { 0, 0, 0, 0 };
+    } else {
+        r = rotate_rect(src, r, index);
+        rotate_func[index](dst, src, r);
+    }
+    if (dst_rect) *dst_rect = r;
+}
+
 // rotate and copy src* surface to dst surface
 void rotate_surface(GRSurface *dst, GRSurface *src)
 {
-    rotate_surface_t rotate;
-    rotate=rotate_func[rotate_config(dst)];
-    rotate(dst, src);
+    rotate_surface_index(dst, src, NULL, NULL, rotate_config(dst));
 }
 
+// rotate and copy only the part 'rect' of src (in src coordinates) to dst,
+// and return the area of dst that was written in 'dst_rect' (if not NULL)
+void rotate_surface_rect(GRSurface *dst, GRSurface *src, const GRRect *rect, GRRect *dst_rect)
+{
+    rotate_surface_index(dst, src, rect, dst_rect, rotate_config(dst));
+}
 
+// rotate by a given angle (0: 0", 1: 90", 2: 180", 3: 270"), regardless of
+// MTK_LCM_PHYSICAL_ROTATION
+void rotate_surface_by(GRSurface *dst, GRSurface *src, int index)
+{
+    rotate_surface_index(dst, src, NULL, NULL, index & 3);
+}
@@ -12,6 +12,8 @@
 void rotate_canvas_exit(void);
 void rotate_canvas_init(GRSurface *gr_draw);
 void rotate_surface(GRSurface *dst, GRSurface *src);
+void rotate_surface_rect(GRSurface *dst, GRSurface *src, const GRRect *rect, GRRect *dst_rect);
+void rotate_surface_by(GRSurface *dst, GRSurface *src, int index);
 GRSurface *rotate_canvas_get(GRSurface *gr_draw);
 
 #endif
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXEL_OPS_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXEL_OPS_SSE2
+#endif
+
+#include "pixel_ops.h"
+
+// x / 255 for 0 <= x <= 255 * 255, without a division.
+static inline unsigned int div255(unsigned int x) {
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+void pixel_fill_c(unsigned char* px, int count,
+                  unsigned char c0, unsigned char c1, unsigned char c2) {
+    for (int i = 0; i < count; ++i) {
+        *px++ = c0;
+        *px++ = c1;
+        *px++ = c2;
+        px++;
+    }
+}
+
+void pixel_blend_c(unsigned char* px, int count,
+                   unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a) {
+    unsigned int inv = 255 - a;
+    for (int i = 0; i < count; ++i) {
+        px[0] = div255(px[0] * inv + c0 * a);
+        px[1] = div255(px[1] * inv + c1 * a);
+        px[2] = div255(px[2] * inv + c2 * a);
+        px += 4;
+    }
+}
+
+void pixel_blend_alpha_c(const unsigned char* alpha, unsigned char* px, int count,
+                         unsigned char c0, unsigned char c1, unsigned char c2,
+                         unsigned char a) {
+    for (int i = 0; i < count; ++i) {
+        unsigned int pa = *alpha++;
+        if (a < 255) pa = div255(pa * a);
+        if (pa == 255) {
+            px[0] = c0;
+            px[1] = c1;
+            px[2] = c2;
+        } else if (pa > 0) {
+            unsigned int inv = 255 - pa;
+            px[0] = div255(px[0] * inv + c0 * pa);
+            px[1] = div255(px[1] * inv + c1 * pa);
+            px[2] = div255(px[2] * inv + c2 * pa);
+        }
+        px += 4;
+    }
+}
+
+#if defined(PIXEL_OPS_NEON)
+
+// NEON works on 8 pixels at a time; vld4/vst4 split them into one
+// register per channel, which leaves the fourth byte untouched.
+
+static inline uint8x8_t div255_u16(uint16x8_t x) {
+    return vshrn_n_u16(vaddq_u16(vaddq_u16(x, vshrq_n_u16(x, 8)), vdupq_n_u16(1)), 8);
+}
+
+static inline uint8x8_t blend_u8(uint8x8_t d, uint8x8_t c, uint8x8_t a, uint8x8_t inv) {
+    return div255_u16(vmlal_u8(vmull_u8(d, inv), c, a));
+}
+
+void pixel_fill(unsigned char* px, int count,
+                unsigned char c0, unsigned char c1, unsigned char c2) {
+    uint8x8_t v0 = vdup_n_u8(c0), v1 = vdup_n_u8(c1), v2 = vdup_n_u8(c2);
+    int i = 0;
+    for (; i + 8 <= count; i += 8, px += 32) {
+        uint8x8x4_t p = vld4_u8(px);
+        p.val[0] = v0;
+        p.val[1] = v1;
+        p.val[2] = v2;
+        vst4_u8(px, p);
+    }
+    pixel_fill_c(px, count - i, c0, c1, c2);
+}
+
+void pixel_blend(unsigned char* px, int count,
+                 unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a) {
+    uint8x8_t va = vdup_n_u8(a), vinv = vdup_n_u8(255 - a);
+    uint8x8_t v0 = vdup_n_u8(c0), v1 = vdup_n_u8(c1), v2 = vdup_n_u8(c2);
+    int i = 0;
+    for (; i + 8 <= count; i += 8, px += 32) {
+        uint8x8x4_t p = vld4_u8(px);
+        p.val[0] = blend_u8(p.val[0], v0, va, vinv);
+        p.val[1] = blend_u8(p.val[1], v1, va, vinv);
+        p.val[2] = blend_u8(p.val[2], v2, va, vinv);
+        vst4_u8(px, p);
+    }
+    pixel_blend_c(px, count - i, c0, c1, c2, a);
+}
+
+void pixel_blend_alpha(const unsigned char* alpha, unsigned char* px, int count,
+                       unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a) {
+    uint8x8_t vga = vdup_n_u8(a);
+    uint8x8_t v0 = vdup_n_u8(c0), v1 = vdup_n_u8(c1), v2 = vdup_n_u8(c2);
+    int i = 0;
+    for (; i + 8 <= count; i += 8, px += 32, alpha += 8) {
+        // Fully transparent runs (the space around glyphs) are common;
+        // skip them without touching the destination.
+        uint64_t bits;
+        memcpy(&bits, alpha, sizeof(bits));
+        if (bits == 0) continue;
+
+        uint8x8_t va = div255_u16(vmull_u8(vld1_u8(alpha), vga));
+        uint8x8_t vinv = vmvn_u8(va);
+        uint8x8x4_t p = vld4_u8(px);
+        p.val[0] = blend_u8(p.val[0], v0, va, vinv);
+        p.val[1] = blend_u8(p.val[1], v1, va, vinv);
+        p.val[2] = blend_u8(p.val[2], v2, va, vinv);
+        vst4_u8(px, p);
+    }
+    pixel_blend_alpha_c(alpha, px, count - i, c0, c1, c2, a);
+}
+
+#elif defined(PIXEL_OPS_SSE2)
+
+// SSE2 works on 4 pixels at a time, widened to two registers of 16-bit
+// lanes.  The fourth byte of each pixel is restored from the destination
+// with a mask before storing.
+
+static inline __m128i div255_epu16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_add_epi16(_mm_srli_epi16(x, 8), _mm_set1_epi16(1)));
+    return _mm_srli_epi16(x, 8);
+}
+
+static inline __m128i blend_epu16(__m128i d, __m128i c, __m128i a) {
+    __m128i inv = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    return div255_epu16(_mm_add_epi16(_mm_mullo_epi16(d, inv), _mm_mullo_epi16(c, a)));
+}
+
+static inline __m128i keep_fourth_byte(__m128i result, __m128i d) {
+    const __m128i mask = _mm_set1_epi32(0x00ffffff);
+    return _mm_or_si128(_mm_and_si128(result, mask), _mm_andnot_si128(mask, d));
+}
+
+void pixel_fill(unsigned char* px, int count,
+                unsigned char c0, unsigned char c1, unsigned char c2) {
+    __m128i color = _mm_set1_epi32(c0 | (c1 << 8) | (c2 << 16));
+    int i = 0;
+    for (; i + 4 <= count; i += 4, px += 16) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(px));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(px), keep_fourth_byte(color, d));
+    }
+    pixel_fill_c(px, count - i, c0, c1, c2);
+}
+
+void pixel_blend(unsigned char* px, int count,
+                 unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i color = _mm_set_epi16(0, c2, c1, c0, 0, c2, c1, c0);
+    __m128i va = _mm_set1_epi16(a);
+    int i = 0;
+    for (; i + 4 <= count; i += 4, px += 16) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(px));
+        __m128i lo = blend_epu16(_mm_unpacklo_epi8(d, zero), color, va);
+        __m128i hi = blend_epu16(_mm_unpackhi_epi8(d, zero), color, va);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(px),
+                         keep_fourth_byte(_mm_packus_epi16(lo, hi), d));
+    }
+    pixel_blend_c(px, count - i, c0, c1, c2, a);
+}
+
+void pixel_blend_alpha(const unsigned char* alpha, unsigned char* px, int count,
+                       unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i color = _mm_set_epi16(0, c2, c1, c0, 0, c2, c1, c0);
+    __m128i vga = _mm_set1_epi16(a);
+    int i = 0;
+    for (; i + 4 <= count; i += 4, px += 16, alpha += 4) {
+        uint32_t bits;
+        memcpy(&bits, alpha, sizeof(bits));
+        if (bits == 0) continue;
+
+        // Spread each pixel's alpha over its four 16-bit lanes.
+        __m128i pa = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero);
+        pa = div255_epu16(_mm_mullo_epi16(pa, vga));
+        pa = _mm_unpacklo_epi16(pa, pa);
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(px));
+        __m128i lo = blend_epu16(_mm_unpacklo_epi8(d, zero), color,
+                                 _mm_unpacklo_epi32(pa, pa));
+        __m128i hi = blend_epu16(_mm_unpackhi_epi8(d, zero), color,
+                                 _mm_unpackhi_epi32(pa, pa));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(px),
+                         keep_fourth_byte(_mm_packus_epi16(lo, hi), d));
+    }
+    pixel_blend_alpha_c(alpha, px, count - i, c0, c1, c2, a);
+}
+
+#else
+
+void pixel_fill(unsigned char* px, int count,
+                unsigned char c0, unsigned char c1, unsigned char c2) {
+    pixel_fill_c(px, count, c0, c1, c2);
+}
+
+void pixel_blend(unsigned char* px, int count,
+                 unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a) {
+    pixel_blend_c(px, count, c0, c1, c2, a);
+}
+
+void pixel_blend_alpha(const unsigned char* alpha, unsigned char* px, int count,
+                       unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a) {
+    pixel_blend_alpha_c(alpha, px, count, c0, c1, c2, a);
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PIXEL_OPS_H_
+#define _PIXEL_OPS_H_
+
+// Row kernels for 4-byte pixels.  Only the first three bytes (the color
+// channels, already in framebuffer order) of each pixel are written; the
+// fourth byte is left as it is.  Blending computes
+//     dst = (dst * (255 - a) + color * a) / 255
+// per channel, with the same truncation as the plain C loops, so the NEON
+// and SSE2 versions produce exactly the same pixels as the fallback.
+
+// Sets 'count' pixels to the color (c0, c1, c2).
+void pixel_fill(unsigned char* px, int count,
+                unsigned char c0, unsigned char c1, unsigned char c2);
+
+// Blends (c0, c1, c2) into 'count' pixels with the constant alpha 'a'.
+void pixel_blend(unsigned char* px, int count,
+                 unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a);
+
+// Blends (c0, c1, c2) into 'count' pixels using the 8-bit coverage in
+// 'alpha' (one byte per pixel), scaled by the constant alpha 'a'.
+void pixel_blend_alpha(const unsigned char* alpha, unsigned char* px, int count,
+                       unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a);
+
+// Plain C versions of the above, used for the leftover pixels of each row
+// and on CPUs without NEON or SSE2.
+void pixel_fill_c(unsigned char* px, int count,
+                  unsigned char c0, unsigned char c1, unsigned char c2);
+void pixel_blend_c(unsigned char* px, int count,
+                   unsigned char c0, unsigned char c1, unsigned char c2, unsigned char a);
+void pixel_blend_alpha_c(const unsigned char* alpha, unsigned char* px, int count,
+                         unsigned char c0, unsigned char c1, unsigned char c2,
+                         unsigned char a);
+
+#endif
@@ -19,6 +19,7 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -28,6 +29,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -35,6 +37,7 @@
 
 #include <png.h>
 
+#include "frame_cache.h"
 #include "minui.h"
 
 #define SURFACE_DATA_ALIGNMENT 8
@@ -200,6 +203,127 @@ static void transform_rgb_to_draw(unsigned char* input_row,
     }
 }
 
+static uint32_t read_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Expand the RLE coded RGB pixels in 'in' into 'count' pixels of the
+// framebuffer pixel format.  Returns false if the data is short or
+// runs past the end of the image.
+static bool decode_frame_cache(const unsigned char* in, size_t in_len,
+                               unsigned char* out, size_t count) {
+    const unsigned char* end = in + in_len;
+    while (count > 0) {
+        if (end - in < 2) return false;
+        unsigned int n = in[0] | (in[1] << 8);
+        in += 2;
+        size_t len = (n & FRAME_CACHE_COUNT) + 1;
+        if (len > count) return false;
+        count -= len;
+        if (n & FRAME_CACHE_RUN) {
+            if (end - in < 3) return false;
+            unsigned char pixel[4];
+#if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
+            pixel[0] = in[2];
+            pixel[1] = in[1];
+            pixel[2] = in[0];
+#else
+            pixel[0] = in[0];
+            pixel[1] = in[1];
+            pixel[2] = in[2];
+#endif
+            pixel[3] = 0xff;
+            in += 3;
+            for (; len > 0; --len, out += 4) {
+                memcpy(out, pixel, 4);
+            }
+        } else {
+            if (static_cast<size_t>(end - in) < len * 3) return false;
+            for (; len > 0; --len, in += 3, out += 4) {
+#if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
+                out[0] = in[2];
+                out[1] = in[1];
+                out[2] = in[0];
+#else
+                out[0] = in[0];
+                out[1] = in[1];
+                out[2] = in[2];
+#endif
+                out[3] = 0xff;
+            }
+        }
+    }
+    return true;
+}
+
+// Load /res/images/NAME.rle (see frame_cache.h).  Returns 0 on success
+// and a negative value if there is no usable cache for the image.
+static int open_frame_cache(const char* name, GRSurface** pSurface) {
+    char resPath[256];
+    unsigned char* data = NULL;
+    GRSurface* surface = NULL;
+    struct stat st;
+    uint32_t width, height;
+    size_t done = 0;
+    int result = 0;
+
+    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.rle", name);
+    resPath[sizeof(resPath)-1] = '\0';
+    int fd = open(resPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(frame_cache_header))) {
+        result = -2;
+        goto exit;
+    }
+
+    data = reinterpret_cast<unsigned char*>(malloc(st.st_size));
+    if (data == NULL) {
+        result = -8;
+        goto exit;
+    }
+    while (done < static_cast<size_t>(st.st_size)) {
+        ssize_t r = TEMP_FAILURE_RETRY(read(fd, data + done, st.st_size - done));
+        if (r <= 0) {
+            result = -2;
+            goto exit;
+        }
+        done += r;
+    }
+
+    if (memcmp(data, FRAME_CACHE_MAGIC, 4) != 0) {
+        result = -3;
+        goto exit;
+    }
+    width = read_le32(data + 4);
+    height = read_le32(data + 8);
+    if (width == 0 || height == 0 || width > 0x10000 || height > 0x10000) {
+        result = -7;
+        goto exit;
+    }
+
+    surface = init_display_surface(width, height);
+    if (surface == NULL) {
+        result = -8;
+        goto exit;
+    }
+    if (!decode_frame_cache(data + sizeof(frame_cache_header),
+                            st.st_size - sizeof(frame_cache_header),
+                            surface->data, static_cast<size_t>(width) * height)) {
+        fprintf(stderr, "corrupt frame cache %s\n", resPath);
+        result = -6;
+        goto exit;
+    }
+
+    *pSurface = surface;
+
+  exit:
+    if (result < 0 && surface != NULL) free(surface);
+    free(data);
+    close(fd);
+    return result;
+}
+
 int res_create_display_surface(const char* name, GRSurface** pSurface) {
     GRSurface* surface = NULL;
     int result = 0;
@@ -212,6 +336,8 @@ int res_create_display_surface(const char* name, GRSurface** pSurface) {
 
     *pSurface = NULL;
 
+    if (open_frame_cache(name, pSurface) == 0) return 0;
+
     result = open_png(name, &png_ptr, &info_ptr, &width, &height, &channels);
     if (result < 0) return result;
 
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -795,6 +796,157 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+/*
+ * Files are created and labelled on the calling thread, in archive order,
+ * so setfscreatecon() (which is per-thread) applies to exactly the file
+ * being opened.  The already-open descriptors are then handed to a small
+ * pool of worker threads that inflate and write the contents.  Nothing is
+ * synced per file; a single syncfs() of the target filesystem at the end
+ * makes the whole directory durable.
+ */
+
+/* Upper bound for the number of worker threads; the actual number also
+ * depends on the number of online CPUs.
+ */
+#define EXTRACT_MAX_THREADS 4
+
+/* Upper bound for files that are open but not written yet.
+ */
+#define EXTRACT_MAX_INFLIGHT 64
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *path;
+    int fd;         /* -1 for directory entries */
+} ExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    ExtractJob *jobs;
+    unsigned int numJobs;       /* jobs queued so far */
+    unsigned int nextJob;       /* next job for a worker */
+    unsigned int inFlight;      /* jobs queued but not finished */
+    bool done;                  /* no more jobs will be queued */
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ExtractPool;
+
+static bool extractJob(const ExtractPool *pool, ExtractJob *job, bool skip)
+{
+    if (job->fd < 0) {
+        return true;
+    }
+
+    bool ok = !skip && mzExtractZipEntryToFile(pool->pArchive, job->pEntry, job->fd);
+    if (close(job->fd) != 0) {
+        ok = false;
+    }
+    job->fd = -1;
+    if (skip) {
+        return false;
+    }
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", job->path);
+        return false;
+    }
+
+    if (pool->timestamp != NULL && utime(job->path, pool->timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->path);
+        return false;
+    }
+
+    LOGV("Extracted file \"%s\"\n", job->path);
+    return true;
+}
+
+static void *extractWorker(void *cookie)
+{
+    ExtractPool *pool = (ExtractPool *)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->nextJob == pool->numJobs && !pool->done) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->nextJob == pool->numJobs) {
+            break;
+        }
+
+        /* Once something has failed, the remaining files are only closed. */
+        ExtractJob *job = &pool->jobs[pool->nextJob++];
+        bool skip = pool->failed;
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractJob(pool, job, skip);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            pool->failed = true;
+        }
+        pool->inFlight--;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Takes ownership of path and fd.  Blocks while too many files are in
+ * flight.  Without worker threads the job runs right away.
+ */
+static bool queueExtractJob(ExtractPool *pool, int numThreads,
+        const ZipEntry *pEntry, char *path, int fd)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->inFlight >= EXTRACT_MAX_INFLIGHT && !pool->failed) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+
+    ExtractJob *job = &pool->jobs[pool->numJobs];
+    job->pEntry = pEntry;
+    job->path = path;
+    job->fd = fd;
+
+    if (pool->failed) {
+        pthread_mutex_unlock(&pool->lock);
+        extractJob(pool, job, true);
+        free(path);
+        return false;
+    }
+
+    pool->numJobs++;
+    if (numThreads == 0) {
+        pool->nextJob++;
+        bool ok = extractJob(pool, job, false);
+        pool->failed = !ok;
+        pthread_mutex_unlock(&pool->lock);
+        return ok;
+    }
+
+    pool->inFlight++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+/* Makes everything written below dir durable with one syncfs().
+ */
+static bool syncTargetDir(const char *dir)
+{
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) {
+        LOGE("Can't open \"%s\" to sync: %s\n", dir, strerror(errno));
+        return false;
+    }
+    bool ok = (syncfs(dfd) == 0);
+    if (!ok) {
+        LOGE("syncfs \"%s\" failed: %s\n", dir, strerror(errno));
+    }
+    close(dfd);
+    return ok;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -865,6 +1017,30 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    ExtractPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+    pool.jobs = (ExtractJob *)calloc(pArchive->numEntries + 1, sizeof(ExtractJob));
+    if (pool.jobs == NULL) {
+        LOGE("Can't allocate extraction jobs\n");
+        free(zpath);
+        return false;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pthread_t threads[EXTRACT_MAX_THREADS];
+    int numThreads = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = (cpus > EXTRACT_MAX_THREADS) ? EXTRACT_MAX_THREADS : (int)cpus;
+    while (numThreads < wanted) {
+        if (pthread_create(&threads[numThreads], NULL, extractWorker, &pool) != 0) {
+            break;
+        }
+        numThreads++;
+    }
+
     /* Walk through the entries and extract anything whose path begins
      * with zpath.
     //TODO: since the entries are sorted, binary search for the first match
@@ -966,7 +1142,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 setfscreatecon(secontext);
             }
 
-            int fd = open(targetFile, O_CREAT|O_WRONLY|O_TRUNC|O_SYNC,
+            int fd = open(targetFile, O_CREAT|O_WRONLY|O_TRUNC,
                 UNZIP_FILEMODE);
 
             if (secontext) {
@@ -981,31 +1157,54 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 break;
             }
 
-            bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-            if (ok) {
-                ok = (fsync(fd) == 0);
-            }
-            if (close(fd) != 0) {
+            char *path = strdup(targetFile);
+            if (path == NULL) {
+                close(fd);
                 ok = false;
+                break;
             }
-            if (!ok) {
-                LOGE("Error extracting \"%s\"\n", targetFile);
+            if (!queueExtractJob(&pool, numThreads, pEntry, path, fd)) {
                 ok = false;
                 break;
             }
-
-            if (timestamp != NULL && utime(targetFile, timestamp)) {
-                LOGE("Error touching \"%s\"\n", targetFile);
+            ++extractCount;
+        } else if (callback != NULL) {
+            /* Keep directories in the job list, so the callback still
+             * sees every entry in archive order.
+             */
+            char *path = strdup(targetFile);
+            if (path == NULL || !queueExtractJob(&pool, numThreads, pEntry, path, -1)) {
                 ok = false;
                 break;
             }
-
-            LOGV("Extracted file \"%s\"\n", targetFile);
-            ++extractCount;
         }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.done = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    int t;
+    for (t = 0; t < numThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (pool.failed) {
+        ok = false;
+    }
 
-        if (callback != NULL) callback(targetFile, cookie);
+    if (ok && extractCount > 0) {
+        ok = syncTargetDir(targetDir);
+    }
+
+    /* The callback runs once the files are complete and durable.
+     */
+    for (i = 0; i < pool.numJobs; i++) {
+        if (ok && callback != NULL) callback(pool.jobs[i].path, cookie);
+        free(pool.jobs[i].path);
     }
+    free(pool.jobs);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
 
     LOGV("Extracted %d file(s)\n", extractCount);
 
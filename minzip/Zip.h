@@ -155,7 +155,11 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
- * If callback is non-NULL, it will be invoked with each unpacked file.
+ * If callback is non-NULL, it will be invoked with each unpacked file,
+ * in archive order, once extraction has completed successfully.
+ *
+ * File contents are written by a pool of worker threads; the target
+ * filesystem is synced once before returning.
  *
  * Returns true on success, false on failure.
  */
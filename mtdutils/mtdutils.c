@@ -25,6 +25,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
@@ -38,6 +39,16 @@ struct MtdPartition {
     unsigned int size;
     unsigned int erase_size;
     char *name;
+
+    // MEMGETBADBLOCK answers, one BLOCK_* per eraseblock.  Kept across
+    // rescans as long as the partition doesn't change.
+    unsigned char *block_state;
+};
+
+enum {
+    BLOCK_UNKNOWN = 0,
+    BLOCK_GOOD,
+    BLOCK_BAD,
 };
 
 struct MtdReadContext {
@@ -45,8 +56,20 @@ struct MtdReadContext {
     char *buffer;
     size_t consumed;
     int fd;
+
+    // ECC counters as of the last block read, to tell whether the next
+    // read hit uncorrectable errors.
+    struct mtd_ecc_stats ecc_stats;
+    int ecc_stats_valid;
 };
 
+// mtd_write_data() queues complete eraseblocks and a writer thread puts
+// them on flash, so the caller can produce the next blocks meanwhile.
+// The queue holds MTD_WRITE_QUEUE_SIZE bytes, within these bounds.
+#define MTD_WRITE_QUEUE_SIZE (2 * 1024 * 1024)
+#define MTD_WRITE_MIN_SLOTS 2
+#define MTD_WRITE_MAX_SLOTS 16
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
@@ -56,6 +79,21 @@ struct MtdWriteContext {
     off64_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    char *queue;            // slots eraseblocks, a ring.
+    char *verify;           // Read-back buffer, also slots eraseblocks.
+    int slots;
+    int head;               // Next slot for the writer thread.
+    int count;              // Slots queued, including the ones being written.
+    off64_t pos;            // Where the next queued block goes.
+    int pos_valid;          // Whether pos is ahead of the fd's offset.
+    off64_t scanned;        // Bad blocks before this have been reported.
+    int error;              // errno of the failed write, sticky.
+    int stop;
+    int thread_started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
 typedef struct {
@@ -105,6 +143,7 @@ mtd_scan_partitions()
             p->name = NULL;
         }
         p->device_index = -1;
+        // block_state is kept, see below.
     }
 
     /* Open and read the file contents.
@@ -146,9 +185,19 @@ mtd_scan_partitions()
          */
         if (matches == 4) {
             MtdPartition *p = &g_mtd_state.partitions[mtdnum];
+            if (p->block_state != NULL &&
+                    (p->size != (unsigned int) mtdsize ||
+                     p->erase_size != (unsigned int) mtderasesize)) {
+                free(p->block_state);
+                p->block_state = NULL;
+            }
             p->device_index = mtdnum;
             p->size = mtdsize;
             p->erase_size = mtderasesize;
+            if (p->block_state == NULL && mtderasesize > 0) {
+                // Without the table every lookup goes to the driver.
+                p->block_state = calloc(mtdsize / mtderasesize, 1);
+            }
             p->name = strdup(mtdname);
             if (p->name == NULL) {
                 errno = ENOMEM;
@@ -281,15 +330,50 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 
     ctx->partition = partition;
     ctx->consumed = partition->erase_size;
+    ctx->ecc_stats_valid = 0;
     return ctx;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+/* MEMGETBADBLOCK for the eraseblock at pos, answered from the partition's
+ * table after the first time.  Factory-bad marks don't change under us,
+ * so the driver is asked once per block per session.  Errors other than
+ * EOPNOTSUPP are returned as they are and not remembered.
+ */
+static int get_bad_block(const MtdPartition *partition, int fd, off64_t pos)
 {
-    struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
-        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
-        return -1;
+    unsigned char *state = NULL;
+    if (partition->block_state != NULL) {
+        state = &partition->block_state[pos / partition->erase_size];
+        if (*state != BLOCK_UNKNOWN) return *state == BLOCK_BAD;
+    }
+
+    off64_t bpos = pos;
+    int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+    if (state != NULL) {
+        if (ret > 0) {
+            *state = BLOCK_BAD;
+        } else if (ret == 0 || errno == EOPNOTSUPP) {
+            *state = BLOCK_GOOD;
+        }
+    }
+    return ret;
+}
+
+static int read_block(MtdReadContext *ctx, char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    struct mtd_ecc_stats *before = &ctx->ecc_stats;
+    struct mtd_ecc_stats after;
+
+    // The counters read after the previous block are the baseline for
+    // this one, so each block costs one ECCGETSTATS.
+    if (!ctx->ecc_stats_valid) {
+        if (ioctl(fd, ECCGETSTATS, before)) {
+            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+            return -1;
+        }
+        ctx->ecc_stats_valid = 1;
     }
 
     off64_t pos = TEMP_FAILURE_RETRY(lseek64(fd, 0, SEEK_CUR));
@@ -308,18 +392,20 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
                     (long long)pos, strerror(errno));
         } else if (ioctl(fd, ECCGETSTATS, &after)) {
             fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+            ctx->ecc_stats_valid = 0;
             return -1;
-        } else if (after.failed != before.failed) {
+        } else if (after.failed != before->failed) {
             fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, (long long)pos);
+                    after.corrected - before->corrected,
+                    after.failed - before->failed, (long long)pos);
             // copy the comparison baseline for the next read.
-            memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
+            memcpy(before, &after, sizeof(struct mtd_ecc_stats));
+        } else if ((mgbb = get_bad_block(partition, fd, pos))) {
             fprintf(stderr,
                     "mtd: MEMGETBADBLOCK returned %d at 0x%08llx: %s\n",
                     mgbb, (long long)pos, strerror(errno));
         } else {
+            memcpy(before, &after, sizeof(struct mtd_ecc_stats));
             return 0;  // Success!
         }
 
@@ -345,7 +431,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         // Read complete blocks directly into the user's buffer
         while (ctx->consumed == ctx->partition->erase_size &&
                len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
+            if (read_block(ctx, data + read)) return -1;
             read += ctx->partition->erase_size;
         }
 
@@ -355,7 +441,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
         // Read the next block into the buffer
         if (ctx->consumed == ctx->partition->erase_size && read < len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+            if (read_block(ctx, ctx->buffer)) return -1;
             ctx->consumed = 0;
         }
     }
@@ -365,6 +451,9 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 ssize_t mtd_read_data_ex(MtdReadContext *ctx, char *data, size_t size, off64_t offset)
 {
+    // ECC errors from this read must not be blamed on the next block.
+    ctx->ecc_stats_valid = 0;
+
     off64_t pos = lseek64(ctx->fd, offset, SEEK_SET);
     if (pos != offset) {
         fprintf(stderr, "can not move file pointer 0x%llX 0x%llX\n", pos, offset);
@@ -402,8 +491,17 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->bad_block_alloc = 0;
     ctx->bad_block_count = 0;
 
+    ctx->slots = MTD_WRITE_QUEUE_SIZE / partition->erase_size;
+    if (ctx->slots < MTD_WRITE_MIN_SLOTS) ctx->slots = MTD_WRITE_MIN_SLOTS;
+    if (ctx->slots > MTD_WRITE_MAX_SLOTS) ctx->slots = MTD_WRITE_MAX_SLOTS;
+
     ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
+    ctx->queue = malloc((size_t) ctx->slots * partition->erase_size);
+    ctx->verify = malloc((size_t) ctx->slots * partition->erase_size);
+    if (ctx->buffer == NULL || ctx->queue == NULL || ctx->verify == NULL) {
+        free(ctx->buffer);
+        free(ctx->queue);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
@@ -413,12 +511,24 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
         free(ctx->buffer);
+        free(ctx->queue);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->head = 0;
+    ctx->count = 0;
+    ctx->pos = 0;
+    ctx->pos_valid = 0;
+    ctx->scanned = 0;
+    ctx->error = 0;
+    ctx->stop = 0;
+    ctx->thread_started = 0;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
     return ctx;
 }
 
@@ -431,76 +541,259 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off64_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
+/* Returns the first eraseblock at or after pos that isn't known bad, or
+ * -1 if the partition ends first.  Bad blocks are reported the first
+ * time they are passed over.
+ */
+static off64_t next_good_block(MtdWriteContext *ctx, off64_t pos)
 {
     const MtdPartition *partition = ctx->partition;
-    int fd = ctx->fd;
-
-    off64_t pos = TEMP_FAILURE_RETRY(lseek64(fd, 0, SEEK_CUR));
-    if (pos == (off64_t) -1) {
-        printf("mtd: write_block: couldn't SEEK_CUR: %s\n", strerror(errno));
-        return -1;
-    }
-
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        off64_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+        int ret = get_bad_block(partition, ctx->fd, pos);
+        if (ret == 0 || (ret == -1 && errno == EOPNOTSUPP)) {
+            return pos;
+        }
+        if (pos >= ctx->scanned) {
             add_bad_block_offset(ctx, pos);
             fprintf(stderr,
                     "mtd: not writing bad block at 0x%08llx (ret %d): %s\n",
                     pos, ret, strerror(errno));
-            pos += partition->erase_size;
-            continue;  // Don't try to erase known factory-bad blocks.
+            ctx->scanned = pos + size;
         }
+        pos += size;  // Don't try to erase known factory-bad blocks.
+    }
+    return -1;
+}
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = size;
-        int retry;
-        for (retry = 0; retry < 2; ++retry) {
+/* Writes the n queued eraseblocks from slot first on, starting at *ppos,
+ * and leaves *ppos after the last one.  Every block gets the treatment
+ * write_block() used to give it on its own: erase, write, read back and
+ * compare, once more if any step fails, then give up on that eraseblock
+ * and move the data to the next one.  Here each step is done for the
+ * whole batch before the next, so the erases run ahead of the writes and
+ * the read-back is a few large reads.  When a block fails, the blocks
+ * queued behind it are written again after it.
+ */
+static int write_blocks(MtdWriteContext *ctx, int first, int n, off64_t *ppos)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    ssize_t size = partition->erase_size;
+    off64_t where[MTD_WRITE_MAX_SLOTS];
+    int retry[MTD_WRITE_MAX_SLOTS];
+    off64_t pos = *ppos;
+    int done = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        where[i] = -1;
+        retry[i] = 0;
+    }
+
+    while (done < n) {
+        int end;
+        int failed = -1;
+
+        // Place the blocks on good eraseblocks and erase them all.
+        for (end = done; end < n; ++end) {
+            pos = next_good_block(ctx, pos);
+            if (pos == -1) break;
+            if (where[end] != pos) retry[end] = 0;  // Retries count per eraseblock.
+            where[end] = pos;
+            pos += size;
+
+            struct erase_info_user erase_info;
+            erase_info.start = where[end];
+            erase_info.length = size;
             if (ioctl(fd, MEMERASE, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08llx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+                        where[end], strerror(errno));
+                failed = end;
+                break;
             }
-            if (TEMP_FAILURE_RETRY(lseek64(fd, pos, SEEK_SET)) != pos ||
-                TEMP_FAILURE_RETRY(write(fd, data, size)) != size) {
+        }
+
+        for (i = done; i < end; ++i) {
+            const char *data = ctx->queue + (size_t) ((first + i) % ctx->slots) * size;
+            if (TEMP_FAILURE_RETRY(pwrite64(fd, data, size, where[i])) != size) {
                 fprintf(stderr, "mtd: write error at 0x%08llx (%s)\n",
-                        pos, strerror(errno));
+                        where[i], strerror(errno));
             }
+        }
 
-            char verify[size];
-            if (TEMP_FAILURE_RETRY(lseek64(fd, pos, SEEK_SET)) != pos ||
-                TEMP_FAILURE_RETRY(read(fd, verify, size)) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08llx (%s)\n",
-                        pos, strerror(errno));
+        // Read back runs of adjacent eraseblocks with one read each.
+        for (i = done; i < end; ) {
+            int run = 1;
+            while (i + run < end && where[i + run] == where[i] + run * size) ++run;
+            char *verify = ctx->verify + (size_t) i * size;
+            if (TEMP_FAILURE_RETRY(pread64(fd, verify, run * size, where[i])) == run * size) {
+                i += run;
                 continue;
             }
-            if (memcmp(data, verify, size) != 0) {
+            // Find out which block can't be read.
+            for (; run > 0; --run, ++i, verify += size) {
+                if (TEMP_FAILURE_RETRY(pread64(fd, verify, size, where[i])) != size) {
+                    fprintf(stderr, "mtd: re-read error at 0x%08llx (%s)\n",
+                            where[i], strerror(errno));
+                    failed = i;
+                    end = i;
+                    break;
+                }
+            }
+        }
+
+        for (i = done; i < end; ++i) {
+            const char *data = ctx->queue + (size_t) ((first + i) % ctx->slots) * size;
+            if (memcmp(data, ctx->verify + (size_t) i * size, size) != 0) {
                 fprintf(stderr, "mtd: verification error at 0x%08llx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+                        where[i], strerror(errno));
+                failed = i;
+                end = i;
+                break;
             }
+            if (retry[i] > 0) {
+                fprintf(stderr, "mtd: wrote block after %d retries\n", retry[i]);
+            }
+            fprintf(stderr, "mtd: successfully wrote block at %llx\n", where[i]);
+        }
+        done = end;
 
-            if (retry > 0) {
-                fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
+        if (failed == -1) {
+            if (done < n) {
+                // Ran out of space on the device
+                errno = ENOSPC;
+                return -1;
             }
-            fprintf(stderr, "mtd: successfully wrote block at %llx\n", pos);
-            return 0;  // Success!
+            break;
         }
 
-        // Try to erase it once more as we give up on this block
-        add_bad_block_offset(ctx, pos);
-        fprintf(stderr, "mtd: skipping write block at 0x%08llx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
-        pos += partition->erase_size;
+        // Everything from the failed block on goes again.
+        pos = where[failed];
+        if (++retry[failed] == 2) {
+            // Try to erase it once more as we give up on this block
+            add_bad_block_offset(ctx, pos);
+            fprintf(stderr, "mtd: skipping write block at 0x%08llx\n", pos);
+            struct erase_info_user erase_info;
+            erase_info.start = pos;
+            erase_info.length = size;
+            ioctl(fd, MEMERASE, &erase_info);
+            retry[failed] = 0;
+            pos += size;
+        }
     }
 
-    // Ran out of space on the device
-    errno = ENOSPC;
-    return -1;
+    *ppos = pos;
+    return 0;
+}
+
+static void *write_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) cookie;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (1) {
+        while (ctx->count == 0 && !ctx->stop) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->count == 0) break;
+
+        // The queued slots are ours until count drops; the caller only
+        // fills slots past them.
+        int first = ctx->head;
+        int n = ctx->count;
+        off64_t pos = ctx->pos;
+        int failed = ctx->error != 0;
+        pthread_mutex_unlock(&ctx->lock);
+
+        int err = 0;
+        if (!failed && write_blocks(ctx, first, n, &pos) != 0) {
+            err = errno;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->pos = pos;
+        if (err != 0 && ctx->error == 0) ctx->error = err;
+        ctx->head = (first + n) % ctx->slots;
+        ctx->count -= n;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Hands a copy of one eraseblock to the writer thread.  Fails with the
+ * error of any earlier block that couldn't be written.
+ */
+static int queue_block(MtdWriteContext *ctx, const char *data)
+{
+    size_t size = ctx->partition->erase_size;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->pos_valid) {
+        // Nothing is queued: pick up where the fd was left.
+        ctx->pos = TEMP_FAILURE_RETRY(lseek64(ctx->fd, 0, SEEK_CUR));
+        if (ctx->pos == (off64_t) -1) {
+            printf("mtd: write_block: couldn't SEEK_CUR: %s\n", strerror(errno));
+            pthread_mutex_unlock(&ctx->lock);
+            return -1;
+        }
+        ctx->pos_valid = 1;
+    }
+    if (!ctx->thread_started) {
+        int err = pthread_create(&ctx->thread, NULL, write_thread, ctx);
+        if (err != 0) {
+            fprintf(stderr, "mtd: couldn't start writer thread: %s\n", strerror(err));
+            pthread_mutex_unlock(&ctx->lock);
+            errno = err;
+            return -1;
+        }
+        ctx->thread_started = 1;
+    }
+    while (ctx->count == ctx->slots && ctx->error == 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    if (ctx->error != 0) {
+        errno = ctx->error;
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    int slot = (ctx->head + ctx->count) % ctx->slots;
+    pthread_mutex_unlock(&ctx->lock);
+
+    memcpy(ctx->queue + slot * size, data, size);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->count++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/* Waits for the queued blocks to be written and leaves the fd's offset
+ * after them, for everything that doesn't go through the queue.
+ */
+static int sync_blocks(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->count > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int err = ctx->error;
+    int pos_valid = ctx->pos_valid;
+    off64_t pos = ctx->pos;
+    ctx->pos_valid = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (pos_valid && TEMP_FAILURE_RETRY(lseek64(ctx->fd, pos, SEEK_SET)) != pos) {
+        printf("mtd: couldn't seek to 0x%08llx: %s\n", pos, strerror(errno));
+        return -1;
+    }
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
 }
 
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
@@ -518,13 +811,13 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
         // If a complete block was accumulated, write it
         if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
+            if (queue_block(ctx, ctx->buffer)) return -1;
             ctx->stored = 0;
         }
 
-        // Write complete blocks directly from the user's buffer
+        // Queue complete blocks straight from the user's buffer
         while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
+            if (queue_block(ctx, data + wrote)) return -1;
             wrote += ctx->partition->erase_size;
         }
     }
@@ -537,6 +830,8 @@ int mtd_write_block_ex(MtdWriteContext *ctx, const char *data, off64_t addr)
     const MtdPartition *partition = ctx->partition;
     int fd = ctx->fd;
 
+    if (sync_blocks(ctx)) return -1;
+
     off64_t pos = lseek64(fd, addr, SEEK_SET);
     if (pos == (off64_t) -1) return 1;
 
@@ -544,8 +839,7 @@ int mtd_write_block_ex(MtdWriteContext *ctx, const char *data, off64_t addr)
 
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        off64_t bpos = pos;
-        if (ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (get_bad_block(partition, fd, pos) > 0) {
             add_bad_block_offset(ctx, pos);
             fprintf(stderr, "mtd: not writing bad block at 0x%08llx\n", pos);
             pos += partition->erase_size;
@@ -570,7 +864,7 @@ int mtd_write_block_ex(MtdWriteContext *ctx, const char *data, off64_t addr)
                         pos, strerror(errno));
             }
 
-            char verify[size];
+            char *verify = ctx->verify;
             fprintf(stdout, "[%s] read back\n", __func__);
             if (lseek64(fd, pos, SEEK_SET) != pos ||
                 read(fd, verify, size) != size) {
@@ -609,6 +903,8 @@ int mtd_write_block_ex(MtdWriteContext *ctx, const char *data, off64_t addr)
 
 int mtd_write_data_ex(MtdWriteContext *ctx, const char *data, size_t size, off64_t offset)
 {
+    if (sync_blocks(ctx)) return -1;
+
     off64_t pos = lseek64(ctx->fd, offset, SEEK_SET);
     if (pos != offset)  {
         fprintf(stderr, "can not move file pointer %llX %llX\n", pos, offset);
@@ -629,10 +925,13 @@ off64_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        if (queue_block(ctx, ctx->buffer)) return -1;
         ctx->stored = 0;
     }
 
+    // Also reports blocks that failed after mtd_write_data() returned.
+    if (sync_blocks(ctx)) return -1;
+
     off64_t pos = TEMP_FAILURE_RETRY(lseek64(ctx->fd, 0, SEEK_CUR));
     if ((off_t) pos == (off_t) -1) {
         printf("mtd_erase_blocks: couldn't SEEK_CUR: %s\n", strerror(errno));
@@ -648,8 +947,7 @@ off64_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        off64_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (get_bad_block(ctx->partition, ctx->fd, pos) > 0) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08llx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
@@ -672,15 +970,30 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off64_t) -1) r = -1;
+
+    if (ctx->thread_started) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stop = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->thread, NULL);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
     if (close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
     free(ctx->buffer);
+    free(ctx->queue);
+    free(ctx->verify);
     free(ctx);
     return r;
 }
 
 int mtd_write_ex(MtdWriteContext *ctx, const char *data, size_t size, off64_t offset)
 {
+    if (sync_blocks(ctx)) return -1;
+
     off64_t pos = lseek64(ctx->fd, offset, SEEK_SET);
     if (pos != offset)  {
         fprintf(stderr, "can not move file pointer %llX %llX\n", pos, offset);
@@ -696,6 +1009,8 @@ int mtd_write_ex(MtdWriteContext *ctx, const char *data, size_t size, off64_t of
 
 off64_t mtd_erase(MtdWriteContext *ctx, off64_t pos)
 {
+        if (sync_blocks(ctx)) return -1;
+
         struct erase_info_user erase_info;
         erase_info.start = (int)pos;
         erase_info.length = ctx->partition->erase_size;
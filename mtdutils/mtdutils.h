@@ -46,7 +46,9 @@ int mtd_partition_info(const MtdPartition *partition,
         size_t *total_size, size_t *erase_size, size_t *write_size);
 
 /* read or write raw data from a partition, starting at the beginning.
- * skips bad blocks as best we can.
+ * skips bad blocks as best we can.  mtd_write_data() hands complete
+ * blocks to a writer thread; a block that can't be written fails a later
+ * call, mtd_erase_blocks() or mtd_write_close().
  */
 typedef struct MtdReadContext MtdReadContext;
 typedef struct MtdWriteContext MtdWriteContext;
@@ -19,6 +19,7 @@ include $(CLEAR_VARS)
 otafault_static_libs := \
     libbase \
     libminzip \
+    libotatrace \
     libz \
     libselinux
 
@@ -18,13 +18,18 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "ota_io.h"
+#include "otatrace/trace.h"
 
+// The updater does I/O on several threads while the main thread opens
+// and closes files, so the cache and the fault names are guarded.
+static pthread_mutex_t filename_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 static std::map<intptr_t, const char*> filename_cache;
 static std::string read_fault_file_name = "";
 static std::string write_fault_file_name = "";
@@ -36,6 +41,31 @@ static bool get_hit_file(const char* cached_path, std::string ffn) {
         : !strncmp(cached_path, ffn.c_str(), strlen(cached_path));
 }
 
+// Returns true if the I/O on the file opened as key is the one that has
+// to fail, and clears the fault so that it hits only once.
+static bool take_fault(intptr_t key, std::string* fault_file_name) {
+    pthread_mutex_lock(&filename_cache_lock);
+    auto cached = filename_cache.find(key);
+    bool hit = cached != filename_cache.end() && get_hit_file(cached->second, *fault_file_name);
+    if (hit) {
+        *fault_file_name = "";
+    }
+    pthread_mutex_unlock(&filename_cache_lock);
+    return hit;
+}
+
+static void cache_filename(intptr_t key, const char* path) {
+    pthread_mutex_lock(&filename_cache_lock);
+    filename_cache[key] = path;
+    pthread_mutex_unlock(&filename_cache_lock);
+}
+
+static void forget_filename(intptr_t key) {
+    pthread_mutex_lock(&filename_cache_lock);
+    filename_cache.erase(key);
+    pthread_mutex_unlock(&filename_cache_lock);
+}
+
 void ota_set_fault_files() {
     if (should_fault_inject(OTAIO_READ)) {
         read_fault_file_name = fault_fname(OTAIO_READ);
@@ -53,45 +83,42 @@ bool have_eio_error = false;
 int ota_open(const char* path, int oflags) {
     // Let the caller handle errors; we do not care if open succeeds or fails
     int fd = open(path, oflags);
-    filename_cache[fd] = path;
+    cache_filename(fd, path);
     return fd;
 }
 
 int ota_open(const char* path, int oflags, mode_t mode) {
     int fd = open(path, oflags, mode);
-    filename_cache[fd] = path;
+    cache_filename(fd, path);
     return fd; }
 
 FILE* ota_fopen(const char* path, const char* mode) {
     FILE* fh = fopen(path, mode);
-    filename_cache[(intptr_t)fh] = path;
+    cache_filename((intptr_t)fh, path);
     return fh;
 }
 
 int ota_close(int fd) {
     // descriptors can be reused, so make sure not to leave them in the cache
-    filename_cache.erase(fd);
+    forget_filename(fd);
     return close(fd);
 }
 
 int ota_fclose(FILE* fh) {
-    filename_cache.erase((intptr_t)fh);
+    forget_filename((intptr_t)fh);
     return fclose(fh);
 }
 
 size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
     if (should_fault_inject(OTAIO_READ)) {
-        auto cached = filename_cache.find((intptr_t)stream);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, read_fault_file_name)) {
-            read_fault_file_name = "";
+        if (take_fault((intptr_t)stream, &read_fault_file_name)) {
             errno = EIO;
             have_eio_error = true;
             return 0;
         }
     }
     size_t status = fread(ptr, size, nitems, stream);
+    trace_io(status * size);
     if (status != nitems && errno == EIO) {
         have_eio_error = true;
     }
@@ -100,17 +127,14 @@ size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
 
 ssize_t ota_read(int fd, void* buf, size_t nbyte) {
     if (should_fault_inject(OTAIO_READ)) {
-        auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end()
-                && get_hit_file(cached_path, read_fault_file_name)) {
-            read_fault_file_name = "";
+        if (take_fault(fd, &read_fault_file_name)) {
             errno = EIO;
             have_eio_error = true;
             return -1;
         }
     }
     ssize_t status = read(fd, buf, nbyte);
+    trace_io(status > 0 ? status : 0);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
     }
@@ -119,17 +143,14 @@ ssize_t ota_read(int fd, void* buf, size_t nbyte) {
 
 size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
     if (should_fault_inject(OTAIO_WRITE)) {
-        auto cached = filename_cache.find((intptr_t)stream);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, write_fault_file_name)) {
-            write_fault_file_name = "";
+        if (take_fault((intptr_t)stream, &write_fault_file_name)) {
             errno = EIO;
             have_eio_error = true;
             return 0;
         }
     }
     size_t status = fwrite(ptr, size, count, stream);
+    trace_io(status * size);
     if (status != count && errno == EIO) {
         have_eio_error = true;
     }
@@ -138,17 +159,62 @@ size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
     if (should_fault_inject(OTAIO_WRITE)) {
-        auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, write_fault_file_name)) {
-            write_fault_file_name = "";
+        if (take_fault(fd, &write_fault_file_name)) {
             errno = EIO;
             have_eio_error = true;
             return -1;
         }
     }
     ssize_t status = write(fd, buf, nbyte);
+    trace_io(status > 0 ? status : 0);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+ssize_t ota_pread(int fd, void* buf, size_t nbyte, off64_t offset) {
+    if (should_fault_inject(OTAIO_READ)) {
+        if (take_fault(fd, &read_fault_file_name)) {
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pread64(fd, buf, nbyte, offset);
+    trace_io(status > 0 ? status : 0);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+ssize_t ota_pwrite(int fd, const void* buf, size_t nbyte, off64_t offset) {
+    if (should_fault_inject(OTAIO_WRITE)) {
+        if (take_fault(fd, &write_fault_file_name)) {
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pwrite64(fd, buf, nbyte, offset);
+    trace_io(status > 0 ? status : 0);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    if (should_fault_inject(OTAIO_WRITE)) {
+        if (take_fault(fd, &write_fault_file_name)) {
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pwritev64(fd, iov, iovcnt, offset);
+    trace_io(status > 0 ? status : 0);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
     }
@@ -157,17 +223,32 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
 
 int ota_fsync(int fd) {
     if (should_fault_inject(OTAIO_FSYNC)) {
-        auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
-        if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, fsync_fault_file_name)) {
-            fsync_fault_file_name = "";
+        if (take_fault(fd, &fsync_fault_file_name)) {
             errno = EIO;
             have_eio_error = true;
             return -1;
         }
     }
+    TraceScope trace(TRACE_FSYNC);
     int status = fsync(fd);
+    trace_io(0);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+int ota_syncfs(int fd) {
+    if (should_fault_inject(OTAIO_FSYNC)) {
+        if (take_fault(fd, &fsync_fault_file_name)) {
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    TraceScope trace(TRACE_FSYNC);
+    int status = syncfs(fd);
+    trace_io(0);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
     }
@@ -25,6 +25,8 @@
 
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define OTAIO_CACHE_FNAME "/cache/saved.file"
 
@@ -48,6 +50,15 @@ size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream);
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte);
 
+ssize_t ota_pread(int fd, void* buf, size_t nbyte, off64_t offset);
+
+ssize_t ota_pwrite(int fd, const void* buf, size_t nbyte, off64_t offset);
+
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+
 int ota_fsync(int fd);
 
+// Flushes the whole filesystem containing fd; shares the fsync fault point.
+int ota_syncfs(int fd);
+
 #endif
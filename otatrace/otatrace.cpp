@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: decode trace files written by recovery, updater and uncrypt
+// (see trace.h), e.g. /cache/recovery/last_trace.
+//
+//   otatrace [-v] FILE...
+//
+// Prints a per-process, per-phase summary; -v also lists every record.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "trace.h"
+
+static std::string phase_name(uint16_t phase) {
+    switch (phase) {
+        case TRACE_PACKAGE_MAP:     return "package_map";
+        case TRACE_VERIFY:          return "verify";
+        case TRACE_FORMAT:          return "format";
+        case TRACE_FSYNC:           return "fsync";
+        case TRACE_STASH_LOAD:      return "stash_load";
+        case TRACE_STASH_WRITE:     return "stash_write";
+        case TRACE_UNCRYPT:         return "uncrypt";
+        case TRACE_UPDATE_BINARY:   return "update_binary";
+        case TRACE_CMD_BSDIFF:      return "cmd_bsdiff";
+        case TRACE_CMD_ERASE:       return "cmd_erase";
+        case TRACE_CMD_FREE:        return "cmd_free";
+        case TRACE_CMD_IMGDIFF:     return "cmd_imgdiff";
+        case TRACE_CMD_MOVE:        return "cmd_move";
+        case TRACE_CMD_NEW:         return "cmd_new";
+        case TRACE_CMD_STASH:       return "cmd_stash";
+        case TRACE_CMD_ZERO:        return "cmd_zero";
+    }
+    return std::to_string(phase);
+}
+
+struct Totals {
+    uint64_t count = 0;
+    uint64_t ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t bytes = 0;
+    uint64_t calls = 0;
+};
+
+struct Process {
+    std::string name;
+    uint32_t pid;
+    uint64_t dropped = 0;
+    std::map<uint16_t, Totals> phases;
+};
+
+static double mb_per_s(uint64_t bytes, uint64_t ns) {
+    return (ns == 0) ? 0.0 : (bytes / 1048576.0) / (ns / 1e9);
+}
+
+// Reads every flushed block in the file.  Returns false if the file
+// can't be read or doesn't start with a trace block; a truncated block
+// at the end (from an interrupted flush) is reported and skipped.
+static bool decode_file(const char* path, bool verbose, std::vector<Process>* processes) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == nullptr) {
+        fprintf(stderr, "can't open %s\n", path);
+        return false;
+    }
+
+    bool ok = true;
+    int blocks = 0;
+    trace_file_header hdr;
+    while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+        if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != TRACE_VERSION || hdr.record_size < sizeof(trace_record)) {
+            fprintf(stderr, "%s: bad trace block %d\n", path, blocks);
+            ok = (blocks > 0);
+            break;
+        }
+        ++blocks;
+
+        std::string name(hdr.process, strnlen(hdr.process, sizeof(hdr.process)));
+        Process* proc = nullptr;
+        for (Process& p : *processes) {
+            if (p.pid == hdr.pid && p.name == name) proc = &p;
+        }
+        if (proc == nullptr) {
+            processes->push_back(Process());
+            proc = &processes->back();
+            proc->name = name;
+            proc->pid = hdr.pid;
+        }
+        proc->dropped += hdr.dropped;
+
+        std::vector<uint8_t> buf(hdr.record_size);
+        uint32_t i = 0;
+        for (; i < hdr.count && fread(buf.data(), buf.size(), 1, fp) == 1; ++i) {
+            trace_record rec;
+            memcpy(&rec, buf.data(), sizeof(rec));
+
+            Totals& t = proc->phases[rec.phase];
+            ++t.count;
+            t.ns += rec.duration_ns;
+            if (rec.duration_ns > t.max_ns) t.max_ns = rec.duration_ns;
+            t.bytes += rec.bytes;
+            t.calls += rec.calls;
+
+            if (verbose) {
+                printf("%-10s %6u %14.3f ms  %-14s %12.3f ms %12" PRIu64 " B %8u calls\n",
+                       name.c_str(), hdr.pid, rec.start_ns / 1e6,
+                       phase_name(rec.phase).c_str(), rec.duration_ns / 1e6, rec.bytes,
+                       rec.calls);
+            }
+        }
+        if (i < hdr.count) {
+            fprintf(stderr, "%s: block %d truncated after %u of %u records\n",
+                    path, blocks, i, hdr.count);
+            break;
+        }
+    }
+
+    fclose(fp);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt != 'v') {
+            fprintf(stderr, "usage: %s [-v] FILE...\n", argv[0]);
+            return 2;
+        }
+        verbose = true;
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-v] FILE...\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<Process> processes;
+    int result = 0;
+    for (int i = optind; i < argc; ++i) {
+        if (!decode_file(argv[i], verbose, &processes)) result = 1;
+    }
+
+    for (const Process& p : processes) {
+        printf("%s (pid %u)\n", p.name.c_str(), p.pid);
+        if (p.dropped > 0) {
+            printf("  %" PRIu64 " records dropped\n", p.dropped);
+        }
+        printf("  %-16s %8s %12s %10s %14s %10s %10s\n",
+               "phase", "count", "total ms", "max ms", "bytes", "calls", "MB/s");
+        for (const auto& it : p.phases) {
+            const Totals& t = it.second;
+            printf("  %-16s %8" PRIu64 " %12.3f %10.3f %14" PRIu64 " %10" PRIu64 " %10.1f\n",
+                   phase_name(it.first).c_str(), t.count, t.ns / 1e6, t.max_ns / 1e6, t.bytes, t.calls,
+                   mb_per_s(t.bytes, t.ns));
+        }
+    }
+
+    return result;
+}
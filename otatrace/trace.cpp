@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "trace.h"
+
+// 128 KiB of records; a full ring is flushed if there is a file.
+#define TRACE_RING_SIZE 4096
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_record ring[TRACE_RING_SIZE];
+static uint64_t ring_head;      // records ever added
+static uint64_t ring_tail;      // oldest record not yet flushed or dropped
+static uint32_t ring_dropped;   // since the last flush
+static char trace_path[PATH_MAX];
+static char trace_process[sizeof(((trace_file_header*)0)->process)];
+static bool trace_warned;       // only complain about the file once
+
+static std::atomic<uint64_t> io_bytes(0);
+static std::atomic<uint64_t> io_calls(0);
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Must be called with trace_lock held.
+static bool flush_locked() {
+    if (trace_path[0] == '\0') return false;
+    if (ring_head == ring_tail && ring_dropped == 0) return true;
+
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        if (!trace_warned) {
+            fprintf(stderr, "failed to open %s: %s\n", trace_path, strerror(errno));
+            trace_warned = true;
+        }
+        return false;
+    }
+
+    trace_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(trace_record);
+    hdr.pid = getpid();
+    hdr.count = ring_head - ring_tail;
+    hdr.dropped = ring_dropped;
+    memcpy(hdr.process, trace_process, sizeof(hdr.process));
+
+    // The records may wrap around the end of the ring.  recovery and
+    // the updater share a file, so each block goes out in one append.
+    size_t first = ring_tail % TRACE_RING_SIZE;
+    size_t n1 = (first + hdr.count > TRACE_RING_SIZE) ? TRACE_RING_SIZE - first : hdr.count;
+    struct iovec iov[3];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = &ring[first];
+    iov[1].iov_len = n1 * sizeof(trace_record);
+    iov[2].iov_base = &ring[0];
+    iov[2].iov_len = (hdr.count - n1) * sizeof(trace_record);
+    size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    bool ok = TEMP_FAILURE_RETRY(writev(fd, iov, 3)) == static_cast<ssize_t>(total);
+    if (close(fd) == -1) ok = false;
+    if (!ok) {
+        if (!trace_warned) {
+            fprintf(stderr, "failed to write %s: %s\n", trace_path, strerror(errno));
+            trace_warned = true;
+        }
+        return false;
+    }
+
+    ring_tail = ring_head;
+    ring_dropped = 0;
+    return true;
+}
+
+static void flush_at_exit() {
+    trace_flush();
+}
+
+void trace_init(const char* process, const char* path) {
+    static bool registered = false;
+
+    pthread_mutex_lock(&trace_lock);
+    strncpy(trace_process, process, sizeof(trace_process));
+    strncpy(trace_path, path, sizeof(trace_path) - 1);
+    if (!registered) {
+        atexit(flush_at_exit);
+        registered = true;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+bool trace_flush() {
+    pthread_mutex_lock(&trace_lock);
+    bool ok = flush_locked();
+    pthread_mutex_unlock(&trace_lock);
+    return ok;
+}
+
+void trace_io(uint64_t bytes, uint32_t calls) {
+    io_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    io_calls.fetch_add(calls, std::memory_order_relaxed);
+}
+
+TraceScope::TraceScope(TracePhase phase) :
+    phase_(phase),
+    start_ns_(now_ns()),
+    start_bytes_(io_bytes.load(std::memory_order_relaxed)),
+    start_calls_(io_calls.load(std::memory_order_relaxed)),
+    extra_bytes_(0),
+    extra_calls_(0) {
+}
+
+void TraceScope::Add(uint64_t bytes, uint32_t calls) {
+    extra_bytes_ += bytes;
+    extra_calls_ += calls;
+}
+
+TraceScope::~TraceScope() {
+    trace_record rec;
+    rec.start_ns = start_ns_;
+    rec.duration_ns = now_ns() - start_ns_;
+    rec.bytes = io_bytes.load(std::memory_order_relaxed) - start_bytes_ + extra_bytes_;
+    rec.calls = io_calls.load(std::memory_order_relaxed) - start_calls_ + extra_calls_;
+    rec.phase = phase_;
+    rec.reserved = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (ring_head - ring_tail == TRACE_RING_SIZE && !flush_locked()) {
+        ++ring_tail;
+        ++ring_dropped;
+    }
+    ring[ring_head++ % TRACE_RING_SIZE] = rec;
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-phase timing for recovery, updater and uncrypt.
+ *
+ * A TraceScope records when a phase started, how long it took, and the
+ * bytes moved and I/O calls made while it was open.  Bytes and calls are
+ * reported through trace_io(); the ota_io wrappers do this for every
+ * read, write and sync, code doing its own I/O reports it itself.  The
+ * counters are process wide, so a scope also counts I/O done by other
+ * threads (and by scopes nested inside it) while it is open.
+ *
+ * Records are kept in a fixed-size ring in memory and appended to the
+ * file named by trace_init() by trace_flush(), when the ring fills up,
+ * and at exit.  Without trace_init() the oldest records are dropped.
+ * The host tool otatrace decodes the files.
+ */
+
+#ifndef _OTATRACE_TRACE_H_
+#define _OTATRACE_TRACE_H_
+
+#include <stdint.h>
+
+// Shared by recovery and the updater it runs.
+#define TEMPORARY_TRACE_FILE "/tmp/recovery.trace"
+
+// The numbering is part of the file format; only ever add to it.
+enum TracePhase {
+    TRACE_PACKAGE_MAP = 1,
+    TRACE_VERIFY = 2,
+    TRACE_FORMAT = 3,
+    TRACE_FSYNC = 4,
+    TRACE_STASH_LOAD = 5,
+    TRACE_STASH_WRITE = 6,
+    TRACE_UNCRYPT = 7,
+    TRACE_UPDATE_BINARY = 8,
+
+    // Transfer list commands.
+    TRACE_CMD_BSDIFF = 16,
+    TRACE_CMD_ERASE = 17,
+    TRACE_CMD_FREE = 18,
+    TRACE_CMD_IMGDIFF = 19,
+    TRACE_CMD_MOVE = 20,
+    TRACE_CMD_NEW = 21,
+    TRACE_CMD_STASH = 22,
+    TRACE_CMD_ZERO = 23,
+};
+
+// Each flush appends a trace_file_header followed by 'count'
+// trace_records, oldest first.  All fields are in host byte order.
+#define TRACE_MAGIC "OTAT"
+#define TRACE_VERSION 1
+
+struct trace_file_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;   // sizeof(trace_record)
+    uint32_t pid;
+    uint32_t count;         // records that follow
+    uint32_t dropped;       // records lost to a full ring before these
+    char process[12];       // NUL padded, not necessarily terminated
+};
+
+struct trace_record {
+    uint64_t start_ns;      // CLOCK_MONOTONIC
+    uint64_t duration_ns;
+    uint64_t bytes;
+    uint32_t calls;
+    uint16_t phase;         // TracePhase
+    uint16_t reserved;
+};
+
+// Names the process in the trace and sets the file records are appended
+// to.  Also arranges for a final flush at exit.
+void trace_init(const char* process, const char* path);
+
+// Appends the records collected since the last flush to the trace file.
+// Returns false if there is no file or it can't be written.
+bool trace_flush();
+
+// Accounts bytes and calls to every open TraceScope.
+void trace_io(uint64_t bytes, uint32_t calls = 1);
+
+class TraceScope {
+  public:
+    explicit TraceScope(TracePhase phase);
+    ~TraceScope();
+
+    // Accounts work that did not go through trace_io(), such as reading
+    // a mapped file.  Only this scope sees it.
+    void Add(uint64_t bytes, uint32_t calls = 0);
+
+  private:
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    TracePhase phase_;
+    uint64_t start_ns_;
+    uint64_t start_bytes_;
+    uint64_t start_calls_;
+    uint64_t extra_bytes_;
+    uint64_t extra_calls_;
+};
+
+#endif
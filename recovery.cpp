@@ -70,6 +70,7 @@
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
+#include "otatrace/trace.h"
 #include "roots.h"
 #include "ui.h"
 #include "unique_fd.h"
@@ -122,6 +123,7 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
 static const char *TEMPORARY_INSTALL_FILE = "/tmp/last_install";
 static const char *LAST_KMSG_FILE = "/cache/recovery/last_kmsg";
 static const char *LAST_LOG_FILE = "/cache/recovery/last_log";
+static const char *LAST_TRACE_FILE = "/cache/recovery/last_trace";
 static const int KEEP_LOG_COUNT = 10;
 // We will try to apply the update package 5 times at most in case of an I/O error.
 static const int EIO_RETRY_COUNT = 4;
@@ -541,6 +543,8 @@ void copy_logs() {
     copy_log_file(TEMPORARY_LOG_FILE, LOG_FILE, true);
     copy_log_file(TEMPORARY_LOG_FILE, LAST_LOG_FILE, false);
     copy_log_file(TEMPORARY_INSTALL_FILE, LAST_INSTALL_FILE, false);
+    trace_flush();
+    copy_log_file(TEMPORARY_TRACE_FILE, LAST_TRACE_FILE, false);
     save_kernel_log(LAST_KMSG_FILE);
     chmod(LOG_FILE, 0600);
     chown(LOG_FILE, 1000, 1000);   // system user
@@ -548,6 +552,7 @@ void copy_logs() {
     chown(LAST_KMSG_FILE, 1000, 1000);   // system user
     chmod(LAST_LOG_FILE, 0640);
     chmod(LAST_INSTALL_FILE, 0644);
+    chmod(LAST_TRACE_FILE, 0640);
     sync();
 }
 
@@ -1622,6 +1627,7 @@ int main(int argc, char **argv) {
     // redirect_stdio should be called only in non-sideload mode. Otherwise
     // we may have two logger instances with different timestamps.
     redirect_stdio(TEMPORARY_LOG_FILE);
+    trace_init("recovery", TEMPORARY_TRACE_FILE);
 
     printf("Starting recovery (pid %d) on %s", getpid(), ctime(&start));
 
@@ -14,8 +14,14 @@
 #include <time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <fs_mgr.h>
 
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include "common.h"
 #include "cutils/properties.h"
 #include "cutils/android_reboot.h"
@@ -151,12 +157,34 @@ static int test_bit_m(int x)
     return check_modify[x>>SHIFT]&(1<<(x&MASK));
 }
 
+// The manifest checksums are not plain CRC32s of the file: each 4 KiB
+// block is folded in as sum += crc32(sum, block), the way the fread()
+// loop this replaced computed them.  Files are read in larger pieces and
+// every block goes through the CRC32 and the MD5 while still in cache.
+#define CRC_BLOCK_SIZE 4096
+#define CRC_READ_SIZE (64 * CRC_BLOCK_SIZE)
+
+// Reads until size bytes, EOF or an error.  Returns the bytes read, or -1
+// if nothing could be read because of an error.
+static ssize_t read_chunk(int fd, unsigned char* buf, size_t size)
+{
+    size_t so_far = 0;
+    while (so_far < size) {
+        ssize_t r = TEMP_FAILURE_RETRY(read(fd, buf + so_far, size - so_far));
+        if (r < 0) {
+            if (so_far == 0)
+                return -1;
+            break;
+        }
+        if (r == 0)
+            break;
+        so_far += r;
+    }
+    return so_far;
+}
+
 static int file_crc_check( const char* path, unsigned int* nCS, unsigned char *nMd5)
 {
-    char buf[4*1024];
-    FILE *fp = 0;
-    int rRead_count = 0;
-    int i = 0;
     *nCS = 0;
 
 #ifdef MTK_ROOT_ADVANCE_CHECK
@@ -183,322 +211,281 @@ static int file_crc_check( const char* path, unsigned int* nCS, unsigned char *n
         return 0;
     }
 
-    fp = fopen(path, "r");
-    if( fp == NULL )
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if( fd < 0 )
     {
         LOGE("\nfile_crc_check->path:%s ,fp is null\n", path);
         LOGE("\nfopen fail reason is %s\n",strerror(errno));
         return -1;
     }
-    while(!feof(fp))
-    {
-        memset(buf, 0x0, sizeof(buf));
-        rRead_count = fread(buf, 1, sizeof(buf), fp);
-        if( rRead_count <=0 )
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Most of /system is small files; don't allocate more than they need.
+    size_t buf_size = CRC_READ_SIZE;
+    if (S_ISREG(st.st_mode) && st.st_size < CRC_READ_SIZE) {
+        buf_size = (st.st_size + CRC_BLOCK_SIZE) / CRC_BLOCK_SIZE * CRC_BLOCK_SIZE;
+    }
+    std::vector<unsigned char> buf(buf_size);
+
+    while (true) {
+        ssize_t count = read_chunk(fd, buf.data(), buf.size());
+        if (count <= 0)
             break;
 
+        for (ssize_t off = 0; off < count; off += CRC_BLOCK_SIZE) {
+            size_t len = std::min<size_t>(CRC_BLOCK_SIZE, count - off);
 #ifdef MTK_ROOT_NORMAL_CHECK
-         *nCS += crc32(*nCS, buf, rRead_count);
+            *nCS += crc32_update(*nCS, &buf[off], len);
 #endif
 
 #ifdef MTK_ROOT_ADVANCE_CHECK
-         MD5Update(&md5,(unsigned char*)buf, rRead_count);
+            MD5Update(&md5, &buf[off], len);
 #endif
+        }
+        if (static_cast<size_t>(count) < buf.size())
+            break;
     }
 
 #ifdef MTK_ROOT_ADVANCE_CHECK
     MD5Final(&md5, nMd5);
 #endif
 
-    fclose(fp);
+    close(fd);
     return 0;
 }
 
-static int clear_selinux_file(char* path)
+// The decrypted manifest (TEMP_FILE_IN_RAM) is parsed once into memory
+// and indexed by path, instead of being re-read for every file on
+// /system.  A manifest name matches a path when the name ends with the
+// path, so the index is keyed by the part of each name starting at
+// "/system/", which is where every path handed to us starts.
+struct manifest_entry {
+    int number;
+    std::string name;
+    unsigned int crc;
+    unsigned char md5[MD5_LENGTH];
+};
+
+static std::vector<manifest_entry> manifest;
+static std::unordered_map<std::string, std::vector<size_t>> manifest_index;
+static bool manifest_loaded = false;
+
+static const char* manifest_key(const char* name)
+{
+    const char* key = strstr(name, SYSTEM_ROOT);
+    return key ? key : name;
+}
+
+static int load_manifest()
 {
-    int found=0;
-    int ret=0;
-    FILE *fp_info;
-    FILE *fp_new;
     char buf[512];
     char p_name[256];
-    unsigned char p_md[MD5_LENGTH*2];
-    char *p_cmp_name;
+    char p_md[256];
     unsigned int p_size;
     int p_number;
-    struct stat statbuf;
 
-    fp_info = fopen(TEMP_FILE_IN_RAM, "r");
-    if(fp_info)
-    {
-        if(fgets(buf, sizeof(buf), fp_info) != NULL)
-        {
-            while(fgets(buf, sizeof(buf), fp_info))
-            {
+    manifest.clear();
+    manifest_index.clear();
+    manifest_loaded = false;
 
-                if (sscanf(buf, "%d    %s    %u    %s", &p_number,p_name,&p_size,p_md) == 4)
-                {
+    FILE* fp_info = fopen(TEMP_FILE_IN_RAM, "r");
+    if (fp_info == NULL) {
+        LOGE("open %s error,error reason is %s\n",TEMP_FILE_IN_RAM,strerror(errno));
+        return CHECK_NO_KEY;
+    }
 
-                    //TODO:path[0] will be '\0' sometimes, and it should be '/'
-                    path[0] = '/';
-                    if(strstr(p_name,path)!=NULL)
-                    {
-                        p_cmp_name=strstr(p_name,path);
-                        if(strcmp(p_cmp_name,path)==0)
-                        {
-                            found=1;
-                            clear_bit(p_number);
-                        }
-                    }
-                }
+    // The first line is the header.
+    if (fgets(buf, sizeof(buf), fp_info) != NULL) {
+        while (fgets(buf, sizeof(buf), fp_info)) {
+            if (sscanf(buf, "%d    %255s    %u    %255s", &p_number, p_name, &p_size, p_md) != 4) {
+                continue;
             }
 
-            if(found==0)
-            {
-                LOGE("found a new file,filename is %s",path);
-                check_file_result->n_newfile+=1;
-
-                if(access(FILE_NEW_TMP,0)==-1)
-                {
-                    int fd_new=creat(FILE_NEW_TMP,0755);
-                }
-                fp_new=fopen(FILE_NEW_TMP, "a");
-                if(fp_new)
-                {
-                    fprintf(fp_new,"%s\n",path);
-                }
-                else
-                {
-                    LOGE("open %s error,error reason is %s\n",FILE_NEW_TMP,strerror(errno));
-                    return CHECK_ADD_NEW_FILE;
-                }
-                checkResult=false;
+            // sscanf() stops at blanks, so take the name from between the tabs.
+            char *p1 = strchr(buf, '\t');
+            char *p2 = p1 ? strchr(p1 + 1, '\t') : NULL;
+            if (p1 == NULL || p2 == NULL) {
+                printf("strchr fail for '\t' buf = %s\n", buf);
                 fclose(fp_info);
-                fclose(fp_new);
-                return CHECK_ADD_NEW_FILE;
+                return CHECK_FAIL;
             }
+
+            manifest_entry entry;
+            entry.number = p_number;
+            entry.name.assign(p1 + 1, p2 - p1 - 1);
+            entry.crc = p_size;
+
+            unsigned char md[MD5_LENGTH*2];
+            memset(md, '0', sizeof(md));
+            memcpy(md, p_md, std::min(strlen(p_md), sizeof(md)));
+            if (md[1] == '\0')
+                md[1] = '0';
+            hextoi_md5(md);
+            memcpy(entry.md5, md, MD5_LENGTH);
+
+            manifest_index[manifest_key(entry.name.c_str())].push_back(manifest.size());
+            manifest.push_back(entry);
         }
     }
-    else
-    {
-        LOGE("open %s error,error reason is %s\n",TEMP_FILE_IN_RAM,strerror(errno));
-        return CHECK_NO_KEY;
-    }
+
     fclose(fp_info);
+    manifest_loaded = true;
     return CHECK_PASS;
 }
 
-static int clear_selinux_dir(char const* path)
+static const std::vector<size_t>* find_manifest_entries(const char* path)
+{
+    auto it = manifest_index.find(manifest_key(path));
+    return it == manifest_index.end() ? NULL : &it->second;
+}
+
+static int add_new_file(const char* path)
 {
-    int ret=0;
-    FILE *fp_info;
     FILE *fp_new;
-    char buf[512];
-    char p_name[256];
-    unsigned char p_md[MD5_LENGTH*2];
-    char *p_cmp_name;
-    unsigned int p_size;
-    int p_number;
-    struct stat statbuf;
 
-    fp_info = fopen(TEMP_FILE_IN_RAM, "r");
-    if(fp_info)
-    {
-        if(fgets(buf, sizeof(buf), fp_info) != NULL)
-        {
-            while(fgets(buf, sizeof(buf), fp_info))
-            {
-                if (sscanf(buf, "%d    %s    %u    %s", &p_number,p_name,&p_size,p_md) == 4)
-                {
+    LOGE("found a new file,filename is %s",path);
+    check_file_result->n_newfile+=1;
 
-                    //TODO:path[0] will be '\0' sometimes, and it should be '/'
-                    //path[0] = '/';
-                    if(strstr(p_name,path)!=NULL)
-                    {
-                        p_cmp_name=strstr(p_name,path);
-			LOGE("%s file is selinux protected,just pass\n",p_cmp_name);
-                        clear_bit(p_number);
-                    }
-		    else
-		    {
-			//LOGE("not found %s in orignal file,please check!",path);
-			continue;
-		    }
-                }
-            }
-        }
+    if(access(FILE_NEW_TMP,0)==-1)
+    {
+        int fd_new=creat(FILE_NEW_TMP,0755);
+        if (fd_new >= 0)
+            close(fd_new);
+    }
+    fp_new=fopen(FILE_NEW_TMP, "a");
+    if(fp_new)
+    {
+        fprintf(fp_new,"%s\n",path);
+        fclose(fp_new);
     }
     else
     {
-        LOGE("open %s error,error reason is %s\n",TEMP_FILE_IN_RAM,strerror(errno));
-        return CHECK_NO_KEY;
+        LOGE("open %s error,error reason is %s\n",FILE_NEW_TMP,strerror(errno));
+        return CHECK_ADD_NEW_FILE;
     }
-    fclose(fp_info);
-    return CHECK_PASS;
+
+    checkResult=false;
+    return CHECK_ADD_NEW_FILE;
 }
 
+static int clear_selinux_file(const char* path)
+{
+    if (!manifest_loaded)
+        return CHECK_NO_KEY;
+
+    const std::vector<size_t>* hits = find_manifest_entries(path);
+    if (hits == NULL)
+        return add_new_file(path);
 
+    for (size_t idx : *hits)
+        clear_bit(manifest[idx].number);
+    return CHECK_PASS;
+}
 
-static int check_reall_file(char* path, unsigned int nCS, char* nMd5)
+static int clear_selinux_dir(char const* path)
 {
-    int found=0;
-    int ret=0;
-    FILE *fp_info;
-    FILE *fp_new;
-    char buf[512];
-    char p_name[256];
-    unsigned char p_md[MD5_LENGTH*2];
-    char *p_cmp_name;
-    unsigned int p_size;
-    int p_number;
-    struct stat statbuf;
+    if (!manifest_loaded)
+        return CHECK_NO_KEY;
 
-    fp_info = fopen(TEMP_FILE_IN_RAM, "r");
-    if(fp_info)
-    {
-        if(fgets(buf, sizeof(buf), fp_info) != NULL)
-        {
-            //while(fgets(buf, sizeof(buf), fp_info)&&!found)
-            while(fgets(buf, sizeof(buf), fp_info))
-            {
-                memset(p_md, '0', sizeof(p_md));
-                if (sscanf(buf, "%d    %s    %u    %s", &p_number,p_name,&p_size,p_md) == 4)
-                {
-                    //TODO: can not get correct p_name from sscanf(), so use below instead
-                    char *p1 = strchr(buf, '\t');
-                    if(p1 == NULL) {
-                      printf("strchr fail for '\t' buf = %s\n", buf);
-                      fclose(fp_info);
-                      return CHECK_FAIL;
-                    }
+    for (const manifest_entry& entry : manifest) {
+        const char* p_cmp_name = strstr(entry.name.c_str(), path);
+        if (p_cmp_name != NULL) {
+            LOGE("%s file is selinux protected,just pass\n",p_cmp_name);
+            clear_bit(entry.number);
+        }
+    }
+    return CHECK_PASS;
+}
 
-                    char *p2 = strchr(p1+1, '\t');
+static int check_reall_file(const char* path, unsigned int nCS, const unsigned char* nMd5)
+{
+    struct stat statbuf;
 
-                    if(p1&&p2)
-                        memcpy(p_name, p1+1, p2-p1-1);
+    if (!manifest_loaded)
+        return CHECK_NO_KEY;
 
-                    //TODO:path[0] will be '\0' sometimes, and it should be '/'
-                    path[0] = '/';
-                    if(strstr(p_name,path)!=NULL)
-                    {
-                        p_cmp_name=strstr(p_name,path);
+    const std::vector<size_t>* hits = find_manifest_entries(path);
+    if (hits == NULL)
+        return add_new_file(path);
 
-                        if(p_cmp_name == NULL) {
-                           printf("strstr path fail p_name = %s, path = %s\n", p_name, path);
-                           fclose(fp_info);
-                           return CHECK_FAIL;
-                        }
-                        if(strcmp(p_cmp_name,path)==0)
-                        {
-                            found=1;
-                            int rettmp = 0;
-                            clear_bit(p_number);
+    for (size_t idx : *hits) {
+        const manifest_entry& entry = manifest[idx];
+        int rettmp = 0;
+        clear_bit(entry.number);
 #ifdef MTK_ROOT_NORMAL_CHECK
-                            if(p_size==nCS)
-                            {
-                                //printf("%s crc check pass\n",path);
-                            }
-                            else
-                            {
-                                printf("expected crc is %u\n",p_size);
-                                printf("computed crc is %u\n",nCS);
-                                printf("%s is modifyed\n",path);
-                                //fclose(fp_info);
-                                rettmp = CHECK_FILE_NOT_MATCH;
-                            }
+        if(entry.crc != nCS)
+        {
+            printf("expected crc is %u\n",entry.crc);
+            printf("computed crc is %u\n",nCS);
+            printf("%s is modifyed\n",path);
+            rettmp = CHECK_FILE_NOT_MATCH;
+        }
 #endif
 
 #ifdef MTK_ROOT_ADVANCE_CHECK
-                            if(p_md[1]=='\0')
-                                p_md[1]='0';
-                            hextoi_md5(p_md);
-                            if(memcmp(nMd5, p_md, MD5_LENGTH)==0)
-                            {
-                                //printf("%s md5 check pass\n",path);
-                            }
-                            else
-                            {
-#if 1
-                                int i;
-                                for(i=0;i<16;i++)
-                                    {
-                                        printf("%02x",nMd5[i]);
-                                    }
-                                for(i=0;i<16;i++)
-                                    {
-                                        printf("%02x", p_md[i]);
-                                    }
-#endif
-                                LOGE("<<ERROR>>\n");
-                                //check_file_result->n_modifyfile+=1;
-                                LOGE("Error:%s has been modified md5",path);
-                                ret=stat(path,&statbuf);
-                                if(ret != 0)
-                                {
-                                    LOGE("Error:%s is not exist\n",path);
-                                }
-                                time_t modify=statbuf.st_mtime;
-                                ui->Print("on %s\n", ctime(&modify));
-                                //fclose(fp_info);
-                                //return CHECK_FILE_NOT_MATCH;
-                                rettmp = CHECK_FILE_NOT_MATCH;
-                            }
-#endif
-                            if(rettmp){
-                                check_file_result->n_modifyfile+=1;
-                                clear_bit_m(p_number);
-                                fclose(fp_info);
-                                return rettmp;
-                            }
-                        }
-                    }
-                }
+        if(memcmp(nMd5, entry.md5, MD5_LENGTH)!=0)
+        {
+            int i;
+            for(i=0;i<16;i++)
+            {
+                printf("%02x",nMd5[i]);
             }
-
-            if(found==0)
+            for(i=0;i<16;i++)
             {
-                LOGE("found a new file,filename is %s",path);
-                check_file_result->n_newfile+=1;
-
-                if(access(FILE_NEW_TMP,0)==-1)
-                {
-                    int fd_new=creat(FILE_NEW_TMP,0755);
-                }
-                fp_new=fopen(FILE_NEW_TMP, "a");
-                if(fp_new)
-                {
-                    fprintf(fp_new,"%s\n",path);
-                }
-                else
-                {
-                    LOGE("open %s error,error reason is %s\n",FILE_NEW_TMP,strerror(errno));
-                    return CHECK_ADD_NEW_FILE;
-                }
-
-                checkResult=false;
-                fclose(fp_info);
-                fclose(fp_new);
-                return CHECK_ADD_NEW_FILE;
+                printf("%02x", entry.md5[i]);
+            }
+            LOGE("<<ERROR>>\n");
+            LOGE("Error:%s has been modified md5",path);
+            memset(&statbuf, 0, sizeof(statbuf));
+            if(stat(path,&statbuf) != 0)
+            {
+                LOGE("Error:%s is not exist\n",path);
             }
+            time_t modify=statbuf.st_mtime;
+            ui->Print("on %s\n", ctime(&modify));
+            rettmp = CHECK_FILE_NOT_MATCH;
+        }
+#endif
+        if(rettmp){
+            check_file_result->n_modifyfile+=1;
+            clear_bit_m(entry.number);
+            return rettmp;
         }
     }
-    else
-    {
-        LOGE("open %s error,error reason is %s\n",TEMP_FILE_IN_RAM,strerror(errno));
-        return CHECK_NO_KEY;
-    }
-    fclose(fp_info);
     return CHECK_PASS;
 }
 
-static bool dir_check( char const*dir)
+// dir_check() first walks /system in readdir order, doing everything
+// that does not need the file contents, and lists the files to verify.
+// The CRC32s and MD5s of those files are then computed on a pool of
+// threads, and the results are checked against the manifest in the order
+// of the walk.
+
+#define DIR_CHECK_MAX_THREADS 4
+
+struct scan_item {
+    std::string path;
+    std::string name;
+    bool top;           // Directly in the directory dir_check() started at.
+    size_t dir_end;     // First item past this item's directory subtree.
+    int status;         // file_crc_check() result.
+    unsigned int crc;
+    unsigned char md5[MD5_LENGTH];
+};
+
+struct scan_pool {
+    std::vector<scan_item>* items;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+static bool collect_dir(char const* dir, bool top, std::vector<scan_item>& items)
 {
     struct dirent *dp;
     DIR *d_fd;
-    unsigned int nCS = 0;
-    unsigned char nMd5[MD5_LENGTH];
     char newdir[FILENAME_MAX];
     int find_pass=0;
+    std::vector<size_t> files;
 
     if ((d_fd = opendir(dir)) == NULL) {
         if(strcmp(dir,"/system/")==0) {
@@ -509,85 +496,149 @@ static bool dir_check( char const*dir)
             if(clear_selinux_dir(dir) != 0) {
                 LOGE("clear selinux dir fail\n");
             }
-             return false;
+            return false;
         }
     }
     while ((dp = readdir(d_fd)) != NULL) {
         find_pass = 0;
         if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 || strcmp(dp->d_name,"lost+found")==0)
-          continue;
+            continue;
 
-        if (dp->d_type == DT_DIR){
-                   memset(newdir, 0, FILENAME_MAX);
-                   strcpy(newdir, dir);
-                   strcat(newdir, dp->d_name);
-                   strcat(newdir, "/");
-                   if(dir_check(newdir) == false){
-                        //closedir(d_fd);
-                        continue;
-                        //return false;
-           }
-         }else{
-              unsigned int idx = 0;
-              unsigned int idy = 0;
-              memset(newdir, 0, FILENAME_MAX);
-              strcpy(newdir, dir);
-              strcat(newdir, dp->d_name);
-              for(; idx < sizeof(file_to_check)/sizeof(char*); idx++){
-                    if(strcmp(dp->d_name, file_to_check[idx]) == 0){
-                            root_to_check[idx]=1;
-                            ui->Print("Dir_check---found a root File:  %s\n",dp->d_name);
-               }
-           }
+        if (dp->d_type == DT_DIR) {
+            snprintf(newdir, sizeof(newdir), "%s%s/", dir, dp->d_name);
+            collect_dir(newdir, false, items);
+            continue;
+        }
 
-             for(; idy < sizeof(folder_to_pass)/sizeof(char*); idy++){
-               if(strstr(newdir, folder_to_pass[idy]) != NULL){
-                               printf("Dir_check---found a folder to pass:  %s\n",newdir);
-                               find_pass=1;
-                               break;
-               }
-             }
+        unsigned int idx = 0;
+        unsigned int idy = 0;
+        snprintf(newdir, sizeof(newdir), "%s%s", dir, dp->d_name);
+        for(; idx < sizeof(file_to_check)/sizeof(char*); idx++){
+            if(strcmp(dp->d_name, file_to_check[idx]) == 0){
+                root_to_check[idx]=1;
+                ui->Print("Dir_check---found a root File:  %s\n",dp->d_name);
+            }
+        }
+
+        for(; idy < sizeof(folder_to_pass)/sizeof(char*); idy++){
+            if(strstr(newdir, folder_to_pass[idy]) != NULL){
+                printf("Dir_check---found a folder to pass:  %s\n",newdir);
+                find_pass=1;
+                break;
+            }
+        }
 
-            if(find_pass==0)  {
-              idy = 0;
-              for(; idy < sizeof(file_to_pass)/sizeof(char*); idy++){
+        if(find_pass==0)  {
+            idy = 0;
+            for(; idy < sizeof(file_to_pass)/sizeof(char*); idy++){
                 if(strstr(dp->d_name, file_to_pass[idy]) != NULL){
-                               printf("Dir_check---found a file to pass:  %s\n",dp->d_name);
-                               find_pass=1;
-                               break;
+                    printf("Dir_check---found a file to pass:  %s\n",dp->d_name);
+                    find_pass=1;
+                    break;
                 }
-              }
             }
+        }
 
-            if(find_pass==0)
-                {
-                    ui->Print("scanning **** %s ****\n",dp->d_name);
-                    if(0 == file_crc_check(newdir, &nCS, nMd5)){
-                        if (check_reall_file(newdir, nCS, (char*)nMd5)!=0)
-                            {
-                                LOGE("Error:%s check fail\n",newdir);
-                                checkResult = false;
-                            }
-                            check_file_result->file_number_to_check++;
-                    }else if(1 == file_crc_check(newdir, &nCS, nMd5)) {
-                        LOGE("%s could be selinux protected\n",newdir);
-                        //closedir(d_fd)
-                        if (clear_selinux_file(newdir)!=0) {
-                                LOGE("Error:%s is a selinux file,clear bit fail\n",newdir);
-                                checkResult = false;
-                        }
-                        check_file_result->file_number_to_check++;
-                        continue;
-                    } else {
-                        LOGE("check %s error\n",newdir);
-                        closedir(d_fd);
-                        return false;
-                    }
-                }
+        if(find_pass==0) {
+            scan_item item;
+            item.path = newdir;
+            item.name = dp->d_name;
+            item.top = top;
+            item.status = -1;
+            item.crc = 0;
+            files.push_back(items.size());
+            items.push_back(item);
+        }
+    }
+    closedir(d_fd);
+
+    for (size_t i : files)
+        items[i].dir_end = items.size();
+    return true;
+}
+
+static void* scan_thread(void* cookie)
+{
+    scan_pool* pool = reinterpret_cast<scan_pool*>(cookie);
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->items->size())
+            break;
+
+        scan_item& item = (*pool->items)[i];
+        item.status = file_crc_check(item.path.c_str(), &item.crc, item.md5);
+    }
+    return NULL;
+}
+
+static void scan_files(std::vector<scan_item>& items)
+{
+    scan_pool pool;
+    pool.items = &items;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = std::min<size_t>(DIR_CHECK_MAX_THREADS, cpus > 1 ? cpus : 1);
+    count = std::min(count, items.size());
+
+    std::vector<pthread_t> threads;
+    for (size_t i = 0; i < count; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, scan_thread, &pool) != 0)
+            break;
+        threads.push_back(thread);
+    }
+
+    // Also covers failing to start any thread.
+    scan_thread(&pool);
+
+    for (pthread_t thread : threads)
+        pthread_join(thread, NULL);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+static bool dir_check( char const*dir)
+{
+    std::vector<scan_item> items;
+
+    if (!collect_dir(dir, true, items))
+        return false;
+
+    scan_files(items);
+
+    bool result = true;
+    size_t i = 0;
+    while (i < items.size()) {
+        scan_item& item = items[i];
+        ui->Print("scanning **** %s ****\n",item.name.c_str());
+        if(0 == item.status){
+            if (check_reall_file(item.path.c_str(), item.crc, item.md5)!=0)
+            {
+                LOGE("Error:%s check fail\n",item.path.c_str());
+                checkResult = false;
+            }
+            check_file_result->file_number_to_check++;
+        }else if(1 == item.status) {
+            LOGE("%s could be selinux protected\n",item.path.c_str());
+            if (clear_selinux_file(item.path.c_str())!=0) {
+                LOGE("Error:%s is a selinux file,clear bit fail\n",item.path.c_str());
+                checkResult = false;
             }
+            check_file_result->file_number_to_check++;
+        } else {
+            // The rest of this directory is not checked.
+            LOGE("check %s error\n",item.path.c_str());
+            if (item.top)
+                result = false;
+            i = item.dir_end;
+            continue;
+        }
+        ++i;
     }
-     closedir(d_fd);
-     return true;
+    return result;
 }
 
 static int load_zip_file()
@@ -1578,6 +1629,12 @@ int root_check(){
         return CHECK_NO_KEY;
     }
 
+    if(load_manifest())
+    {
+        ui->Print("load system manifest fail\n");
+        return CHECK_NO_KEY;
+    }
+
     if(false == dir_check(SYSTEM_ROOT))
     {
         checkResult = false;
@@ -42,6 +42,7 @@
 #include "mtdutils/mounts.h"
 #include "roots.h"
 #include "common.h"
+#include "otatrace/trace.h"
 #include "mt_partition.h"
 #include "make_ext4fs.h"
 #include "wipe.h"
@@ -319,6 +320,7 @@ static int exec_cmd(const char* path, char* const argv[]) {
 }
 
 int format_volume(const char* volume, const char* directory) {
+    TraceScope trace(TRACE_FORMAT);
 
     time_t start, end;
     start = time((time_t *)NULL);
@@ -34,6 +34,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string>
 #include <vector>
 
 #include <android-base/strings.h>
@@ -48,6 +50,13 @@
 
 #define TEXT_INDENT     4
 
+// Values of drawn_progress_ other than a filled width.
+static constexpr int kNotDrawn = -1;
+static constexpr int kIndeterminate = -2;
+
+// Threads decoding animation frames in the background.
+static constexpr long kMaxFrameLoaders = 4;
+
 
 // Return the current time as a double (including fractions of a second).
 static double now() {
@@ -66,6 +75,8 @@ ScreenRecoveryUI::ScreenRecoveryUI() :
     progressScopeSize(0),
     progress(0),
     pagesIdentical(false),
+    drawn_frame_(nullptr),
+    drawn_progress_(kNotDrawn),
     text_cols_(0),
     text_rows_(0),
     text_(nullptr),
@@ -81,6 +92,7 @@ ScreenRecoveryUI::ScreenRecoveryUI() :
     file_viewer_text_(nullptr),
     intro_frames(0),
     loop_frames(0),
+    next_frame_to_load_(0),
     animation_fps(30), // TODO: there's currently no way to infer this.
     stage(-1),
     max_stage(-1),
@@ -152,6 +164,8 @@ int ScreenRecoveryUI::GetProgressBaseline() {
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::draw_background_locked() {
     pagesIdentical = false;
+    drawn_frame_ = nullptr;
+    drawn_progress_ = kNotDrawn;
     gr_color(0, 0, 0, 255);
     gr_clear();
 
@@ -176,17 +190,21 @@ void ScreenRecoveryUI::draw_background_locked() {
     }
 }
 
-// Draws the animation and progress bar (if any) on the screen.
+// Draws the animation and progress bar (if any) on the screen, skipping
+// whichever of them is already showing the right thing.
 // Does not flip pages.
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::draw_foreground_locked() {
     if (currentIcon != NONE) {
         GRSurface* frame = GetCurrentFrame();
-        int frame_width = gr_get_width(frame);
-        int frame_height = gr_get_height(frame);
-        int frame_x = (gr_fb_width() - frame_width) / 2;
-        int frame_y = GetAnimationBaseline();
-        gr_blit(frame, 0, 0, frame_width, frame_height, frame_x, frame_y);
+        if (frame != drawn_frame_) {
+            int frame_width = gr_get_width(frame);
+            int frame_height = gr_get_height(frame);
+            int frame_x = (gr_fb_width() - frame_width) / 2;
+            int frame_y = GetAnimationBaseline();
+            gr_blit(frame, 0, 0, frame_width, frame_height, frame_x, frame_y);
+            drawn_frame_ = frame;
+        }
     }
 
     if (progressBarType != EMPTY) {
@@ -196,13 +214,17 @@ void ScreenRecoveryUI::draw_foreground_locked() {
         int progress_x = (gr_fb_width() - width)/2;
         int progress_y = GetProgressBaseline();
 
+        float p = progressScopeStart + progress * progressScopeSize;
+        int pos = (int) (p * width);
+        int drawn = (progressBarType == DETERMINATE) ? pos : kIndeterminate;
+        if (drawn == drawn_progress_) return;
+        drawn_progress_ = drawn;
+
         // Erase behind the progress bar (in case this was a progress-only update)
         gr_color(0, 0, 0, 255);
-        gr_fill(progress_x, progress_y, width, height);
+        gr_fill(progress_x, progress_y, progress_x + width, progress_y + height);
 
         if (progressBarType == DETERMINATE) {
-            float p = progressScopeStart + progress * progressScopeSize;
-            int pos = (int) (p * width);
 
             if (rtl_locale) {
                 // Fill the progress bar from right to left.
@@ -293,6 +315,8 @@ void ScreenRecoveryUI::draw_screen_locked() {
         draw_background_locked();
         draw_foreground_locked();
     } else {
+        drawn_frame_ = nullptr;
+        drawn_progress_ = kNotDrawn;
         gr_color(0, 0, 0, 255);
         gr_clear();
 
@@ -357,7 +381,12 @@ void ScreenRecoveryUI::update_screen_locked() {
 // Updates only the progress bar, if possible, otherwise redraws the screen.
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_progress_locked() {
-    if (show_text || !pagesIdentical) {
+    if (show_text) {
+        // Neither the animation nor the progress bar is visible behind the
+        // text, so there is nothing to update.
+        return;
+    }
+    if (!pagesIdentical) {
         draw_screen_locked();    // Must redraw the whole screen
         pagesIdentical = true;
     } else {
@@ -383,14 +412,15 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
         // update the installation animation, if active
         // skip this if we have a text overlay (too expensive to update)
         if ((currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) && !show_text) {
+            // Hold the current frame while the next is still loading.
             if (!intro_done) {
                 if (current_frame == intro_frames - 1) {
                     intro_done = true;
                     current_frame = 0;
-                } else {
+                } else if (introFrames[current_frame + 1] != nullptr) {
                     ++current_frame;
                 }
-            } else {
+            } else if (loopFrames[(current_frame + 1) % loop_frames] != nullptr) {
                 current_frame = (current_frame + 1) % loop_frames;
             }
 
@@ -517,15 +547,61 @@ void ScreenRecoveryUI::LoadAnimation() {
     // But you must have an animation.
     if (loop_frames == 0) abort();
 
-    introFrames = new GRSurface*[intro_frames];
-    for (int i = 0; i < intro_frames; ++i) {
-        // TODO: remember the names above, so we don't have to hard-code the number of 0s.
-        LoadBitmap(android::base::StringPrintf("intro%05d", i).c_str(), &introFrames[i]);
+    introFrames = new GRSurface*[intro_frames]();
+    loopFrames = new GRSurface*[loop_frames]();
+
+    // Only the first frame is needed to put something on the screen, and
+    // the first loop frame for the layout; the rest can come later.
+    GRSurface* surface;
+    LoadBitmap("loop00000", &surface);
+    loopFrames[0] = surface;
+    if (intro_frames > 0) {
+        LoadBitmap("intro00000", &surface);
+        introFrames[0] = surface;
+    }
+    next_frame_to_load_ = 1;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long loaders = std::min(kMaxFrameLoaders, std::max(1L, cpus));
+    for (int i = 0; i < loaders; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, FrameLoaderStartRoutine, this) != 0) {
+            if (i == 0) FrameLoaderLoop();
+            break;
+        }
+        pthread_detach(thread);
     }
+}
 
-    loopFrames = new GRSurface*[loop_frames];
-    for (int i = 0; i < loop_frames; ++i) {
-        LoadBitmap(android::base::StringPrintf("loop%05d", i).c_str(), &loopFrames[i]);
+// Frames in the order they are shown: the intro, then the loop.
+GRSurface** ScreenRecoveryUI::FrameSlot(int index) {
+    return index < intro_frames ? &introFrames[index] : &loopFrames[index - intro_frames];
+}
+
+void* ScreenRecoveryUI::FrameLoaderStartRoutine(void* data) {
+    reinterpret_cast<ScreenRecoveryUI*>(data)->FrameLoaderLoop();
+    return nullptr;
+}
+
+void ScreenRecoveryUI::FrameLoaderLoop() {
+    while (true) {
+        pthread_mutex_lock(&updateMutex);
+        int index = next_frame_to_load_++;
+        bool loaded = index < intro_frames + loop_frames && *FrameSlot(index) != nullptr;
+        pthread_mutex_unlock(&updateMutex);
+        if (index >= intro_frames + loop_frames) break;
+        if (loaded) continue;
+
+        // TODO: remember the names above, so we don't have to hard-code the number of 0s.
+        std::string name = (index < intro_frames)
+                ? android::base::StringPrintf("intro%05d", index)
+                : android::base::StringPrintf("loop%05d", index - intro_frames);
+        GRSurface* surface;
+        LoadBitmap(name.c_str(), &surface);
+
+        pthread_mutex_lock(&updateMutex);
+        *FrameSlot(index) = surface;
+        pthread_mutex_unlock(&updateMutex);
     }
 }
 
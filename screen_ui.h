@@ -100,9 +100,16 @@ class ScreenRecoveryUI : public RecoveryUI {
     float progressScopeStart, progressScopeSize, progress;
     double progressScopeTime, progressScopeDuration;
 
-    // true when both graphics pages are the same (except for the progress bar).
+    // true when the screen is up to date except for the foreground
+    // (animation frame and progress bar).
     bool pagesIdentical;
 
+    // What draw_foreground_locked() last put on the screen, so that it can
+    // skip parts that haven't changed: the animation frame and the filled
+    // width of the progress bar (kNotDrawn after the screen was cleared).
+    GRSurface* drawn_frame_;
+    int drawn_progress_;
+
     size_t text_cols_, text_rows_;
 
     // Log text overlay, displayed when a magic key is pressed.
@@ -126,6 +133,12 @@ class ScreenRecoveryUI : public RecoveryUI {
     int intro_frames;
     int loop_frames;
 
+    // The frames after the first are decoded in the background, in the
+    // order they are shown; until then their slots hold nullptr.  The
+    // next frame to hand to a loader thread, in that order.  Guarded by
+    // updateMutex, like the frame slots.
+    int next_frame_to_load_;
+
     // Number of frames per sec (default: 30) for both parts of the animation.
     int animation_fps;
 
@@ -148,6 +161,10 @@ class ScreenRecoveryUI : public RecoveryUI {
     static void* ProgressThreadStartRoutine(void* data);
     void ProgressThreadLoop();
 
+    GRSurface** FrameSlot(int index);
+    static void* FrameLoaderStartRoutine(void* data);
+    void FrameLoaderLoop();
+
     void ShowFile(FILE*);
     void PrintV(const char*, bool, va_list);
     void PutChar(char);
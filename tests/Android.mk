@@ -28,10 +28,27 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_SRC_FILES := unit/asn1_decoder_test.cpp
 LOCAL_SRC_FILES += unit/recovery_test.cpp
 LOCAL_SRC_FILES += unit/locale_test.cpp
-LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_SRC_FILES += unit/pixel_ops_test.cpp
+LOCAL_SRC_FILES += unit/sparse_writer_test.cpp ../updater/mt_sparse.cpp
+LOCAL_SRC_FILES += unit/trace_test.cpp
+LOCAL_SRC_FILES += unit/transfer_list_test.cpp ../updater/transfer_list.cpp
+LOCAL_C_INCLUDES := bootable/recovery system/core/libsparse
+LOCAL_STATIC_LIBRARIES += libbase libotatrace libz
 LOCAL_SHARED_LIBRARIES := liblog
 include $(BUILD_NATIVE_TEST)
 
+# Benchmarks
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_MODULE := recovery_benchmark
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+LOCAL_SRC_FILES := benchmark/pixel_ops_benchmark.cpp
+LOCAL_SRC_FILES += benchmark/crc32_benchmark.cpp ../cr32.c
+LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_STATIC_LIBRARIES := libminui
+LOCAL_SHARED_LIBRARIES := libpng
+include $(BUILD_NATIVE_BENCHMARK)
+
 # Component tests
 include $(CLEAR_VARS)
 LOCAL_CLANG := true
@@ -41,7 +58,9 @@ LOCAL_MODULE := recovery_component_test
 LOCAL_C_INCLUDES := bootable/recovery
 LOCAL_SRC_FILES := \
     component/verifier_test.cpp \
-    component/applypatch_test.cpp
+    component/applypatch_test.cpp \
+    component/freecache_test.cpp \
+    component/partition_writer_test.cpp
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_STATIC_LIBRARIES := \
     libapplypatch \
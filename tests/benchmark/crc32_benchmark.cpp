@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+extern "C" {
+#include "cr32.h"
+}
+
+// The block size root_check folds into its checksums, and a large buffer.
+static const int kSizes[] = { 4096, 1 << 20 };
+
+static std::vector<unsigned char> random_data(size_t size) {
+    std::vector<unsigned char> data(size);
+    srandom(size);
+    for (unsigned char& c : data) {
+        c = random() & 0xff;
+    }
+    return data;
+}
+
+// crc32_update() must match crc32() for every alignment, length and
+// split of the data, or the manifest checksums no longer verify.
+static bool crc32_update_is_exact() {
+    std::vector<unsigned char> data = random_data(4096 + 64);
+    for (size_t offset = 0; offset < 8; ++offset) {
+        for (size_t len = 0; len <= 4096; len += (len < 64) ? 1 : 61) {
+            char* p = reinterpret_cast<char*>(&data[offset]);
+            uint32_t expected = crc32(0x12345678, p, len);
+            if (crc32_update(0x12345678, p, len) != expected) {
+                fprintf(stderr, "crc32_update mismatch at offset %zu len %zu\n", offset, len);
+                return false;
+            }
+            uint32_t split = crc32_update(0x12345678, p, len / 3);
+            if (crc32_update(split, p + len / 3, len - len / 3) != expected) {
+                fprintf(stderr, "crc32_update split mismatch at offset %zu len %zu\n",
+                        offset, len);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void BM_crc32(benchmark::State& state) {
+    std::vector<unsigned char> data = random_data(state.range_x());
+    uint32_t crc = 0;
+    while (state.KeepRunning()) {
+        crc = crc32(crc, reinterpret_cast<char*>(data.data()), data.size());
+    }
+    benchmark::DoNotOptimize(crc);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_crc32)->Arg(kSizes[0])->Arg(kSizes[1]);
+
+static void BM_crc32_update(benchmark::State& state) {
+    if (!crc32_update_is_exact()) {
+        abort();
+    }
+    std::vector<unsigned char> data = random_data(state.range_x());
+    uint32_t crc = 0;
+    while (state.KeepRunning()) {
+        crc = crc32_update(crc, data.data(), data.size());
+    }
+    benchmark::DoNotOptimize(crc);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_crc32_update)->Arg(kSizes[0])->Arg(kSizes[1]);
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "minui/minui.h"
+#include "minui/mt_graphic_rotate.h"
+#include "minui/pixel_ops.h"
+
+// A 1440x2560 panel, the largest we ship recovery on.
+static const int kWidth = 1440;
+static const int kHeight = 2560;
+
+static void BM_fill(benchmark::State& state) {
+    std::vector<unsigned char> fb(kWidth * kHeight * 4);
+    while (state.KeepRunning()) {
+        for (int y = 0; y < kHeight; ++y) {
+            pixel_fill(&fb[y * kWidth * 4], kWidth, 10, 20, 30);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * fb.size());
+}
+BENCHMARK(BM_fill);
+
+static void BM_fill_c(benchmark::State& state) {
+    std::vector<unsigned char> fb(kWidth * kHeight * 4);
+    while (state.KeepRunning()) {
+        for (int y = 0; y < kHeight; ++y) {
+            pixel_fill_c(&fb[y * kWidth * 4], kWidth, 10, 20, 30);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * fb.size());
+}
+BENCHMARK(BM_fill_c);
+
+static void BM_blend(benchmark::State& state) {
+    std::vector<unsigned char> fb(kWidth * kHeight * 4, 0x55);
+    while (state.KeepRunning()) {
+        for (int y = 0; y < kHeight; ++y) {
+            pixel_blend(&fb[y * kWidth * 4], kWidth, 10, 20, 30, 128);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * fb.size());
+}
+BENCHMARK(BM_blend);
+
+static void BM_blend_c(benchmark::State& state) {
+    std::vector<unsigned char> fb(kWidth * kHeight * 4, 0x55);
+    while (state.KeepRunning()) {
+        for (int y = 0; y < kHeight; ++y) {
+            pixel_blend_c(&fb[y * kWidth * 4], kWidth, 10, 20, 30, 128);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * fb.size());
+}
+BENCHMARK(BM_blend_c);
+
+// Text: one line of glyph coverage, half of it partially transparent.
+static std::vector<unsigned char> glyph_coverage() {
+    std::vector<unsigned char> alpha(kWidth);
+    for (int i = 0; i < kWidth; ++i) {
+        alpha[i] = (i % 4 == 0) ? 0 : (i * 37) & 0xff;
+    }
+    return alpha;
+}
+
+static void BM_blend_alpha(benchmark::State& state) {
+    std::vector<unsigned char> fb(kWidth * kHeight * 4, 0x55);
+    std::vector<unsigned char> alpha = glyph_coverage();
+    while (state.KeepRunning()) {
+        for (int y = 0; y < kHeight; ++y) {
+            pixel_blend_alpha(alpha.data(), &fb[y * kWidth * 4], kWidth, 10, 20, 30, 200);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * fb.size());
+}
+BENCHMARK(BM_blend_alpha);
+
+static void BM_blend_alpha_c(benchmark::State& state) {
+    std::vector<unsigned char> fb(kWidth * kHeight * 4, 0x55);
+    std::vector<unsigned char> alpha = glyph_coverage();
+    while (state.KeepRunning()) {
+        for (int y = 0; y < kHeight; ++y) {
+            pixel_blend_alpha_c(alpha.data(), &fb[y * kWidth * 4], kWidth, 10, 20, 30, 200);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * fb.size());
+}
+BENCHMARK(BM_blend_alpha_c);
+
+static void BM_blit(benchmark::State& state) {
+    std::vector<unsigned char> src(kWidth * kHeight * 4, 0x55);
+    std::vector<unsigned char> dst(kWidth * kHeight * 4);
+    while (state.KeepRunning()) {
+        memcpy(dst.data(), src.data(), dst.size());
+    }
+    state.SetBytesProcessed(state.iterations() * dst.size());
+}
+BENCHMARK(BM_blit);
+
+// Arg: 0, 1, 2 or 3 for 0, 90, 180 and 270 degrees.
+static void BM_rotate(benchmark::State& state) {
+    int index = state.range_x();
+    std::vector<unsigned char> src_data(kWidth * kHeight * 4, 0x55);
+    std::vector<unsigned char> dst_data(kWidth * kHeight * 4);
+
+    GRSurface src;
+    src.width = kWidth;
+    src.height = kHeight;
+    src.row_bytes = kWidth * 4;
+    src.pixel_bytes = 4;
+    src.data = src_data.data();
+
+    GRSurface dst = src;
+    if (index % 2) {
+        dst.width = kHeight;
+        dst.height = kWidth;
+        dst.row_bytes = kHeight * 4;
+    }
+    dst.data = dst_data.data();
+
+    while (state.KeepRunning()) {
+        rotate_surface_by(&dst, &src, index);
+    }
+    state.SetBytesProcessed(state.iterations() * dst_data.size());
+}
+BENCHMARK(BM_rotate)->Arg(0)->Arg(1)->Arg(2)->Arg(3);
+
+BENCHMARK_MAIN();
@@ -24,6 +24,7 @@
 #include <time.h>
 
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
@@ -231,6 +232,48 @@ TEST_F(ApplyPatchTest, CheckModeFailure) {
     ASSERT_NE(0, applypatch_check(&old_file[0], 2, argv));
 }
 
+static ssize_t chunked_sink(const unsigned char* data, ssize_t len, void* token) {
+    std::vector<ssize_t>* chunks = reinterpret_cast<std::vector<ssize_t>*>(token);
+    chunks->push_back(len);
+    return len;
+}
+
+TEST_F(ApplyPatchTest, StreamingBSDiffPatch) {
+    struct FileContents old_fc;
+    ASSERT_EQ(0, LoadFileContents(&old_file[0], &old_fc));
+    struct FileContents patch_fc;
+    ASSERT_EQ(0, LoadFileContents(&patch_file[0], &patch_fc));
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_fc.data.size();
+    patch.data = reinterpret_cast<char*>(patch_fc.data.data());
+
+    // The output must be identical to the in-memory patcher, but handed
+    // to the sink in several pieces rather than as one buffer.
+    std::vector<ssize_t> chunks;
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    ASSERT_EQ(0, ApplyBSDiffPatch(old_fc.data.data(), old_fc.data.size(), &patch, 0,
+                                  chunked_sink, &chunks, &ctx));
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1_Final(digest, &ctx);
+    ASSERT_EQ(new_sha1, print_sha1(digest));
+
+    ssize_t total = 0;
+    for (ssize_t len : chunks) {
+        total += len;
+    }
+    ASSERT_EQ(static_cast<ssize_t>(new_size), total);
+    ASSERT_LT(1U, chunks.size());
+
+    std::vector<unsigned char> new_data;
+    ASSERT_EQ(0, ApplyBSDiffPatchMem(old_fc.data.data(), old_fc.data.size(), &patch, 0,
+                                     &new_data));
+    SHA1(new_data.data(), new_data.size(), digest);
+    ASSERT_EQ(new_sha1, print_sha1(digest));
+}
+
 TEST_F(ApplyPatchCacheTest, CheckCacheCorruptedSingle) {
     mangle_file(old_file);
     char* s = &old_sha1[0];
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agree to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "applypatch/applypatch.h"
+
+static std::vector<std::string> Plan(const std::vector<CacheFile>& files, size_t bytes,
+                                     bool* enough) {
+    std::vector<CacheFile> plan;
+    *enough = PlanCacheEviction(files, bytes, &plan);
+    std::vector<std::string> paths;
+    for (const auto& file : plan) {
+        paths.push_back(file.path);
+    }
+    return paths;
+}
+
+static const std::vector<CacheFile> kFiles = {
+    { "/cache/a", 4096 },
+    { "/cache/b", 40960 },
+    { "/cache/c", 8192 },
+    { "/cache/d", 1 << 20 },
+    { "/cache/e", 12288 },
+};
+
+TEST(FreeCacheTest, FewestFiles) {
+    bool enough;
+    // One file is enough; the smallest one that is.
+    ASSERT_EQ(std::vector<std::string> { "/cache/c" }, Plan(kFiles, 8000, &enough));
+    ASSERT_TRUE(enough);
+    ASSERT_EQ(std::vector<std::string> { "/cache/d" }, Plan(kFiles, 50000, &enough));
+    ASSERT_TRUE(enough);
+
+    // The largest first, then the smallest that covers the rest.
+    ASSERT_EQ((std::vector<std::string> { "/cache/d", "/cache/a" }),
+              Plan(kFiles, (1 << 20) + 100, &enough));
+    ASSERT_TRUE(enough);
+    ASSERT_EQ((std::vector<std::string> { "/cache/d", "/cache/b", "/cache/e" }),
+              Plan(kFiles, (1 << 20) + 50000, &enough));
+    ASSERT_TRUE(enough);
+}
+
+TEST(FreeCacheTest, NotEnough) {
+    bool enough;
+    ASSERT_EQ(5U, Plan(kFiles, 2 << 20, &enough).size());
+    ASSERT_FALSE(enough);
+    ASSERT_TRUE(Plan(std::vector<CacheFile>(), 1, &enough).empty());
+    ASSERT_FALSE(enough);
+}
+
+TEST(FreeCacheTest, NothingNeeded) {
+    bool enough;
+    ASSERT_TRUE(Plan(kFiles, 0, &enough).empty());
+    ASSERT_TRUE(enough);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agree to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "applypatch/partition_writer.h"
+
+static std::string RandomData(size_t len) {
+    std::string data(len, '\0');
+    for (char& c : data) {
+        c = random() & 0xff;
+    }
+    return data;
+}
+
+// Writes data[offset..] in pieces of the given size, which don't line
+// up with the verify regions.
+static bool WritePieces(const char* path, const std::string& data, size_t offset, size_t piece,
+                        size_t* verified) {
+    PartitionWriter writer(path);
+    if (!writer.Start(offset)) {
+        return false;
+    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+    for (size_t i = offset; i < data.size(); i += piece) {
+        if (!writer.Write(p + i, std::min(piece, data.size() - i))) {
+            return false;
+        }
+    }
+    return writer.Finish(verified);
+}
+
+TEST(PartitionWriterTest, WriteAndVerify) {
+    std::string data = RandomData(3 * PARTITION_WRITER_REGION + 12345);
+    for (size_t piece : { 4096, 100000, 3 * PARTITION_WRITER_REGION }) {
+        TemporaryFile tf;
+        size_t verified = 0;
+        ASSERT_TRUE(WritePieces(tf.path, data, 0, piece, &verified)) << "piece " << piece;
+        ASSERT_EQ(data.size(), verified);
+
+        std::string out;
+        ASSERT_TRUE(android::base::ReadFileToString(tf.path, &out));
+        ASSERT_EQ(data, out);
+    }
+}
+
+TEST(PartitionWriterTest, RestartAtRegion) {
+    std::string data = RandomData(2 * PARTITION_WRITER_REGION + 1);
+    std::string stale = data.substr(0, PARTITION_WRITER_REGION) +
+            RandomData(PARTITION_WRITER_REGION + 1);
+
+    TemporaryFile tf;
+    ASSERT_TRUE(android::base::WriteStringToFile(stale, tf.path));
+
+    // Only the part from the offset on is written and verified.
+    size_t verified = 0;
+    ASSERT_TRUE(WritePieces(tf.path, data, PARTITION_WRITER_REGION, 65536, &verified));
+    ASSERT_EQ(data.size(), verified);
+
+    std::string out;
+    ASSERT_TRUE(android::base::ReadFileToString(tf.path, &out));
+    ASSERT_EQ(data, out);
+}
+
+// Flips a byte in what the verify thread reads back from one region.
+class CorruptingWriter : public PartitionWriter {
+  public:
+    CorruptingWriter(const char* path, size_t bad_offset) :
+            PartitionWriter(path), bad_offset_(bad_offset) {}
+
+  protected:
+    bool ReadRegion(const Region& region, uint8_t* buffer) override {
+        if (!PartitionWriter::ReadRegion(region, buffer)) {
+            return false;
+        }
+        if (region.offset == bad_offset_) {
+            buffer[region.len / 2] ^= 0xff;
+        }
+        return true;
+    }
+
+  private:
+    size_t bad_offset_;
+};
+
+TEST(PartitionWriterTest, BadRegion) {
+    std::string data = RandomData(4 * PARTITION_WRITER_REGION);
+    TemporaryFile tf;
+
+    // Regions after the bad one don't move the result past it.
+    CorruptingWriter writer(tf.path, PARTITION_WRITER_REGION);
+    ASSERT_TRUE(writer.Start(0));
+    ASSERT_TRUE(writer.Write(reinterpret_cast<const unsigned char*>(data.data()), data.size()));
+    size_t verified = 0;
+    ASSERT_TRUE(writer.Finish(&verified));
+    ASSERT_EQ(static_cast<size_t>(PARTITION_WRITER_REGION), verified);
+}
+
+TEST(PartitionWriterTest, Empty) {
+    TemporaryFile tf;
+    size_t verified = 1;
+    ASSERT_TRUE(WritePieces(tf.path, "", 0, 4096, &verified));
+    ASSERT_EQ(0U, verified);
+}
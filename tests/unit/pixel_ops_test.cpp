@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "minui/minui.h"
+#include "minui/mt_graphic_rotate.h"
+#include "minui/pixel_ops.h"
+
+// Odd widths so that the vector loops leave some pixels to the C tail.
+static const int kWidths[] = { 1, 3, 4, 7, 8, 15, 16, 33, 1437 };
+
+static std::vector<unsigned char> random_bytes(size_t size) {
+    std::vector<unsigned char> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = random() & 0xff;
+    }
+    return data;
+}
+
+TEST(PixelOpsTest, FillMatchesC) {
+    for (int width : kWidths) {
+        std::vector<unsigned char> expected = random_bytes(width * 4);
+        std::vector<unsigned char> actual = expected;
+        pixel_fill_c(expected.data(), width, 12, 200, 255);
+        pixel_fill(actual.data(), width, 12, 200, 255);
+        ASSERT_EQ(expected, actual) << "width " << width;
+    }
+}
+
+TEST(PixelOpsTest, BlendMatchesC) {
+    for (int width : kWidths) {
+        for (int a : { 1, 64, 128, 254 }) {
+            std::vector<unsigned char> expected = random_bytes(width * 4);
+            std::vector<unsigned char> actual = expected;
+            pixel_blend_c(expected.data(), width, 255, 0, 99, a);
+            pixel_blend(actual.data(), width, 255, 0, 99, a);
+            ASSERT_EQ(expected, actual) << "width " << width << " alpha " << a;
+        }
+    }
+}
+
+TEST(PixelOpsTest, BlendAlphaMatchesC) {
+    for (int width : kWidths) {
+        for (int a : { 0, 77, 255 }) {
+            std::vector<unsigned char> alpha = random_bytes(width);
+            // Include fully transparent and fully opaque coverage.
+            for (int i = 0; i < width; i += 3) alpha[i] = 0;
+            for (int i = 1; i < width; i += 5) alpha[i] = 255;
+            std::vector<unsigned char> expected = random_bytes(width * 4);
+            std::vector<unsigned char> actual = expected;
+            pixel_blend_alpha_c(alpha.data(), expected.data(), width, 30, 140, 250, a);
+            pixel_blend_alpha(alpha.data(), actual.data(), width, 30, 140, 250, a);
+            ASSERT_EQ(expected, actual) << "width " << width << " alpha " << a;
+        }
+    }
+}
+
+TEST(PixelOpsTest, BlendAlphaMatchesDivide) {
+    // The C kernels avoid the division by 255; check them against it.
+    for (int d = 0; d < 256; ++d) {
+        for (int a = 0; a < 256; ++a) {
+            unsigned char alpha = a;
+            unsigned char px[4] = { (unsigned char)d, (unsigned char)d, (unsigned char)d, 7 };
+            pixel_blend_alpha_c(&alpha, px, 1, 200, 0, 255, 255);
+            ASSERT_EQ((d * (255 - a) + 200 * a) / 255, px[0]);
+            ASSERT_EQ((d * (255 - a)) / 255, px[1]);
+            ASSERT_EQ((d * (255 - a) + 255 * a) / 255, px[2]);
+            ASSERT_EQ(7, px[3]);
+        }
+    }
+}
+
+static GRSurface make_surface(int width, int height, unsigned char* data) {
+    GRSurface s;
+    s.width = width;
+    s.height = height;
+    s.row_bytes = width * 4;
+    s.pixel_bytes = 4;
+    s.data = data;
+    return s;
+}
+
+TEST(PixelOpsTest, Rotate) {
+    // Not a multiple of the tile size in either direction.
+    const int w = 45, h = 70;
+    std::vector<unsigned char> src_data = random_bytes(w * h * 4);
+    std::vector<unsigned char> dst_data(w * h * 4);
+    GRSurface src = make_surface(w, h, src_data.data());
+    const unsigned int* sp = reinterpret_cast<const unsigned int*>(src_data.data());
+    const unsigned int* dp = reinterpret_cast<const unsigned int*>(dst_data.data());
+
+    GRSurface dst = make_surface(h, w, dst_data.data());
+    rotate_surface_by(&dst, &src, 1);
+    for (int y = 0; y < w; ++y) {
+        for (int x = 0; x < h; ++x) {
+            ASSERT_EQ(sp[(h - 1 - x) * w + y], dp[y * h + x]);
+        }
+    }
+
+    rotate_surface_by(&dst, &src, 3);
+    for (int y = 0; y < w; ++y) {
+        for (int x = 0; x < h; ++x) {
+            ASSERT_EQ(sp[x * w + (w - 1 - y)], dp[y * h + x]);
+        }
+    }
+
+    dst = make_surface(w, h, dst_data.data());
+    rotate_surface_by(&dst, &src, 2);
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            ASSERT_EQ(sp[(h - 1 - y) * w + (w - 1 - x)], dp[y * w + x]);
+        }
+    }
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include "sparse_format.h"
+#include "updater/mt_sparse.h"
+
+static const uint32_t kBlockSize = 4096;
+
+// Builds a sparse image chunk by chunk, along with the expanded image it
+// describes (don't care blocks read back as zeros from a fresh file).
+class SparseImage {
+  public:
+    SparseImage() : blocks_(0), chunks_(0) { }
+
+    void Raw(uint32_t blocks) {
+        std::string data(blocks * kBlockSize, '\0');
+        for (char& c : data) {
+            c = random() & 0xff;
+        }
+        Chunk(CHUNK_TYPE_RAW, blocks, data);
+        expanded_ += data;
+    }
+
+    void Fill(uint32_t blocks, uint32_t value) {
+        Chunk(CHUNK_TYPE_FILL, blocks, std::string(reinterpret_cast<char*>(&value), 4));
+        for (size_t i = 0; i < blocks * kBlockSize / 4; ++i) {
+            expanded_.append(reinterpret_cast<char*>(&value), 4);
+        }
+    }
+
+    void DontCare(uint32_t blocks) {
+        Chunk(CHUNK_TYPE_DONT_CARE, blocks, "");
+        expanded_.append(blocks * kBlockSize, '\0');
+    }
+
+    void Crc(uint32_t crc) {
+        Chunk(CHUNK_TYPE_CRC32, 0, std::string(reinterpret_cast<char*>(&crc), 4));
+    }
+
+    uint32_t ExpandedCrc() const {
+        return crc32(0, reinterpret_cast<const Bytef*>(expanded_.data()), expanded_.size());
+    }
+
+    std::string Image(uint32_t checksum = 0) const {
+        sparse_header_t header;
+        memset(&header, 0, sizeof(header));
+        header.magic = SPARSE_HEADER_MAGIC;
+        header.major_version = 1;
+        header.file_hdr_sz = sizeof(sparse_header_t);
+        header.chunk_hdr_sz = sizeof(chunk_header_t);
+        header.blk_sz = kBlockSize;
+        header.total_blks = blocks_;
+        header.total_chunks = chunks_;
+        header.image_checksum = checksum;
+        return std::string(reinterpret_cast<char*>(&header), sizeof(header)) + body_;
+    }
+
+    const std::string& expanded() const { return expanded_; }
+
+  private:
+    void Chunk(uint16_t type, uint32_t blocks, const std::string& payload) {
+        chunk_header_t chunk;
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.chunk_type = type;
+        chunk.chunk_sz = blocks;
+        chunk.total_sz = sizeof(chunk) + payload.size();
+        body_.append(reinterpret_cast<char*>(&chunk), sizeof(chunk));
+        body_ += payload;
+        blocks_ += blocks;
+        ++chunks_;
+    }
+
+    std::string body_;
+    std::string expanded_;
+    uint32_t blocks_;
+    uint32_t chunks_;
+};
+
+// Feeds the image to a SparseWriter in pieces of the given size and
+// returns what ended up in the file.
+static bool WriteImage(const std::string& image, size_t piece, std::string* out) {
+    TemporaryFile tf;
+    SparseWriter writer(tf.fd);
+    for (size_t i = 0; i < image.size(); i += piece) {
+        size_t n = std::min(piece, image.size() - i);
+        if (!writer.Write(reinterpret_cast<const uint8_t*>(image.data() + i), n)) {
+            return false;
+        }
+    }
+    if (!writer.Finish()) {
+        return false;
+    }
+    return android::base::ReadFileToString(tf.path, out);
+}
+
+TEST(SparseWriterTest, AllChunkTypes) {
+    // The CRC32 chunk covers everything before it, so the same data is
+    // generated twice: once up to the CRC32 chunk, once in full.
+    SparseImage prefix;
+    srandom(1);
+    prefix.Raw(3);
+    prefix.Fill(2, 0xdeadbeef);
+    prefix.DontCare(4);
+    prefix.Raw(1);
+
+    SparseImage full;
+    srandom(1);
+    full.Raw(3);
+    full.Fill(2, 0xdeadbeef);
+    full.DontCare(4);
+    full.Raw(1);
+    full.Crc(prefix.ExpandedCrc());
+    full.Fill(3, 0);
+    full.Raw(5);
+
+    std::string image = full.Image(full.ExpandedCrc());
+    // Piece sizes that split headers and blocks in every possible way.
+    for (size_t piece : { 1, 7, 28, 4095, 4096, 4097, 65536, 1 << 20 }) {
+        std::string out;
+        ASSERT_TRUE(WriteImage(image, piece, &out)) << "piece " << piece;
+        ASSERT_EQ(full.expanded(), out) << "piece " << piece;
+    }
+}
+
+TEST(SparseWriterTest, BadCrc) {
+    SparseImage img;
+    img.Raw(2);
+    img.Crc(img.ExpandedCrc() ^ 1);
+    std::string out;
+    ASSERT_FALSE(WriteImage(img.Image(), 4096, &out));
+}
+
+TEST(SparseWriterTest, BadImageChecksum) {
+    SparseImage img;
+    img.Raw(2);
+    img.DontCare(2);
+    std::string out;
+    ASSERT_TRUE(WriteImage(img.Image(img.ExpandedCrc()), 4096, &out));
+    ASSERT_FALSE(WriteImage(img.Image(img.ExpandedCrc() ^ 1), 4096, &out));
+}
+
+TEST(SparseWriterTest, Truncated) {
+    SparseImage img;
+    img.Raw(2);
+    img.Fill(1, 0x12345678);
+    std::string image = img.Image();
+    std::string out;
+    ASSERT_FALSE(WriteImage(image.substr(0, image.size() - 1), 512, &out));
+}
+
+TEST(SparseWriterTest, BadMagic) {
+    SparseImage img;
+    img.Raw(1);
+    std::string image = img.Image();
+    image[0] ^= 1;
+    std::string out;
+    ASSERT_FALSE(WriteImage(image, 4096, &out));
+}
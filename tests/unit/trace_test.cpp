@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otatrace/trace.h"
+
+// Splits a trace file into its flushed blocks.
+static bool ReadBlocks(const std::string& path, std::vector<trace_file_header>* headers,
+                       std::vector<trace_record>* records) {
+    std::string content;
+    if (!android::base::ReadFileToString(path, &content)) return false;
+
+    size_t pos = 0;
+    while (pos < content.size()) {
+        trace_file_header hdr;
+        if (content.size() - pos < sizeof(hdr)) return false;
+        memcpy(&hdr, content.data() + pos, sizeof(hdr));
+        pos += sizeof(hdr);
+        if (memcmp(hdr.magic, TRACE_MAGIC, 4) != 0 || hdr.record_size != sizeof(trace_record)) {
+            return false;
+        }
+        headers->push_back(hdr);
+        for (uint32_t i = 0; i < hdr.count; ++i) {
+            trace_record rec;
+            if (content.size() - pos < sizeof(rec)) return false;
+            memcpy(&rec, content.data() + pos, sizeof(rec));
+            pos += sizeof(rec);
+            records->push_back(rec);
+        }
+    }
+    return true;
+}
+
+TEST(TraceTest, ScopesAndFlush) {
+    TemporaryFile tf;
+    trace_init("test", tf.path);
+    {
+        TraceScope outer(TRACE_FORMAT);
+        trace_io(100, 2);
+        {
+            TraceScope inner(TRACE_FSYNC);
+            trace_io(0);
+        }
+        outer.Add(5, 1);
+    }
+    ASSERT_TRUE(trace_flush());
+
+    std::vector<trace_file_header> headers;
+    std::vector<trace_record> records;
+    ASSERT_TRUE(ReadBlocks(tf.path, &headers, &records));
+    ASSERT_EQ(1U, headers.size());
+    ASSERT_EQ(static_cast<uint32_t>(getpid()), headers[0].pid);
+    ASSERT_EQ(0U, headers[0].dropped);
+    ASSERT_STREQ("test", std::string(headers[0].process, 4).c_str());
+
+    // Records are in the order the scopes closed; the outer scope also
+    // sees the I/O done in the inner one.
+    ASSERT_EQ(2U, records.size());
+    ASSERT_EQ(TRACE_FSYNC, records[0].phase);
+    ASSERT_EQ(0U, records[0].bytes);
+    ASSERT_EQ(1U, records[0].calls);
+    ASSERT_EQ(TRACE_FORMAT, records[1].phase);
+    ASSERT_EQ(105U, records[1].bytes);
+    ASSERT_EQ(4U, records[1].calls);
+    ASSERT_LE(records[1].start_ns, records[0].start_ns);
+    ASSERT_GE(records[1].duration_ns, records[0].duration_ns);
+
+    // Nothing new, nothing written.
+    ASSERT_TRUE(trace_flush());
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(tf.path, &content));
+    ASSERT_EQ(sizeof(trace_file_header) + 2 * sizeof(trace_record), content.size());
+}
+
+TEST(TraceTest, FullRingIsFlushed) {
+    TemporaryFile tf;
+    trace_init("test", tf.path);
+    const size_t kCount = 10000;
+    for (size_t i = 0; i < kCount; ++i) {
+        TraceScope scope(TRACE_CMD_NEW);
+        scope.Add(i);
+    }
+    ASSERT_TRUE(trace_flush());
+
+    std::vector<trace_file_header> headers;
+    std::vector<trace_record> records;
+    ASSERT_TRUE(ReadBlocks(tf.path, &headers, &records));
+    ASSERT_LT(1U, headers.size());
+    ASSERT_EQ(kCount, records.size());
+    for (size_t i = 0; i < kCount; ++i) {
+        ASSERT_EQ(TRACE_CMD_NEW, records[i].phase);
+        ASSERT_EQ(i, records[i].bytes);
+    }
+    for (const trace_file_header& hdr : headers) {
+        ASSERT_EQ(0U, hdr.dropped);
+    }
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "updater/transfer_list.h"
+
+static const char kHashA[] = "0123456789abcdef0123456789abcdef01234567";
+static const char kHashB[] = "fedcba9876543210fedcba9876543210fedcba98";
+
+static const std::string kList = std::string() +
+    "4\n"
+    "30\n"
+    "2\n"
+    "12\n"
+    "stash " + kHashA + " 2,0,4\n"
+    "move " + kHashB + " 2,10,14 4 2,20,24\n"
+    "bsdiff 0 100 " + kHashA + " " + kHashB + " 4,30,32,40,42 4 - " + kHashA + ":2,0,4\n"
+    "imgdiff 100 50 " + kHashB + " " + kHashA + " 2,50,52 4 2,0,2 2,0,2 " + kHashA +
+        ":2,2,4\n"
+    "free " + kHashA + "\n"
+    "new 2,60,64\n"
+    "zero 4,70,72,80,82\n"
+    "erase 2,90,100\n";
+
+// Binary lists are read in place, so they have to be 4-byte aligned.
+class AlignedBuffer {
+  public:
+    explicit AlignedBuffer(const std::string& s) : size_(s.size()), data_((s.size() + 3) / 4) {
+        memcpy(data_.data(), s.data(), s.size());
+    }
+
+    const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(data_.data()); }
+    uint8_t* data() { return reinterpret_cast<uint8_t*>(data_.data()); }
+    size_t size() const { return size_; }
+
+  private:
+    size_t size_;
+    std::vector<uint32_t> data_;
+};
+
+static std::string ToBinary(const std::string& text) {
+    TransferList list;
+    std::string out;
+    EXPECT_TRUE(list.Parse(reinterpret_cast<const uint8_t*>(text.data()), text.size()));
+    EXPECT_TRUE(list.ToBinary(&out));
+    return out;
+}
+
+TEST(TransferListTest, TextHeader) {
+    TransferList list;
+    ASSERT_TRUE(list.Parse(reinterpret_cast<const uint8_t*>(kList.data()), kList.size()));
+    ASSERT_FALSE(list.binary());
+    ASSERT_EQ(4, list.version());
+    ASSERT_EQ(30, list.total_blocks());
+    ASSERT_EQ(2, list.stash_entries());
+    ASSERT_EQ(12, list.stash_max_blocks());
+    ASSERT_EQ(4U, list.first());
+    // The trailing newline leaves an empty last line.
+    ASSERT_EQ(13U, list.end());
+
+    TransferArgs args;
+    ASSERT_EQ(nullptr, list.Load(12, &args));
+}
+
+TEST(TransferListTest, RoundTrip) {
+    std::string binary = ToBinary(kList);
+    AlignedBuffer buf(binary);
+
+    TransferList list;
+    ASSERT_TRUE(list.Parse(buf.data(), buf.size()));
+    ASSERT_TRUE(list.binary());
+    ASSERT_EQ(4, list.version());
+    ASSERT_EQ(30, list.total_blocks());
+    ASSERT_EQ(2, list.stash_entries());
+    ASSERT_EQ(12, list.stash_max_blocks());
+    ASSERT_EQ(8U, list.end() - list.first());
+
+    std::string text;
+    ASSERT_TRUE(list.ToText(&text));
+    ASSERT_EQ(kList, text);
+}
+
+TEST(TransferListTest, Args) {
+    std::string binary = ToBinary(kList);
+    AlignedBuffer buf(binary);
+
+    TransferList text_list;
+    TransferList binary_list;
+    ASSERT_TRUE(text_list.Parse(reinterpret_cast<const uint8_t*>(kList.data()), kList.size()));
+    ASSERT_TRUE(binary_list.Parse(buf.data(), buf.size()));
+
+    // Both formats give the same arguments for the bsdiff command.
+    for (const TransferList* list : { &text_list, &binary_list }) {
+        TransferArgs args;
+        const char* name = list->Load(list->first() + 2, &args);
+        ASSERT_STREQ("bsdiff", name);
+
+        size_t offset, len, blocks;
+        ASSERT_TRUE(args.NextNumber(&offset));
+        ASSERT_TRUE(args.NextNumber(&len));
+        ASSERT_EQ(0U, offset);
+        ASSERT_EQ(100U, len);
+
+        std::string src, tgt;
+        ASSERT_TRUE(args.NextString(&src));
+        ASSERT_TRUE(args.NextString(&tgt));
+        ASSERT_EQ(kHashA, src);
+        ASSERT_EQ(kHashB, tgt);
+
+        RangeSet rs;
+        ASSERT_TRUE(args.NextRange(&rs));
+        ASSERT_EQ(2U, rs.count);
+        ASSERT_EQ(4U, rs.size);
+        ASSERT_EQ((std::vector<size_t> { 30, 32, 40, 42 }), rs.pos);
+
+        ASSERT_TRUE(args.NextNumber(&blocks));
+        ASSERT_EQ(4U, blocks);
+        ASSERT_TRUE(args.NextDash());
+
+        std::string id;
+        RangeSet locs;
+        ASSERT_TRUE(args.NextStashRef(&id, &locs));
+        ASSERT_EQ(kHashA, id);
+        ASSERT_EQ((std::vector<size_t> { 0, 4 }), locs.pos);
+        ASSERT_TRUE(args.empty());
+        ASSERT_FALSE(args.NextString(&id));
+
+        // The same hashes as raw digests.
+        ASSERT_STREQ("bsdiff", list->Load(list->first() + 2, &args));
+        ASSERT_TRUE(args.Skip());
+        ASSERT_TRUE(args.Skip());
+        uint8_t src_hash[BTL_HASH_SIZE];
+        uint8_t tgt_hash[BTL_HASH_SIZE];
+        ASSERT_TRUE(args.NextHash(src_hash));
+        ASSERT_TRUE(args.NextHash(tgt_hash));
+        ASSERT_EQ(0x01, src_hash[0]);
+        ASSERT_EQ(0x67, src_hash[BTL_HASH_SIZE - 1]);
+        ASSERT_EQ(0xfe, tgt_hash[0]);
+        ASSERT_EQ(0x98, tgt_hash[BTL_HASH_SIZE - 1]);
+        ASSERT_FALSE(args.NextHash(src_hash));
+    }
+
+    // Binary lists also check the kind of each argument.
+    TransferArgs args;
+    ASSERT_STREQ("new", binary_list.Load(binary_list.first() + 5, &args));
+    size_t n;
+    ASSERT_FALSE(args.NextNumber(&n));
+    ASSERT_FALSE(args.NextDash());
+    RangeSet rs;
+    ASSERT_TRUE(args.NextRange(&rs));
+    ASSERT_EQ(4U, rs.size);
+}
+
+TEST(TransferListTest, RejectCorrupt) {
+    std::string binary = ToBinary(kList);
+
+    {
+        // Truncated.
+        AlignedBuffer buf(binary.substr(0, binary.size() - 4));
+        TransferList list;
+        ASSERT_FALSE(list.Parse(buf.data(), buf.size()));
+    }
+
+    {
+        // Every table size in the header.
+        for (size_t i = offsetof(btl_header, number_count); i < offsetof(btl_header, reserved);
+                i += 4) {
+            AlignedBuffer buf(binary);
+            buf.data()[i] ^= 0x40;
+            TransferList list;
+            ASSERT_FALSE(list.Parse(buf.data(), buf.size())) << "offset " << i;
+        }
+    }
+
+    {
+        // A command pointing past the arguments.
+        AlignedBuffer buf(binary);
+        const btl_header* h = reinterpret_cast<const btl_header*>(buf.data());
+        size_t commands = sizeof(btl_header) + h->number_count * sizeof(uint64_t);
+        btl_command* c = reinterpret_cast<btl_command*>(buf.data() + commands);
+        c[0].first_arg = h->arg_count;
+        TransferList list;
+        ASSERT_FALSE(list.Parse(buf.data(), buf.size()));
+    }
+
+    {
+        // An empty block range.
+        AlignedBuffer buf(binary);
+        const btl_header* h = reinterpret_cast<const btl_header*>(buf.data());
+        uint32_t* pos = reinterpret_cast<uint32_t*>(buf.data() + buf.size() -
+                h->hash_count * BTL_HASH_SIZE - h->pos_count * sizeof(uint32_t));
+        pos[1] = pos[0];
+        TransferList list;
+        ASSERT_FALSE(list.Parse(buf.data(), buf.size()));
+    }
+
+    {
+        // Text lists older than version 3 have no binary form.
+        std::string v2 = "2\n4\n0\n0\nnew 2,0,4\n";
+        TransferList list;
+        std::string out;
+        ASSERT_TRUE(list.Parse(reinterpret_cast<const uint8_t*>(v2.data()), v2.size()));
+        ASSERT_FALSE(list.ToBinary(&out));
+    }
+}
@@ -32,7 +32,7 @@ LOCAL_MODULE := uncrypt
 LOCAL_C_INCLUDES += bootable/recovery
 
 LOCAL_STATIC_LIBRARIES := libbootloader_message libbase \
-                          liblog libfs_mgr libcutils libmtdutils \
+                          liblog libfs_mgr libcutils libmtdutils libotatrace \
 
 LOCAL_INIT_RC := uncrypt.rc
 
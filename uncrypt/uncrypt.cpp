@@ -95,11 +95,13 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -125,10 +127,18 @@
 #include "common.h"
 
 #include "error_code.h"
+#include "otatrace/trace.h"
 #include "unique_fd.h"
 
 #define WINDOW_SIZE 5
 
+// Number of extents requested per FS_IOC_FIEMAP call.
+#define FIEMAP_BATCH 256
+
+// Largest piece of an extent that is read and rewritten in one go when
+// the device is encrypted.
+#define EXTENT_IO_SIZE (1024 * 1024)
+
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
 // SETUP_BCB and CLEAR_BCB services use socket communication and do not rely
@@ -142,6 +152,7 @@
 static const std::string CACHE_BLOCK_MAP = "/cache/recovery/block.map";
 static const std::string UNCRYPT_PATH_FILE = "/cache/recovery/uncrypt_file";
 static const std::string UNCRYPT_STATUS = "/cache/recovery/uncrypt_status";
+static const std::string UNCRYPT_TRACE = "/cache/recovery/uncrypt.trace";
 static const std::string UNCRYPT_SOCKET = "uncrypt";
 
 static struct fstab* fstab = nullptr;
@@ -170,6 +181,174 @@ static void add_block_to_ranges(std::vector<int>& ranges, int new_block) {
     }
 }
 
+static bool write_status_to_socket(int status, int socket);
+
+static void add_extent_to_ranges(std::vector<int>& ranges, int start, int count) {
+    if (!ranges.empty() && start == ranges.back()) {
+        ranges.back() += count;
+    } else {
+        ranges.push_back(start);
+        ranges.push_back(start + count);
+    }
+}
+
+struct FileExtent {
+    int logical;    // first block within the file
+    int physical;   // first block on the block device
+    int count;      // length in blocks
+};
+
+// Gets the extents of the file with FS_IOC_FIEMAP, FIEMAP_BATCH extents
+// per call instead of one FIBMAP call per block.  Returns false if the
+// filesystem doesn't support FIEMAP or reports anything other than a
+// plain list of mapped blocks covering the whole file (holes, inline or
+// not yet allocated data); callers then fall back to FIBMAP.
+static bool get_file_extents(int fd, off64_t size, long blksize, int blocks,
+                             std::vector<FileExtent>* extents) {
+    const uint32_t unsupported = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+            FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE |
+            FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN;
+
+    std::vector<uint8_t> buf(sizeof(struct fiemap) +
+                             FIEMAP_BATCH * sizeof(struct fiemap_extent));
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(buf.data());
+
+    int next_block = 0;
+    bool last = false;
+    while (!last && next_block < blocks) {
+        memset(buf.data(), 0, buf.size());
+        fm->fm_start = static_cast<uint64_t>(next_block) * blksize;
+        fm->fm_length = size - fm->fm_start;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_BATCH;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+            ALOGI("FIEMAP not available: %s", strerror(errno));
+            return false;
+        }
+        if (fm->fm_mapped_extents == 0) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; ++i) {
+            const struct fiemap_extent* fe = &fm->fm_extents[i];
+            if ((fe->fe_flags & unsupported) != 0 ||
+                fe->fe_logical % blksize != 0 || fe->fe_physical % blksize != 0 ||
+                fe->fe_logical != static_cast<uint64_t>(next_block) * blksize) {
+                ALOGI("unexpected extent (flags 0x%x) at offset %" PRIu64,
+                      fe->fe_flags, static_cast<uint64_t>(fe->fe_logical));
+                return false;
+            }
+
+            uint64_t count = (fe->fe_length + blksize - 1) / blksize;
+            count = std::min(count, static_cast<uint64_t>(blocks - next_block));
+            extents->push_back({next_block, static_cast<int>(fe->fe_physical / blksize),
+                                static_cast<int>(count)});
+            next_block += count;
+
+            if ((fe->fe_flags & FIEMAP_EXTENT_LAST) != 0 || next_block >= blocks) {
+                last = true;
+                break;
+            }
+        }
+    }
+
+    if (next_block < blocks) {
+        ALOGI("FIEMAP mapped %d of %d blocks", next_block, blocks);
+        return false;
+    }
+    return true;
+}
+
+static int traced_fsync(int fd) {
+    TraceScope trace(TRACE_FSYNC);
+    trace_io(0);
+    return fsync(fd);
+}
+
+static bool pread_fully(int fd, unsigned char* buffer, size_t size, off64_t offset) {
+    while (size > 0) {
+        ssize_t r = TEMP_FAILURE_RETRY(pread64(fd, buffer, size, offset));
+        trace_io(r > 0 ? r : 0);
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            return false;
+        }
+        buffer += r;
+        size -= r;
+        offset += r;
+    }
+    return true;
+}
+
+static bool pwrite_fully(int fd, const unsigned char* buffer, size_t size, off64_t offset) {
+    while (size > 0) {
+        ssize_t w = TEMP_FAILURE_RETRY(pwrite64(fd, buffer, size, offset));
+        trace_io(w > 0 ? w : 0);
+        if (w <= 0) {
+            if (w == 0) errno = EIO;
+            return false;
+        }
+        buffer += w;
+        size -= w;
+        offset += w;
+    }
+    return true;
+}
+
+// Builds the block ranges from the file's extents.  When encrypted, each
+// extent is also read through the filesystem and rewritten to the same
+// blocks of the underlying device with a few large writes.  Every piece
+// is read completely before any of its blocks is overwritten, and pieces
+// are handled in file order, so reads never see already rewritten data.
+static int map_extents(const std::vector<FileExtent>& extents, int fd, int wfd,
+                       const struct stat& sb, bool encrypted, int socket,
+                       std::vector<int>& ranges) {
+    std::vector<unsigned char> buffer;
+    size_t io_blocks = std::max(static_cast<long>(1), EXTENT_IO_SIZE / sb.st_blksize);
+    if (encrypted) {
+        buffer.resize(io_blocks * sb.st_blksize);
+    }
+
+    int last_progress = 0;
+    for (const FileExtent& extent : extents) {
+        add_extent_to_ranges(ranges, extent.physical, extent.count);
+        if (!encrypted) {
+            continue;
+        }
+
+        for (int done = 0; done < extent.count; ) {
+            int count = std::min(static_cast<int>(io_blocks), extent.count - done);
+            off64_t pos = static_cast<off64_t>(extent.logical + done) * sb.st_blksize;
+            size_t len = static_cast<size_t>(count) * sb.st_blksize;
+            size_t to_read = static_cast<size_t>(std::min(static_cast<off64_t>(len),
+                                                          sb.st_size - pos));
+
+            if (!pread_fully(fd, buffer.data(), to_read, pos)) {
+                ALOGE("failed to read: %s", strerror(errno));
+                return kUncryptReadError;
+            }
+            memset(buffer.data() + to_read, 0, len - to_read);
+
+            off64_t offset = static_cast<off64_t>(extent.physical + done) * sb.st_blksize;
+            if (!pwrite_fully(wfd, buffer.data(), len, offset)) {
+                ALOGE("error writing offset %" PRId64 ": %s", offset, strerror(errno));
+                return kUncryptWriteError;
+            }
+            done += count;
+
+            // Update the status file, progress must be between [0, 99].
+            int progress = static_cast<int>(100 * (double(pos + to_read) / double(sb.st_size)));
+            if (progress > last_progress && progress < 100) {
+                last_progress = progress;
+                write_status_to_socket(progress, socket);
+            }
+        }
+    }
+
+    return 0;
+}
+
 static struct fstab* read_fstab() {
     fstab = NULL;
 
@@ -299,7 +478,18 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         }
     }
 
-    off64_t pos = 0;
+    std::vector<FileExtent> extents;
+    if (get_file_extents(fd.get(), sb.st_size, sb.st_blksize, blocks, &extents)) {
+        ALOGI("  mapped %zu extents with FIEMAP", extents.size());
+        int rc = map_extents(extents, fd.get(), wfd.get(), sb, encrypted, socket, ranges);
+        if (rc != 0) {
+            return rc;
+        }
+        // Nothing is left for the FIBMAP loops below.
+        head_block = blocks;
+    }
+
+    off64_t pos = (head_block == blocks) ? sb.st_size : 0;
     int last_progress = 0;
     while (pos < sb.st_size) {
         // Update the status file, progress must be between [0, 99].
@@ -376,7 +566,7 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         }
     }
 
-    if (fsync(mapfd.get()) == -1) {
+    if (traced_fsync(mapfd.get()) == -1) {
         ALOGE("failed to fsync \"%s\": %s", tmp_map_file.c_str(), strerror(errno));
         return kUncryptFileSyncError;
     }
@@ -387,7 +577,7 @@ static int produce_block_map(const char* path, const char* map_file, const char*
     mapfd = -1;
 
     if (encrypted) {
-        if (fsync(wfd.get()) == -1) {
+        if (traced_fsync(wfd.get()) == -1) {
             ALOGE("failed to fsync \"%s\": %s", blk_dev, strerror(errno));
             return kUncryptFileSyncError;
         }
@@ -410,7 +600,7 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         ALOGE("failed to open dir %s: %s", dir_name.c_str(), strerror(errno));
         return kUncryptFileOpenError;
     }
-    if (fsync(dfd.get()) == -1) {
+    if (traced_fsync(dfd.get()) == -1) {
         ALOGE("failed to fsync %s: %s", dir_name.c_str(), strerror(errno));
         return kUncryptFileSyncError;
     }
@@ -487,7 +677,11 @@ static bool uncrypt_wrapper(const char* input_path, const char* map_file, const
     CHECK(map_file != nullptr);
 
     auto start = std::chrono::system_clock::now();
-    int status = uncrypt(input_path, map_file, socket);
+    int status;
+    {
+        TraceScope trace(TRACE_UNCRYPT);
+        status = uncrypt(input_path, map_file, socket);
+    }
     std::chrono::duration<double> duration = std::chrono::system_clock::now() - start;
     int count = static_cast<int>(duration.count());
 
@@ -628,6 +822,8 @@ int main(int argc, char** argv) {
     bool success = false;
     switch (action) {
         case UNCRYPT:
+            unlink(UNCRYPT_TRACE.c_str());
+            trace_init("uncrypt", UNCRYPT_TRACE.c_str());
             success = uncrypt_wrapper(input_path, map_file, socket_fd.get());
             break;
         case SETUP_BCB:
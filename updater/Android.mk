@@ -17,6 +17,7 @@ LOCAL_PATH := $(call my-dir)
 updater_src_files := \
 	install.cpp \
 	blockimg.cpp \
+	transfer_list.cpp \
 	updater.cpp
 
 #
@@ -108,3 +109,12 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(LOCAL_PATH)/mt_updater.mk
 include $(BUILD_EXECUTABLE)
+
+# Host tool converting transfer lists between the text and binary formats.
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := btlconvert.cpp transfer_list.cpp
+LOCAL_MODULE := btlconvert
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_STATIC_LIBRARIES := libbase
+include $(BUILD_HOST_EXECUTABLE)
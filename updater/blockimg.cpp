@@ -32,17 +32,22 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <time.h>
 #include <unistd.h>
 #include <fec/io.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 
@@ -53,7 +58,9 @@
 #include "openssl/sha.h"
 #include "minzip/Hash.h"
 #include "ota_io.h"
+#include "otatrace/trace.h"
 #include "print_sha1.h"
+#include "transfer_list.h"
 #include "unique_fd.h"
 #include "updater.h"
 #include "mt_common.h"
@@ -70,68 +77,10 @@
 #define STASH_DIRECTORY_MODE 0700
 #define STASH_FILE_MODE 0600
 
-struct RangeSet {
-    size_t count;             // Limit is INT_MAX.
-    size_t size;
-    std::vector<size_t> pos;  // Actual limit is INT_MAX.
-};
-
 static CauseCode failure_type = kNoCause;
 static bool is_retry = false;
 static std::map<std::string, RangeSet> stash_map;
 
-static void parse_range(const std::string& range_text, RangeSet& rs) {
-
-    std::vector<std::string> pieces = android::base::Split(range_text, ",");
-    if (pieces.size() < 3) {
-        goto err;
-    }
-
-    size_t num;
-    if (!android::base::ParseUint(pieces[0].c_str(), &num, static_cast<size_t>(INT_MAX))) {
-        goto err;
-    }
-
-    if (num == 0 || num % 2) {
-        goto err; // must be even
-    } else if (num != pieces.size() - 1) {
-        goto err;
-    }
-
-    rs.pos.resize(num);
-    rs.count = num / 2;
-    rs.size = 0;
-
-    for (size_t i = 0; i < num; i += 2) {
-        if (!android::base::ParseUint(pieces[i+1].c_str(), &rs.pos[i],
-                                      static_cast<size_t>(INT_MAX))) {
-            goto err;
-        }
-
-        if (!android::base::ParseUint(pieces[i+2].c_str(), &rs.pos[i+1],
-                                      static_cast<size_t>(INT_MAX))) {
-            goto err;
-        }
-
-        if (rs.pos[i] >= rs.pos[i+1]) {
-            goto err; // empty or negative range
-        }
-
-        size_t sz = rs.pos[i+1] - rs.pos[i];
-        if (rs.size > SIZE_MAX - sz) {
-            goto err; // overflow
-        }
-
-        rs.size += sz;
-    }
-
-    return;
-
-err:
-    fprintf(stderr, "failed to parse range '%s'\n", range_text.c_str());
-    exit(1);
-}
-
 static bool range_overlaps(const RangeSet& r1, const RangeSet& r2) {
     for (size_t i = 0; i < r1.count; ++i) {
         size_t r1_0 = r1.pos[i * 2];
@@ -187,6 +136,31 @@ static int write_all(int fd, const std::vector<uint8_t>& buffer, size_t size) {
     return write_all(fd, buffer.data(), size);
 }
 
+// Writes all of iov at offset; iov is modified on partial writes.
+static int pwritev_all(int fd, struct iovec* iov, int iovcnt, off64_t offset) {
+    while (iovcnt > 0) {
+        ssize_t w = TEMP_FAILURE_RETRY(ota_pwritev(fd, iov, iovcnt, offset));
+        if (w == -1) {
+            failure_type = kFwriteFailure;
+            fprintf(stderr, "pwritev failed: %s\n", strerror(errno));
+            return -1;
+        }
+        offset += w;
+
+        while (iovcnt > 0 && static_cast<size_t>(w) >= iov->iov_len) {
+            w -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = reinterpret_cast<uint8_t*>(iov->iov_base) + w;
+            iov->iov_len -= w;
+        }
+    }
+
+    return 0;
+}
+
 static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
     // Don't discard blocks unless the update is a retry run.
     if (!is_retry) {
@@ -288,64 +262,216 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
 // can't write each section until it's that transfer's turn to go.
 //
 // To achieve this, we expand the new data from the archive in a
-// background thread, and block that threads 'receive uncompressed
-// data' function until the main thread has reached a point where we
-// want some new data to be written.  We signal the background thread
-// with the destination for the data and block the main thread,
-// waiting for the background thread to complete writing that section.
-// Then it signals the main thread to wake up and goes back to
-// blocking waiting for a transfer.
+// background thread into a ring of NEW_DATA_BUFFERS buffers.  The
+// inflater fills the buffers in order and publishes each one when it
+// is full, running ahead of the main thread until the ring is full;
+// a 'new' command takes whatever buffers are ready and writes them to
+// its target ranges with one pwritev() per run of contiguous blocks,
+// then hands the buffers back.  Inflating the next part of the stream
+// thus overlaps with writing the current one and with all the other
+// commands.
 //
-// NewThreadInfo is the struct used to pass information back and forth
-// between the two threads.  When the main thread wants some data
-// written, it sets rss to the destination location and signals the
-// condition.  When the background thread is done writing, it clears
-// rss and signals the condition again.
+// There is exactly one producer and one consumer, so the buffers are
+// handed over with a pair of counters and no lock.  A thread only
+// takes the mutex to sleep when the ring is full (inflater) or empty
+// (main thread), and the other side only takes it to wake it up.
 
-struct NewThreadInfo {
-    ZipArchive* za;
-    const ZipEntry* entry;
+#define NEW_DATA_BUFFERS 16
+#define NEW_DATA_BUFFER_SIZE (1024 * 1024)
+
+class NewDataRing {
+  public:
+    NewDataRing();
+    ~NewDataRing();
+
+    // Inflater side.  Appends data to the stream; returns false once
+    // the ring has been cancelled.
+    bool Put(const uint8_t* data, size_t size);
 
-    RangeSinkState* rss;
+    // Publishes the last, partially filled buffer and ends the stream.
+    void Finish();
 
-    pthread_mutex_t mu;
-    pthread_cond_t cv;
+    // Main thread side.  Writes the next tgt.size blocks of the stream
+    // to tgt, or just skips them if fd is -1.
+    bool Write(int fd, const RangeSet& tgt);
+
+    // Makes Put() fail, so that the inflater stops early.
+    void Cancel();
+
+  private:
+    template <typename Ready> void WaitUntil(Ready ready);
+    void Wake();
+
+    struct Buffer {
+        std::vector<uint8_t> data;
+        size_t size;
+    };
+
+    Buffer buffers_[NEW_DATA_BUFFERS];
+    std::atomic<uint64_t> published_;   // Buffers handed to the main thread.
+    std::atomic<uint64_t> released_;    // Buffers handed back to the inflater.
+    std::atomic<bool> finished_;
+    std::atomic<bool> cancelled_;
+    size_t fill_;                       // Inflater: bytes in the buffer being filled.
+    size_t offset_;                     // Main thread: bytes used of the oldest buffer.
+
+    std::atomic<int> waiters_;
+    pthread_mutex_t mu_;
+    pthread_cond_t cv_;
 };
 
-static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
-    NewThreadInfo* nti = reinterpret_cast<NewThreadInfo*>(cookie);
+NewDataRing::NewDataRing() :
+        published_(0), released_(0), finished_(false), cancelled_(false), fill_(0), offset_(0),
+        waiters_(0) {
+    for (Buffer& b : buffers_) {
+        b.data.resize(NEW_DATA_BUFFER_SIZE);
+        b.size = 0;
+    }
+    pthread_mutex_init(&mu_, nullptr);
+    pthread_cond_init(&cv_, nullptr);
+}
+
+NewDataRing::~NewDataRing() {
+    pthread_cond_destroy(&cv_);
+    pthread_mutex_destroy(&mu_);
+}
+
+// The counters are sequentially consistent, so a thread that registers
+// as a waiter either sees the update it is waiting for, or the other
+// side sees the waiter and signals it under the mutex.
+template <typename Ready>
+void NewDataRing::WaitUntil(Ready ready) {
+    if (ready()) {
+        return;
+    }
 
+    pthread_mutex_lock(&mu_);
+    ++waiters_;
+    while (!ready()) {
+        pthread_cond_wait(&cv_, &mu_);
+    }
+    --waiters_;
+    pthread_mutex_unlock(&mu_);
+}
+
+void NewDataRing::Wake() {
+    if (waiters_ > 0) {
+        pthread_mutex_lock(&mu_);
+        pthread_cond_broadcast(&cv_);
+        pthread_mutex_unlock(&mu_);
+    }
+}
+
+bool NewDataRing::Put(const uint8_t* data, size_t size) {
     while (size > 0) {
-        // Wait for nti->rss to be non-null, indicating some of this
-        // data is wanted.
-        pthread_mutex_lock(&nti->mu);
-        while (nti->rss == nullptr) {
-            pthread_cond_wait(&nti->cv, &nti->mu);
+        WaitUntil([this]() {
+            return cancelled_ || published_ - released_ < NEW_DATA_BUFFERS;
+        });
+        if (cancelled_) {
+            return false;
         }
-        pthread_mutex_unlock(&nti->mu);
 
-        // At this point nti->rss is set, and we own it.  The main
-        // thread is waiting for it to disappear from nti.
-        ssize_t written = RangeSinkWrite(data, size, nti->rss);
-        data += written;
-        size -= written;
+        Buffer& b = buffers_[published_ % NEW_DATA_BUFFERS];
+        size_t n = std::min(size, NEW_DATA_BUFFER_SIZE - fill_);
+        memcpy(b.data.data() + fill_, data, n);
+        fill_ += n;
+        data += n;
+        size -= n;
+
+        if (fill_ == NEW_DATA_BUFFER_SIZE) {
+            b.size = fill_;
+            fill_ = 0;
+            ++published_;
+            Wake();
+        }
+    }
+
+    return true;
+}
+
+void NewDataRing::Finish() {
+    if (fill_ > 0) {
+        // Put() has already claimed the buffer being filled.
+        buffers_[published_ % NEW_DATA_BUFFERS].size = fill_;
+        fill_ = 0;
+        ++published_;
+    }
+    finished_ = true;
+    Wake();
+}
+
+void NewDataRing::Cancel() {
+    cancelled_ = true;
+    pthread_mutex_lock(&mu_);
+    pthread_cond_broadcast(&cv_);
+    pthread_mutex_unlock(&mu_);
+}
+
+bool NewDataRing::Write(int fd, const RangeSet& tgt) {
+    struct iovec iov[NEW_DATA_BUFFERS];
 
-        if (nti->rss->p_block == nti->rss->tgt.count) {
-            // we have written all the bytes desired by this rss.
+    for (size_t i = 0; i < tgt.count; ++i) {
+        off64_t offset = static_cast<off64_t>(tgt.pos[i * 2]) * BLOCKSIZE;
+        size_t remain = (tgt.pos[i * 2 + 1] - tgt.pos[i * 2]) * BLOCKSIZE;
+
+        while (remain > 0) {
+            WaitUntil([this]() {
+                return finished_ || cancelled_ || published_ > released_;
+            });
+
+            // Everything published so far may be written in one go.
+            uint64_t end = published_;
+            uint64_t next = released_;
+            if (next == end) {
+                fprintf(stderr, "new data stream ended %zu bytes early\n", remain);
+                return false;
+            }
+
+            int iovcnt = 0;
+            size_t bytes = 0;
+            while (next < end && bytes < remain) {
+                Buffer& b = buffers_[next % NEW_DATA_BUFFERS];
+                size_t n = std::min(b.size - offset_, remain - bytes);
+                iov[iovcnt].iov_base = b.data.data() + offset_;
+                iov[iovcnt].iov_len = n;
+                ++iovcnt;
+                bytes += n;
+                offset_ += n;
+                if (offset_ == b.size) {
+                    offset_ = 0;
+                    ++next;
+                }
+            }
+
+            if (fd != -1 && pwritev_all(fd, iov, iovcnt, offset) == -1) {
+                return false;
+            }
+            offset += bytes;
+            remain -= bytes;
 
-            pthread_mutex_lock(&nti->mu);
-            nti->rss = nullptr;
-            pthread_cond_broadcast(&nti->cv);
-            pthread_mutex_unlock(&nti->mu);
+            released_ = next;
+            Wake();
         }
     }
 
     return true;
 }
 
+struct NewThreadInfo {
+    ZipArchive* za;
+    const ZipEntry* entry;
+    NewDataRing* ring;
+};
+
+static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
+    NewThreadInfo* nti = reinterpret_cast<NewThreadInfo*>(cookie);
+    return nti->ring->Put(data, size);
+}
+
 static void* unzip_new_data(void* cookie) {
     NewThreadInfo* nti = (NewThreadInfo*) cookie;
     mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+    nti->ring->Finish();
     return nullptr;
 }
 
@@ -395,12 +521,695 @@ static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer,
     return 0;
 }
 
+static int write_all_at(int fd, const uint8_t* data, size_t size, off64_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = TEMP_FAILURE_RETRY(ota_pwrite(fd, data+written, size-written,
+                                                  offset+written));
+        if (w == -1) {
+            failure_type = kFwriteFailure;
+            fprintf(stderr, "pwrite failed: %s\n", strerror(errno));
+            return -1;
+        }
+        written += w;
+    }
+
+    return 0;
+}
+
+static ssize_t VectorSinkWrite(const uint8_t* data, ssize_t size, void* token) {
+    std::vector<uint8_t>* out = reinterpret_cast<std::vector<uint8_t>*>(token);
+    out->insert(out->end(), data, data + size);
+    return size;
+}
+
+// Writes to the partition are made durable in groups instead of one
+// fsync per command.  A group is committed once it holds
+// GROUP_COMMIT_MAX_BYTES of data or its first write is
+// GROUP_COMMIT_MAX_MS old, and whenever waiting any longer would break
+// resuming:
+//
+//  - before a block that a command of the open group read its source
+//    from is overwritten, because after a crash that command has to be
+//    run again from the same source;
+//  - before a stash that a command of the open group used is deleted,
+//    so frees are held back until the group is on disk, and before a
+//    stash with the same id as a held back free is stored again.
+//
+// Stashes still only need to reach /cache before their source blocks
+// are overwritten, which StashCache::Protect() takes care of; the
+// stashes whose frees are held back stay in the cache, so they are
+// written out if that happens before the commit.
+//
+// After every commit, the index of the first transfer list line that
+// may not be on disk yet is written to a journal in the stash
+// directory, along with the SHA-1 of the transfer list.  An update that
+// is resumed with the same transfer list skips the commands before that
+// line without reading or verifying their blocks.  The journal is only
+// written after the fsync, so it may lag behind the partition but never
+// runs ahead of it.
+
+#define GROUP_COMMIT_MAX_BYTES (32 * 1024 * 1024)
+#define GROUP_COMMIT_MAX_MS 2000
+
+#define JOURNAL_NAME "journal"
+
+class StashCache;
+
+static int FreeStash(StashCache* stashes, const std::string& id);
+
+class GroupCommit {
+  public:
+    GroupCommit(int fd, StashCache* stashes);
+    ~GroupCommit();
+
+    // Enables the journal at path for the transfer list with the given
+    // hash.  Returns the line to resume from, or 0 if the journal is
+    // missing or belongs to another transfer list.
+    size_t OpenJournal(const std::string& path, const std::string& key);
+
+    // Must be called before writing to tgt.
+    bool BeforeWrite(const RangeSet& tgt);
+
+    // Records that the command on the given line has written bytes to
+    // the partition after reading src, and that freestash may be deleted
+    // once the command is on disk.
+    bool Done(size_t line, const RangeSet& src, size_t bytes, const std::string& freestash);
+
+    // Deletes the stash once everything written so far is on disk.
+    int Free(const std::string& id);
+
+    // Commits the open group if it is going to delete the given stash.
+    bool WaitForStash(const std::string& id);
+
+    bool Commit();
+
+    void LogStats();
+
+  private:
+    bool CommitLocked();
+    void WriteJournal();
+    bool Overlaps(const RangeSet& rs) const;
+    void AddSource(const RangeSet& rs);
+
+    int fd_;
+    StashCache* stashes_;
+    std::string journal_;
+    std::string key_;
+    size_t next_line_;                  // First line not known to be on disk.
+    bool dirty_;
+    size_t bytes_;
+    struct timespec opened_;            // Time of the first write of the group.
+    std::map<size_t, size_t> sources_;  // Blocks read by the group, start -> end.
+    std::vector<std::string> frees_;
+    size_t commands_;
+    size_t commits_;
+    pthread_mutex_t mu_;
+};
+
+GroupCommit::GroupCommit(int fd, StashCache* stashes) :
+        fd_(fd), stashes_(stashes), next_line_(0), dirty_(false), bytes_(0), commands_(0),
+        commits_(0) {
+    pthread_mutex_init(&mu_, nullptr);
+}
+
+GroupCommit::~GroupCommit() {
+    pthread_mutex_destroy(&mu_);
+}
+
+size_t GroupCommit::OpenJournal(const std::string& path, const std::string& key) {
+    journal_ = path;
+    key_ = key;
+
+    std::string content;
+    if (!android::base::ReadFileToString(path, &content)) {
+        return 0;
+    }
+
+    // <transfer list sha1>\n<line>\n
+    std::vector<std::string> fields = android::base::Split(content, "\n");
+    size_t line;
+    if (fields.size() < 2 || fields[0] != key ||
+            !android::base::ParseUint(fields[1].c_str(), &line)) {
+        fprintf(stderr, "ignoring journal of another transfer list\n");
+        return 0;
+    }
+
+    next_line_ = line;
+    return line;
+}
+
+bool GroupCommit::Overlaps(const RangeSet& rs) const {
+    for (size_t i = 0; i < rs.count; ++i) {
+        size_t start = rs.pos[i * 2];
+        size_t end = rs.pos[i * 2 + 1];
+
+        auto it = sources_.upper_bound(start);
+        if (it != sources_.end() && it->first < end) {
+            return true;
+        }
+        if (it != sources_.begin() && (--it)->second > start) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void GroupCommit::AddSource(const RangeSet& rs) {
+    for (size_t i = 0; i < rs.count; ++i) {
+        size_t start = rs.pos[i * 2];
+        size_t end = rs.pos[i * 2 + 1];
+
+        // Merge with every range that touches [start, end).
+        auto it = sources_.upper_bound(start);
+        if (it != sources_.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second >= start) {
+                it = prev;
+            }
+        }
+        while (it != sources_.end() && it->first <= end) {
+            start = std::min(start, it->first);
+            end = std::max(end, it->second);
+            it = sources_.erase(it);
+        }
+        sources_[start] = end;
+    }
+}
+
+bool GroupCommit::BeforeWrite(const RangeSet& tgt) {
+    pthread_mutex_lock(&mu_);
+    bool ok = !Overlaps(tgt) || CommitLocked();
+    pthread_mutex_unlock(&mu_);
+    return ok;
+}
+
+bool GroupCommit::Done(size_t line, const RangeSet& src, size_t bytes,
+        const std::string& freestash) {
+    pthread_mutex_lock(&mu_);
+    if (!dirty_) {
+        clock_gettime(CLOCK_MONOTONIC, &opened_);
+        dirty_ = true;
+    }
+    AddSource(src);
+    bytes_ += bytes;
+    if (!freestash.empty()) {
+        frees_.push_back(freestash);
+    }
+    next_line_ = std::max(next_line_, line + 1);
+    ++commands_;
+
+    bool ok = true;
+    if (bytes_ >= GROUP_COMMIT_MAX_BYTES) {
+        ok = CommitLocked();
+    } else {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t ms = (now.tv_sec - opened_.tv_sec) * 1000LL +
+                (now.tv_nsec - opened_.tv_nsec) / 1000000;
+        if (ms >= GROUP_COMMIT_MAX_MS) {
+            ok = CommitLocked();
+        }
+    }
+    pthread_mutex_unlock(&mu_);
+    return ok;
+}
+
+int GroupCommit::Free(const std::string& id) {
+    pthread_mutex_lock(&mu_);
+    bool deferred = dirty_;
+    if (deferred) {
+        frees_.push_back(id);
+    }
+    pthread_mutex_unlock(&mu_);
+
+    return deferred ? 0 : FreeStash(stashes_, id);
+}
+
+bool GroupCommit::WaitForStash(const std::string& id) {
+    pthread_mutex_lock(&mu_);
+    bool ok = std::find(frees_.begin(), frees_.end(), id) == frees_.end() || CommitLocked();
+    pthread_mutex_unlock(&mu_);
+    return ok;
+}
+
+bool GroupCommit::Commit() {
+    pthread_mutex_lock(&mu_);
+    bool ok = CommitLocked();
+    pthread_mutex_unlock(&mu_);
+    return ok;
+}
+
+bool GroupCommit::CommitLocked() {
+    if (!dirty_) {
+        return true;
+    }
+
+    if (ota_fsync(fd_) == -1) {
+        failure_type = kFsyncFailure;
+        fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    for (const std::string& id : frees_) {
+        FreeStash(stashes_, id);
+    }
+    frees_.clear();
+    sources_.clear();
+    bytes_ = 0;
+    dirty_ = false;
+    ++commits_;
+
+    WriteJournal();
+    return true;
+}
+
+// The journal only saves work on resume, so failing to update it is not
+// an error; the previous contents stay valid.
+void GroupCommit::WriteJournal() {
+    if (journal_.empty()) {
+        return;
+    }
+
+    std::string content = key_ + "\n" + std::to_string(next_line_) + "\n";
+    std::string fn = journal_ + ".partial";
+
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE));
+    unique_fd fd_holder(fd);
+
+    if (fd == -1) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", fn.c_str(), strerror(errno));
+        return;
+    }
+
+    ssize_t w = TEMP_FAILURE_RETRY(ota_write(fd, content.data(), content.size()));
+    if (w != static_cast<ssize_t>(content.size()) || ota_fsync(fd) == -1) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", fn.c_str(), strerror(errno));
+        return;
+    }
+
+    if (rename(fn.c_str(), journal_.c_str()) == -1) {
+        fprintf(stderr, "rename(\"%s\", \"%s\") failed: %s\n", fn.c_str(), journal_.c_str(),
+                strerror(errno));
+    }
+}
+
+void GroupCommit::LogStats() {
+    pthread_mutex_lock(&mu_);
+    fprintf(stderr, "committed %zu commands in %zu groups\n", commands_, commits_);
+    pthread_mutex_unlock(&mu_);
+}
+
+// Transfers which read their source from the partition and write a
+// target range (move, bsdiff and imgdiff) are run as a three stage
+// pipeline.  The main thread parses the command, loads and verifies
+// the source blocks exactly as before and queues a PipelineJob.  A
+// pool of patch threads applies the patches into private output
+// buffers, and a writer thread writes the output to the target ranges
+// and hands them to the group commit.  The main thread therefore reads the source
+// of command N+1 while command N is being patched and command N-1 is
+// being written, and independent bsdiff/imgdiff commands are patched
+// on several cores at once.
+//
+// The conflict checks below are what make a job independent: a job is
+// only queued after every earlier job writing to the blocks it reads
+// has been written, and a stash is only reused once the job that frees
+// it is done.  Patching itself only touches the job's own buffers, so
+// jobs in the queue may be patched in any order.
+//
+// Jobs are written strictly in transfer list order, one at a time, and
+// committed together with the writes of the main thread, so the on-disk
+// state after a crash is one a serial run could have left behind and
+// resuming works as it always has.
+// Before the main thread reads blocks from the partition it waits for
+// queued jobs whose target overlaps the range being read, and before
+// running any command that writes the partition by itself (new, zero,
+// erase) or deletes stashes (free) it drains the pipeline completely.
+
+struct PipelineJob {
+    PipelineJob(const RangeSet& rs) : tgt(rs) { };
+
+    size_t line;             // Transfer list line of the command.
+    RangeSet tgt;
+    RangeSet srcranges;      // Blocks the source was read from.
+    std::vector<uint8_t> src;
+    size_t src_blocks;
+    Value patch;
+    bool imgdiff;
+    std::string freestash;   // Stash to delete once the target is durable.
+    std::vector<uint8_t> out;
+    size_t bytes;            // Buffer space charged against PIPELINE_MAX_BYTES.
+    bool patched;
+    bool failed;
+};
+
+// Upper bound for source and output buffers held by queued jobs.  A
+// single job larger than this is still accepted when the pipeline is
+// otherwise empty.
+#define PIPELINE_MAX_BYTES (64 * 1024 * 1024)
+
+// Upper bound for the number of patch threads; the actual number also
+// depends on the number of online CPUs.
+#define PIPELINE_MAX_PATCH_THREADS 4
+
+class TransferPipeline {
+  public:
+    TransferPipeline(int fd, GroupCommit* commit);
+    ~TransferPipeline();
+
+    bool Start();
+
+    // Queues a job, blocking while the pipeline holds too much data.
+    // Returns false if a previously queued job has failed.
+    bool Submit(PipelineJob* job);
+
+    // Blocks until no queued job writes to any block in rs.
+    bool WaitForRange(const RangeSet& rs);
+
+    // Blocks until no queued job is going to delete the given stash.
+    bool WaitForStash(const std::string& id);
+
+    // Blocks until every queued job has been written.
+    bool Drain();
+
+    bool Failed();
+
+  private:
+    static void* PatchThread(void* cookie);
+    static void* WriteThread(void* cookie);
+
+    void PatchLoop();
+    void WriteLoop();
+    bool PatchJob(PipelineJob* job);
+    bool WriteJob(PipelineJob* job);
+    void Shutdown();
+
+    int fd_;
+    GroupCommit* commit_;
+    std::deque<PipelineJob*> jobs_;
+    size_t next_patch_;
+    size_t bytes_;
+    bool failed_;
+    bool stop_;
+    bool started_;
+
+    pthread_mutex_t mu_;
+    pthread_cond_t cv_;
+    std::vector<pthread_t> patch_threads_;
+    pthread_t write_thread_;
+};
+
+TransferPipeline::TransferPipeline(int fd, GroupCommit* commit) :
+        fd_(fd), commit_(commit), next_patch_(0), bytes_(0), failed_(false),
+        stop_(false), started_(false) {
+    pthread_mutex_init(&mu_, nullptr);
+    pthread_cond_init(&cv_, nullptr);
+}
+
+TransferPipeline::~TransferPipeline() {
+    Shutdown();
+    for (PipelineJob* job : jobs_) {
+        delete job;
+    }
+    pthread_cond_destroy(&cv_);
+    pthread_mutex_destroy(&mu_);
+}
+
+bool TransferPipeline::Start() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = PIPELINE_MAX_PATCH_THREADS;
+    if (cpus > 0 && static_cast<size_t>(cpus) < nthreads) {
+        nthreads = cpus;
+    }
+
+    int error = pthread_create(&write_thread_, nullptr, WriteThread, this);
+    if (error != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+        return false;
+    }
+    started_ = true;
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_t thread;
+        error = pthread_create(&thread, nullptr, PatchThread, this);
+        if (error != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            break;
+        }
+        patch_threads_.push_back(thread);
+    }
+
+    if (patch_threads_.empty()) {
+        Shutdown();
+        return false;
+    }
+
+    fprintf(stderr, "patching with %zu threads\n", patch_threads_.size());
+    return true;
+}
+
+void TransferPipeline::Shutdown() {
+    if (!started_) {
+        return;
+    }
+
+    pthread_mutex_lock(&mu_);
+    stop_ = true;
+    pthread_cond_broadcast(&cv_);
+    pthread_mutex_unlock(&mu_);
+
+    for (pthread_t thread : patch_threads_) {
+        pthread_join(thread, nullptr);
+    }
+    patch_threads_.clear();
+    pthread_join(write_thread_, nullptr);
+    started_ = false;
+}
+
+bool TransferPipeline::Submit(PipelineJob* job) {
+    job->bytes = job->src.size() + job->tgt.size * BLOCKSIZE;
+    job->patched = false;
+    job->failed = false;
+
+    pthread_mutex_lock(&mu_);
+    while (!failed_ && !jobs_.empty() && bytes_ + job->bytes > PIPELINE_MAX_BYTES) {
+        pthread_cond_wait(&cv_, &mu_);
+    }
+
+    bool ok = !failed_;
+    if (ok) {
+        jobs_.push_back(job);
+        bytes_ += job->bytes;
+        pthread_cond_broadcast(&cv_);
+    }
+    pthread_mutex_unlock(&mu_);
+
+    if (!ok) {
+        delete job;
+    }
+    return ok;
+}
+
+bool TransferPipeline::WaitForRange(const RangeSet& rs) {
+    pthread_mutex_lock(&mu_);
+    while (!failed_) {
+        bool busy = false;
+        for (const PipelineJob* job : jobs_) {
+            if (range_overlaps(job->tgt, rs)) {
+                busy = true;
+                break;
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        pthread_cond_wait(&cv_, &mu_);
+    }
+
+    bool ok = !failed_;
+    pthread_mutex_unlock(&mu_);
+    return ok;
+}
+
+bool TransferPipeline::WaitForStash(const std::string& id) {
+    pthread_mutex_lock(&mu_);
+    while (!failed_) {
+        bool busy = false;
+        for (const PipelineJob* job : jobs_) {
+            if (job->freestash == id) {
+                busy = true;
+                break;
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        pthread_cond_wait(&cv_, &mu_);
+    }
+
+    bool ok = !failed_;
+    pthread_mutex_unlock(&mu_);
+    return ok;
+}
+
+bool TransferPipeline::Drain() {
+    pthread_mutex_lock(&mu_);
+    while (!failed_ && !jobs_.empty()) {
+        pthread_cond_wait(&cv_, &mu_);
+    }
+
+    bool ok = !failed_;
+    pthread_mutex_unlock(&mu_);
+    return ok;
+}
+
+bool TransferPipeline::Failed() {
+    pthread_mutex_lock(&mu_);
+    bool failed = failed_;
+    pthread_mutex_unlock(&mu_);
+    return failed;
+}
+
+void* TransferPipeline::PatchThread(void* cookie) {
+    reinterpret_cast<TransferPipeline*>(cookie)->PatchLoop();
+    return nullptr;
+}
+
+void* TransferPipeline::WriteThread(void* cookie) {
+    reinterpret_cast<TransferPipeline*>(cookie)->WriteLoop();
+    return nullptr;
+}
+
+bool TransferPipeline::PatchJob(PipelineJob* job) {
+    size_t expected = job->tgt.size * BLOCKSIZE;
+
+    if (job->patch.data == nullptr) {
+        // move: the loaded source is the target data.
+        job->out.swap(job->src);
+        job->out.resize(expected);
+        return true;
+    }
+
+    job->out.reserve(expected);
+    if (job->imgdiff) {
+        if (ApplyImagePatch(job->src.data(), job->src_blocks * BLOCKSIZE, &job->patch,
+                &VectorSinkWrite, &job->out, nullptr, nullptr) != 0) {
+            fprintf(stderr, "Failed to apply image patch.\n");
+            return false;
+        }
+    } else {
+        if (ApplyBSDiffPatch(job->src.data(), job->src_blocks * BLOCKSIZE, &job->patch,
+                0, &VectorSinkWrite, &job->out, nullptr) != 0) {
+            fprintf(stderr, "Failed to apply bsdiff patch.\n");
+            return false;
+        }
+    }
+
+    // We expect the output of the patcher to fill the tgt ranges exactly.
+    if (job->out.size() > expected) {
+        fprintf(stderr, "range sink write overrun");
+        job->out.resize(expected);
+    } else if (job->out.size() < expected) {
+        fprintf(stderr, "range sink underrun?\n");
+    }
+
+    // The source is no longer needed, release it before the write.
+    std::vector<uint8_t>().swap(job->src);
+    return true;
+}
+
+void TransferPipeline::PatchLoop() {
+    pthread_mutex_lock(&mu_);
+    while (true) {
+        while (!stop_ && next_patch_ >= jobs_.size()) {
+            pthread_cond_wait(&cv_, &mu_);
+        }
+        if (next_patch_ >= jobs_.size()) {
+            break;
+        }
+
+        PipelineJob* job = jobs_[next_patch_++];
+        bool skip = failed_ || stop_;
+        pthread_mutex_unlock(&mu_);
+
+        bool ok = !skip && PatchJob(job);
+
+        pthread_mutex_lock(&mu_);
+        job->patched = true;
+        job->failed = !ok;
+        pthread_cond_broadcast(&cv_);
+    }
+    pthread_mutex_unlock(&mu_);
+}
+
+bool TransferPipeline::WriteJob(PipelineJob* job) {
+    if (!commit_->BeforeWrite(job->tgt)) {
+        return false;
+    }
+
+    const uint8_t* data = job->out.data();
+    size_t remain = job->out.size();
+
+    for (size_t i = 0; i < job->tgt.count && remain > 0; ++i) {
+        off64_t offset = static_cast<off64_t>(job->tgt.pos[i * 2]) * BLOCKSIZE;
+        size_t size = (job->tgt.pos[i * 2 + 1] - job->tgt.pos[i * 2]) * BLOCKSIZE;
+        if (size > remain) {
+            size = remain;
+        }
+
+        if (!discard_blocks(fd_, offset, size)) {
+            return false;
+        }
+
+        if (write_all_at(fd_, data, size, offset) == -1) {
+            return false;
+        }
+
+        data += size;
+        remain -= size;
+    }
+
+    return commit_->Done(job->line, job->srcranges, job->out.size(), job->freestash);
+}
+
+void TransferPipeline::WriteLoop() {
+    pthread_mutex_lock(&mu_);
+    while (true) {
+        while (!stop_ && (jobs_.empty() || !jobs_.front()->patched)) {
+            pthread_cond_wait(&cv_, &mu_);
+        }
+        if (jobs_.empty() || !jobs_.front()->patched) {
+            break;
+        }
+
+        // Once a job has failed nothing after it may reach the disk.
+        PipelineJob* job = jobs_.front();
+        bool skip = failed_ || job->failed;
+        pthread_mutex_unlock(&mu_);
+
+        bool ok = !skip && WriteJob(job);
+
+        pthread_mutex_lock(&mu_);
+        if (!ok) {
+            failed_ = true;
+        }
+        jobs_.pop_front();
+        --next_patch_;
+        bytes_ -= job->bytes;
+        delete job;
+        pthread_cond_broadcast(&cv_);
+    }
+    pthread_mutex_unlock(&mu_);
+}
+
 // Parameters for transfer list command functions
 struct CommandParameters {
-    std::vector<std::string> tokens;
-    size_t cpos;
+    const TransferList* list;
+    TransferArgs args;
     const char* cmdname;
-    const char* cmdline;
+    size_t line;
+    RangeSet srcranges;
     std::string freestash;
     std::string stashbase;
     bool canwrite;
@@ -415,8 +1224,26 @@ struct CommandParameters {
     pthread_t thread;
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
+    TransferPipeline* pipeline;
+    StashCache* stashes;
+    GroupCommit* commit;
 };
 
+// Waits for queued pipeline writes to the given blocks before they are
+// read back from the partition.
+static bool WaitForPendingWrites(CommandParameters& params, const RangeSet& rs) {
+    return params.pipeline == nullptr || params.pipeline->WaitForRange(rs);
+}
+
+// Waits until no queued job or open commit group is going to delete the
+// given stash, before a stash with the same id is stored.
+static bool WaitForStashFree(CommandParameters& params, const std::string& id) {
+    if (params.pipeline != nullptr && !params.pipeline->WaitForStash(id)) {
+        return false;
+    }
+    return params.commit == nullptr || params.commit->WaitForStash(id);
+}
+
 // Do a source/target load for move/bsdiff/imgdiff in version 1.
 // We expect to parse the remainder of the parameter tokens as:
 //
@@ -428,21 +1255,20 @@ struct CommandParameters {
 static int LoadSrcTgtVersion1(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
         std::vector<uint8_t>& buffer, int fd) {
 
-    if (params.cpos + 1 >= params.tokens.size()) {
+    // <src_range> <tgt_range>
+    RangeSet src;
+    if (!params.args.NextRange(&src) || !params.args.NextRange(&tgt)) {
         fprintf(stderr, "invalid parameters\n");
         return -1;
     }
 
-    // <src_range>
-    RangeSet src;
-    parse_range(params.tokens[params.cpos++], src);
-
-    // <tgt_range>
-    parse_range(params.tokens[params.cpos++], tgt);
-
     allocate(src.size * BLOCKSIZE, buffer);
+    if (!WaitForPendingWrites(params, src)) {
+        return -1;
+    }
     int rc = ReadBlocks(src, buffer, fd);
     src_blocks = src.size;
+    params.srcranges = src;
 
     return rc;
 }
@@ -563,152 +1389,424 @@ static void DeleteStash(const std::string& base) {
     }
 }
 
-static int LoadStash(CommandParameters& params, const std::string& base, const std::string& id,
-        bool verify, size_t* blocks, std::vector<uint8_t>& buffer, bool printnoent) {
-    // In verify mode, if source range_set was saved for the given hash,
-    // check contents in the source blocks first. If the check fails,
-    // search for the stashed files on /cache as usual.
-    if (!params.canwrite) {
-        if (stash_map.find(id) != stash_map.end()) {
-            const RangeSet& src = stash_map[id];
-            allocate(src.size * BLOCKSIZE, buffer);
+// Stashes are kept in memory while they fit in STASH_MAX_MEMORY and are
+// only written to /cache when resuming the update would need them.  An
+// interrupted update can be resumed as long as every stash whose source
+// blocks have been overwritten is on /cache, so before a command writes
+// to the partition, the stashes read from the blocks it is about to
+// overwrite are written out.  On resume, a stash that only lived in
+// memory is read again from its source blocks and checked against its
+// hash, exactly like the stash command does when it runs for the first
+// time.  Stashes that have to go to /cache together are written as a
+// group and made durable with one syncfs() and one directory fsync,
+// instead of an fsync for every file.
+
+#define STASH_MAX_MEMORY (64 * 1024 * 1024)
+
+class StashCache {
+  public:
+    StashCache(const std::string& base);
+    ~StashCache();
+
+    // Copies a stash held in memory to buffer.  Returns false if the
+    // stash is not in memory.
+    bool Get(const std::string& id, std::vector<uint8_t>& buffer, size_t* blocks);
+
+    // Stores the given blocks, which were read from src.  If exists is
+    // not null, an existing stash with the same id is kept as it is and
+    // *exists tells whether there was one.
+    int Put(const std::string& id, const std::vector<uint8_t>& buffer, size_t blocks,
+            const RangeSet& src, bool checkspace, bool* exists);
+
+    // Writes out every stash held only in memory whose source blocks
+    // overlap tgt.  Must be called before writing to tgt.
+    int Protect(const RangeSet& tgt);
+
+    int Free(const std::string& id);
+
+    // Drops the stashes held in memory, after the stash directory has
+    // been deleted.
+    void Clear();
+
+    void LogStats();
+
+  private:
+    struct Entry {
+        std::vector<uint8_t> data;
+        size_t blocks;
+        RangeSet src;
+        bool ondisk;
+        bool checkspace;
+        uint64_t seq;
+    };
+    typedef std::map<std::string, Entry>::iterator EntryIter;
+
+    int WriteGroup(const std::vector<EntryIter>& group);
+    int Evict(size_t needed);
+    void Drop(EntryIter it);
+
+    std::string base_;
+    std::map<std::string, Entry> entries_;
+    size_t bytes_;
+    uint64_t seq_;
+    size_t kept_blocks_;
+    size_t written_blocks_;
+    size_t groups_;
+    pthread_mutex_t mu_;
+};
 
-            if (ReadBlocks(src, buffer, params.fd) == -1) {
-                fprintf(stderr, "failed to read source blocks in stash map.\n");
-                return -1;
-            }
-            if (VerifyBlocks(id, buffer, src.size, true) != 0) {
-                fprintf(stderr, "failed to verify loaded source blocks in stash map.\n");
-                return -1;
-            }
+StashCache::StashCache(const std::string& base) :
+        base_(base), bytes_(0), seq_(0), kept_blocks_(0), written_blocks_(0), groups_(0) {
+    pthread_mutex_init(&mu_, nullptr);
+}
+
+StashCache::~StashCache() {
+    pthread_mutex_destroy(&mu_);
+}
+
+bool StashCache::Get(const std::string& id, std::vector<uint8_t>& buffer, size_t* blocks) {
+    pthread_mutex_lock(&mu_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+        pthread_mutex_unlock(&mu_);
+        return false;
+    }
+
+    fprintf(stderr, " loading %s from memory\n", id.c_str());
+    const Entry& e = it->second;
+    allocate(e.data.size(), buffer);
+    memcpy(buffer.data(), e.data.data(), e.data.size());
+    *blocks = e.blocks;
+    pthread_mutex_unlock(&mu_);
+    return true;
+}
+
+int StashCache::Put(const std::string& id, const std::vector<uint8_t>& buffer, size_t blocks,
+        const RangeSet& src, bool checkspace, bool* exists) {
+    if (base_.empty()) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mu_);
+    auto it = entries_.find(id);
+
+    if (exists) {
+        std::string cn = GetStashFileName(base_, id, "");
+        struct stat sb;
+
+        if (it != entries_.end() || stat(cn.c_str(), &sb) == 0) {
+            // The stash already exists and since the name is the hash of the contents,
+            // it's safe to assume the contents are identical (accidental hash collisions
+            // are unlikely)
+            fprintf(stderr, " skipping %zu existing blocks in %s\n", blocks, id.c_str());
+            *exists = true;
+            pthread_mutex_unlock(&mu_);
             return 0;
         }
+
+        *exists = false;
     }
 
-    if (base.empty()) {
+    if (it != entries_.end()) {
+        if (it->second.ondisk) {
+            DeleteFile(GetStashFileName(base_, id, ""), nullptr);
+        }
+        Drop(it);
+    }
+
+    size_t size = blocks * BLOCKSIZE;
+    if (size <= STASH_MAX_MEMORY && bytes_ + size > STASH_MAX_MEMORY &&
+            Evict(bytes_ + size - STASH_MAX_MEMORY) != 0) {
+        pthread_mutex_unlock(&mu_);
         return -1;
     }
 
-    size_t blockcount = 0;
+    Entry& e = entries_[id];
+    e.data.assign(buffer.begin(), buffer.begin() + size);
+    e.blocks = blocks;
+    e.src = src;
+    e.ondisk = false;
+    e.checkspace = checkspace;
+    e.seq = seq_++;
+    bytes_ += size;
+    it = entries_.find(id);
 
-    if (!blocks) {
-        blocks = &blockcount;
+    int rc = 0;
+    if (size > STASH_MAX_MEMORY) {
+        // Too large to keep around, goes to /cache right away.
+        rc = WriteGroup(std::vector<EntryIter>(1, it));
+        Drop(it);
     }
 
-    std::string fn = GetStashFileName(base, id, "");
-
-    struct stat sb;
-    int res = stat(fn.c_str(), &sb);
+    pthread_mutex_unlock(&mu_);
+    return rc;
+}
 
-    if (res == -1) {
-        if (errno != ENOENT || printnoent) {
-            fprintf(stderr, "stat \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+int StashCache::Protect(const RangeSet& tgt) {
+    pthread_mutex_lock(&mu_);
+    std::vector<EntryIter> group;
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (!it->second.ondisk && range_overlaps(it->second.src, tgt)) {
+            group.push_back(it);
         }
+    }
+
+    int rc = WriteGroup(group);
+    pthread_mutex_unlock(&mu_);
+    return rc;
+}
+
+int StashCache::Free(const std::string& id) {
+    if (base_.empty() || id.empty()) {
         return -1;
     }
 
-    fprintf(stderr, " loading %s\n", fn.c_str());
+    pthread_mutex_lock(&mu_);
+    auto it = entries_.find(id);
+    bool ondisk = true;
+    if (it != entries_.end()) {
+        ondisk = it->second.ondisk;
+        if (!ondisk) {
+            kept_blocks_ += it->second.blocks;
+        }
+        Drop(it);
+    }
+    pthread_mutex_unlock(&mu_);
 
-    if ((sb.st_size % BLOCKSIZE) != 0) {
-        fprintf(stderr, "%s size %" PRId64 " not multiple of block size %d",
-                fn.c_str(), static_cast<int64_t>(sb.st_size), BLOCKSIZE);
+    // Stashes not found in memory may have been written by an earlier attempt.
+    if (ondisk) {
+        DeleteFile(GetStashFileName(base_, id, ""), nullptr);
+    }
+
+    return 0;
+}
+
+void StashCache::Clear() {
+    pthread_mutex_lock(&mu_);
+    entries_.clear();
+    bytes_ = 0;
+    pthread_mutex_unlock(&mu_);
+}
+
+void StashCache::LogStats() {
+    pthread_mutex_lock(&mu_);
+    fprintf(stderr, "stash: %zu blocks freed from memory, %zu blocks written in %zu groups\n",
+            kept_blocks_, written_blocks_, groups_);
+    pthread_mutex_unlock(&mu_);
+}
+
+void StashCache::Drop(EntryIter it) {
+    bytes_ -= it->second.data.size();
+    entries_.erase(it);
+}
+
+// Writes out the oldest stashes held in memory to make room for at least
+// needed bytes.  Frees a quarter of the budget at a time, so that the
+// next few stashes don't need another group of their own.
+int StashCache::Evict(size_t needed) {
+    std::vector<EntryIter> oldest;
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        oldest.push_back(it);
+    }
+    std::sort(oldest.begin(), oldest.end(), [](const EntryIter& a, const EntryIter& b) {
+        return a->second.seq < b->second.seq;
+    });
+
+    needed = std::max(needed, static_cast<size_t>(STASH_MAX_MEMORY / 4));
+
+    std::vector<EntryIter> evicted;
+    std::vector<EntryIter> group;
+    size_t freed = 0;
+    for (EntryIter it : oldest) {
+        if (freed >= needed) {
+            break;
+        }
+        if (!it->second.ondisk) {
+            group.push_back(it);
+        }
+        evicted.push_back(it);
+        freed += it->second.data.size();
+    }
+
+    if (WriteGroup(group) != 0) {
         return -1;
     }
 
-    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY));
-    unique_fd fd_holder(fd);
+    for (EntryIter it : evicted) {
+        Drop(it);
+    }
 
-    if (fd == -1) {
-        fprintf(stderr, "open \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+    return 0;
+}
+
+int StashCache::WriteGroup(const std::vector<EntryIter>& group) {
+    if (group.empty()) {
+        return 0;
+    }
+
+    TraceScope trace(TRACE_STASH_WRITE);
+
+    size_t space = 0;
+    for (EntryIter it : group) {
+        if (it->second.checkspace) {
+            space += it->second.data.size();
+        }
+    }
+
+    if (space > 0 && CacheSizeCheck(space) != 0) {
+        fprintf(stderr, "not enough space to write stash\n");
         return -1;
     }
 
-    allocate(sb.st_size, buffer);
+    for (EntryIter it : group) {
+        std::string fn = GetStashFileName(base_, it->first, ".partial");
+        fprintf(stderr, " writing %zu blocks to %s\n", it->second.blocks, fn.c_str());
 
-    if (read_all(fd, buffer, sb.st_size) == -1) {
+        int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                         STASH_FILE_MODE));
+        unique_fd fd_holder(fd);
+
+        if (fd == -1) {
+            fprintf(stderr, "failed to create \"%s\": %s\n", fn.c_str(), strerror(errno));
+            return -1;
+        }
+
+        if (write_all(fd, it->second.data, it->second.data.size()) == -1) {
+            return -1;
+        }
+    }
+
+    std::string dname = GetStashFileName(base_, "", "");
+    int dfd = TEMP_FAILURE_RETRY(open(dname.c_str(), O_RDONLY | O_DIRECTORY));
+    unique_fd dfd_holder(dfd);
+
+    if (dfd == -1) {
+        failure_type = kFileOpenFailure;
+        fprintf(stderr, "failed to open \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
         return -1;
     }
 
-    *blocks = sb.st_size / BLOCKSIZE;
+    // The contents of every file must be durable before any of them
+    // appears under its final name.
+    if (ota_syncfs(dfd) == -1) {
+        failure_type = kFsyncFailure;
+        fprintf(stderr, "syncfs \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
+        return -1;
+    }
 
-    if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
-        fprintf(stderr, "unexpected contents in %s\n", fn.c_str());
-        DeleteFile(fn, nullptr);
+    for (EntryIter it : group) {
+        std::string fn = GetStashFileName(base_, it->first, ".partial");
+        std::string cn = GetStashFileName(base_, it->first, "");
+
+        if (rename(fn.c_str(), cn.c_str()) == -1) {
+            fprintf(stderr, "rename(\"%s\", \"%s\") failed: %s\n", fn.c_str(), cn.c_str(),
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    if (ota_fsync(dfd) == -1) {
+        failure_type = kFsyncFailure;
+        fprintf(stderr, "fsync \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
         return -1;
     }
 
-    return 0;
-}
-
-static int WriteStash(const std::string& base, const std::string& id, int blocks,
-        std::vector<uint8_t>& buffer, bool checkspace, bool *exists) {
-    if (base.empty()) {
-        return -1;
+    for (EntryIter it : group) {
+        it->second.ondisk = true;
+        written_blocks_ += it->second.blocks;
+    }
+    ++groups_;
+
+    return 0;
+}
+
+// Makes sure every stash read from blocks in tgt is on /cache, and every
+// command that read its source from them is on disk, before the blocks
+// are overwritten.
+static bool ProtectStashes(CommandParameters& params, const RangeSet& tgt) {
+    if (params.commit != nullptr && !params.commit->BeforeWrite(tgt)) {
+        return false;
+    }
+    return params.stashes == nullptr || params.stashes->Protect(tgt) == 0;
+}
+
+static int LoadStash(CommandParameters& params, const std::string& base, const std::string& id,
+        bool verify, size_t* blocks, std::vector<uint8_t>& buffer, bool printnoent) {
+    // In verify mode, if source range_set was saved for the given hash,
+    // check contents in the source blocks first. If the check fails,
+    // search for the stashed files on /cache as usual.
+    if (!params.canwrite) {
+        if (stash_map.find(id) != stash_map.end()) {
+            const RangeSet& src = stash_map[id];
+            allocate(src.size * BLOCKSIZE, buffer);
+
+            if (ReadBlocks(src, buffer, params.fd) == -1) {
+                fprintf(stderr, "failed to read source blocks in stash map.\n");
+                return -1;
+            }
+            if (VerifyBlocks(id, buffer, src.size, true) != 0) {
+                fprintf(stderr, "failed to verify loaded source blocks in stash map.\n");
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    size_t blockcount = 0;
+
+    if (!blocks) {
+        blocks = &blockcount;
+    }
+
+    if (params.stashes != nullptr && params.stashes->Get(id, buffer, blocks)) {
+        // Stashes held in memory were verified when they were stored.
+        return 0;
     }
 
-    if (checkspace && CacheSizeCheck(blocks * BLOCKSIZE) != 0) {
-        fprintf(stderr, "not enough space to write stash\n");
+    if (base.empty()) {
         return -1;
     }
 
-    std::string fn = GetStashFileName(base, id, ".partial");
-    std::string cn = GetStashFileName(base, id, "");
+    TraceScope trace(TRACE_STASH_LOAD);
+    std::string fn = GetStashFileName(base, id, "");
 
-    if (exists) {
-        struct stat sb;
-        int res = stat(cn.c_str(), &sb);
+    struct stat sb;
+    int res = stat(fn.c_str(), &sb);
 
-        if (res == 0) {
-            // The file already exists and since the name is the hash of the contents,
-            // it's safe to assume the contents are identical (accidental hash collisions
-            // are unlikely)
-            fprintf(stderr, " skipping %d existing blocks in %s\n", blocks, cn.c_str());
-            *exists = true;
-            return 0;
+    if (res == -1) {
+        if (errno != ENOENT || printnoent) {
+            fprintf(stderr, "stat \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
         }
-
-        *exists = false;
-    }
-
-    fprintf(stderr, " writing %d blocks to %s\n", blocks, cn.c_str());
-
-    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE));
-    unique_fd fd_holder(fd);
-
-    if (fd == -1) {
-        fprintf(stderr, "failed to create \"%s\": %s\n", fn.c_str(), strerror(errno));
         return -1;
     }
 
-    if (write_all(fd, buffer, blocks * BLOCKSIZE) == -1) {
-        return -1;
-    }
+    fprintf(stderr, " loading %s\n", fn.c_str());
 
-    if (ota_fsync(fd) == -1) {
-        failure_type = kFsyncFailure;
-        fprintf(stderr, "fsync \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+    if ((sb.st_size % BLOCKSIZE) != 0) {
+        fprintf(stderr, "%s size %" PRId64 " not multiple of block size %d",
+                fn.c_str(), static_cast<int64_t>(sb.st_size), BLOCKSIZE);
         return -1;
     }
 
-    if (rename(fn.c_str(), cn.c_str()) == -1) {
-        fprintf(stderr, "rename(\"%s\", \"%s\") failed: %s\n", fn.c_str(), cn.c_str(),
-                strerror(errno));
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY));
+    unique_fd fd_holder(fd);
+
+    if (fd == -1) {
+        fprintf(stderr, "open \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
         return -1;
     }
 
-    std::string dname = GetStashFileName(base, "", "");
-    int dfd = TEMP_FAILURE_RETRY(open(dname.c_str(), O_RDONLY | O_DIRECTORY));
-    unique_fd dfd_holder(dfd);
+    allocate(sb.st_size, buffer);
 
-    if (dfd == -1) {
-        failure_type = kFileOpenFailure;
-        fprintf(stderr, "failed to open \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
+    if (read_all(fd, buffer, sb.st_size) == -1) {
         return -1;
     }
 
-    if (ota_fsync(dfd) == -1) {
-        failure_type = kFsyncFailure;
-        fprintf(stderr, "fsync \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
+    *blocks = sb.st_size / BLOCKSIZE;
+
+    if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
+        fprintf(stderr, "unexpected contents in %s\n", fn.c_str());
+        DeleteFile(fn, nullptr);
         return -1;
     }
 
@@ -718,8 +1816,11 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
 // Creates a directory for storing stash files and checks if the /cache partition
 // hash enough space for the expected amount of blocks we need to store. Returns
 // >0 if we created the directory, zero if it existed already, and <0 of failure.
+// With dryrun, which verification runs that write no stash files use, the space
+// is only planned and nothing on /cache is deleted yet.
 
-static int CreateStash(State* state, int maxblocks, const char* blockdev, std::string& base) {
+static int CreateStash(State* state, int maxblocks, const char* blockdev, std::string& base,
+        bool dryrun) {
     if (blockdev == nullptr) {
         return -1;
     }
@@ -762,7 +1863,7 @@ static int CreateStash(State* state, int maxblocks, const char* blockdev, std::s
             return -1;
         }
 
-        if (CacheSizeCheck(maxblocks * BLOCKSIZE) != 0) {
+        if (CacheSizeCheck(maxblocks * BLOCKSIZE, dryrun) != 0) {
             ErrorAbort(state, kStashCreationFailure, "not enough space for stash\n");
             return -1;
         }
@@ -782,7 +1883,7 @@ static int CreateStash(State* state, int maxblocks, const char* blockdev, std::s
 
     size = maxblocks * BLOCKSIZE - size;
 
-    if (size > 0 && CacheSizeCheck(size) != 0) {
+    if (size > 0 && CacheSizeCheck(size, dryrun) != 0) {
         ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%d more needed)\n",
                    size);
         return -1;
@@ -791,15 +1892,40 @@ static int CreateStash(State* state, int maxblocks, const char* blockdev, std::s
     return 0; // Using existing directory
 }
 
+// Same for a raw digest, as the version 3 commands carry them.
+static int VerifyBlocks(const uint8_t* expected, const std::vector<uint8_t>& buffer,
+        const size_t blocks, bool printerror) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+
+    SHA1(buffer.data(), blocks * BLOCKSIZE, digest);
+
+    if (memcmp(digest, expected, SHA_DIGEST_LENGTH) != 0) {
+        if (printerror) {
+            fprintf(stderr, "failed to verify blocks (expected %s, read %s)\n",
+                    print_sha1(expected).c_str(), print_sha1(digest).c_str());
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
 static int SaveStash(CommandParameters& params, const std::string& base,
         std::vector<uint8_t>& buffer, int fd, bool usehash) {
 
     // <stash_id> <src_range>
-    if (params.cpos + 1 >= params.tokens.size()) {
+    std::string id;
+    RangeSet src;
+    if (!params.args.NextString(&id) || !params.args.NextRange(&src)) {
         fprintf(stderr, "missing id and/or src range fields in stash command\n");
         return -1;
     }
-    const std::string& id = params.tokens[params.cpos++];
+
+    // A queued command may still be holding an overlap stash with the
+    // same name, which it deletes once its own write is durable.
+    if (!WaitForStashFree(params, id)) {
+        return -1;
+    }
 
     size_t blocks = 0;
     if (usehash && LoadStash(params, base, id, true, &blocks, buffer, false) == 0) {
@@ -809,10 +1935,10 @@ static int SaveStash(CommandParameters& params, const std::string& base,
         return 0;
     }
 
-    RangeSet src;
-    parse_range(params.tokens[params.cpos++], src);
-
     allocate(src.size * BLOCKSIZE, buffer);
+    if (!WaitForPendingWrites(params, src)) {
+        return -1;
+    }
     if (ReadBlocks(src, buffer, fd) == -1) {
         return -1;
     }
@@ -835,18 +1961,25 @@ static int SaveStash(CommandParameters& params, const std::string& base,
 
     fprintf(stderr, "stashing %zu blocks to %s\n", blocks, id.c_str());
     params.stashed += blocks;
-    return WriteStash(base, id, blocks, buffer, false, nullptr);
+    return params.stashes->Put(id, buffer, blocks, src, false, nullptr);
 }
 
-static int FreeStash(const std::string& base, const std::string& id) {
-    if (base.empty() || id.empty()) {
+static int FreeStash(StashCache* stashes, const std::string& id) {
+    if (stashes == nullptr) {
         return -1;
     }
 
-    std::string fn = GetStashFileName(base, id, "");
-    DeleteFile(fn, nullptr);
+    return stashes->Free(id);
+}
 
-    return 0;
+// Deletes a stash that is no longer needed once the commands written so
+// far are on disk.
+static int ReleaseStash(CommandParameters& params, const std::string& id) {
+    if (params.commit != nullptr) {
+        return params.commit->Free(id);
+    }
+
+    return FreeStash(params.stashes, id);
 }
 
 static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
@@ -888,31 +2021,37 @@ static int LoadSrcTgtVersion2(CommandParameters& params, RangeSet& tgt, size_t&
 
     // At least it needs to provide three parameters: <tgt_range>,
     // <src_block_count> and "-"/<src_range>.
-    if (params.cpos + 2 >= params.tokens.size()) {
+    if (!params.args.NextRange(&tgt) || params.args.empty()) {
         fprintf(stderr, "invalid parameters\n");
         return -1;
     }
 
-    // <tgt_range>
-    parse_range(params.tokens[params.cpos++], tgt);
-
     // <src_block_count>
-    const std::string& token = params.tokens[params.cpos++];
-    if (!android::base::ParseUint(token.c_str(), &src_blocks)) {
-        fprintf(stderr, "invalid src_block_count \"%s\"\n", token.c_str());
+    if (!params.args.NextNumber(&src_blocks)) {
+        fprintf(stderr, "invalid src_block_count\n");
+        return -1;
+    }
+    if (params.args.empty()) {
+        fprintf(stderr, "invalid parameters\n");
         return -1;
     }
 
     allocate(src_blocks * BLOCKSIZE, buffer);
 
     // "-" or <src_range> [<src_loc>]
-    if (params.tokens[params.cpos] == "-") {
+    if (params.args.NextDash()) {
         // no source ranges, only stashes
-        params.cpos++;
     } else {
         RangeSet src;
-        parse_range(params.tokens[params.cpos++], src);
+        if (!params.args.NextRange(&src)) {
+            fprintf(stderr, "invalid source range\n");
+            return -1;
+        }
+        if (!WaitForPendingWrites(params, src)) {
+            return -1;
+        }
         int res = ReadBlocks(src, buffer, fd);
+        params.srcranges = src;
 
         if (overlap) {
             *overlap = range_overlaps(src, tgt);
@@ -922,40 +2061,41 @@ static int LoadSrcTgtVersion2(CommandParameters& params, RangeSet& tgt, size_t&
             return -1;
         }
 
-        if (params.cpos >= params.tokens.size()) {
+        if (params.args.empty()) {
             // no stashes, only source range
             return 0;
         }
 
         RangeSet locs;
-        parse_range(params.tokens[params.cpos++], locs);
+        if (!params.args.NextRange(&locs)) {
+            fprintf(stderr, "invalid source location\n");
+            return -1;
+        }
         MoveRange(buffer, locs, buffer);
     }
 
     // <[stash_id:stash_range]>
-    while (params.cpos < params.tokens.size()) {
+    while (!params.args.empty()) {
         // Each word is a an index into the stash table, a colon, and
         // then a rangeset describing where in the source block that
         // stashed data should go.
-        std::vector<std::string> tokens = android::base::Split(params.tokens[params.cpos++], ":");
-        if (tokens.size() != 2) {
+        std::string id;
+        RangeSet locs;
+        if (!params.args.NextStashRef(&id, &locs)) {
             fprintf(stderr, "invalid parameter\n");
             return -1;
         }
 
         std::vector<uint8_t> stash;
-        int res = LoadStash(params, stashbase, tokens[0], false, nullptr, stash, true);
+        int res = LoadStash(params, stashbase, id, false, nullptr, stash, true);
 
         if (res == -1) {
             // These source blocks will fail verification if used later, but we
             // will let the caller decide if this is a fatal failure
-            fprintf(stderr, "failed to load stash %s\n", tokens[0].c_str());
+            fprintf(stderr, "failed to load stash %s\n", id.c_str());
             continue;
         }
 
-        RangeSet locs;
-        parse_range(tokens[1], locs);
-
         MoveRange(buffer, locs, stash);
     }
 
@@ -982,22 +2122,19 @@ static int LoadSrcTgtVersion2(CommandParameters& params, RangeSet& tgt, size_t&
 static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
         bool onehash, bool& overlap) {
 
-    if (params.cpos >= params.tokens.size()) {
+    // The hashes stay raw digests; only an overlap stash needs the text.
+    uint8_t srchash[SHA_DIGEST_LENGTH];
+    if (!params.args.NextHash(srchash)) {
         fprintf(stderr, "missing source hash\n");
         return -1;
     }
 
-    std::string srchash = params.tokens[params.cpos++];
-    std::string tgthash;
-
+    uint8_t tgthash[SHA_DIGEST_LENGTH];
     if (onehash) {
-        tgthash = srchash;
-    } else {
-        if (params.cpos >= params.tokens.size()) {
-            fprintf(stderr, "missing target hash\n");
-            return -1;
-        }
-        tgthash = params.tokens[params.cpos++];
+        memcpy(tgthash, srchash, SHA_DIGEST_LENGTH);
+    } else if (!params.args.NextHash(tgthash)) {
+        fprintf(stderr, "missing target hash\n");
+        return -1;
     }
 
     if (LoadSrcTgtVersion2(params, tgt, src_blocks, params.buffer, params.fd, params.stashbase,
@@ -1007,6 +2144,10 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t&
 
     std::vector<uint8_t> tgtbuffer(tgt.size * BLOCKSIZE);
 
+    if (!WaitForPendingWrites(params, tgt)) {
+        return -1;
+    }
+
     if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
         return -1;
     }
@@ -1021,12 +2162,18 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t&
         // resume from possible write errors. In verify mode, we can skip stashing
         // because the source blocks won't be overwritten.
         if (overlap && params.canwrite) {
-            fprintf(stderr, "stashing %zu overlapping blocks to %s\n", src_blocks,
-                    srchash.c_str());
+            std::string id = print_sha1(srchash);
+            fprintf(stderr, "stashing %zu overlapping blocks to %s\n", src_blocks, id.c_str());
+
+            if (!WaitForStashFree(params, id)) {
+                return -1;
+            }
 
+            // The stash only has to reach /cache before tgt is written,
+            // which is what the command is about to do.
             bool stash_exists = false;
-            if (WriteStash(params.stashbase, srchash, src_blocks, params.buffer, true,
-                           &stash_exists) != 0) {
+            if (params.stashes->Put(id, params.buffer, src_blocks, tgt, true,
+                                    &stash_exists) != 0) {
                 fprintf(stderr, "failed to stash overlapping source blocks\n");
                 return -1;
             }
@@ -1034,7 +2181,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t&
             params.stashed += src_blocks;
             // Can be deleted when the write has completed
             if (!stash_exists) {
-                params.freestash = srchash;
+                params.freestash = id;
             }
         }
 
@@ -1042,8 +2189,8 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t&
         return 0;
     }
 
-    if (overlap && LoadStash(params, params.stashbase, srchash, true, nullptr, params.buffer,
-                             true) == 0) {
+    if (overlap && LoadStash(params, params.stashbase, print_sha1(srchash), true, nullptr,
+                             params.buffer, true) == 0) {
         // Overlapping source blocks were previously stashed, command can proceed.
         // We are recovering from an interrupted command, so we don't know if the
         // stash can safely be deleted after this command.
@@ -1087,6 +2234,22 @@ static int PerformCommandMove(CommandParameters& params) {
         if (status == 0) {
             fprintf(stderr, "  moving %zu blocks\n", blocks);
 
+            if (!ProtectStashes(params, tgt)) {
+                return -1;
+            }
+
+            if (params.pipeline != nullptr) {
+                PipelineJob* job = new PipelineJob(tgt);
+                job->line = params.line;
+                job->srcranges = params.srcranges;
+                job->src.swap(params.buffer);
+                job->src_blocks = blocks;
+                job->patch.data = nullptr;
+                job->freestash.swap(params.freestash);
+                params.written += tgt.size;
+                return params.pipeline->Submit(job) ? 0 : -1;
+            }
+
             if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
                 return -1;
             }
@@ -1097,7 +2260,7 @@ static int PerformCommandMove(CommandParameters& params) {
     }
 
     if (!params.freestash.empty()) {
-        FreeStash(params.stashbase, params.freestash);
+        ReleaseStash(params, params.freestash);
         params.freestash.clear();
     }
 
@@ -1113,20 +2276,19 @@ static int PerformCommandStash(CommandParameters& params) {
 
 static int PerformCommandFree(CommandParameters& params) {
     // <stash_id>
-    if (params.cpos >= params.tokens.size()) {
+    std::string id;
+    if (!params.args.NextString(&id)) {
         fprintf(stderr, "missing stash id in free command\n");
         return -1;
     }
 
-    const std::string& id = params.tokens[params.cpos++];
-
     if (!params.canwrite && stash_map.find(id) != stash_map.end()) {
         stash_map.erase(id);
         return 0;
     }
 
     if (params.createdstash || params.canwrite) {
-        return FreeStash(params.stashbase, id);
+        return ReleaseStash(params, id);
     }
 
     return 0;
@@ -1134,20 +2296,22 @@ static int PerformCommandFree(CommandParameters& params) {
 
 static int PerformCommandZero(CommandParameters& params) {
 
-    if (params.cpos >= params.tokens.size()) {
+    RangeSet tgt;
+    if (!params.args.NextRange(&tgt)) {
         fprintf(stderr, "missing target blocks for zero\n");
         return -1;
     }
 
-    RangeSet tgt;
-    parse_range(params.tokens[params.cpos++], tgt);
-
     fprintf(stderr, "  zeroing %zu blocks\n", tgt.size);
 
     allocate(BLOCKSIZE, params.buffer);
     memset(params.buffer.data(), 0, BLOCKSIZE);
 
     if (params.canwrite) {
+        if (!ProtectStashes(params, tgt)) {
+            return -1;
+        }
+
         for (size_t i = 0; i < tgt.count; ++i) {
             off64_t offset = static_cast<off64_t>(tgt.pos[i * 2]) * BLOCKSIZE;
             size_t size = (tgt.pos[i * 2 + 1] - tgt.pos[i * 2]) * BLOCKSIZE;
@@ -1178,40 +2342,30 @@ static int PerformCommandZero(CommandParameters& params) {
 
 static int PerformCommandNew(CommandParameters& params) {
 
-    if (params.cpos >= params.tokens.size()) {
+    RangeSet tgt;
+    if (!params.args.NextRange(&tgt)) {
         fprintf(stderr, "missing target blocks for new\n");
         return -1;
     }
 
-    RangeSet tgt;
-    parse_range(params.tokens[params.cpos++], tgt);
-
     if (params.canwrite) {
         fprintf(stderr, " writing %zu blocks of new data\n", tgt.size);
 
-        RangeSinkState rss(tgt);
-        rss.fd = params.fd;
-        rss.p_block = 0;
-        rss.p_remain = (tgt.pos[1] - tgt.pos[0]) * BLOCKSIZE;
-
-        off64_t offset = static_cast<off64_t>(tgt.pos[0]) * BLOCKSIZE;
-        if (!discard_blocks(params.fd, offset, tgt.size * BLOCKSIZE)) {
+        if (!ProtectStashes(params, tgt)) {
             return -1;
         }
 
-        if (!check_lseek(params.fd, offset, SEEK_SET)) {
-            return -1;
+        for (size_t i = 0; i < tgt.count; ++i) {
+            off64_t offset = static_cast<off64_t>(tgt.pos[i * 2]) * BLOCKSIZE;
+            size_t size = (tgt.pos[i * 2 + 1] - tgt.pos[i * 2]) * BLOCKSIZE;
+            if (!discard_blocks(params.fd, offset, size)) {
+                return -1;
+            }
         }
 
-        pthread_mutex_lock(&params.nti.mu);
-        params.nti.rss = &rss;
-        pthread_cond_broadcast(&params.nti.cv);
-
-        while (params.nti.rss) {
-            pthread_cond_wait(&params.nti.cv, &params.nti.mu);
+        if (!params.nti.ring->Write(params.fd, tgt)) {
+            return -1;
         }
-
-        pthread_mutex_unlock(&params.nti.mu);
     }
 
     params.written += tgt.size;
@@ -1222,20 +2376,10 @@ static int PerformCommandNew(CommandParameters& params) {
 static int PerformCommandDiff(CommandParameters& params) {
 
     // <offset> <length>
-    if (params.cpos + 1 >= params.tokens.size()) {
-        fprintf(stderr, "missing patch offset or length for %s\n", params.cmdname);
-        return -1;
-    }
-
     size_t offset;
-    if (!android::base::ParseUint(params.tokens[params.cpos++].c_str(), &offset)) {
-        fprintf(stderr, "invalid patch offset\n");
-        return -1;
-    }
-
     size_t len;
-    if (!android::base::ParseUint(params.tokens[params.cpos++].c_str(), &len)) {
-        fprintf(stderr, "invalid patch offset\n");
+    if (!params.args.NextNumber(&offset) || !params.args.NextNumber(&len)) {
+        fprintf(stderr, "missing or invalid patch offset or length for %s\n", params.cmdname);
         return -1;
     }
 
@@ -1267,11 +2411,28 @@ static int PerformCommandDiff(CommandParameters& params) {
         if (status == 0) {
             fprintf(stderr, "patching %zu blocks to %zu\n", blocks, tgt.size);
 
+            if (!ProtectStashes(params, tgt)) {
+                return -1;
+            }
+
             Value patch_value;
             patch_value.type = VAL_BLOB;
             patch_value.size = len;
             patch_value.data = (char*) (params.patch_start + offset);
 
+            if (params.pipeline != nullptr) {
+                PipelineJob* job = new PipelineJob(tgt);
+                job->line = params.line;
+                job->srcranges = params.srcranges;
+                job->src.swap(params.buffer);
+                job->src_blocks = blocks;
+                job->patch = patch_value;
+                job->imgdiff = (params.cmdname[0] == 'i');
+                job->freestash.swap(params.freestash);
+                params.written += tgt.size;
+                return params.pipeline->Submit(job) ? 0 : -1;
+            }
+
             RangeSinkState rss(tgt);
             rss.fd = params.fd;
             rss.p_block = 0;
@@ -1306,12 +2467,12 @@ static int PerformCommandDiff(CommandParameters& params) {
             }
         } else {
             fprintf(stderr, "skipping %zu blocks already patched to %zu [%s]\n",
-                blocks, tgt.size, params.cmdline);
+                blocks, tgt.size, params.list->Text(params.line).c_str());
         }
     }
 
     if (!params.freestash.empty()) {
-        FreeStash(params.stashbase, params.freestash);
+        ReleaseStash(params, params.freestash);
         params.freestash.clear();
     }
 
@@ -1336,17 +2497,19 @@ static int PerformCommandErase(CommandParameters& params) {
         return -1;
     }
 
-    if (params.cpos >= params.tokens.size()) {
+    RangeSet tgt;
+    if (!params.args.NextRange(&tgt)) {
         fprintf(stderr, "missing target blocks for erase\n");
         return -1;
     }
 
-    RangeSet tgt;
-    parse_range(params.tokens[params.cpos++], tgt);
-
     if (params.canwrite) {
         fprintf(stderr, " erasing %zu blocks\n", tgt.size);
 
+        if (!ProtectStashes(params, tgt)) {
+            return -1;
+        }
+
         for (size_t i = 0; i < tgt.count; ++i) {
             uint64_t blocks[2];
             // offset in bytes
@@ -1370,6 +2533,7 @@ typedef int (*CommandFunction)(CommandParameters&);
 struct Command {
     const char* name;
     CommandFunction f;
+    TracePhase phase;
 };
 
 // CompareCommands and CompareCommandNames are for the hash table
@@ -1382,6 +2546,99 @@ static int CompareCommandNames(const void* c1, const void* c2) {
     return strcmp(((const Command*) c1)->name, (const char*) c2);
 }
 
+// Move, bsdiff, imgdiff and stash only read the partition through
+// WaitForPendingWrites, so they may run while earlier transfers are
+// still in the pipeline. All other commands drain it first.
+
+static bool IsPipelinedCommand(const Command* cmd) {
+    return cmd->f == PerformCommandMove || cmd->f == PerformCommandDiff ||
+           cmd->f == PerformCommandStash;
+}
+
+// Commands that are handed to the group commit once they have written.
+
+static bool WritesPartition(const Command* cmd) {
+    return cmd->f == PerformCommandMove || cmd->f == PerformCommandDiff ||
+           cmd->f == PerformCommandZero || cmd->f == PerformCommandNew ||
+           cmd->f == PerformCommandErase;
+}
+
+// Accounts for a command before the resume point of the journal, whose
+// writes are known to be on disk.  Returns 1 if the command is done, 0
+// if it has to run anyway and -1 on error.  Stashes still have to be
+// loaded, as only the ones on /cache survived, unless the stash is
+// freed before the resume point as well.
+
+static int SkipDurableCommand(CommandParameters& params, const Command* cmd, bool deadstash) {
+    if (cmd->f == PerformCommandStash) {
+        return deadstash ? 1 : 0;
+    }
+    if (!WritesPartition(cmd)) {
+        return 0;
+    }
+
+    // Version 3 syntax:
+    //    move <srchash> <tgt_range> ...
+    //    bsdiff|imgdiff <offset> <length> <srchash> <tgthash> <tgt_range> ...
+    size_t skip = 0;
+    if (cmd->f == PerformCommandMove) {
+        skip = 1;
+    } else if (cmd->f == PerformCommandDiff) {
+        skip = 4;
+    }
+    for (size_t i = 0; i < skip; ++i) {
+        params.args.Skip();
+    }
+
+    RangeSet tgt;
+    if (!params.args.NextRange(&tgt)) {
+        fprintf(stderr, "missing target blocks for %s\n", params.cmdname);
+        return -1;
+    }
+
+    if (cmd->f == PerformCommandNew) {
+        // The new data stream still has to be read past this command's part.
+        if (!params.nti.ring->Write(-1, tgt)) {
+            return -1;
+        }
+    }
+
+    if (cmd->f != PerformCommandErase) {
+        params.written += tgt.size;
+    }
+
+    return 1;
+}
+
+// Finds the stash commands before line resume whose stash is freed before
+// it too, so that nothing after the resume point can need them.
+
+static std::vector<bool> FindDeadStashes(const TransferList& list, size_t resume) {
+    std::vector<bool> dead(list.end(), false);
+    std::map<std::string, size_t> live;
+    TransferArgs args;
+
+    for (size_t i = list.first(); i < resume && i < list.end(); ++i) {
+        const char* name = list.Load(i, &args);
+        std::string id;
+        if (name == nullptr || !args.NextString(&id)) {
+            continue;
+        }
+
+        if (strcmp(name, "stash") == 0) {
+            live[id] = i;
+        } else if (strcmp(name, "free") == 0) {
+            auto it = live.find(id);
+            if (it != live.end()) {
+                dead[it->second] = true;
+                live.erase(it);
+            }
+        }
+    }
+
+    return dead;
+}
+
 // HashString is used to hash command names for the hash table
 
 static unsigned int HashString(const char *s) {
@@ -1484,79 +2741,91 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
         return StringValue(strdup(""));
     }
 
-    if (params.canwrite) {
-        params.nti.za = za;
-        params.nti.entry = new_entry;
-
-        pthread_mutex_init(&params.nti.mu, nullptr);
-        pthread_cond_init(&params.nti.cv, nullptr);
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-
-        int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
-        if (error != 0) {
-            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
-            return StringValue(strdup(""));
-        }
-    }
-
-    // Copy all the lines in transfer_list_value into std::string for
-    // processing.
-    const std::string transfer_list(transfer_list_value->data, transfer_list_value->size);
-    std::vector<std::string> lines = android::base::Split(transfer_list, "\n");
-    if (lines.size() < 2) {
-        ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zd]\n",
-                   lines.size());
-        return StringValue(strdup(""));
-    }
-
-    // First line in transfer list is the version number
-    if (!android::base::ParseInt(lines[0].c_str(), &params.version, 1, 4)) {
-        fprintf(stderr, "unexpected transfer list version [%s]\n", lines[0].c_str());
+    // The list is walked in place; binary lists need no further parsing
+    // at all.
+    TransferList tl;
+    if (!tl.Parse(reinterpret_cast<const uint8_t*>(transfer_list_value->data),
+                  transfer_list_value->size)) {
+        ErrorAbort(state, kArgsParsingFailure, "failed to parse the transfer list\n");
         return StringValue(strdup(""));
     }
+    params.list = &tl;
+    params.version = tl.version();
 
-    fprintf(stderr, "blockimg version is %d\n", params.version);
-
-    // Second line in transfer list is the total number of blocks we expect to write
-    int total_blocks;
-    if (!android::base::ParseInt(lines[1].c_str(), &total_blocks, 0)) {
-        ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%s]\n", lines[1].c_str());
-        return StringValue(strdup(""));
-    }
+    fprintf(stderr, "blockimg version is %d%s\n", params.version, tl.binary() ? " (binary)" : "");
 
+    int total_blocks = tl.total_blocks();
     if (total_blocks == 0) {
         return StringValue(strdup("t"));
     }
 
-    size_t start = 2;
     if (params.version >= 2) {
-        if (lines.size() < 4) {
-            ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zu]\n",
-                       lines.size());
+        fprintf(stderr, "maximum stash entries %d\n", tl.stash_entries());
+
+        // Verifying a version 3+ list stashes no blocks, only ranges.
+        int res = CreateStash(state, tl.stash_max_blocks(), blockdev_filename->data,
+                              params.stashbase, !params.canwrite && params.version >= 3);
+        if (res == -1) {
             return StringValue(strdup(""));
         }
 
-        // Third line is how many stash entries are needed simultaneously
-        fprintf(stderr, "maximum stash entries %s\n", lines[2].c_str());
+        params.createdstash = res;
+    }
 
-        // Fourth line is the maximum number of blocks that will be stashed simultaneously
-        int stash_max_blocks;
-        if (!android::base::ParseInt(lines[3].c_str(), &stash_max_blocks, 0)) {
-            ErrorAbort(state, kArgsParsingFailure, "unexpected maximum stash blocks [%s]\n",
-                       lines[3].c_str());
-            return StringValue(strdup(""));
+    std::unique_ptr<StashCache> stashes(new StashCache(params.stashbase));
+    params.stashes = stashes.get();
+
+    std::unique_ptr<GroupCommit> commit;
+    size_t resume = 0;
+    std::vector<bool> deadstashes;
+    if (params.canwrite) {
+        commit.reset(new GroupCommit(params.fd, params.stashes));
+        params.commit = commit.get();
+
+        // Earlier versions have no hashes to tell which stashes are still
+        // valid, so they always start from the top.
+        if (params.version >= 3) {
+            uint8_t digest[SHA_DIGEST_LENGTH];
+            SHA1(reinterpret_cast<const uint8_t*>(transfer_list_value->data),
+                 transfer_list_value->size, digest);
+            resume = commit->OpenJournal(GetStashFileName(params.stashbase, JOURNAL_NAME, ""),
+                                         print_sha1(digest));
+            if (resume > tl.first()) {
+                fprintf(stderr, "resuming from line %zu\n", resume);
+                deadstashes = FindDeadStashes(tl, resume);
+            } else {
+                resume = 0;
+            }
         }
+    }
 
-        int res = CreateStash(state, stash_max_blocks, blockdev_filename->data, params.stashbase);
-        if (res == -1) {
+    std::unique_ptr<TransferPipeline> pipeline;
+    if (params.canwrite) {
+        pipeline.reset(new TransferPipeline(params.fd, params.commit));
+        if (!pipeline->Start()) {
             return StringValue(strdup(""));
         }
+        params.pipeline = pipeline.get();
+    }
 
-        params.createdstash = res;
+    // The inflater is started last, so that every return after this
+    // point goes through pbiudone and stops it.
+    std::unique_ptr<NewDataRing> ring;
+    if (params.canwrite) {
+        ring.reset(new NewDataRing());
+        params.nti.za = za;
+        params.nti.entry = new_entry;
+        params.nti.ring = ring.get();
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-        start += 2;
+        int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
+        if (error != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            return StringValue(strdup(""));
+        }
     }
 
     // Build a hash table of the available commands
@@ -1569,18 +2838,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
     }
 
     int rc = -1;
+    size_t reported = 0;
 
     // Subsequent lines are all individual transfer commands
-    for (auto it = lines.cbegin() + start; it != lines.cend(); it++) {
-        const std::string& line_str(*it);
-        if (line_str.empty()) {
+    for (size_t line = tl.first(); line < tl.end(); ++line) {
+        params.cmdname = tl.Load(line, &params.args);
+        if (params.cmdname == nullptr) {
             continue;
         }
 
-        params.tokens = android::base::Split(line_str, " ");
-        params.cpos = 0;
-        params.cmdname = params.tokens[params.cpos++].c_str();
-        params.cmdline = line_str.c_str();
+        params.line = line;
+        params.srcranges = RangeSet();
 
         unsigned int cmdhash = HashString(params.cmdname);
         const Command* cmd = reinterpret_cast<const Command*>(mzHashTableLookup(cmdht, cmdhash,
@@ -1592,27 +2860,68 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
             goto pbiudone;
         }
 
-        if (cmd->f != nullptr && cmd->f(params) == -1) {
-            fprintf(stderr, "failed to execute command [%s]\n", line_str.c_str());
+        bool pipelined = params.pipeline != nullptr && IsPipelinedCommand(cmd);
+        if (params.pipeline != nullptr && !pipelined && !params.pipeline->Drain()) {
+            fprintf(stderr, "failed to complete queued commands before [%s]\n",
+                    tl.Text(line).c_str());
             goto pbiudone;
         }
 
+        size_t written = params.written;
+        int skipped = 0;
+        if (params.line < resume) {
+            skipped = SkipDurableCommand(params, cmd, deadstashes[params.line]);
+            if (skipped == -1) {
+                fprintf(stderr, "failed to skip command [%s]\n", tl.Text(line).c_str());
+                goto pbiudone;
+            }
+        }
+
+        if (skipped == 0 && cmd->f != nullptr) {
+            // Pipelined commands leave their writes to the writer thread;
+            // only loading the data is timed here.
+            TraceScope trace(cmd->phase);
+            if (cmd->f(params) == -1) {
+                fprintf(stderr, "failed to execute command [%s]\n",
+                        tl.Text(line).c_str());
+                goto pbiudone;
+            }
+        }
+
         if (params.canwrite) {
-            if (ota_fsync(params.fd) == -1) {
-                failure_type = kFsyncFailure;
-                fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+            // Pipelined transfers are handed to the group commit by the
+            // writer thread.
+            if (skipped == 0 && !pipelined && WritesPartition(cmd) &&
+                    !params.commit->Done(params.line, params.srcranges,
+                                         (params.written - written) * BLOCKSIZE, "")) {
                 goto pbiudone;
             }
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double) params.written / total_blocks);
-            fflush(cmd_pipe);
+            // One update per 0.1% is plenty for the progress bar.
+            if ((params.written - reported) * 1000 >= static_cast<size_t>(total_blocks)) {
+                fprintf(cmd_pipe, "set_progress %.4f\n", (double) params.written / total_blocks);
+                fflush(cmd_pipe);
+                reported = params.written;
+            }
         }
     }
 
     if (params.canwrite) {
-        pthread_join(params.thread, nullptr);
+        if (!params.pipeline->Drain()) {
+            fprintf(stderr, "failed to complete queued commands\n");
+            goto pbiudone;
+        }
+
+        if (!params.commit->Commit()) {
+            goto pbiudone;
+        }
+
+        fprintf(cmd_pipe, "set_progress %.4f\n", (double) params.written / total_blocks);
+        fflush(cmd_pipe);
 
         fprintf(stderr, "wrote %zu blocks; expected %d\n", params.written, total_blocks);
         fprintf(stderr, "stashed %zu blocks\n", params.stashed);
+        params.stashes->LogStats();
+        params.commit->LogStats();
         fprintf(stderr, "max alloc needed was %zu\n", params.buffer.size());
 
         const char* partition = strrchr(blockdev_filename->data, '/');
@@ -1625,6 +2934,7 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
         }
         // Delete stash only after successfully completing the update, as it
         // may contain blocks needed to complete the update later.
+        params.stashes->Clear();
         DeleteStash(params.stashbase);
     } else {
         fprintf(stderr, "verified partition contents; update may be resumed\n");
@@ -1633,7 +2943,28 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
     rc = 0;
 
 pbiudone:
-    if (ota_fsync(params.fd) == -1) {
+    // Let queued transfers that loaded successfully reach the disk, so
+    // the partition is left in the same state as a serial run would
+    // have left it.
+    if (params.pipeline != nullptr) {
+        params.pipeline->Drain();
+        pipeline.reset();
+        params.pipeline = nullptr;
+    }
+
+    // Nothing reads the new data stream anymore; stop the inflater in
+    // case the update failed before it was done.
+    if (params.nti.ring != nullptr) {
+        params.nti.ring->Cancel();
+        pthread_join(params.thread, nullptr);
+        params.nti.ring = nullptr;
+    }
+
+    // Whatever reached the partition is committed, so a resumed update
+    // can skip it.
+    if (params.commit != nullptr) {
+        params.commit->Commit();
+    } else if (ota_fsync(params.fd) == -1) {
         failure_type = kFsyncFailure;
         fprintf(stderr, "fsync failed: %s\n", strerror(errno));
     }
@@ -1642,6 +2973,7 @@ pbiudone:
     // Only delete the stash if the update cannot be resumed, or it's
     // a verification run and we created the stash.
     if (params.isunresumable || (!params.canwrite && params.createdstash)) {
+        params.stashes->Clear();
         DeleteStash(params.stashbase);
     }
 
@@ -1711,14 +3043,14 @@ pbiudone:
 Value* BlockImageVerifyFn(const char* name, State* state, int argc, Expr* argv[]) {
     // Commands which are not tested are set to nullptr to skip them completely
     const Command commands[] = {
-        { "bsdiff",     PerformCommandDiff  },
-        { "erase",      nullptr             },
-        { "free",       PerformCommandFree  },
-        { "imgdiff",    PerformCommandDiff  },
-        { "move",       PerformCommandMove  },
-        { "new",        nullptr             },
-        { "stash",      PerformCommandStash },
-        { "zero",       nullptr             }
+        { "bsdiff",     PerformCommandDiff,  TRACE_CMD_BSDIFF },
+        { "erase",      nullptr,             TRACE_CMD_ERASE },
+        { "free",       PerformCommandFree,  TRACE_CMD_FREE },
+        { "imgdiff",    PerformCommandDiff,  TRACE_CMD_IMGDIFF },
+        { "move",       PerformCommandMove,  TRACE_CMD_MOVE },
+        { "new",        nullptr,             TRACE_CMD_NEW },
+        { "stash",      PerformCommandStash, TRACE_CMD_STASH },
+        { "zero",       nullptr,             TRACE_CMD_ZERO }
     };
 
     // Perform a dry run without writing to test if an update can proceed
@@ -1728,14 +3060,14 @@ Value* BlockImageVerifyFn(const char* name, State* state, int argc, Expr* argv[]
 
 Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]) {
     const Command commands[] = {
-        { "bsdiff",     PerformCommandDiff  },
-        { "erase",      PerformCommandErase },
-        { "free",       PerformCommandFree  },
-        { "imgdiff",    PerformCommandDiff  },
-        { "move",       PerformCommandMove  },
-        { "new",        PerformCommandNew   },
-        { "stash",      PerformCommandStash },
-        { "zero",       PerformCommandZero  }
+        { "bsdiff",     PerformCommandDiff,  TRACE_CMD_BSDIFF },
+        { "erase",      PerformCommandErase, TRACE_CMD_ERASE },
+        { "free",       PerformCommandFree,  TRACE_CMD_FREE },
+        { "imgdiff",    PerformCommandDiff,  TRACE_CMD_IMGDIFF },
+        { "move",       PerformCommandMove,  TRACE_CMD_MOVE },
+        { "new",        PerformCommandNew,   TRACE_CMD_NEW },
+        { "stash",      PerformCommandStash, TRACE_CMD_STASH },
+        { "zero",       PerformCommandZero,  TRACE_CMD_ZERO }
     };
 
     return PerformBlockImageUpdate(name, state, argc, argv, commands,
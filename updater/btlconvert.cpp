@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: convert block image transfer lists (see transfer_list.h)
+// between the text and the binary format.
+//
+//   btlconvert IN OUT
+//
+// The format of IN is detected; OUT gets the other one.  A binary
+// system.transfer.list can be dropped into an OTA package in place of
+// the text one, block_image_update() accepts both.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+
+#include "transfer_list.h"
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s IN OUT\n", argv[0]);
+        return 2;
+    }
+
+    std::string in;
+    if (!android::base::ReadFileToString(argv[1], &in)) {
+        fprintf(stderr, "failed to read %s\n", argv[1]);
+        return 1;
+    }
+
+    // Binary lists are read in place, which needs aligned tables.
+    std::vector<uint32_t> data((in.size() + 3) / 4);
+    memcpy(data.data(), in.data(), in.size());
+
+    TransferList list;
+    if (!list.Parse(reinterpret_cast<const uint8_t*>(data.data()), in.size())) {
+        fprintf(stderr, "failed to parse %s\n", argv[1]);
+        return 1;
+    }
+
+    std::string out;
+    if (list.binary() ? !list.ToText(&out) : !list.ToBinary(&out)) {
+        return 1;
+    }
+
+    if (!android::base::WriteStringToFile(out, argv[2])) {
+        fprintf(stderr, "failed to write %s\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: %zu -> %zu bytes\n", list.binary() ? "binary to text" : "text to binary",
+            in.size(), out.size());
+    return 0;
+}
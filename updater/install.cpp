@@ -1180,11 +1180,15 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
                 partition, strerror(errno));
     }
 
+    // Blocks are written in the background, so a failure can also show
+    // up here.
     if (mtd_erase_blocks(ctx, -1) == (off64_t)-1) {
         fprintf(stderr, "%s: error erasing blocks of %s\n", name, partition);
+        success = false;
     }
     if (mtd_write_close(ctx) != 0) {
         fprintf(stderr, "%s: error closing write of %s\n", name, partition);
+        success = false;
     }
 
     printf("%s %s partition\n",
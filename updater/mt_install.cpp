@@ -23,7 +23,7 @@
 #include "minzip/DirUtil.h"
 
 #ifdef MTK_SLC_BUFFER_SUPPORT
-#include "sparse_format.h"
+#include "mt_sparse.h"
 #endif
 
 #ifdef USE_EXT4
@@ -544,189 +544,6 @@ Value* mtSwitchActiveFn(const char* name, State* state, int argc, Expr* argv[])
 }
 
 #ifdef MTK_SLC_BUFFER_SUPPORT
-static void show_sparse_header(sparse_header_t *sparse_header)
-{
-   printf("=== Sparse Image Header ===\n");
-   printf("Read Sparse Image Header = %d \n",sizeof(sparse_header_t));
-   printf("magic: 0x%x\n", sparse_header->magic);
-   printf("major_version: 0x%x\n", sparse_header->major_version);
-   printf("minor_version: 0x%x\n", sparse_header->minor_version);
-   printf("file_hdr_sz: %d\n", sparse_header->file_hdr_sz);
-   printf("chunk_hdr_sz: %d\n", sparse_header->chunk_hdr_sz);
-   printf("blk_sz: %d\n", sparse_header->blk_sz);
-   printf("total_blks: %d\n", sparse_header->total_blks);
-}
-
-static void show_chunk_header(chunk_header_t *chunk_header)
-{
-   printf("=== Chunk Header ===\n");
-   printf("Read Chunk Header = %d \n",sizeof(chunk_header_t));
-   printf("chunk_type: 0x%x\n", chunk_header->chunk_type);
-   printf("chunk_sz: %d\n", chunk_header->chunk_sz);
-   printf("total_size: 0x%x\n", chunk_header->total_sz);
-}
-
-
-static bool receive_new_sparse_data(const unsigned char* data, int size, void* cookie) {
-    int* fd = (int*) cookie;
-    static char *tmp_buf = NULL , *tmp_buf_head = NULL;
-    static int state = HANDL_SPARESE_INIT_STATE;
-    static int blk_remain = 0, blk_size = 0, total_chunk = 0, total_blks = 0, data_remain = 0;
-    static int chunk_hdr_size = 0;;
-    int copy_size = 0 ,written = 0, input_size = 0;
-
-    input_size = size;
-
-    while(1)
-    {
-        /* 1. Handle Sparse and 1st chunk header */
-        if(state == HANDL_SPARESE_INIT_STATE) {
-            sparse_header_t* sparse_header = (sparse_header_t*) data;  /* Assign sparse header */
-            if(sparse_header->magic != SPARSE_HEADER_MAGIC)
-            {
-               printf("First data must be sparse header\n");
-               if(tmp_buf_head)  free(tmp_buf_head);
-               return false;
-            }
-            else
-            {
-               printf("Data stream has a sparse header block size = %d\n", sparse_header->blk_sz);
-
-               tmp_buf = (char *)malloc(sparse_header->blk_sz); /* Malloc block size temp buffer */
-               tmp_buf_head = tmp_buf;
-
-               if(tmp_buf == NULL)  {
-                  printf("receive_new_sparse_data malloc error \n");
-                  if(tmp_buf_head)  free(tmp_buf_head);
-                  return false;
-               }
-
-                // show_sparse_header(sparse_header);
-
-                /* Skip spares header data and size */
-                data += sparse_header->file_hdr_sz;
-                size -= sparse_header->file_hdr_sz;
-
-                total_blks = sparse_header->total_blks;
-                blk_remain = sparse_header->blk_sz;
-                blk_size = sparse_header->blk_sz;
-                chunk_hdr_size = sparse_header->chunk_hdr_sz;
-                state = HANDLE_CHUNK_HEADER;
-            }
-        }
-
-        /* 2. Handle Chunk header */
-        if(state == HANDLE_CHUNK_HEADER)
-        {
-            chunk_header_t* chunk_header = (chunk_header_t*) data;  /* Assign chunk header */
-            //printf("chunk header\n");
-            //show_chunk_header(chunk_header);
-
-            /* Skip chunk header data and size */
-            data += chunk_hdr_size;
-            size -= chunk_hdr_size;
-
-            /* The number of total chunk write */
-            total_chunk = chunk_header->chunk_sz;
-
-            if(chunk_header->chunk_type == CHUNK_TYPE_RAW)
-            {
-                //printf("CHUNK_TYPE_RAW\n");
-                state = PREPARE_BLOCK_SIZE_BUFFER;
-            }
-            else if(chunk_header->chunk_type == CHUNK_TYPE_DONT_CARE)
-            {
-                //printf("CHUNK_TYPE_DONT_CARE\n");
-                if(TEMP_FAILURE_RETRY(lseek(*fd, total_chunk*blk_size, SEEK_CUR) == -1)) {
-                    printf("lseek error %s", strerror(errno));
-                    if(tmp_buf_head)  free(tmp_buf_head);
-                    return false;
-                }
-                total_blks -= total_chunk;
-            }
-       }
-
-        /* 3. Collect block size buffer */
-        if(state == PREPARE_BLOCK_SIZE_BUFFER)
-        {
-            if(blk_remain > size) {
-                copy_size = size;
-            } else {
-                copy_size = blk_remain;
-            }
-            memcpy(tmp_buf,data,copy_size);
-            data += copy_size;
-            tmp_buf += copy_size;
-            blk_remain -= copy_size;
-            size -= copy_size;
-            if(blk_remain == 0)
-            {
-               tmp_buf = tmp_buf_head; /* reset buffer head */
-               //printf("Collect buffer done write it to MTD\n");
-               //printf("copy size = %d\n", copy_size);
-               blk_remain = blk_size; /* reset blk_remain size  */
-               state = READ_BLOCK_SIZE_DATA_DONE;
-            }
-            else if(size == 0){
-               break;
-            }
-       }
-
-        /* 4. Write block size buffer to MTD */
-        if(state == READ_BLOCK_SIZE_DATA_DONE)
-        {
-           written = write(*fd, tmp_buf_head, blk_size);
-           //printf("4. Write block size buffer to MTD fd = %d written = %d blk_size = %d\n", *fd,written,blk_size);
-           if(written != blk_size)
-           {
-              //printf("write error written is %d\n", written);
-              if(tmp_buf_head)  free(tmp_buf_head);
-              return false;
-           }
-           total_blks--;
-           total_chunk--;
-
-           if(total_blks >0)  {
-               //printf("Continue prepare block size\n");
-               if(total_chunk == 0)
-               {
-                  //printf("Read next chunk header\n");
-                  state = HANDLE_CHUNK_HEADER;
-               }
-               else if(total_chunk > 0)
-               {
-                   if(copy_size != input_size)
-                   {
-                      data_remain = input_size-copy_size;
-                      //printf("The new remain size is %d\n", data_remain);
-                      if(data_remain < 0)
-                      {
-                          printf("Error %d", data_remain);
-                      }
-                      else
-                      {
-                          memcpy(tmp_buf,data,data_remain);
-                          tmp_buf += data_remain;
-                          blk_remain -= data_remain;
-                      }
-                   }
-
-                   state = PREPARE_BLOCK_SIZE_BUFFER;
-                   break;
-               }
-           }
-           else
-           {
-               if(tmp_buf_head)  free(tmp_buf_head);
-               //printf("Wrtie finished total_blks = %d\n",total_blks);
-               state = WRITE_DONE;
-               break;
-           }
-       }
-   }
-   return true;
-}
-
 static int mt_write_sparse_image(State* state, const char* sparse_image, const char* partition) {
     ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
     pthread_attr_t attr;
@@ -777,7 +594,17 @@ static int mt_write_sparse_image(State* state, const char* sparse_image, const c
     }
 
     fd = TEMP_FAILURE_RETRY(open(dev_name, O_RDWR));
-    ret = mzProcessZipEntryContents(za, sparse_entry, receive_new_sparse_data, &fd);
+    if (fd == -1) {
+        printf("failed to open %s: %s\n", dev_name, strerror(errno));
+        return MT_FN_FAIL_EXIT;
+    }
+
+    // The whole partition has just been erased, so blocks that would be
+    // filled with the erased pattern can be skipped.
+    SparseWriter writer(fd);
+    writer.set_erased_value(0xffffffff);
+    ret = mzProcessZipEntryContents(za, sparse_entry, SparseWriterProcess, &writer) &&
+          writer.Finish();
     close(fd);
     printf("Error = %d\n", ret);
     return ret;
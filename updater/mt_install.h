@@ -29,15 +29,6 @@
 #define MT_FN_CONTINUE          (MT_FN_SUCCESS_CONTINUE | MT_FN_FAIL_CONTINUE)
 #define MT_FN_EXIT              (MT_FN_SUCCESS_EXIT | MT_FN_FAIL_EXIT)
 
-/* Handle sparse image state machine */
-#define HANDL_SPARESE_INIT_STATE   0x1000
-#define HANDLE_CHUNK_HEADER        0x1001
-#define PREPARE_BLOCK_SIZE_BUFFER  0x1002
-#define READ_BLOCK_SIZE_DATA_DONE  0x1003
-#define WRITE_BLOCK_SIZE_DATA_DONE 0x1004
-#define DONT_CARE_DATA             0x1005
-#define WRITE_DONE                 0x1006
-
 /* Common */
 int remove_dir(const char *dirname);
 void mt_init_partition_type(void);
@@ -0,0 +1,437 @@
+/*
+* Copyright (C) 2016 MediaTek Inc.
+* Modification based on code covered by the mentioned copyright
+* and/or permission notice(s).
+*/
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <zlib.h>
+
+#include "sparse_format.h"
+#include "mt_sparse.h"
+
+// Number of iovecs collected before they are written out.
+#define SPARSE_MAX_IOVECS 64
+
+// Size of the buffer FILL chunks are expanded into, when they have to be
+// written out.
+#define SPARSE_FILL_BUFFER_SIZE (64 * 1024)
+
+// Appends count copies of a piece with the given CRC32 and length to crc.
+// Lengths handed to zlib are kept below 2^30, so they fit in any z_off_t.
+static uint32_t crc32_repeat(uint32_t crc, uint32_t piece_crc, size_t piece_len,
+        uint64_t count) {
+    while (count > 0) {
+        uLong c = piece_crc;
+        uint64_t len = piece_len;
+        uint64_t n = 1;
+        while (n * 2 <= count && len * 2 <= (1 << 30)) {
+            c = crc32_combine(c, c, len);
+            len *= 2;
+            n *= 2;
+        }
+        crc = crc32_combine(crc, c, len);
+        count -= n;
+    }
+    return crc;
+}
+
+SparseWriter::SparseWriter(int fd) :
+        fd_(fd), state_(kFileHeader), next_(kFileHeader), blk_size_(0), chunk_hdr_size_(0),
+        total_blks_(0), total_chunks_(0), image_checksum_(0), chunks_(0), blocks_(0), skip_(0),
+        raw_remain_(0), chunk_blks_(0), crc_(crc32(0, nullptr, 0)), has_erased_(false),
+        erased_(0), is_block_(false), discard_zeroes_(false), zero_crc_(0), hdr_len_(0),
+        carry_len_(0), fill_value_(0), fill_valid_(false) {
+    struct stat sb;
+    if (fstat(fd_, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+        is_block_ = true;
+        unsigned int zeroes;
+        discard_zeroes_ = ioctl(fd_, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0;
+    }
+}
+
+void SparseWriter::set_erased_value(uint32_t value) {
+    has_erased_ = true;
+    erased_ = value;
+}
+
+bool SparseWriter::Write(const uint8_t* data, size_t size) {
+    while (state_ != kFailed && size > 0) {
+        if (state_ == kFileHeader) {
+            if (Gather(&data, &size, sizeof(sparse_header_t)) && !StartFile()) {
+                state_ = kFailed;
+            }
+        } else if (state_ == kSkip) {
+            size_t n = std::min<uint64_t>(skip_, size);
+            data += n;
+            size -= n;
+            skip_ -= n;
+            if (skip_ == 0) {
+                state_ = next_;
+            }
+        } else if (state_ == kChunkHeader) {
+            if (Gather(&data, &size, chunk_hdr_size_) && !StartChunk()) {
+                state_ = kFailed;
+            }
+        } else if (state_ == kRaw) {
+            if (!ConsumeRaw(&data, &size)) {
+                state_ = kFailed;
+            }
+        } else if (state_ == kFillValue) {
+            if (Gather(&data, &size, sizeof(uint32_t))) {
+                uint32_t value;
+                memcpy(&value, hdr_.data(), sizeof(value));
+                if (FillBlocks(value, chunk_blks_)) {
+                    EndChunk();
+                } else {
+                    state_ = kFailed;
+                }
+            }
+        } else if (state_ == kCrcValue) {
+            if (Gather(&data, &size, sizeof(uint32_t))) {
+                uint32_t value;
+                memcpy(&value, hdr_.data(), sizeof(value));
+                if (value != crc_) {
+                    printf("sparse image CRC32 mismatch at block %u: 0x%08x != 0x%08x\n",
+                           blocks_, value, crc_);
+                    state_ = kFailed;
+                } else {
+                    EndChunk();
+                }
+            }
+        } else if (state_ == kDone) {
+            printf("ignoring %zu bytes after the end of the sparse image\n", size);
+            break;
+        }
+    }
+
+    if (state_ != kFailed && !Flush()) {
+        state_ = kFailed;
+    }
+    return state_ != kFailed;
+}
+
+bool SparseWriter::Finish() {
+    if (state_ == kFailed || !Flush()) {
+        return false;
+    }
+    if (state_ != kDone || blocks_ != total_blks_) {
+        printf("sparse image truncated: %u of %u chunks, %u of %u blocks\n",
+               chunks_, total_chunks_, blocks_, total_blks_);
+        return false;
+    }
+    if (image_checksum_ != 0 && image_checksum_ != crc_) {
+        printf("sparse image checksum mismatch: 0x%08x != 0x%08x\n", image_checksum_, crc_);
+        return false;
+    }
+    return true;
+}
+
+// Collects need bytes of header data in hdr_, which may arrive split
+// across several calls.  Returns true once all of them are there.
+bool SparseWriter::Gather(const uint8_t** data, size_t* size, size_t need) {
+    if (hdr_.size() < need) {
+        hdr_.resize(need);
+    }
+    size_t n = std::min(need - hdr_len_, *size);
+    memcpy(hdr_.data() + hdr_len_, *data, n);
+    hdr_len_ += n;
+    *data += n;
+    *size -= n;
+    if (hdr_len_ < need) {
+        return false;
+    }
+    hdr_len_ = 0;
+    return true;
+}
+
+bool SparseWriter::StartFile() {
+    sparse_header_t header;
+    memcpy(&header, hdr_.data(), sizeof(header));
+
+    if (header.magic != SPARSE_HEADER_MAGIC) {
+        printf("First data must be sparse header\n");
+        return false;
+    }
+    if (header.file_hdr_sz < sizeof(sparse_header_t) ||
+            header.chunk_hdr_sz < sizeof(chunk_header_t) ||
+            header.blk_sz == 0 || header.blk_sz % sizeof(uint32_t) != 0) {
+        printf("invalid sparse header: file_hdr_sz %u chunk_hdr_sz %u blk_sz %u\n",
+               header.file_hdr_sz, header.chunk_hdr_sz, header.blk_sz);
+        return false;
+    }
+
+    printf("Data stream has a sparse header block size = %u, %u blocks in %u chunks\n",
+           header.blk_sz, header.total_blks, header.total_chunks);
+
+    blk_size_ = header.blk_sz;
+    chunk_hdr_size_ = header.chunk_hdr_sz;
+    total_blks_ = header.total_blks;
+    total_chunks_ = header.total_chunks;
+    image_checksum_ = header.image_checksum;
+
+    carry_.resize(blk_size_);
+    std::vector<uint8_t> zero(blk_size_, 0);
+    zero_crc_ = crc32(0, zero.data(), blk_size_);
+
+    next_ = total_chunks_ > 0 ? kChunkHeader : kDone;
+    skip_ = header.file_hdr_sz - sizeof(sparse_header_t);
+    state_ = skip_ > 0 ? kSkip : next_;
+    return true;
+}
+
+bool SparseWriter::StartChunk() {
+    chunk_header_t chunk;
+    memcpy(&chunk, hdr_.data(), sizeof(chunk));
+
+    chunk_blks_ = chunk.chunk_sz;
+    if (static_cast<uint64_t>(blocks_) + chunk_blks_ > total_blks_ ||
+            chunk.total_sz < chunk_hdr_size_) {
+        printf("invalid chunk %u: type 0x%x chunk_sz %u total_sz %u\n", chunks_,
+               chunk.chunk_type, chunk.chunk_sz, chunk.total_sz);
+        return false;
+    }
+
+    uint64_t bytes = static_cast<uint64_t>(chunk_blks_) * blk_size_;
+    uint64_t payload = chunk.total_sz - chunk_hdr_size_;
+
+    switch (chunk.chunk_type) {
+      case CHUNK_TYPE_RAW:
+        if (payload != bytes) {
+            break;
+        }
+        raw_remain_ = bytes;
+        if (raw_remain_ > 0) {
+            state_ = kRaw;
+        } else {
+            EndChunk();
+        }
+        return true;
+
+      case CHUNK_TYPE_FILL:
+        if (payload != sizeof(uint32_t)) {
+            break;
+        }
+        state_ = kFillValue;
+        return true;
+
+      case CHUNK_TYPE_DONT_CARE:
+        if (payload != 0) {
+            break;
+        }
+        // Don't care blocks count as zeros in the image checksum.
+        crc_ = crc32_repeat(crc_, zero_crc_, blk_size_, chunk_blks_);
+        if (!Flush() || !Skip(bytes)) {
+            return false;
+        }
+        EndChunk();
+        return true;
+
+      case CHUNK_TYPE_CRC32:
+        if (payload != sizeof(uint32_t)) {
+            break;
+        }
+        state_ = kCrcValue;
+        return true;
+
+      default:
+        printf("unknown chunk type 0x%x\n", chunk.chunk_type);
+        return false;
+    }
+
+    printf("invalid chunk %u: type 0x%x chunk_sz %u total_sz %u\n", chunks_,
+           chunk.chunk_type, chunk.chunk_sz, chunk.total_sz);
+    return false;
+}
+
+void SparseWriter::EndChunk() {
+    blocks_ += chunk_blks_;
+    ++chunks_;
+    state_ = chunks_ < total_chunks_ ? kChunkHeader : kDone;
+}
+
+// RAW data is queued in place.  Chunks are block aligned, so a partial
+// block can only be left over at the end of the input; it is copied to
+// carry_ and completed by the next call.
+bool SparseWriter::ConsumeRaw(const uint8_t** data, size_t* size) {
+    size_t n = std::min<uint64_t>(raw_remain_, *size);
+    const uint8_t* p = *data;
+    *data += n;
+    *size -= n;
+    raw_remain_ -= n;
+    crc_ = crc32(crc_, p, n);
+
+    if (carry_len_ > 0) {
+        size_t c = std::min<size_t>(blk_size_ - carry_len_, n);
+        memcpy(carry_.data() + carry_len_, p, c);
+        carry_len_ += c;
+        p += c;
+        n -= c;
+        if (carry_len_ < blk_size_) {
+            return true;
+        }
+        if (!Queue(carry_.data(), blk_size_)) {
+            return false;
+        }
+        carry_len_ = 0;
+    }
+
+    size_t whole = n - n % blk_size_;
+    if (!Queue(p, whole)) {
+        return false;
+    }
+
+    if (n > whole) {
+        // carry_ may still be queued.
+        if (!Flush()) {
+            return false;
+        }
+        carry_len_ = n - whole;
+        memcpy(carry_.data(), p + whole, carry_len_);
+    }
+
+    if (raw_remain_ == 0) {
+        EndChunk();
+    }
+    return true;
+}
+
+bool SparseWriter::FillBlocks(uint32_t value, uint64_t blocks) {
+    uint64_t bytes = blocks * blk_size_;
+
+    if (!fill_valid_ || fill_value_ != value) {
+        // fill_ may still be queued.
+        if (!Flush()) {
+            return false;
+        }
+        size_t len = std::max<size_t>(SPARSE_FILL_BUFFER_SIZE / blk_size_, 1) * blk_size_;
+        fill_.resize(len);
+        for (size_t i = 0; i < len; i += sizeof(value)) {
+            memcpy(fill_.data() + i, &value, sizeof(value));
+        }
+        fill_value_ = value;
+        fill_valid_ = true;
+    }
+    crc_ = crc32_repeat(crc_, crc32(0, fill_.data(), blk_size_), blk_size_, blocks);
+
+    if (has_erased_ && value == erased_) {
+        return Flush() && Skip(bytes);
+    }
+
+    if (value == 0) {
+        if (!Flush()) {
+            return false;
+        }
+        if (ZeroOut(bytes)) {
+            return Skip(bytes);
+        }
+    }
+
+    while (bytes > 0) {
+        size_t n = std::min<uint64_t>(bytes, fill_.size());
+        if (!Queue(fill_.data(), n)) {
+            return false;
+        }
+        bytes -= n;
+    }
+    return true;
+}
+
+// Zeroes the next bytes of a block device without writing them, using
+// BLKDISCARD if it zeroes out blocks and BLKZEROOUT otherwise.  Does not
+// move the file offset.  Returns false if the device supports neither.
+bool SparseWriter::ZeroOut(uint64_t bytes) {
+    if (!is_block_) {
+        return false;
+    }
+
+    off64_t offset = lseek64(fd_, 0, SEEK_CUR);
+    if (offset == -1) {
+        return false;
+    }
+
+    uint64_t range[2] = { static_cast<uint64_t>(offset), bytes };
+    if (discard_zeroes_ && ioctl(fd_, BLKDISCARD, &range) == 0) {
+        return true;
+    }
+    if (ioctl(fd_, BLKZEROOUT, &range) == 0) {
+        return true;
+    }
+
+    printf("BLKZEROOUT failed: %s; writing zeros\n", strerror(errno));
+    is_block_ = false;
+    return false;
+}
+
+bool SparseWriter::Skip(uint64_t bytes) {
+    if (bytes > 0 && lseek64(fd_, bytes, SEEK_CUR) == -1) {
+        printf("lseek error %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool SparseWriter::Queue(const void* data, size_t len) {
+    if (len == 0) {
+        return true;
+    }
+
+    // Merge with the previous iovec if the data follows it directly.
+    if (!iov_.empty()) {
+        struct iovec& last = iov_.back();
+        if (static_cast<const uint8_t*>(last.iov_base) + last.iov_len == data) {
+            last.iov_len += len;
+            return true;
+        }
+    }
+
+    struct iovec v;
+    v.iov_base = const_cast<void*>(data);
+    v.iov_len = len;
+    iov_.push_back(v);
+
+    if (iov_.size() >= SPARSE_MAX_IOVECS) {
+        return Flush();
+    }
+    return true;
+}
+
+bool SparseWriter::Flush() {
+    size_t i = 0;
+    while (i < iov_.size()) {
+        ssize_t w = TEMP_FAILURE_RETRY(writev(fd_, &iov_[i], iov_.size() - i));
+        if (w <= 0) {
+            printf("write error %s\n", w == 0 ? "(no progress)" : strerror(errno));
+            iov_.clear();
+            return false;
+        }
+
+        size_t written = w;
+        while (written > 0) {
+            if (written >= iov_[i].iov_len) {
+                written -= iov_[i].iov_len;
+                ++i;
+            } else {
+                iov_[i].iov_base = static_cast<uint8_t*>(iov_[i].iov_base) + written;
+                iov_[i].iov_len -= written;
+                written = 0;
+            }
+        }
+    }
+    iov_.clear();
+    return true;
+}
+
+bool SparseWriterProcess(const unsigned char* data, int size, void* cookie) {
+    SparseWriter* writer = reinterpret_cast<SparseWriter*>(cookie);
+    return writer->Write(data, size);
+}
@@ -0,0 +1,101 @@
+/*
+* Copyright (C) 2016 MediaTek Inc.
+* Modification based on code covered by the mentioned copyright
+* and/or permission notice(s).
+*/
+#ifndef MT_SPARSE_H
+#define MT_SPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+// Streaming writer for Android sparse images (system/core/libsparse).
+// The image is fed in pieces of any size, in order, and written to fd
+// starting at its current offset.  RAW data is written straight from the
+// caller's buffer, coalesced into vectored writes of whole blocks; only a
+// block that straddles two pieces is copied.  FILL chunks of zeros become
+// BLKDISCARD/BLKZEROOUT on block devices, DONT_CARE chunks are seeked
+// over, and CRC32 chunks are checked against the data written so far.
+//
+// All state lives in the object, so any number of images can be written
+// in one session.
+
+class SparseWriter {
+  public:
+    explicit SparseWriter(int fd);
+
+    // Tells the writer that the target has been erased to the given
+    // 32-bit pattern, so FILL chunks using it can be seeked over.
+    void set_erased_value(uint32_t value);
+
+    // Consumes the next size bytes of the image.  Returns false on any
+    // malformed input or write error; the writer is unusable afterwards.
+    bool Write(const uint8_t* data, size_t size);
+
+    // Checks that the whole image has been consumed.
+    bool Finish();
+
+  private:
+    enum State {
+        kFileHeader,
+        kSkip,
+        kChunkHeader,
+        kRaw,
+        kFillValue,
+        kCrcValue,
+        kDone,
+        kFailed,
+    };
+
+    bool Gather(const uint8_t** data, size_t* size, size_t need);
+    bool StartFile();
+    bool StartChunk();
+    bool ConsumeRaw(const uint8_t** data, size_t* size);
+    bool FillBlocks(uint32_t value, uint64_t blocks);
+    bool ZeroOut(uint64_t bytes);
+    bool Skip(uint64_t bytes);
+    void EndChunk();
+
+    bool Queue(const void* data, size_t len);
+    bool Flush();
+
+    int fd_;
+    State state_;
+    State next_;           // State to enter after kSkip.
+
+    uint32_t blk_size_;
+    uint32_t chunk_hdr_size_;
+    uint32_t total_blks_;
+    uint32_t total_chunks_;
+    uint32_t image_checksum_;
+
+    uint32_t chunks_;      // Chunks completed so far.
+    uint32_t blocks_;      // Output blocks completed so far.
+    uint64_t skip_;        // Bytes left to drop in kSkip.
+    uint64_t raw_remain_;  // Bytes left in the current RAW chunk.
+    uint32_t chunk_blks_;  // Size of the current chunk in blocks.
+    uint32_t crc_;         // CRC32 of the output image so far.
+
+    bool has_erased_;
+    uint32_t erased_;
+    bool is_block_;
+    bool discard_zeroes_;
+    uint32_t zero_crc_;    // CRC32 of one block of zeros.
+
+    std::vector<uint8_t> hdr_;
+    size_t hdr_len_;
+    std::vector<uint8_t> carry_;
+    size_t carry_len_;
+    std::vector<uint8_t> fill_;
+    uint32_t fill_value_;
+    bool fill_valid_;
+    std::vector<struct iovec> iov_;
+};
+
+// mzProcessZipEntryContents() callback; cookie is the SparseWriter.
+bool SparseWriterProcess(const unsigned char* data, int size, void* cookie);
+
+#endif
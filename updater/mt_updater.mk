@@ -7,7 +7,8 @@
 MEDIATEK_RECOVERY_PATH := vendor/mediatek/proprietary/bootable/recovery
 
 LOCAL_SRC_FILES += \
-         mt_install.cpp
+         mt_install.cpp \
+         mt_sparse.cpp
 
 ifeq ($(MTK_CACHE_MERGE_SUPPORT), true)
 LOCAL_CFLAGS += -DCACHE_MERGE_SUPPORT
@@ -0,0 +1,698 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "transfer_list.h"
+
+static_assert(sizeof(btl_header) == 64, "btl_header has the wrong size");
+static_assert(sizeof(btl_command) == 8, "btl_command has the wrong size");
+static_assert(sizeof(btl_arg) == 8, "btl_arg has the wrong size");
+static_assert(sizeof(btl_stash_ref) == 8, "btl_stash_ref has the wrong size");
+static_assert(sizeof(btl_range) == 12, "btl_range has the wrong size");
+
+// Indexed by BtlOp.
+static const char* const kOpNames[] = {
+    nullptr, "bsdiff", "erase", "free", "imgdiff", "move", "new", "stash", "zero",
+};
+
+#define BTL_OP_COUNT (sizeof(kOpNames) / sizeof(kOpNames[0]))
+
+void parse_range(const std::string& range_text, RangeSet& rs) {
+
+    std::vector<std::string> pieces = android::base::Split(range_text, ",");
+    if (pieces.size() < 3) {
+        goto err;
+    }
+
+    size_t num;
+    if (!android::base::ParseUint(pieces[0].c_str(), &num, static_cast<size_t>(INT_MAX))) {
+        goto err;
+    }
+
+    if (num == 0 || num % 2) {
+        goto err; // must be even
+    } else if (num != pieces.size() - 1) {
+        goto err;
+    }
+
+    rs.pos.resize(num);
+    rs.count = num / 2;
+    rs.size = 0;
+
+    for (size_t i = 0; i < num; i += 2) {
+        if (!android::base::ParseUint(pieces[i+1].c_str(), &rs.pos[i],
+                                      static_cast<size_t>(INT_MAX))) {
+            goto err;
+        }
+
+        if (!android::base::ParseUint(pieces[i+2].c_str(), &rs.pos[i+1],
+                                      static_cast<size_t>(INT_MAX))) {
+            goto err;
+        }
+
+        if (rs.pos[i] >= rs.pos[i+1]) {
+            goto err; // empty or negative range
+        }
+
+        size_t sz = rs.pos[i+1] - rs.pos[i];
+        if (rs.size > SIZE_MAX - sz) {
+            goto err; // overflow
+        }
+
+        rs.size += sz;
+    }
+
+    return;
+
+err:
+    fprintf(stderr, "failed to parse range '%s'\n", range_text.c_str());
+    exit(1);
+}
+
+static std::string HexString(const uint8_t* data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(len * 2);
+    for (size_t i = 0; i < len; ++i) {
+        result.push_back(hex[data[i] >> 4]);
+        result.push_back(hex[data[i] & 0xf]);
+    }
+    return result;
+}
+
+static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool ParseHash(const std::string& s, uint8_t* hash) {
+    if (s.size() != BTL_HASH_SIZE * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < BTL_HASH_SIZE; ++i) {
+        int hi = HexDigit(s[i * 2]);
+        int lo = HexDigit(s[i * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        hash[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+static std::string RangeText(const RangeSet& rs) {
+    std::string result = std::to_string(rs.count * 2);
+    for (size_t pos : rs.pos) {
+        result += "," + std::to_string(pos);
+    }
+    return result;
+}
+
+TransferArgs::TransferArgs() : list_(nullptr), args_(nullptr), pos_(0), count_(0) {
+}
+
+bool TransferArgs::empty() const {
+    return pos_ >= count_;
+}
+
+bool TransferArgs::NextString(std::string* s) {
+    if (empty()) {
+        return false;
+    }
+    if (args_ == nullptr) {
+        *s = tokens_[pos_++];
+    } else {
+        *s = list_->ArgText(args_[pos_++]);
+    }
+    return true;
+}
+
+bool TransferArgs::NextNumber(size_t* n) {
+    if (empty()) {
+        return false;
+    }
+    if (args_ == nullptr) {
+        if (!android::base::ParseUint(tokens_[pos_].c_str(), n)) {
+            return false;
+        }
+    } else {
+        if (args_[pos_].type != BTL_ARG_NUMBER) {
+            return false;
+        }
+        uint64_t value;
+        memcpy(&value, list_->numbers_ + args_[pos_].index * sizeof(value), sizeof(value));
+        if (value > SIZE_MAX) {
+            return false;
+        }
+        *n = value;
+    }
+    ++pos_;
+    return true;
+}
+
+bool TransferArgs::NextHash(uint8_t* hash) {
+    if (empty()) {
+        return false;
+    }
+    if (args_ == nullptr) {
+        if (!ParseHash(tokens_[pos_], hash)) {
+            return false;
+        }
+    } else {
+        if (args_[pos_].type != BTL_ARG_HASH) {
+            return false;
+        }
+        memcpy(hash, list_->hashes_ + args_[pos_].index * BTL_HASH_SIZE, BTL_HASH_SIZE);
+    }
+    ++pos_;
+    return true;
+}
+
+bool TransferArgs::NextRange(RangeSet* rs) {
+    if (empty()) {
+        return false;
+    }
+    if (args_ == nullptr) {
+        parse_range(tokens_[pos_], *rs);
+    } else {
+        if (args_[pos_].type != BTL_ARG_RANGE) {
+            return false;
+        }
+        list_->LoadRange(args_[pos_].index, rs);
+    }
+    ++pos_;
+    return true;
+}
+
+bool TransferArgs::NextStashRef(std::string* id, RangeSet* locs) {
+    if (empty()) {
+        return false;
+    }
+    if (args_ == nullptr) {
+        std::vector<std::string> pieces = android::base::Split(tokens_[pos_], ":");
+        if (pieces.size() != 2) {
+            return false;
+        }
+        *id = pieces[0];
+        parse_range(pieces[1], *locs);
+    } else {
+        if (args_[pos_].type != BTL_ARG_STASH_REF) {
+            return false;
+        }
+        const btl_stash_ref& ref = list_->stash_refs_[args_[pos_].index];
+        *id = HexString(list_->hashes_ + ref.hash * BTL_HASH_SIZE, BTL_HASH_SIZE);
+        list_->LoadRange(ref.range, locs);
+    }
+    ++pos_;
+    return true;
+}
+
+bool TransferArgs::NextDash() {
+    if (empty()) {
+        return false;
+    }
+    bool dash = args_ == nullptr ? tokens_[pos_] == "-" : args_[pos_].type == BTL_ARG_DASH;
+    if (dash) {
+        ++pos_;
+    }
+    return dash;
+}
+
+bool TransferArgs::Skip() {
+    if (empty()) {
+        return false;
+    }
+    ++pos_;
+    return true;
+}
+
+TransferList::TransferList() :
+        data_(nullptr), size_(0), binary_(false), version_(0), total_blocks_(0),
+        stash_entries_(0), stash_max_blocks_(0), first_(0), header_(nullptr),
+        commands_(nullptr), args_(nullptr), stash_refs_(nullptr), ranges_(nullptr),
+        pos_(nullptr), hashes_(nullptr), numbers_(nullptr) {
+}
+
+bool TransferList::Parse(const uint8_t* data, size_t size) {
+    data_ = data;
+    size_ = size;
+    binary_ = size >= 4 && memcmp(data, BTL_MAGIC, 4) == 0;
+    return binary_ ? ParseBinary() : ParseText();
+}
+
+bool TransferList::ParseText() {
+    const char* text = reinterpret_cast<const char*>(data_);
+    size_t start = 0;
+    for (size_t i = 0; i <= size_; ++i) {
+        if (i == size_ || text[i] == '\n') {
+            lines_.push_back(std::make_pair(start, i - start));
+            start = i + 1;
+        }
+    }
+
+    if (lines_.size() < 2) {
+        fprintf(stderr, "too few lines in the transfer list [%zu]\n", lines_.size());
+        return false;
+    }
+
+    // First line in transfer list is the version number
+    std::string line = Text(0);
+    if (!android::base::ParseInt(line.c_str(), &version_, 1, 4)) {
+        fprintf(stderr, "unexpected transfer list version [%s]\n", line.c_str());
+        return false;
+    }
+
+    // Second line in transfer list is the total number of blocks we expect to write
+    line = Text(1);
+    if (!android::base::ParseInt(line.c_str(), &total_blocks_, 0)) {
+        fprintf(stderr, "unexpected block count [%s]\n", line.c_str());
+        return false;
+    }
+
+    first_ = 2;
+    if (version_ < 2 || total_blocks_ == 0) {
+        return true;
+    }
+
+    if (lines_.size() < 4) {
+        fprintf(stderr, "too few lines in the transfer list [%zu]\n", lines_.size());
+        return false;
+    }
+
+    // Third line is how many stash entries are needed simultaneously
+    line = Text(2);
+    if (!android::base::ParseInt(line.c_str(), &stash_entries_, 0)) {
+        fprintf(stderr, "unexpected maximum stash entries [%s]\n", line.c_str());
+        return false;
+    }
+
+    // Fourth line is the maximum number of blocks that will be stashed simultaneously
+    line = Text(3);
+    if (!android::base::ParseInt(line.c_str(), &stash_max_blocks_, 0)) {
+        fprintf(stderr, "unexpected maximum stash blocks [%s]\n", line.c_str());
+        return false;
+    }
+
+    first_ = 4;
+    return true;
+}
+
+// Checks every table and index once, so that loading commands later
+// needs no checks at all.
+bool TransferList::ParseBinary() {
+    if (size_ < sizeof(btl_header) || reinterpret_cast<uintptr_t>(data_) % 4 != 0) {
+        fprintf(stderr, "truncated or misaligned binary transfer list\n");
+        return false;
+    }
+
+    header_ = reinterpret_cast<const btl_header*>(data_);
+    if (header_->format_version != BTL_FORMAT_VERSION) {
+        fprintf(stderr, "unsupported binary transfer list format %u\n", header_->format_version);
+        return false;
+    }
+    if (header_->version < 3 || header_->version > 4 || header_->total_blocks > INT_MAX ||
+            header_->stash_entries > INT_MAX || header_->stash_max_blocks > INT_MAX) {
+        fprintf(stderr, "unexpected binary transfer list header\n");
+        return false;
+    }
+
+    uint64_t offset = sizeof(btl_header);
+    uint64_t numbers = offset;
+    offset += static_cast<uint64_t>(header_->number_count) * sizeof(uint64_t);
+    uint64_t commands = offset;
+    offset += static_cast<uint64_t>(header_->command_count) * sizeof(btl_command);
+    uint64_t args = offset;
+    offset += static_cast<uint64_t>(header_->arg_count) * sizeof(btl_arg);
+    uint64_t stash_refs = offset;
+    offset += static_cast<uint64_t>(header_->stash_ref_count) * sizeof(btl_stash_ref);
+    uint64_t ranges = offset;
+    offset += static_cast<uint64_t>(header_->range_count) * sizeof(btl_range);
+    uint64_t pos = offset;
+    offset += static_cast<uint64_t>(header_->pos_count) * sizeof(uint32_t);
+    uint64_t hashes = offset;
+    offset += static_cast<uint64_t>(header_->hash_count) * BTL_HASH_SIZE;
+
+    if (offset != size_) {
+        fprintf(stderr, "binary transfer list is %zu bytes, expected %" PRIu64 "\n", size_,
+                offset);
+        return false;
+    }
+
+    numbers_ = data_ + numbers;
+    commands_ = reinterpret_cast<const btl_command*>(data_ + commands);
+    args_ = reinterpret_cast<const btl_arg*>(data_ + args);
+    stash_refs_ = reinterpret_cast<const btl_stash_ref*>(data_ + stash_refs);
+    ranges_ = reinterpret_cast<const btl_range*>(data_ + ranges);
+    pos_ = reinterpret_cast<const uint32_t*>(data_ + pos);
+    hashes_ = data_ + hashes;
+
+    for (uint32_t i = 0; i < header_->range_count; ++i) {
+        const btl_range& r = ranges_[i];
+        if (r.count == 0 || r.first_pos > header_->pos_count ||
+                r.count > (header_->pos_count - r.first_pos) / 2) {
+            fprintf(stderr, "invalid range %u in binary transfer list\n", i);
+            return false;
+        }
+        uint64_t blocks = 0;
+        for (uint32_t j = 0; j < r.count; ++j) {
+            uint32_t start = pos_[r.first_pos + j * 2];
+            uint32_t end = pos_[r.first_pos + j * 2 + 1];
+            if (start >= end || end > INT_MAX) {
+                fprintf(stderr, "invalid range %u in binary transfer list\n", i);
+                return false;
+            }
+            blocks += end - start;
+        }
+        if (blocks != r.blocks) {
+            fprintf(stderr, "invalid size of range %u in binary transfer list\n", i);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header_->stash_ref_count; ++i) {
+        if (stash_refs_[i].hash >= header_->hash_count ||
+                stash_refs_[i].range >= header_->range_count) {
+            fprintf(stderr, "invalid stash reference %u in binary transfer list\n", i);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header_->arg_count; ++i) {
+        uint32_t limit;
+        switch (args_[i].type) {
+            case BTL_ARG_DASH:      limit = UINT32_MAX; break;
+            case BTL_ARG_HASH:      limit = header_->hash_count; break;
+            case BTL_ARG_NUMBER:    limit = header_->number_count; break;
+            case BTL_ARG_RANGE:     limit = header_->range_count; break;
+            case BTL_ARG_STASH_REF: limit = header_->stash_ref_count; break;
+            default:                limit = 0; break;
+        }
+        if (args_[i].index >= limit) {
+            fprintf(stderr, "invalid argument %u in binary transfer list\n", i);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header_->command_count; ++i) {
+        const btl_command& c = commands_[i];
+        if (c.op == 0 || c.op >= BTL_OP_COUNT || c.first_arg > header_->arg_count ||
+                c.arg_count > header_->arg_count - c.first_arg) {
+            fprintf(stderr, "invalid command %u in binary transfer list\n", i);
+            return false;
+        }
+    }
+
+    version_ = header_->version;
+    total_blocks_ = header_->total_blocks;
+    stash_entries_ = header_->stash_entries;
+    stash_max_blocks_ = header_->stash_max_blocks;
+    first_ = 0;
+    return true;
+}
+
+size_t TransferList::end() const {
+    return binary_ ? header_->command_count : lines_.size();
+}
+
+const char* TransferList::Load(size_t index, TransferArgs* args) const {
+    args->list_ = this;
+    args->pos_ = 0;
+    args->count_ = 0;
+    args->tokens_.clear();
+    args->args_ = nullptr;
+
+    if (binary_) {
+        const btl_command& c = commands_[index];
+        args->args_ = args_ + c.first_arg;
+        args->count_ = c.arg_count;
+        return kOpNames[c.op];
+    }
+
+    if (lines_[index].second == 0) {
+        return nullptr;
+    }
+
+    args->tokens_ = android::base::Split(Text(index), " ");
+    args->pos_ = 1;
+    args->count_ = args->tokens_.size();
+    return args->tokens_[0].c_str();
+}
+
+void TransferList::LoadRange(uint32_t index, RangeSet* rs) const {
+    const btl_range& r = ranges_[index];
+    rs->count = r.count;
+    rs->size = r.blocks;
+    rs->pos.assign(pos_ + r.first_pos, pos_ + r.first_pos + r.count * 2);
+}
+
+std::string TransferList::ArgText(const btl_arg& arg) const {
+    RangeSet rs;
+    switch (arg.type) {
+        case BTL_ARG_DASH:
+            return "-";
+        case BTL_ARG_HASH:
+            return HexString(hashes_ + arg.index * BTL_HASH_SIZE, BTL_HASH_SIZE);
+        case BTL_ARG_NUMBER: {
+            uint64_t value;
+            memcpy(&value, numbers_ + arg.index * sizeof(value), sizeof(value));
+            return std::to_string(value);
+        }
+        case BTL_ARG_RANGE:
+            LoadRange(arg.index, &rs);
+            return RangeText(rs);
+        case BTL_ARG_STASH_REF: {
+            const btl_stash_ref& ref = stash_refs_[arg.index];
+            LoadRange(ref.range, &rs);
+            return HexString(hashes_ + ref.hash * BTL_HASH_SIZE, BTL_HASH_SIZE) + ":" +
+                    RangeText(rs);
+        }
+    }
+    return "";
+}
+
+std::string TransferList::Text(size_t index) const {
+    if (!binary_) {
+        return std::string(reinterpret_cast<const char*>(data_) + lines_[index].first,
+                           lines_[index].second);
+    }
+
+    const btl_command& c = commands_[index];
+    std::string result = kOpNames[c.op];
+    for (uint32_t i = 0; i < c.arg_count; ++i) {
+        result += " " + ArgText(args_[c.first_arg + i]);
+    }
+    return result;
+}
+
+bool TransferList::ToText(std::string* out) const {
+    if (!binary_) {
+        out->assign(reinterpret_cast<const char*>(data_), size_);
+        return true;
+    }
+
+    *out = std::to_string(version_) + "\n" + std::to_string(total_blocks_) + "\n" +
+            std::to_string(stash_entries_) + "\n" + std::to_string(stash_max_blocks_) + "\n";
+    for (size_t i = first_; i < end(); ++i) {
+        *out += Text(i) + "\n";
+    }
+    return true;
+}
+
+// Builds the tables of a binary list; hashes are shared between the
+// commands that use them, which is most of them for stash and free.
+class BinaryWriter {
+  public:
+    bool AddCommand(const char* name, const std::vector<std::string>& tokens);
+    std::string Finish(const TransferList& list);
+
+  private:
+    bool AddArg(const std::string& token);
+    uint32_t AddHash(const uint8_t* hash);
+    uint32_t AddRange(const std::string& text);
+
+    std::vector<uint64_t> numbers_;
+    std::vector<btl_command> commands_;
+    std::vector<btl_arg> args_;
+    std::vector<btl_stash_ref> stash_refs_;
+    std::vector<btl_range> ranges_;
+    std::vector<uint32_t> pos_;
+    std::string hashes_;
+    std::map<std::string, uint32_t> hash_index_;
+};
+
+uint32_t BinaryWriter::AddHash(const uint8_t* hash) {
+    std::string key(reinterpret_cast<const char*>(hash), BTL_HASH_SIZE);
+    auto it = hash_index_.find(key);
+    if (it != hash_index_.end()) {
+        return it->second;
+    }
+    uint32_t index = hash_index_.size();
+    hash_index_[key] = index;
+    hashes_ += key;
+    return index;
+}
+
+uint32_t BinaryWriter::AddRange(const std::string& text) {
+    RangeSet rs;
+    parse_range(text, rs);
+
+    btl_range r;
+    r.first_pos = pos_.size();
+    r.count = rs.count;
+    r.blocks = rs.size;
+    pos_.insert(pos_.end(), rs.pos.begin(), rs.pos.end());
+    ranges_.push_back(r);
+    return ranges_.size() - 1;
+}
+
+// Tells the arguments apart by their syntax: "-", <hash>, <id>:<range>,
+// <range> (which always has a comma) and plain numbers.
+bool BinaryWriter::AddArg(const std::string& token) {
+    btl_arg arg;
+    uint8_t hash[BTL_HASH_SIZE];
+    size_t colon = token.find(':');
+    uint64_t number;
+
+    if (token == "-") {
+        arg.type = BTL_ARG_DASH;
+        arg.index = 0;
+    } else if (colon != std::string::npos) {
+        if (!ParseHash(token.substr(0, colon), hash)) {
+            return false;
+        }
+        btl_stash_ref ref;
+        ref.hash = AddHash(hash);
+        ref.range = AddRange(token.substr(colon + 1));
+        stash_refs_.push_back(ref);
+        arg.type = BTL_ARG_STASH_REF;
+        arg.index = stash_refs_.size() - 1;
+    } else if (ParseHash(token, hash)) {
+        arg.type = BTL_ARG_HASH;
+        arg.index = AddHash(hash);
+    } else if (token.find(',') != std::string::npos) {
+        arg.type = BTL_ARG_RANGE;
+        arg.index = AddRange(token);
+    } else if (android::base::ParseUint(token.c_str(), &number)) {
+        numbers_.push_back(number);
+        arg.type = BTL_ARG_NUMBER;
+        arg.index = numbers_.size() - 1;
+    } else {
+        return false;
+    }
+
+    args_.push_back(arg);
+    return true;
+}
+
+bool BinaryWriter::AddCommand(const char* name, const std::vector<std::string>& tokens) {
+    btl_command c;
+    memset(&c, 0, sizeof(c));
+    for (size_t op = 1; op < BTL_OP_COUNT; ++op) {
+        if (strcmp(name, kOpNames[op]) == 0) {
+            c.op = op;
+        }
+    }
+    if (c.op == 0 || tokens.size() - 1 > UINT16_MAX) {
+        fprintf(stderr, "unexpected command [%s]\n", name);
+        return false;
+    }
+
+    c.first_arg = args_.size();
+    c.arg_count = tokens.size() - 1;
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        if (!AddArg(tokens[i])) {
+            fprintf(stderr, "unexpected argument [%s] of %s\n", tokens[i].c_str(), name);
+            return false;
+        }
+    }
+    commands_.push_back(c);
+    return true;
+}
+
+template <typename T>
+static void Append(std::string* out, const std::vector<T>& table) {
+    out->append(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(T));
+}
+
+std::string BinaryWriter::Finish(const TransferList& list) {
+    btl_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BTL_MAGIC, sizeof(h.magic));
+    h.format_version = BTL_FORMAT_VERSION;
+    h.version = list.version();
+    h.total_blocks = list.total_blocks();
+    h.stash_entries = list.stash_entries();
+    h.stash_max_blocks = list.stash_max_blocks();
+    h.number_count = numbers_.size();
+    h.command_count = commands_.size();
+    h.arg_count = args_.size();
+    h.stash_ref_count = stash_refs_.size();
+    h.range_count = ranges_.size();
+    h.pos_count = pos_.size();
+    h.hash_count = hashes_.size() / BTL_HASH_SIZE;
+
+    std::string out(reinterpret_cast<const char*>(&h), sizeof(h));
+    Append(&out, numbers_);
+    Append(&out, commands_);
+    Append(&out, args_);
+    Append(&out, stash_refs_);
+    Append(&out, ranges_);
+    Append(&out, pos_);
+    out += hashes_;
+    return out;
+}
+
+bool TransferList::ToBinary(std::string* out) const {
+    if (binary_) {
+        out->assign(reinterpret_cast<const char*>(data_), size_);
+        return true;
+    }
+    if (version_ < 3) {
+        fprintf(stderr, "version %d transfer lists can't be stored in binary\n", version_);
+        return false;
+    }
+
+    BinaryWriter writer;
+    TransferArgs args;
+    for (size_t i = first_; i < end(); ++i) {
+        const char* name = Load(i, &args);
+        if (name != nullptr && !writer.AddCommand(name, args.tokens_)) {
+            return false;
+        }
+    }
+
+    *out = writer.Finish(*this);
+    return true;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_TRANSFER_LIST_H_
+#define _UPDATER_TRANSFER_LIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+struct RangeSet {
+    size_t count;             // Limit is INT_MAX.
+    size_t size;
+    std::vector<size_t> pos;  // Actual limit is INT_MAX.
+};
+
+// Parses "<count>,<start>,<end>,..." into rs.  Exits on malformed input.
+void parse_range(const std::string& range_text, RangeSet& rs);
+
+// Binary transfer lists hold the same commands as the text format with
+// every argument already parsed: ranges are tables of block numbers and
+// hashes are raw SHA-1 digests, so the updater walks the list in place
+// without splitting or parsing any text.  The layout is
+//
+//    btl_header
+//    uint64_t[number_count]
+//    btl_command[command_count]      in transfer list order
+//    btl_arg[arg_count]              arguments of all commands, in order
+//    btl_stash_ref[stash_ref_count]
+//    btl_range[range_count]
+//    uint32_t[pos_count]             start/end block pairs of all ranges
+//    uint8_t[hash_count][BTL_HASH_SIZE]
+//
+// with all integers little-endian.  Only versions 3 and later can be
+// stored in binary, as their stash ids are SHA-1 digests as well.
+
+#define BTL_MAGIC "OTBL"
+#define BTL_FORMAT_VERSION 1
+#define BTL_HASH_SIZE 20
+
+enum BtlOp {
+    BTL_OP_BSDIFF = 1,
+    BTL_OP_ERASE,
+    BTL_OP_FREE,
+    BTL_OP_IMGDIFF,
+    BTL_OP_MOVE,
+    BTL_OP_NEW,
+    BTL_OP_STASH,
+    BTL_OP_ZERO,
+};
+
+enum BtlArgType {
+    BTL_ARG_DASH = 1,               // "-", no index
+    BTL_ARG_HASH,                   // index into the hashes
+    BTL_ARG_NUMBER,                 // index into the numbers
+    BTL_ARG_RANGE,                  // index into the ranges
+    BTL_ARG_STASH_REF,              // index into the stash refs
+};
+
+struct btl_header {
+    char magic[4];
+    uint32_t format_version;
+    uint32_t version;               // Transfer list version.
+    uint32_t total_blocks;
+    uint32_t stash_entries;
+    uint32_t stash_max_blocks;
+    uint32_t number_count;
+    uint32_t command_count;
+    uint32_t arg_count;
+    uint32_t stash_ref_count;
+    uint32_t range_count;
+    uint32_t pos_count;
+    uint32_t hash_count;
+    uint32_t reserved[3];
+};
+
+struct btl_command {
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t arg_count;
+    uint32_t first_arg;
+};
+
+struct btl_arg {
+    uint32_t type;
+    uint32_t index;
+};
+
+struct btl_stash_ref {
+    uint32_t hash;                  // Stash id.
+    uint32_t range;                 // Where the stash goes in the source.
+};
+
+struct btl_range {
+    uint32_t first_pos;
+    uint32_t count;                 // Start/end pairs.
+    uint32_t blocks;
+};
+
+class TransferList;
+
+// The arguments of one command, read in the order they have on a text
+// line.  Each Next function returns false if there is no argument left
+// or the next one is of another kind.
+class TransferArgs {
+  public:
+    TransferArgs();
+
+    bool empty() const;
+
+    // Any argument, in its text form.
+    bool NextString(std::string* s);
+    bool NextNumber(size_t* n);
+    // A SHA-1 as BTL_HASH_SIZE raw bytes, which binary lists hand out
+    // without any conversion.
+    bool NextHash(uint8_t* hash);
+    bool NextRange(RangeSet* rs);
+    // <stash_id>:<range>
+    bool NextStashRef(std::string* id, RangeSet* locs);
+    // Consumes the next argument if it is "-".
+    bool NextDash();
+    // Passes over the next argument, whatever its kind.
+    bool Skip();
+
+  private:
+    friend class TransferList;
+
+    const TransferList* list_;
+    std::vector<std::string> tokens_;   // Text lists, tokens_[0] is the command.
+    const btl_arg* args_;               // Binary lists.
+    size_t pos_;
+    size_t count_;
+};
+
+class TransferList {
+  public:
+    TransferList();
+
+    // Accepts a list in either format.  data has to outlive the object.
+    bool Parse(const uint8_t* data, size_t size);
+
+    bool binary() const { return binary_; }
+    int version() const { return version_; }
+    int total_blocks() const { return total_blocks_; }
+    int stash_entries() const { return stash_entries_; }
+    int stash_max_blocks() const { return stash_max_blocks_; }
+
+    // Commands are numbered from first() to end(); in text lists the
+    // number is the line number, so empty lines are included.
+    size_t first() const { return first_; }
+    size_t end() const;
+
+    // Prepares args for the given command and returns its name, or
+    // nullptr for an empty line.
+    const char* Load(size_t index, TransferArgs* args) const;
+
+    // The command as a line of the text format.
+    std::string Text(size_t index) const;
+
+    // Converts the whole list to the given format.
+    bool ToText(std::string* out) const;
+    bool ToBinary(std::string* out) const;
+
+  private:
+    friend class TransferArgs;
+
+    bool ParseText();
+    bool ParseBinary();
+    void LoadRange(uint32_t index, RangeSet* rs) const;
+    std::string ArgText(const btl_arg& arg) const;
+
+    const uint8_t* data_;
+    size_t size_;
+    bool binary_;
+    int version_;
+    int total_blocks_;
+    int stash_entries_;
+    int stash_max_blocks_;
+    size_t first_;
+
+    // Text lists: offset and length of every line.
+    std::vector<std::pair<size_t, size_t>> lines_;
+
+    // Binary lists.
+    const btl_header* header_;
+    const btl_command* commands_;
+    const btl_arg* args_;
+    const btl_stash_ref* stash_refs_;
+    const btl_range* ranges_;
+    const uint32_t* pos_;
+    const uint8_t* hashes_;
+    const uint8_t* numbers_;            // Not necessarily 8-byte aligned.
+};
+
+#endif  // _UPDATER_TRANSFER_LIST_H_
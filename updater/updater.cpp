@@ -31,6 +31,7 @@
 #include "minzip/Zip.h"
 #include "minzip/SysUtil.h"
 #include "config.h"
+#include "otatrace/trace.h"
 
 // Generated by the makefile, this function defines the
 // RegisterDeviceExtensions() function, which calls all the
@@ -53,6 +54,9 @@ int main(int argc, char** argv) {
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
+    // Phase timings go after recovery's own, for copy_logs() to save.
+    trace_init("updater", TEMPORARY_TRACE_FILE);
+
     if (argc != 4 && argc != 5) {
         fprintf(stderr, "unexpected number of arguments (%d)\n", argc);
         return 1;
@@ -78,9 +82,13 @@ int main(int argc, char** argv) {
 
     const char* package_filename = argv[3];
     MemMapping map;
-    if (sysMapFile(package_filename, &map) != 0) {
-        printf("failed to map package %s\n", argv[3]);
-        return 3;
+    {
+        TraceScope trace(TRACE_PACKAGE_MAP);
+        if (sysMapFile(package_filename, &map) != 0) {
+            printf("failed to map package %s\n", argv[3]);
+            return 3;
+        }
+        trace.Add(map.length);
     }
     ZipArchive za;
     int err;
@@ -159,7 +167,15 @@ int main(int argc, char** argv) {
         }
     }
 
-    char* result = Evaluate(&state, root);
+    // Evaluate the compiled form of the script when there is memory for
+    // it; it gives the same results.
+    int folded = 0;
+    Expr* compiled = CompileExpr(root, &folded);
+    if (compiled != NULL) {
+        printf("compiled script, %d constant operators folded\n", folded);
+    }
+    char* result = Evaluate(&state, compiled != NULL ? compiled : root);
+    FreeCompiledExpr(compiled);
 
     if (have_eio_error) {
         fprintf(cmd_pipe, "retry_update\n");
@@ -16,10 +16,14 @@
 
 #include <errno.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include <algorithm>
+#include <atomic>
 #include <memory>
 
 #include <openssl/ecdsa.h>
@@ -35,6 +39,51 @@ extern RecoveryUI* ui;
 
 static constexpr size_t MiB = 1024 * 1024;
 
+// On a Nexus 5X, experiment showed 16MiB beat 1MiB by 6% faster for a
+// 1196MiB full OTA and 60% for an 89MiB incremental OTA.
+// http://b/28135231.
+static constexpr size_t kHashChunkSize = 16 * MiB;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Asks the kernel to start reading the given chunk of the package while
+// the current one is being hashed.  addr is the start of the mapping and
+// offset a multiple of kHashChunkSize, so the range is page aligned.
+static void prefetch_chunk(unsigned char* addr, size_t offset, size_t length) {
+    if (offset < length) {
+        madvise(addr + offset, std::min(length - offset, kHashChunkSize), MADV_WILLNEED);
+    }
+}
+
+// When both SHA-1 and SHA-256 keys are present, the SHA-256 digest is
+// computed on its own thread while the main thread computes SHA-1 and
+// drives the progress bar.  Both threads walk the same mapping, so
+// whichever one gets to a chunk first faults it in for the other.  The
+// digest implementations come from libcrypto, which already picks the
+// ARMv8 crypto extension or SHA-NI code paths when the CPU has them.
+struct Sha256ThreadInfo {
+    unsigned char* addr;
+    size_t length;
+    SHA256_CTX ctx;
+    std::atomic<size_t> so_far;
+};
+
+static void* sha256_thread(void* cookie) {
+    Sha256ThreadInfo* info = reinterpret_cast<Sha256ThreadInfo*>(cookie);
+    size_t so_far = 0;
+    while (so_far < info->length) {
+        size_t size = std::min(info->length - so_far, kHashChunkSize);
+        SHA256_Update(&info->ctx, info->addr + so_far, size);
+        so_far += size;
+        info->so_far.store(so_far);
+    }
+    return nullptr;
+}
+
 /*
  * Simple version of PKCS#7 SignedData extraction. This extracts the
  * signature OCTET STRING to be used for signature verification.
@@ -205,34 +254,68 @@ int verify_file(unsigned char* addr, size_t length,
         }
     }
 
+    double start = now_sec();
+
     SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
     SHA1_Init(&sha1_ctx);
-    SHA256_Init(&sha256_ctx);
+
+    Sha256ThreadInfo sha256_info;
+    sha256_info.addr = addr;
+    sha256_info.length = signed_len;
+    sha256_info.so_far.store(0);
+    SHA256_Init(&sha256_info.ctx);
+
+    pthread_t sha256_tid;
+    bool sha256_threaded = false;
+    if (need_sha1 && need_sha256) {
+        int error = pthread_create(&sha256_tid, nullptr, sha256_thread, &sha256_info);
+        if (error == 0) {
+            sha256_threaded = true;
+        } else {
+            LOGW("failed to start SHA-256 thread: %s\n", strerror(error));
+        }
+    }
+
+    prefetch_chunk(addr, 0, signed_len);
 
     double frac = -1.0;
     size_t so_far = 0;
     while (so_far < signed_len) {
-        // On a Nexus 5X, experiment showed 16MiB beat 1MiB by 6% faster for a
-        // 1196MiB full OTA and 60% for an 89MiB incremental OTA.
-        // http://b/28135231.
-        size_t size = std::min(signed_len - so_far, 16 * MiB);
+        size_t size = std::min(signed_len - so_far, kHashChunkSize);
+        prefetch_chunk(addr, so_far + size, signed_len);
 
         if (need_sha1) SHA1_Update(&sha1_ctx, addr + so_far, size);
-        if (need_sha256) SHA256_Update(&sha256_ctx, addr + so_far, size);
+        if (need_sha256 && !sha256_threaded) {
+            SHA256_Update(&sha256_info.ctx, addr + so_far, size);
+        }
         so_far += size;
 
-        double f = so_far / (double)signed_len;
+        size_t done = so_far;
+        if (sha256_threaded) {
+            done = std::min(done, sha256_info.so_far.load());
+        }
+        double f = done / (double)signed_len;
         if (f > frac + 0.02 || size == so_far) {
             ui->SetProgress(f);
             frac = f;
         }
     }
 
+    if (sha256_threaded) {
+        pthread_join(sha256_tid, nullptr);
+        ui->SetProgress(1.0);
+    }
+
     uint8_t sha1[SHA_DIGEST_LENGTH];
     SHA1_Final(sha1, &sha1_ctx);
     uint8_t sha256[SHA256_DIGEST_LENGTH];
-    SHA256_Final(sha256, &sha256_ctx);
+    SHA256_Final(sha256, &sha256_info.ctx);
+
+    double duration = now_sec() - start;
+    LOGI("hashed %zu bytes (%s%s%s) in %.2f s (%.1f MiB/s)\n", signed_len,
+         need_sha1 ? "SHA-1" : "", need_sha1 && need_sha256 ? " + " : "",
+         need_sha256 ? "SHA-256" : "", duration,
+         duration > 0 ? signed_len / duration / MiB : 0.0);
 
     uint8_t* sig_der = nullptr;
     size_t sig_der_length = 0;